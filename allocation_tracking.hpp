@@ -0,0 +1,77 @@
+// allocation_tracking.hpp - replaces the global operator new and delete, so
+// include it in exactly one translation unit of a program (main.cpp, or a
+// check in tests/). Build with -DOLLAMA_NO_ALLOCATION_TRACKING to leave the
+// hooks out.
+
+#ifndef OLLAMA_ALLOCATION_TRACKING_HPP
+#define OLLAMA_ALLOCATION_TRACKING_HPP
+
+#include "ollama_engine.hpp"
+#include <cstdlib>
+#include <new>
+
+#ifndef OLLAMA_NO_ALLOCATION_TRACKING
+// Global allocation hooks feeding MemoryAccounting. Every block carries a
+// small header in front of the returned pointer recording its size and the
+// subsystem it was charged to, so frees are credited back to the right one.
+namespace allocation_tracking {
+
+struct alignas(16) Header {
+    uint64_t size;
+    uint32_t offset;  // From the start of the malloc block to the user pointer
+    uint8_t subsystem;
+};
+
+void* allocate(size_t size, size_t alignment) noexcept {
+    alignment = std::max(alignment, alignof(Header));
+    char* base = static_cast<char*>(std::malloc(size + sizeof(Header) + alignment - 1));
+    if (!base) return nullptr;
+    uintptr_t user = (reinterpret_cast<uintptr_t>(base) + sizeof(Header) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+    Header* header = reinterpret_cast<Header*>(user) - 1;
+    header->size = size;
+    header->offset = static_cast<uint32_t>(user - reinterpret_cast<uintptr_t>(base));
+    header->subsystem = MemoryAccounting::current();
+    MemoryAccounting::recordAllocation(MemoryAccounting::current(), size);
+    return reinterpret_cast<void*>(user);
+}
+
+void release(void* ptr) noexcept {
+    if (!ptr) return;
+    Header* header = static_cast<Header*>(ptr) - 1;
+    MemoryAccounting::recordFree(static_cast<MemoryAccounting::Subsystem>(header->subsystem), header->size);
+    std::free(static_cast<char*>(ptr) - header->offset);
+}
+
+void* allocateOrThrow(size_t size, size_t alignment) {
+    if (void* ptr = allocate(size, alignment)) return ptr;
+    throw std::bad_alloc();
+}
+
+const bool enabled = (MemoryAccounting::setTracking(true), true);
+
+} // namespace allocation_tracking
+
+void* operator new(size_t size) { return allocation_tracking::allocateOrThrow(size, 0); }
+void* operator new[](size_t size) { return allocation_tracking::allocateOrThrow(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocation_tracking::allocate(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocation_tracking::allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t al) { return allocation_tracking::allocateOrThrow(size, size_t(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return allocation_tracking::allocateOrThrow(size, size_t(al)); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocation_tracking::allocate(size, size_t(al)); }
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocation_tracking::allocate(size, size_t(al)); }
+
+void operator delete(void* ptr) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr) noexcept { allocation_tracking::release(ptr); }
+void operator delete(void* ptr, size_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { allocation_tracking::release(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { allocation_tracking::release(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { allocation_tracking::release(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { allocation_tracking::release(ptr); }
+#endif
+
+#endif // OLLAMA_ALLOCATION_TRACKING_HPP
@@ -2,20 +2,37 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <curl/curl.h>
-#include <nlohmann/json.hpp>
 #include <thread>
 #include <chrono>
+#include <sstream>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <iomanip>
+#include <csignal>
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <set>
+#include "ollama_engine.hpp"
+#include "allocation_tracking.hpp"
 
 
 #ifdef _WIN32
 #include <windows.h>
 #include <io.h>
+#include <conio.h>
 #else
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <poll.h>
+#include <fnmatch.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 
-using json = nlohmann::json;
 
 class ColorUtils {
 private:
@@ -62,6 +79,13 @@ public:
         return color + text + RESET;
     }
     
+    // colorize() without the temporary string, for per-token output
+    static void write(std::ostream& out, std::string_view text, const std::string& color) {
+        if (colors_enabled) out << color;
+        out << text;
+        if (colors_enabled) out << RESET;
+    }
+    
     static bool areColorsEnabled() {
         return colors_enabled;
     }
@@ -149,394 +173,2716 @@ public:
     }
 };
 
-class OllamaAssistant {
+// Size of the terminal stdout is attached to; false when it is not one
+static bool terminalSize(int& out_rows, int& out_columns) {
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) return false;
+    out_rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+    out_columns = info.srWindow.Right - info.srWindow.Left + 1;
+#else
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0) return false;
+    out_rows = size.ws_row;
+    out_columns = size.ws_col;
+#endif
+    return out_rows > 2 && out_columns > 0;
+}
+
+// Live status on the terminal's bottom row. Everything above it is made the
+// scroll region, so normal output scrolls past without touching it. While a
+// request runs, a background thread re-renders at 4 Hz and writes only when
+// the text changed. Between requests it is redrawn only after commands and,
+// while the prompt waits for input, when background jobs change. Disabled
+// when stdout is not a terminal.
+class StatusLine {
 private:
-    std::string api_url;
-    std::string model_name;
-    std::vector<json> conversation_history;
-    CURL* curl;
-    bool streaming_enabled;
-    
-    struct WriteCallback {
-        std::string data;
-    };
+    static constexpr auto TICK = std::chrono::milliseconds(250);
+    static constexpr auto RESIDENCY_INTERVAL = std::chrono::seconds(5);
     
-    static size_t WriteCallbackFunc(void* contents, size_t size, size_t nmemb, void* userp) {
-        size_t totalSize = size * nmemb;
-        std::string* response = static_cast<std::string*>(userp);
-        response->append((char*)contents, totalSize);
-        return totalSize;
+    bool enabled = false;
+    int rows = 0;
+    int columns = 0;
+    std::mutex output_mutex;   // Serializes terminal writes with the reply printer
+    std::mutex state_mutex;
+    std::condition_variable wake;
+    std::thread worker;
+    bool stopping = false;
+    bool busy = false;
+    bool prompting = false;    // Waiting for input, so nothing else is printing
+    bool dirty = false;        // Changed outside a request
+    std::string drawn;         // Last text written, for damage tracking
+    
+    InferenceBackend* backend = nullptr;
+    OllamaHttpBackend* http = nullptr;  // Null for in-process backends
+    std::string model;
+    uint64_t context_used = 0;
+    uint64_t num_ctx = 0;
+    std::chrono::steady_clock::time_point request_start;
+    std::chrono::steady_clock::time_point first_token;
+    std::chrono::steady_clock::time_point last_token;
+    uint64_t tokens = 0;
+    double ttft_ms = -1.0;
+    std::string residency = "?";
+    std::chrono::steady_clock::time_point residency_checked;
+    size_t jobs_running = 0;
+    size_t jobs_finished = 0;
+    
+    // Confines scrolling to the rows above the status line. Caller holds
+    // output_mutex.
+    void setScrollRegion() {
+        // Make room first in case the cursor sits on the last row
+        std::cout << "\n\033[1A\0337\033[1;" << (rows - 1) << "r\0338" << std::flush;
+        drawn.clear();
     }
-
     
-public:
-    OllamaAssistant(const std::string& model = "llama3.2") 
-        : api_url("http://localhost:11434/api/chat"), model_name(model), streaming_enabled(true) {
-        curl = curl_easy_init();
-        if (!curl) {
-            throw std::runtime_error("Failed to initialize libcurl");
+    static std::string formatTokens(uint64_t count) {
+        if (count < 1000) return std::to_string(count);
+        std::ostringstream out;
+        out.precision(1);
+        out << std::fixed << count / 1000.0 << "k";
+        return out.str();
+    }
+    
+    // Caller holds state_mutex
+    std::string render() const {
+        auto now = std::chrono::steady_clock::now();
+        std::ostringstream line;
+        line.precision(1);
+        line << std::fixed << " " << model;
+        if (busy && tokens == 0) {
+            line << " | waiting " << std::chrono::duration<double>(now - request_start).count() << " s";
+        } else {
+            double span = std::chrono::duration<double>(last_token - first_token).count();
+            line << " | " << (tokens > 1 && span > 0 ? (tokens - 1) / span : 0.0) << " tok/s";
+        }
+        if (ttft_ms >= 0) {
+            line << " | TTFT " << static_cast<uint64_t>(ttft_ms) << " ms";
+        }
+        line << " | ctx " << formatTokens(context_used);
+        if (num_ctx > 0) {
+            line << "/" << formatTokens(num_ctx) << " (" << (100 * context_used / num_ctx) << "%)";
+        }
+        line << " | " << residency;
+        line << " | queue " << (backend ? backend->queuedRequests() : 0);
+        if (jobs_running + jobs_finished > 0) {
+            line << " | bg " << jobs_running << " running, " << jobs_finished << " done";
         }
         
-        // Initialize conversation with system message
-        conversation_history.push_back({
-            {"role", "system"},
-            {"content", "You are a helpful terminal assistant. Provide clear, concise responses focused on programming and technical help."}
-        });
+        std::string text = line.str();
+        if (static_cast<int>(text.size()) > columns) {
+            text.resize(columns);
+        }
+        return text;
     }
     
-    ~OllamaAssistant() {
-        if (curl) {
-            curl_easy_cleanup(curl);
+    // Writes the line if it changed. Caller holds output_mutex.
+    void draw(const std::string& text) {
+        int new_rows = rows;
+        int new_columns = columns;
+        if (terminalSize(new_rows, new_columns) && (new_rows != rows || new_columns != columns)) {
+            rows = new_rows;
+            columns = new_columns;
+            setScrollRegion();
         }
+        if (text == drawn) return;
+        std::cout << "\0337\033[" << rows << ";1H\033[2K" << ColorUtils::DIM << ColorUtils::CYAN << text
+                  << ColorUtils::RESET << "\0338" << std::flush;
+        drawn = text;
     }
     
-    void setStreamingEnabled(bool enabled) {
-        streaming_enabled = enabled;
+    void refreshResidency() {
+        if (!http) {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            residency = "in-process";
+            return;
+        }
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            name = model;
+            residency_checked = std::chrono::steady_clock::now();
+        }
+        uint64_t size = 0;
+        uint64_t size_vram = 0;
+        std::string text;
+        bool known = false;
+        bool down = false;
+        if (HealthMonitor* health = http->getHealth()) {
+            // Read from the monitor's last /api/ps rather than asked here
+            HealthMonitor::Snapshot snapshot = health->snapshot();
+            known = snapshot.up;
+            if (const HealthMonitor::LoadedModel* loaded = snapshot.find(OllamaHttpBackend::withDefaultTag(name))) {
+                size = loaded->size;
+                size_vram = loaded->size_vram;
+            }
+            down = snapshot.probed && !snapshot.up;
+        } else {
+            known = http->modelResidency(name, size, size_vram);
+        }
+        if (down) {
+            text = "server down";
+        } else if (!known) {
+            text = "server ?";
+        } else if (size == 0) {
+            text = "not loaded";
+        } else {
+            std::ostringstream out;
+            out.precision(1);
+            out << std::fixed << "resident " << size / 1073741824.0 << " GB, " << (100 * size_vram / size) << "% GPU";
+            text = out.str();
+        }
+        std::lock_guard<std::mutex> lock(state_mutex);
+        residency = text;
     }
     
-    bool isStreamingEnabled() const {
-        return streaming_enabled;
+    // Ctrl-C would otherwise leave the shell with a shortened scroll region
+    static void restoreOnSignal(int signal_number) {
+        static const char reset[] = "\0337\033[r\0338";
+#ifdef _WIN32
+        _write(_fileno(stdout), reset, sizeof(reset) - 1);
+#else
+        ssize_t ignored = write(STDOUT_FILENO, reset, sizeof(reset) - 1);
+        (void)ignored;
+#endif
+        std::signal(signal_number, SIG_DFL);
+        std::raise(signal_number);
     }
     
-    bool checkOllamaConnection() {
-        CURL* test_curl = curl_easy_init();
-        if (!test_curl) return false;
-        
-        WriteCallback response;
-        curl_easy_setopt(test_curl, CURLOPT_URL, "http://localhost:11434/api/tags");
-        curl_easy_setopt(test_curl, CURLOPT_WRITEFUNCTION, WriteCallbackFunc);
-        curl_easy_setopt(test_curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(test_curl, CURLOPT_TIMEOUT, 5L);
-        
-        CURLcode res = curl_easy_perform(test_curl);
-        curl_easy_cleanup(test_curl);
-        
-        return res == CURLE_OK;
+    void loop() {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        while (!stopping) {
+            wake.wait_for(lock, TICK, [this] { return stopping || (dirty && prompting); });
+            if (stopping) break;
+            if (!busy && !(dirty && prompting)) continue;
+            dirty = false;
+            
+            if (busy && std::chrono::steady_clock::now() - residency_checked >= RESIDENCY_INTERVAL) {
+                lock.unlock();
+                refreshResidency();
+                lock.lock();
+            }
+            std::string text = render();
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> output_lock(output_mutex);
+                draw(text);
+            }
+            lock.lock();
+        }
     }
     
-    std::vector<std::string> getAvailableModels() {
-        std::vector<std::string> models;
-        
-        WriteCallback response;
-        curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:11434/api/tags");
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallbackFunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+public:
+    StatusLine() = default;
+    StatusLine(const StatusLine&) = delete;
+    StatusLine& operator=(const StatusLine&) = delete;
+    
+    ~StatusLine() {
+        stop();
+    }
+    
+    void start(InferenceBackend& inference_backend, OllamaHttpBackend* http_backend) {
+#ifdef _WIN32
+        bool tty = _isatty(_fileno(stdout)) && ColorUtils::areColorsEnabled();
+#else
+        const char* term = std::getenv("TERM");
+        bool tty = isatty(STDOUT_FILENO) && !(term && std::string(term) == "dumb");
+#endif
+        if (!tty || !terminalSize(rows, columns)) return;
         
-        CURLcode res = curl_easy_perform(curl);
-        if (res == CURLE_OK) {
-            try {
-                json response_json = json::parse(response.data);
-                if (response_json.contains("models")) {
-                    for (const auto& model : response_json["models"]) {
-                        if (model.contains("name")) {
-                            models.push_back(model["name"]);
-                        }
-                    }
-                }
-            } catch (const json::exception& e) {
-                // If parsing fails, return empty vector
-            }
+        backend = &inference_backend;
+        http = http_backend;
+        enabled = true;
+        std::signal(SIGINT, restoreOnSignal);
+        std::signal(SIGTERM, restoreOnSignal);
+        {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            setScrollRegion();
         }
-        
-        return models;
+        worker = std::thread([this] { loop(); });
     }
     
-    void setModel(const std::string& model) {
-        model_name = model;
-        std::cout << ColorUtils::colorize("Model changed to: ", ColorUtils::GREEN) 
-                 << ColorUtils::colorize(model_name, ColorUtils::BOLD + ColorUtils::CYAN) << "\n" << std::endl;
+    // Restores the full-screen scroll region and clears the line
+    void stop() {
+        if (!enabled) return;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+        std::cout << "\0337\033[r\033[" << rows << ";1H\033[2K\0338" << std::flush;
+        enabled = false;
     }
     
-    std::string getCurrentModel() const {
-        return model_name;
+    bool isEnabled() const {
+        return enabled;
     }
-
-    std::string sendMessage(const std::string& message) {
-        // Add user message to conversation history
-        conversation_history.push_back({
-            {"role", "user"},
-            {"content", message}
-        });
-
-        // Prepare JSON payload for Ollama chat API
-        json payload = {
-            {"model", model_name},
-            {"messages", conversation_history},
-            {"stream", streaming_enabled}
-        };
-
-        std::string json_string = payload.dump();
-
-        // Set up HTTP headers
-        struct curl_slist* headers = nullptr;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-
-        // Set up response callback
-        WriteCallback response;
-
-        // Configure curl options
-        curl_easy_setopt(curl, CURLOPT_URL, api_url.c_str());
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_string.c_str());
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallbackFunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);  // Longer timeout for local processing
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-
-        // Perform the request
-        CURLcode res = curl_easy_perform(curl);
-        curl_slist_free_all(headers);
-
-        if (res != CURLE_OK) {
-            throw std::runtime_error("HTTP request failed: " + std::string(curl_easy_strerror(res)) + 
-                                    "\nMake sure Ollama is running: ollama serve");
+    
+    // Held by the reply printer so redraws never split its output
+    std::unique_lock<std::mutex> lockOutput() {
+        return std::unique_lock<std::mutex>(output_mutex);
+    }
+    
+    void setModel(const std::string& name) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (model != name) {
+            model = name;
+            residency = "?";
+            residency_checked = {};
         }
-
-        // Check HTTP response code
-        long response_code;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-        if (response_code != 200) {
-            throw std::runtime_error("Ollama API request failed with HTTP " + std::to_string(response_code) + 
-                                    ": " + response.data + 
-                                    "\nMake sure the model '" + model_name + "' is installed: ollama pull " + model_name);
+    }
+    
+    void beginRequest(uint64_t estimated_context, uint64_t context_limit) {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> lock(state_mutex);
+        busy = true;
+        request_start = std::chrono::steady_clock::now();
+        tokens = 0;
+        ttft_ms = -1.0;
+        context_used = estimated_context;
+        num_ctx = context_limit;
+        residency_checked = {};  // Catch a model being loaded for this request
+        if (HealthMonitor* health = http ? http->getHealth() : nullptr) {
+            health->probeSoon();
         }
-
-        // Final assistant reply string (move outside try block)
-        std::string assistant_reply;
-
-        // Parse JSON response
-        try {
-            if (streaming_enabled) {
-                std::istringstream stream(response.data);
-                std::string line;
-                while (std::getline(stream, line)) {
-                    if (line.rfind("data: ", 0) == 0) {
-                        line = line.substr(6); // Remove "data: "
-                    }
-
-                    if (line.empty() || line == "[DONE]") continue;
-
-                    try {
-                        json chunk = json::parse(line);
-                        if (chunk.contains("message") && chunk["message"].contains("content")) {
-                            std::string content = chunk["message"]["content"];
-                            assistant_reply += content;
-                        }
-                    } catch (const json::exception& e) {
-                        std::cerr << "Stream JSON parse error: " << e.what() << std::endl;
-                    }
-                }
-            } else {
-                // Fallback for non-streaming
-                json response_json = json::parse(response.data);
-                if (response_json.contains("message") && response_json["message"].contains("content")) {
-                    assistant_reply = response_json["message"]["content"];
-                }
+        wake.notify_all();
+    }
+    
+    // Called per streamed piece, with the output lock held
+    void onToken() {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> lock(state_mutex);
+        last_token = std::chrono::steady_clock::now();
+        if (tokens++ == 0) {
+            first_token = last_token;
+            ttft_ms = std::chrono::duration<double, std::milli>(first_token - request_start).count();
+        }
+        ++context_used;
+    }
+    
+    // Final values from the server's last chunk, then one last redraw
+    void endRequest(uint64_t prompt_tokens, uint64_t reply_tokens, uint64_t context_limit) {
+        if (!enabled) return;
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            busy = false;
+            if (prompt_tokens + reply_tokens > 0) {
+                context_used = prompt_tokens + reply_tokens;
             }
-        } catch (const json::exception& e) {
-            throw std::runtime_error("JSON parsing error: " + std::string(e.what()));
+            num_ctx = context_limit;
+            text = render();
         }
-
-        // Append assistant reply to history
-        conversation_history.push_back({
-            {"role", "assistant"},
-            {"content", assistant_reply}
-        });
-
-        return assistant_reply;
+        std::lock_guard<std::mutex> output_lock(output_mutex);
+        draw(text);
     }
-
     
-    void clearConversation() {
-        conversation_history.clear();
-        conversation_history.push_back({
-            {"role", "system"},
-            {"content", "You are a helpful terminal assistant. Provide clear, concise responses focused on programming and technical help."}
-        });
-        std::cout << ColorUtils::colorize("Conversation history cleared.", ColorUtils::GREEN) << "\n" << std::endl;
+    // Callable from any thread
+    void setJobs(size_t running, size_t finished) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        jobs_running = running;
+        jobs_finished = finished;
+        dirty = true;
+        wake.notify_all();
     }
     
-    void showConversationHistory() {
-        std::cout << "\n" << ColorUtils::colorize("=== Conversation History ===", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+    // Brackets the wait for input, during which changes may be drawn at
+    // once. Leaving waits for a draw in progress to finish.
+    void setPrompting(bool waiting) {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> output_lock(output_mutex);
+        std::lock_guard<std::mutex> lock(state_mutex);
+        prompting = waiting;
+        if (waiting) wake.notify_all();
+    }
+    
+    // The screen was redrawn by someone else (e.g. the history pager):
+    // restore the scroll region and repaint on the next draw
+    void invalidate() {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> output_lock(output_mutex);
+        rows = 0;
+        columns = 0;
+    }
+    
+    // Redraw between requests, e.g. after /model or /clear
+    void refresh(uint64_t context_estimate, uint64_t context_limit) {
+        if (!enabled) return;
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            context_used = context_estimate;
+            num_ctx = context_limit;
+            text = render();
+        }
+        std::lock_guard<std::mutex> output_lock(output_mutex);
+        draw(text);
+    }
+};
+
+// Line-wrap index of the conversation for the history pager. It records,
+// per message, where each wrapped screen line starts, plus the message's
+// first global line, so any screen line is found by binary search without
+// touching message text. New messages are added as they arrive; only a
+// width change or an edit of older messages rebuilds it.
+class HistoryLayout {
+public:
+    struct Entry {
+        bool user;
+        size_t first_line;             // Global index of the message's first line
+        std::vector<uint32_t> starts;  // Byte offset of each wrapped line in the content
         
-        if (conversation_history.size() <= 1) {
-            std::cout << ColorUtils::colorize("No conversation history yet.", ColorUtils::GRAY) << std::endl;
-        } else {
-            for (size_t i = 1; i < conversation_history.size(); ++i) { 
-                const auto& msg = conversation_history[i];
-                std::string role = msg["role"];
-                std::string content = msg["content"];
-                
-                if (role == "user") {
-                    std::cout << ColorUtils::colorize("You: ", ColorUtils::BOLD + ColorUtils::BLUE) 
-                             << content << std::endl;
-                } else if (role == "assistant") {
-                    std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN) 
-                             << content << std::endl;
+        // Wrapped lines plus the blank separator line
+        size_t lineCount() const {
+            return starts.size() + 1;
+        }
+    };
+    
+    static constexpr const char* USER_PREFIX = "You: ";
+    static constexpr const char* ASSISTANT_PREFIX = "Ollama: ";
+    
+private:
+    std::vector<Entry> entries;  // entries[i] is message i + 1
+    std::vector<size_t> user_turns;  // Entry index of each user message
+    size_t total_lines = 0;
+    size_t width = 0;
+    size_t covered_chars = 0;    // Content bytes indexed, system prompt included
+    
+    // Greedy word wrap by code points; `indent` columns are taken on the first line
+    static void wrap(std::string_view text, size_t indent, size_t columns, std::vector<uint32_t>& starts) {
+        starts.assign(1, 0);
+        size_t column = indent;
+        size_t break_at = std::string_view::npos;  // Just past the last space on this line
+        size_t column_at_break = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c == '\n') {
+                starts.push_back(static_cast<uint32_t>(i + 1));
+                column = 0;
+                break_at = std::string_view::npos;
+                continue;
+            }
+            if ((c & 0xC0) == 0x80) continue;  // UTF-8 continuation byte
+            if (column >= columns) {
+                if (break_at != std::string_view::npos && break_at > starts.back()) {
+                    starts.push_back(static_cast<uint32_t>(break_at));
+                    column -= column_at_break;
+                } else {
+                    starts.push_back(static_cast<uint32_t>(i));
+                    column = 0;
                 }
-                std::cout << std::endl;
+                break_at = std::string_view::npos;
+            }
+            ++column;
+            if (c == ' ') {
+                break_at = i + 1;
+                column_at_break = column;
             }
         }
-        std::cout << ColorUtils::colorize("========================", ColorUtils::CYAN) << "\n" << std::endl;
     }
     
-    size_t getConversationLength() const {
-        return conversation_history.size() - 1; 
+    void add(const json& message) {
+        const std::string& content = message["content"].get_ref<const std::string&>();
+        Entry entry;
+        entry.user = message["role"] == "user";
+        entry.first_line = total_lines;
+        wrap(content, std::strlen(entry.user ? USER_PREFIX : ASSISTANT_PREFIX), width, entry.starts);
+        if (entry.user) user_turns.push_back(entries.size());
+        total_lines += entry.lineCount();
+        covered_chars += content.size();
+        entries.push_back(std::move(entry));
     }
-};
-
-class TerminalInterface {
-private:
-    std::unique_ptr<OllamaAssistant> assistant;
     
-    void printHelp() {
-        std::cout << "\n" << ColorUtils::colorize("=== Ollama Terminal Assistant ===", ColorUtils::BOLD + ColorUtils::MAGENTA) << std::endl;
-        std::cout << ColorUtils::colorize("Available Commands:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
-        
-        std::cout << ColorUtils::colorize("  /help", ColorUtils::YELLOW) 
-                 << "      - Show this help message" << std::endl;
-        std::cout << ColorUtils::colorize("  /clear", ColorUtils::YELLOW) 
-                 << "     - Clear conversation history" << std::endl;
-        std::cout << ColorUtils::colorize("  /history", ColorUtils::YELLOW) 
-                 << "   - Show conversation history" << std::endl;
-        std::cout << ColorUtils::colorize("  /models", ColorUtils::YELLOW) 
-                 << "    - List available models" << std::endl;
-        std::cout << ColorUtils::colorize("  /model", ColorUtils::YELLOW) 
-                 << "     - Change current model" << std::endl;
-        std::cout << ColorUtils::colorize("  /status", ColorUtils::YELLOW) 
-                 << "    - Check Ollama connection" << std::endl;
-        std::cout << ColorUtils::colorize("  /stream", ColorUtils::YELLOW) 
-                 << "    - Toggle streaming output" << std::endl;
-        std::cout << ColorUtils::colorize("  /quit", ColorUtils::YELLOW) 
-                 << "      - Exit the application" << std::endl;
-        std::cout << ColorUtils::colorize("  /exit", ColorUtils::YELLOW) 
-                 << "      - Exit the application" << std::endl;
+public:
+    // Brings the index up to date with the conversation; only new messages
+    // are wrapped unless the width or earlier messages changed
+    void sync(const ConversationStore& conversation, size_t columns) {
+        MemoryScope scope(MemoryAccounting::RENDERER);
+        size_t messages = conversation.size() - 1;
+        std::vector<json> fresh;
+        size_t expected_chars = covered_chars;
+        for (size_t i = entries.size() + 1; i <= messages; ++i) {
+            fresh.push_back(conversation.at(i));
+            expected_chars += fresh.back()["content"].get_ref<const std::string&>().size();
+        }
+        if (columns == width && messages >= entries.size() && expected_chars == conversation.totalChars()) {
+            for (const auto& message : fresh) {
+                add(message);
+            }
+            return;
+        }
         
-        std::cout << "\n" << ColorUtils::colorize("Just type your message and press Enter to chat!", ColorUtils::GREEN) << std::endl;
-        std::cout << ColorUtils::colorize("   Ask programming questions, get help, or have a conversation!", ColorUtils::DIM) << std::endl;
-        std::cout << ColorUtils::colorize("   Current model: ", ColorUtils::DIM) 
-                 << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
-        std::cout << ColorUtils::colorize("   Streaming: ", ColorUtils::DIM) 
-                 << ColorUtils::colorize(assistant->isStreamingEnabled() ? "ON" : "OFF", 
-                                        assistant->isStreamingEnabled() ? ColorUtils::GREEN : ColorUtils::RED) << std::endl;
-        std::cout << ColorUtils::colorize("================================", ColorUtils::MAGENTA) << "\n" << std::endl;
+        entries.clear();
+        user_turns.clear();
+        total_lines = 0;
+        width = columns;
+        covered_chars = conversation.getSystemPrompt().size();
+        for (const auto& message : conversation.materialize(1)) {
+            add(message);
+        }
     }
     
-    void printWelcome() {
-        StreamingOutput::typeText(ColorUtils::colorize("Ollama Terminal Assistant", ColorUtils::BOLD + ColorUtils::MAGENTA) + "\n", "", 30);
-        StreamingOutput::typeText(ColorUtils::colorize(" Your FREE local AI assistant - No API keys needed!", ColorUtils::CYAN) + "\n", "", 20);
-        std::cout << ColorUtils::colorize("Running locally with model: ", ColorUtils::GREEN) 
-                 << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
-        std::cout << ColorUtils::colorize("Streaming mode: ", ColorUtils::GREEN) 
-                  << std::endl;
-        StreamingOutput::typeText(ColorUtils::colorize("Type '/help' for commands or start chatting!", ColorUtils::GREEN) + "\n", "", 15);
-        std::cout << ColorUtils::colorize("========================================", ColorUtils::MAGENTA) << "\n" << std::endl;
+    size_t lineCount() const {
+        return total_lines;
     }
     
-    std::string getInput() {
-        std::string input;
-        std::cout << ColorUtils::colorize("You: ", ColorUtils::BOLD + ColorUtils::BLUE);
-        std::getline(std::cin, input);
-        return input;
+    size_t messageCount() const {
+        return entries.size();
     }
     
-    void showThinking() {
-        std::cout << ColorUtils::colorize(" ", ColorUtils::GREEN) 
-                 << ColorUtils::colorize("Thinking", ColorUtils::YELLOW) << std::flush;
-        for (int i = 0; i < 3; ++i) {
-            std::cout << ColorUtils::colorize(".", ColorUtils::YELLOW) << std::flush;
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        }
+    const Entry& entry(size_t index) const {
+        return entries[index];
     }
     
-    void clearThinking() {
-        std::cout << "\r" << std::string(20, ' ') << "\r" << std::flush;
+    // Entry holding a global line
+    size_t entryForLine(size_t line) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), line,
+                                   [](size_t value, const Entry& e) { return value < e.first_line; });
+        return static_cast<size_t>(it - entries.begin()) - 1;
     }
     
-    bool isCommand(const std::string& input) {
-        return !input.empty() && input[0] == '/';
+    // Global line showing byte `offset` of an entry's content
+    size_t lineForOffset(size_t index, size_t offset) const {
+        const Entry& e = entries[index];
+        auto it = std::upper_bound(e.starts.begin(), e.starts.end(), static_cast<uint32_t>(offset));
+        return e.first_line + static_cast<size_t>(it - e.starts.begin()) - 1;
     }
     
-    bool handleCommand(const std::string& command) {
-        if (command == "/help") {
-            printHelp();
-            return true;
-        } else if (command == "/clear") {
-            assistant->clearConversation();
-            return true;
-        } else if (command == "/history") {
-            assistant->showConversationHistory();
-            return true;
-        } else if (command == "/models") {
-            showAvailableModels();
-            return true;
-        } else if (command == "/model") {
-            changeModel();
-            return true;
-        } else if (command == "/status") {
-            checkStatus();
-            return true;
-        } else if (command == "/stream") {
-            toggleStreaming();
-            return true;
-        } else if (command == "/quit" || command == "/exit") {
-            StreamingOutput::typeText(ColorUtils::colorize(" Goodbye! Thanks for using Ollama Terminal Assistant!", ColorUtils::GREEN) + "\n", "", 25);
-            return false;
-        } else {
-            std::cout << ColorUtils::colorize(" Unknown command: ", ColorUtils::RED) << command << std::endl;
-            std::cout << ColorUtils::colorize(" Type '/help' for available commands.", ColorUtils::YELLOW) << "\n" << std::endl;
-            return true;
-        }
+    size_t turnCount() const {
+        return user_turns.size();
     }
     
-    void toggleStreaming() {
-        assistant->setStreamingEnabled(!assistant->isStreamingEnabled());
-        std::string status = assistant->isStreamingEnabled() ? "ENABLED" : "DISABLED";
-        std::string color = assistant->isStreamingEnabled() ? ColorUtils::GREEN : ColorUtils::RED;
-        std::string icon = assistant->isStreamingEnabled() ? " " : " ";
-        
-        std::cout << ColorUtils::colorize(icon + " Streaming output " + status, color) << std::endl;
-        if (assistant->isStreamingEnabled()) {
-            std::cout << ColorUtils::colorize(" Responses will now appear character by character like ChatGPT!", ColorUtils::CYAN) << std::endl;
-        } else {
-            std::cout << ColorUtils::colorize(" Responses will now appear instantly.", ColorUtils::CYAN) << std::endl;
+    // First line of user turn `turn` (1-based)
+    size_t lineForTurn(size_t turn) const {
+        if (user_turns.empty()) return 0;
+        turn = std::min(std::max<size_t>(turn, 1), user_turns.size());
+        return entries[user_turns[turn - 1]].first_line;
+    }
+    
+    // 1-based user turn a line belongs to, counting the reply with its question
+    size_t turnForLine(size_t line) const {
+        if (entries.empty()) return 0;
+        size_t index = entryForLine(line);
+        return static_cast<size_t>(std::upper_bound(user_turns.begin(), user_turns.end(), index) - user_turns.begin());
+    }
+};
+
+// Full-screen viewer over a HistoryLayout. Each redraw fetches only the
+// messages on screen, so opening and scrolling cost O(screen) whatever the
+// history size. Keys: j/k or arrows scroll, space/b or PgDn/PgUp page,
+// g/G top/bottom, :N jumps to turn N, /text searches (n/N repeat) and q quits.
+class HistoryPager {
+private:
+    const ConversationStore& conversation;
+    const HistoryLayout& layout;
+    int rows;
+    int columns;
+    size_t top = 0;
+    std::string search;  // Lowercased current search text
+    std::string message; // Shown in the bottom bar until the next key
+    size_t match_entry = 0;
+    size_t match_offset = std::string::npos;
+    std::map<size_t, std::string> content_cache;  // Messages near the screen
+    
+    size_t pageLines() const {
+        return static_cast<size_t>(rows - 1);
+    }
+    
+    size_t maxTop() const {
+        return layout.lineCount() > pageLines() ? layout.lineCount() - pageLines() : 0;
+    }
+    
+    const std::string& content(size_t index) {
+        auto it = content_cache.find(index);
+        if (it != content_cache.end()) return it->second;
+        if (content_cache.size() >= 256) content_cache.clear();
+        json message_json = conversation.at(index + 1);
+        return content_cache[index] = message_json["content"].get<std::string>();
+    }
+    
+    static std::string lowercase(std::string_view text) {
+        std::string lower(text);
+        for (char& c : lower) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
         }
-        std::cout << std::endl;
+        return lower;
     }
     
-    void showAvailableModels() {
-        std::cout << ColorUtils::colorize(" Fetching available models...", ColorUtils::YELLOW) << std::endl;
-        
-        try {
-            auto models = assistant->getAvailableModels();
-            if (models.empty()) {
-                std::cout << ColorUtils::colorize(" No models found. Install a model first:", ColorUtils::RED) << std::endl;
-                std::cout << ColorUtils::colorize("   ollama pull llama3.2", ColorUtils::CYAN) << std::endl;
-                std::cout << ColorUtils::colorize("   ollama pull codellama", ColorUtils::CYAN) << std::endl;
-            } else {
-                std::cout << ColorUtils::colorize("Available Models:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
-                for (size_t i = 0; i < models.size(); ++i) {
-                    std::string marker = (models[i] == assistant->getCurrentModel()) ? "➤ " : "  ";
-                    std::string color = (models[i] == assistant->getCurrentModel()) ? 
-                                      ColorUtils::BOLD + ColorUtils::GREEN : ColorUtils::WHITE;
-                    std::cout << ColorUtils::colorize(marker + std::to_string(i + 1) + ". " + models[i], color) << std::endl;
+    // Copies a line for the terminal: control characters become spaces and
+    // search matches are shown in reverse video
+    void appendLine(std::string& out, std::string_view line) const {
+        std::string lower = search.empty() ? std::string() : lowercase(line);
+        size_t next_match = search.empty() ? std::string::npos : lower.find(search);
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (i == next_match) {
+                out += "\033[7m";
+                for (size_t j = 0; j < search.size(); ++j, ++i) {
+                    unsigned char c = static_cast<unsigned char>(line[i]);
+                    out += c < 0x20 ? ' ' : line[i];
                 }
+                out += "\033[27m";
+                next_match = lower.find(search, i);
+                --i;
+                continue;
             }
-        } catch (const std::exception& e) {
-            std::cout << ColorUtils::colorize(" Error fetching models: ", ColorUtils::RED) << e.what() << std::endl;
+            unsigned char c = static_cast<unsigned char>(line[i]);
+            out += c < 0x20 ? ' ' : line[i];
         }
-        std::cout << std::endl;
     }
     
-    void changeModel() {
-        try {
-            auto models = assistant->getAvailableModels();
-            if (models.empty()) {
-                std::cout << ColorUtils::colorize(" No models available. Install one first:", ColorUtils::RED) << std::endl;
-                std::cout << ColorUtils::colorize("   ollama pull llama3.2", ColorUtils::CYAN) << std::endl;
+    void draw() {
+        std::string screen = "\033[H";
+        size_t line = top;
+        for (size_t row = 0; row < pageLines(); ++row, ++line) {
+            screen += "\033[2K";
+            if (line < layout.lineCount()) {
+                size_t index = layout.entryForLine(line);
+                const HistoryLayout::Entry& e = layout.entry(index);
+                size_t k = line - e.first_line;
+                if (k < e.starts.size()) {
+                    const std::string& text = content(index);
+                    size_t end = k + 1 < e.starts.size() ? e.starts[k + 1] : text.size();
+                    std::string_view part(text.data() + e.starts[k], end - e.starts[k]);
+                    if (!part.empty() && part.back() == '\n') part.remove_suffix(1);
+                    if (k == 0) {
+                        screen += ColorUtils::colorize(e.user ? HistoryLayout::USER_PREFIX : HistoryLayout::ASSISTANT_PREFIX,
+                                                       ColorUtils::BOLD + (e.user ? ColorUtils::BLUE : ColorUtils::GREEN));
+                    }
+                    appendLine(screen, part);
+                }
+            } else {
+                screen += ColorUtils::colorize("~", ColorUtils::GRAY);
+            }
+            screen += "\r\n";
+        }
+        
+        std::ostringstream bar;
+        size_t last = std::min(top + pageLines(), layout.lineCount());
+        bar << " lines " << (layout.lineCount() ? top + 1 : 0) << "-" << last << " of " << layout.lineCount()
+            << ", turn " << layout.turnForLine(top) << "/" << layout.turnCount();
+        if (!message.empty()) {
+            bar << " | " << message;
+        } else {
+            bar << " | j/k space/b g/G :turn /search n/N q";
+        }
+        std::string text = bar.str();
+        if (static_cast<int>(text.size()) > columns) text.resize(columns);
+        screen += "\033[2K\033[7m" + text + std::string(columns - static_cast<int>(text.size()), ' ') + "\033[27m";
+        std::cout << screen << std::flush;
+    }
+    
+    // Finds the next (or previous) match after the current one and scrolls to it
+    bool findMatch(bool forward) {
+        size_t count = layout.messageCount();
+        if (search.empty() || count == 0) return false;
+        size_t index = match_offset == std::string::npos ? layout.entryForLine(top) : match_entry;
+        size_t from = match_offset;
+        for (size_t step = 0; step <= count; ++step) {
+            std::string lower = lowercase(content(index));
+            size_t at;
+            if (forward) {
+                at = lower.find(search, from == std::string::npos ? 0 : from + 1);
+            } else {
+                at = from == std::string::npos ? lower.rfind(search)
+                                               : (from == 0 ? std::string::npos : lower.rfind(search, from - 1));
+            }
+            if (at != std::string::npos) {
+                match_entry = index;
+                match_offset = at;
+                size_t line = layout.lineForOffset(index, at);
+                top = std::min(line > pageLines() / 3 ? line - pageLines() / 3 : 0, maxTop());
+                return true;
+            }
+            index = forward ? (index + 1) % count : (index + count - 1) % count;
+            from = std::string::npos;
+        }
+        return false;
+    }
+    
+    static int readKey() {
+#ifdef _WIN32
+        return _getch();
+#else
+        unsigned char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) return -1;
+        return c;
+#endif
+    }
+    
+    // Reads a line on the bottom row; empty when cancelled with Escape
+    std::string prompt(char lead) {
+        std::string text;
+        while (true) {
+            std::cout << "\033[" << rows << ";1H\033[2K" << lead << text << std::flush;
+            int c = readKey();
+            if (c < 0 || c == 27) return std::string();
+            if (c == '\r' || c == '\n') return text;
+            if ((c == 127 || c == 8)) {
+                if (!text.empty()) text.pop_back();
+            } else if (c >= 0x20) {
+                text += static_cast<char>(c);
+            }
+        }
+    }
+    
+    // Arrow and paging keys arrive as ESC [ sequences
+    int readEscape() {
+        if (readKey() != '[') return 0;
+        int c = readKey();
+        if (c >= '0' && c <= '9') {
+            readKey();  // Trailing '~'
+            return c == '5' ? 'b' : c == '6' ? ' ' : 0;
+        }
+        switch (c) {
+            case 'A': return 'k';
+            case 'B': return 'j';
+            case 'H': return 'g';
+            case 'F': return 'G';
+            default: return 0;
+        }
+    }
+    
+public:
+    HistoryPager(const ConversationStore& store, const HistoryLayout& history, int screen_rows, int screen_columns)
+        : conversation(store), layout(history), rows(screen_rows), columns(screen_columns) {}
+    
+    // Shows the history starting at `turn` (0 for the end) until q is pressed
+    void run(size_t turn) {
+#ifndef _WIN32
+        termios saved;
+        tcgetattr(STDIN_FILENO, &saved);
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+#endif
+        std::cout << "\033[?1049h\033[r\033[?25l";
+        top = turn > 0 ? std::min(layout.lineForTurn(turn), maxTop()) : maxTop();
+        
+        bool running = true;
+        while (running) {
+            draw();
+            message.clear();
+            int key = readKey();
+            if (key == 27) key = readEscape();
+            switch (key) {
+                case -1:
+                case 'q':
+                    running = false;
+                    break;
+                case 'j':
+                    top = std::min(top + 1, maxTop());
+                    break;
+                case 'k':
+                    if (top > 0) --top;
+                    break;
+                case ' ':
+                case 'f':
+                    top = std::min(top + pageLines(), maxTop());
+                    break;
+                case 'b':
+                    top = top > pageLines() ? top - pageLines() : 0;
+                    break;
+                case 'g':
+                    top = 0;
+                    break;
+                case 'G':
+                    top = maxTop();
+                    break;
+                case ':': {
+                    std::string number = prompt(':');
+                    try {
+                        if (!number.empty()) top = std::min(layout.lineForTurn(std::stoul(number)), maxTop());
+                    } catch (const std::exception&) {
+                        message = "Not a turn number: " + number;
+                    }
+                    break;
+                }
+                case '/': {
+                    std::string text = prompt('/');
+                    if (text.empty()) break;
+                    search = lowercase(text);
+                    match_offset = std::string::npos;
+                    if (!findMatch(true)) message = "Not found: " + text;
+                    break;
+                }
+                case 'n':
+                case 'N':
+                    if (!findMatch(key == 'n')) message = search.empty() ? "No search" : "Not found";
+                    break;
+                default:
+                    break;
+            }
+        }
+        
+        std::cout << "\033[?25h\033[?1049l" << std::flush;
+#ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+#endif
+    }
+};
+
+// Generations running beside the foreground chat (/bg). Each job forks the
+// conversation into its own OllamaAssistant on the shared backend and runs
+// on its own thread, buffering the reply until it is brought to the
+// foreground with /fg. Thread-safe.
+class BackgroundJobs {
+public:
+    enum State { RUNNING, DONE, FAILED, CANCELLED };
+    
+    struct Job {
+        size_t id = 0;
+        std::string prompt;
+        std::unique_ptr<OllamaAssistant> assistant;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::string output;   // Reply so far
+        std::string error;
+        State state = RUNNING;
+        uint64_t pieces = 0;
+        bool announced = false;
+        std::atomic<bool> cancel{false};
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point finished;
+    };
+    
+    using ChangeCallback = std::function<void(size_t running, size_t finished)>;
+    
+private:
+    std::mutex mutex;
+    std::map<size_t, std::shared_ptr<Job>> jobs;
+    size_t next_id = 1;
+    ChangeCallback on_change;
+    
+    void notifyChange() {
+        size_t running = 0;
+        size_t finished = 0;
+        ChangeCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entry : jobs) {
+                std::lock_guard<std::mutex> job_lock(entry.second->mutex);
+                (entry.second->state == RUNNING ? running : finished) += 1;
+            }
+            callback = on_change;
+        }
+        if (callback) callback(running, finished);
+    }
+    
+    void execute(Job& job) {
+        State state = DONE;
+        std::string error;
+        try {
+            job.assistant->sendMessage(job.prompt, [&job](std::string_view delta) {
+                std::lock_guard<std::mutex> lock(job.mutex);
+                job.output.append(delta.data(), delta.size());
+                ++job.pieces;
+                job.changed.notify_all();
+                return !job.cancel.load();
+            });
+            if (job.cancel) state = CANCELLED;
+        } catch (const std::exception& e) {
+            state = FAILED;
+            error = e.what();
+        }
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            // Non-streamed replies arrive only at the end
+            if (state == DONE && job.output.empty() && job.assistant->getConversationLength() > 0) {
+                job.output = job.assistant->getConversation().back()["content"].get<std::string>();
+            }
+            job.state = state;
+            job.error = error;
+            job.finished = std::chrono::steady_clock::now();
+        }
+        job.changed.notify_all();
+        notifyChange();
+    }
+    
+public:
+    BackgroundJobs() = default;
+    BackgroundJobs(const BackgroundJobs&) = delete;
+    BackgroundJobs& operator=(const BackgroundJobs&) = delete;
+    
+    ~BackgroundJobs() {
+        cancelAll();
+    }
+    
+    // Called from job threads whenever a job starts or finishes
+    void setChangeCallback(ChangeCallback callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        on_change = std::move(callback);
+    }
+    
+    // Runs `prompt` in a copy of the conversation described by `state`
+    size_t start(const json& state, const std::string& prompt, std::shared_ptr<InferenceBackend> backend,
+                 const ClientResources& resources) {
+        auto job = std::make_shared<Job>();
+        job->prompt = prompt;
+        job->assistant = std::make_unique<OllamaAssistant>("", std::move(backend), resources);
+        job->assistant->importState(state);
+        job->started = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job->id = next_id++;
+            jobs[job->id] = job;
+        }
+        Job* raw = job.get();
+        job->thread = std::thread([this, raw] { execute(*raw); });
+        notifyChange();
+        return job->id;
+    }
+    
+    std::vector<std::shared_ptr<Job>> list() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::shared_ptr<Job>> all;
+        for (const auto& entry : jobs) {
+            all.push_back(entry.second);
+        }
+        return all;
+    }
+    
+    // Finished jobs not reported yet; each is returned once
+    std::vector<std::shared_ptr<Job>> takeFinished() {
+        std::vector<std::shared_ptr<Job>> finished;
+        for (const auto& job : list()) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (job->state != RUNNING && !job->announced) {
+                job->announced = true;
+                finished.push_back(job);
+            }
+        }
+        return finished;
+    }
+    
+    // Removes a job from the table; the caller owns it and must join its thread
+    std::shared_ptr<Job> take(size_t id) {
+        std::shared_ptr<Job> job;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = jobs.find(id);
+            if (it == jobs.end()) return nullptr;
+            job = it->second;
+            jobs.erase(it);
+        }
+        notifyChange();
+        return job;
+    }
+    
+    void cancelAll() {
+        std::map<size_t, std::shared_ptr<Job>> all;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            all.swap(jobs);
+            on_change = nullptr;
+        }
+        for (auto& entry : all) {
+            entry.second->cancel = true;
+        }
+        for (auto& entry : all) {
+            if (entry.second->thread.joinable()) entry.second->thread.join();
+        }
+    }
+};
+
+#ifndef _WIN32
+// Files matching a glob such as src/*.cpp (wildcards in the file name only)
+// and which of them changed. Uses inotify on Linux and polls modification
+// times elsewhere. Waiting also returns when stdin has input, so a caller
+// can watch files and the keyboard at once.
+class FileWatcher {
+private:
+    static constexpr int POLL_INTERVAL_MS = 250;
+    
+    std::filesystem::path directory;
+    std::string prefix;   // Prepended to file names to form reported paths
+    std::string pattern;
+    int inotify_fd = -1;
+    std::map<std::string, std::filesystem::file_time_type> stamps;  // Polling fallback
+    
+    bool matches(const char* name) const {
+        return fnmatch(pattern.c_str(), name, FNM_PERIOD) == 0;
+    }
+    
+    void scan(std::vector<std::string>* changed) {
+        std::map<std::string, std::filesystem::file_time_type> current;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            std::string name = entry.path().filename().string();
+            if (!entry.is_regular_file(error) || !matches(name.c_str())) continue;
+            auto stamp = entry.last_write_time(error);
+            auto it = stamps.find(prefix + name);
+            if (changed && (it == stamps.end() || it->second != stamp)) {
+                changed->push_back(prefix + name);
+            }
+            current[prefix + name] = stamp;
+        }
+        stamps.swap(current);
+    }
+    
+public:
+    explicit FileWatcher(const std::string& glob) {
+        std::filesystem::path full(glob);
+        pattern = full.filename().string();
+        if (full.has_parent_path()) {
+            directory = full.parent_path();
+            prefix = directory.string() + "/";
+        } else {
+            directory = ".";
+        }
+        if (directory.string().find_first_of("*?[") != std::string::npos) {
+            throw std::runtime_error("Wildcards are only supported in the file name: " + glob);
+        }
+        if (pattern.empty() || !std::filesystem::is_directory(directory)) {
+            throw std::runtime_error("No such directory: " + directory.string());
+        }
+#ifdef __linux__
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0 || inotify_add_watch(inotify_fd, directory.c_str(),
+                                                IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            throw std::runtime_error("Cannot watch " + directory.string() + ": " + std::strerror(errno));
+        }
+#endif
+        scan(nullptr);
+    }
+    
+    ~FileWatcher() {
+        if (inotify_fd >= 0) close(inotify_fd);
+    }
+    
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+    
+    // Matching files when the watch started
+    std::vector<std::string> files() const {
+        std::vector<std::string> paths;
+        for (const auto& entry : stamps) {
+            paths.push_back(entry.first);
+        }
+        return paths;
+    }
+    
+    // Waits up to `timeout_ms` for matching files to change; `input` tells
+    // whether stdin became readable. A path may be reported for a change
+    // that left its content as it was.
+    std::vector<std::string> wait(int timeout_ms, bool& input) {
+        std::vector<std::string> changed;
+        pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+        bool polling = inotify_fd < 0;
+        int ready = poll(fds, polling ? 1 : 2, polling ? std::min(timeout_ms, POLL_INTERVAL_MS) : timeout_ms);
+        input = ready > 0 && (fds[0].revents & (POLLIN | POLLHUP)) != 0;
+        if (polling) {
+            scan(&changed);
+            return changed;
+        }
+#ifdef __linux__
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            alignas(inotify_event) char buffer[16 * 1024];
+            ssize_t length;
+            while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                for (char* at = buffer; at < buffer + length;) {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(at);
+                    if (event->len > 0 && matches(event->name)) {
+                        std::string path = prefix + event->name;
+                        if (std::find(changed.begin(), changed.end(), path) == changed.end()) {
+                            changed.push_back(path);
+                        }
+                    }
+                    at += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+#endif
+        return changed;
+    }
+};
+#endif
+
+// Reads one message from the user. On a terminal, input is read unbuffered
+// with bracketed paste enabled, so a pasted block arrives as one message
+// however many lines it has; it shows as a one-line placeholder and is
+// copied into the message a chunk at a time. Typed text gets backspace,
+// Ctrl-U and Ctrl-D. A line starting with """ opens a multi-line block that
+// ends at a line ending with """, on a terminal or not.
+class LineReader {
+private:
+    static constexpr size_t CHUNK = 64 * 1024;
+    static constexpr int ESCAPE_TIMEOUT_MS = 50;
+    static constexpr const char* PASTE_BEGIN = "\033[200~";
+    static constexpr const char* PASTE_END = "\033[201~";
+    static constexpr size_t MARKER_LENGTH = 6;
+    static constexpr const char* BLOCK_QUOTE = "\"\"\"";
+    
+    bool tty = false;
+    
+    static void echo(StatusLine& status_line, const std::string& text) {
+        auto output_lock = status_line.lockOutput();
+        std::cout << text << std::flush;
+    }
+    
+#ifndef _WIN32
+    std::vector<char> buffer;  // Read but not yet consumed: [begin, end)
+    size_t begin = 0;
+    size_t end = 0;
+    
+    // Terminal settings while reading a line; restored on every way out
+    class RawMode {
+    private:
+        termios saved;
+        bool active = true;
+        
+    public:
+        RawMode() {
+            tcgetattr(STDIN_FILENO, &saved);
+            termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+            std::cout << "\033[?2004h" << std::flush;
+        }
+        
+        ~RawMode() {
+            restore();
+        }
+        
+        RawMode(const RawMode&) = delete;
+        RawMode& operator=(const RawMode&) = delete;
+        
+        void restore() {
+            if (!active) return;
+            active = false;
+            std::cout << "\033[?2004l" << std::flush;
+            tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        }
+    };
+    
+    // Reads more input after what is buffered, waiting at most `timeout_ms`
+    // (-1: forever). False on EOF or timeout.
+    bool fill(int timeout_ms = -1) {
+        if (begin == end) {
+            begin = end = 0;
+        } else if (end == buffer.size()) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (timeout_ms >= 0) {
+            pollfd fd = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&fd, 1, timeout_ms) <= 0) return false;
+        }
+        ssize_t length;
+        do {
+            length = ::read(STDIN_FILENO, buffer.data() + end, buffer.size() - end);
+        } while (length < 0 && errno == EINTR);
+        if (length <= 0) return false;
+        end += length;
+        return true;
+    }
+    
+    // Skips an escape sequence starting at `begin` (arrow keys and the like,
+    // which there is no cursor movement for). True for a paste start.
+    bool consumeEscape() {
+        size_t offset = 1;
+        while (true) {
+            if (begin + offset >= end) {
+                if (!fill(ESCAPE_TIMEOUT_MS)) {  // Lone Esc, or a cut-off sequence
+                    begin = end;
+                    return false;
+                }
+                continue;
+            }
+            unsigned char c = buffer[begin + offset];
+            if (offset == 1 && c != '[' && c != 'O') {
+                begin += 2;
+                return false;
+            }
+            if (offset > 1 && c >= 0x40 && c <= 0x7e) {
+                bool paste = std::string_view(buffer.data() + begin, offset + 1) == PASTE_BEGIN;
+                begin += offset + 1;
+                return paste;
+            }
+            ++offset;
+        }
+    }
+    
+    // Appends pasted text up to the end marker to `text`, with CR and CRLF
+    // line ends turned into LF. Whole buffered runs are copied at once.
+    void readPaste(std::string& text) {
+        size_t start = text.size();
+        while (true) {
+            const void* found = memmem(buffer.data() + begin, end - begin, PASTE_END, MARKER_LENGTH);
+            if (found) {
+                size_t at = static_cast<const char*>(found) - buffer.data();
+                text.append(buffer.data() + begin, at - begin);
+                begin = at + MARKER_LENGTH;
+                break;
+            }
+            // Keep a possible partial marker for the next read
+            size_t keep = std::min(end - begin, MARKER_LENGTH - 1);
+            text.append(buffer.data() + begin, end - begin - keep);
+            begin = end - keep;
+            if (!fill()) {
+                text.append(buffer.data() + begin, end - begin);
+                begin = end;
+                break;
+            }
+        }
+        if (text.find('\r', start) == std::string::npos) return;
+        size_t out = start;
+        for (size_t in = start; in < text.size(); ++in) {
+            if (text[in] != '\r') {
+                text[out++] = text[in];
+            } else if (in + 1 >= text.size() || text[in + 1] != '\n') {
+                text[out++] = '\n';
+            }
+        }
+        text.resize(out);
+    }
+    
+    // Reads one line onto the end of `text` with our own echo and editing.
+    // Pastes without a newline are echoed like typing; others become a
+    // placeholder that backspace removes whole.
+    bool readRawLine(std::string& text, const std::string& prompt, StatusLine& status_line) {
+        struct Paste {
+            size_t start;
+            size_t end;
+            size_t columns;  // Width of the placeholder
+        };
+        std::vector<Paste> line_pastes;
+        size_t line_start = text.size();
+        RawMode raw_mode;
+        
+        while (true) {
+            if (begin == end && !fill()) return text.size() > line_start;
+            std::string shown;
+            while (begin < end) {
+                unsigned char c = buffer[begin];
+                if (c == '\r' || c == '\n') {
+                    ++begin;
+                    if (c == '\r' && begin < end && buffer[begin] == '\n') ++begin;
+                    echo(status_line, shown + "\r\n");
+                    return true;
+                }
+                if (c == 27) {
+                    if (!consumeEscape()) continue;
+                    size_t start = text.size();
+                    readPaste(text);
+                    size_t lines = std::count(text.begin() + start, text.end(), '\n');
+                    if (lines == 0) {
+                        shown.append(text, start, std::string::npos);
+                        continue;
+                    }
+                    if (text.back() != '\n') ++lines;
+                    std::ostringstream placeholder;
+                    placeholder.precision(1);
+                    placeholder << std::fixed << "[pasted " << lines << " lines, "
+                                << (text.size() - start) / 1024.0 << " KB]";
+                    line_pastes.push_back({start, text.size(), placeholder.str().size()});
+                    shown += ColorUtils::colorize(placeholder.str(), ColorUtils::DIM);
+                    continue;
+                }
+                ++begin;
+                if (c == 127 || c == 8) {  // Backspace
+                    if (text.size() == line_start) continue;
+                    if (!line_pastes.empty() && line_pastes.back().end == text.size()) {
+                        text.resize(line_pastes.back().start);
+                        for (size_t i = 0; i < line_pastes.back().columns; ++i) shown += "\b \b";
+                        line_pastes.pop_back();
+                        continue;
+                    }
+                    // One UTF-8 character, shown one column wide
+                    while (text.size() > line_start + 1 && (static_cast<unsigned char>(text.back()) & 0xc0) == 0x80) {
+                        text.pop_back();
+                    }
+                    text.pop_back();
+                    shown += "\b \b";
+                } else if (c == 21) {  // Ctrl-U
+                    text.resize(line_start);
+                    line_pastes.clear();
+                    shown += "\r\033[K" + prompt;
+                } else if (c == 4) {  // Ctrl-D
+                    if (text.size() == line_start) {
+                        echo(status_line, shown);
+                        return false;
+                    }
+                } else if (c == 3) {  // Ctrl-C, with the terminal restored first
+                    echo(status_line, shown + "^C\r\n");
+                    raw_mode.restore();
+                    std::raise(SIGINT);
+                    text.resize(line_start);
+                    return false;
+                } else if (c >= 32 || c == '\t') {
+                    text += static_cast<char>(c);
+                    shown += static_cast<char>(c);
+                }
+            }
+            echo(status_line, shown);
+        }
+    }
+#endif
+    
+    bool readLine(std::string& text, const std::string& prompt, StatusLine& status_line) {
+#ifndef _WIN32
+        if (tty) return readRawLine(text, prompt, status_line);
+#endif
+        std::string line;
+        if (!std::getline(std::cin, line)) return false;
+        text += line;
+        return true;
+    }
+    
+public:
+    LineReader() {
+#ifdef _WIN32
+        tty = false;
+#else
+        const char* term = std::getenv("TERM");
+        tty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !(term && std::string(term) == "dumb");
+        if (tty) buffer.resize(CHUNK);
+#endif
+    }
+    
+    // Reads the next message after showing `prompt`, continuing a """ block
+    // over several lines. False at end of input.
+    bool read(std::string& message, const std::string& prompt, StatusLine& status_line) {
+        message.clear();
+        echo(status_line, prompt);
+        if (!readLine(message, prompt, status_line)) return !message.empty();
+        if (message.compare(0, 3, BLOCK_QUOTE) != 0) return true;
+        
+        message.erase(0, 3);
+        const std::string continuation = ColorUtils::colorize("...  ", ColorUtils::DIM);
+        size_t line_start = 0;
+        bool opened = message.empty();  // """ alone on the first line
+        while (message.size() - line_start < 3 || message.compare(message.size() - 3, 3, BLOCK_QUOTE) != 0) {
+            if (!opened) message += '\n';
+            opened = false;
+            line_start = message.size();
+            echo(status_line, continuation);
+            if (!readLine(message, continuation, status_line)) break;
+        }
+        if (message.size() >= 3 && message.compare(message.size() - 3, 3, BLOCK_QUOTE) == 0) {
+            message.resize(message.size() - 3);
+        }
+        return true;
+    }
+};
+
+class TerminalInterface {
+private:
+    std::unique_ptr<OllamaAssistant> assistant;
+    StatusLine status_line;
+    HistoryLayout history_layout;
+    LineReader line_reader;
+    BackgroundJobs jobs;  // After status_line: its callback must not outlive it
+    std::vector<std::string> pending_files;  // Staged by /file for the next message
+    PromptReducer reducer{PromptReducer::Options::none()};  // Off until /reduce on
+    PromptReducer::Stats reduced_total;
+    uint64_t reduced_messages = 0;
+    size_t best_of = 0;             // Samples per message, 0 for a single reply
+    std::string best_scorer = "vote";
+    std::string compile_command = "c++ -fsyntax-only -x c++";
+    std::string judge_model;
+    std::string draft_model;        // Drafts each reply for the current model to review; "" for off
+    MemoryAccounting::Snapshot last_mem[MemoryAccounting::SUBSYSTEM_COUNT];
+    std::chrono::steady_clock::time_point last_mem_time = std::chrono::steady_clock::now();
+    
+    void printHelp() {
+        std::cout << "\n" << ColorUtils::colorize("=== Ollama Terminal Assistant ===", ColorUtils::BOLD + ColorUtils::MAGENTA) << std::endl;
+        std::cout << ColorUtils::colorize("Available Commands:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        
+        std::cout << ColorUtils::colorize("  /help", ColorUtils::YELLOW) 
+                 << "      - Show this help message" << std::endl;
+        std::cout << ColorUtils::colorize("  /clear", ColorUtils::YELLOW) 
+                 << "     - Clear conversation history" << std::endl;
+        std::cout << ColorUtils::colorize("  /history", ColorUtils::YELLOW) 
+                 << "   - Browse conversation history (/history N opens at turn N)" << std::endl;
+        std::cout << ColorUtils::colorize("  /models", ColorUtils::YELLOW) 
+                 << "    - List available models" << std::endl;
+        std::cout << ColorUtils::colorize("  /model", ColorUtils::YELLOW) 
+                 << "     - Change current model" << std::endl;
+        std::cout << ColorUtils::colorize("  /info", ColorUtils::YELLOW) 
+                 << "      - Show capabilities of a model (default: current)" << std::endl;
+        std::cout << ColorUtils::colorize("  /local", ColorUtils::YELLOW) 
+                 << "     - List locally installed models with metadata" << std::endl;
+        std::cout << ColorUtils::colorize("  /context", ColorUtils::YELLOW) 
+                 << "   - Show context sizing (/context auto|off to toggle)" << std::endl;
+        std::cout << ColorUtils::colorize("  /raw", ColorUtils::YELLOW) 
+                 << "       - Toggle /api/generate mode with context-token reuse" << std::endl;
+        std::cout << ColorUtils::colorize("  /stats", ColorUtils::YELLOW) 
+                 << "     - Compare request size and prefill time per endpoint" << std::endl;
+        std::cout << ColorUtils::colorize("  /bench [n]", ColorUtils::YELLOW) 
+                 << " - Measure tokens/s and per-token overhead of the backend" << std::endl;
+        std::cout << ColorUtils::colorize("  /bg <prompt>", ColorUtils::YELLOW) 
+                 << " - Run a prompt in the background on a copy of this conversation" << std::endl;
+        std::cout << ColorUtils::colorize("  /jobs", ColorUtils::YELLOW) 
+                 << "      - List background jobs" << std::endl;
+        std::cout << ColorUtils::colorize("  /fg [n]", ColorUtils::YELLOW) 
+                 << "    - Show job n (default: oldest), wait for it and add it to this conversation" << std::endl;
+        std::cout << ColorUtils::colorize("  /file <path> [message]", ColorUtils::YELLOW) 
+                 << " - Attach a file (sent as a diff once the conversation has it)" << std::endl;
+        std::cout << ColorUtils::colorize("  /reduce", ColorUtils::YELLOW) 
+                 << "    - Show input reduction (/reduce on|off, or ansi|whitespace|repeats|comments to toggle)" << std::endl;
+        std::cout << ColorUtils::colorize("  /timeout", ColorUtils::YELLOW) 
+                 << "   - Show request timeouts (/timeout connect|ttft|load|token|idle|total <seconds>, 0 = off)" << std::endl;
+        std::cout << ColorUtils::colorize("  /draft [model|off]", ColorUtils::YELLOW) 
+                 << " - Stream a draft from a fast model, then show the current model's revision as a diff" << std::endl;
+        std::cout << ColorUtils::colorize("  /best [n|off]", ColorUtils::YELLOW) 
+                 << " - Sample each message n times at once and keep the best (/best vote|compile [cmd]|judge <model>)" << std::endl;
+        std::cout << ColorUtils::colorize("  /deadline [s|off]", ColorUtils::YELLOW) 
+                 << " - Fit each reply into s seconds, sizing num_predict from measured speed" << std::endl;
+        std::cout << ColorUtils::colorize("  /continue [n|off]", ColorUtils::YELLOW) 
+                 << " - Continue replies cut off at the length limit, up to n times" << std::endl;
+        std::cout << ColorUtils::colorize("  /stop", ColorUtils::YELLOW) 
+                 << "      - Show stop rules (/stop block, /stop lines N, /stop text S, /stop off)" << std::endl;
+        std::cout << ColorUtils::colorize("  /watch <glob> [prompt]", ColorUtils::YELLOW) 
+                 << " - Re-run a prompt whenever matching files change (Enter stops)" << std::endl;
+        std::cout << ColorUtils::colorize("  /mem", ColorUtils::YELLOW) 
+                 << "       - Show heap usage per subsystem and rates since the last /mem" << std::endl;
+        std::cout << ColorUtils::colorize("  /status", ColorUtils::YELLOW) 
+                 << "    - Check Ollama connection" << std::endl;
+        std::cout << ColorUtils::colorize("  /stream", ColorUtils::YELLOW) 
+                 << "    - Toggle streaming output" << std::endl;
+        std::cout << ColorUtils::colorize("  /quit", ColorUtils::YELLOW) 
+                 << "      - Exit the application" << std::endl;
+        std::cout << ColorUtils::colorize("  /exit", ColorUtils::YELLOW) 
+                 << "      - Exit the application" << std::endl;
+        
+        std::cout << "\n" << ColorUtils::colorize("Just type your message and press Enter to chat!", ColorUtils::GREEN) << std::endl;
+        std::cout << ColorUtils::colorize("   Ask programming questions, get help, or have a conversation!", ColorUtils::DIM) << std::endl;
+        std::cout << ColorUtils::colorize("   Pastes are sent as one message; wrap typed multi-line text in \"\"\" ... \"\"\"", ColorUtils::DIM) << std::endl;
+        std::cout << ColorUtils::colorize("   Current model: ", ColorUtils::DIM) 
+                 << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        std::cout << ColorUtils::colorize("   Streaming: ", ColorUtils::DIM) 
+                 << ColorUtils::colorize(assistant->isStreamingEnabled() ? "ON" : "OFF", 
+                                        assistant->isStreamingEnabled() ? ColorUtils::GREEN : ColorUtils::RED) << std::endl;
+        std::cout << ColorUtils::colorize("================================", ColorUtils::MAGENTA) << "\n" << std::endl;
+    }
+    
+    void printWelcome() {
+        StreamingOutput::typeText(ColorUtils::colorize("Ollama Terminal Assistant", ColorUtils::BOLD + ColorUtils::MAGENTA) + "\n", "", 30);
+        StreamingOutput::typeText(ColorUtils::colorize(" Your FREE local AI assistant - No API keys needed!", ColorUtils::CYAN) + "\n", "", 20);
+        std::cout << ColorUtils::colorize("Running locally with model: ", ColorUtils::GREEN) 
+                 << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        std::cout << ColorUtils::colorize("Streaming mode: ", ColorUtils::GREEN) 
+                  << std::endl;
+        StreamingOutput::typeText(ColorUtils::colorize("Type '/help' for commands or start chatting!", ColorUtils::GREEN) + "\n", "", 15);
+        std::cout << ColorUtils::colorize("========================================", ColorUtils::MAGENTA) << "\n" << std::endl;
+    }
+    
+    // One message, however many lines it spans. False at end of input.
+    bool getInput(std::string& input) {
+        announceFinishedJobs();
+        status_line.setPrompting(true);
+        bool more = line_reader.read(input, ColorUtils::colorize("You: ", ColorUtils::BOLD + ColorUtils::BLUE), status_line);
+        status_line.setPrompting(false);
+        return more;
+    }
+    
+    // Placeholder until the first token; the status line shows the wait
+    void showThinking() {
+        std::cout << ColorUtils::colorize(" ", ColorUtils::GREEN) 
+                 << ColorUtils::colorize("Thinking...", ColorUtils::YELLOW) << std::flush;
+    }
+    
+    void clearThinking() {
+        std::cout << "\r" << std::string(20, ' ') << "\r" << std::flush;
+    }
+    
+    // num_ctx sent with requests, or 0 when the server default applies
+    uint64_t contextLimit() const {
+        return assistant->isAutoContext() ? assistant->getContextSizer().getCurrentCtx() : 0;
+    }
+    
+    void refreshStatusLine() {
+        status_line.setModel(assistant->getCurrentModel());
+        status_line.refresh(assistant->estimateHistoryTokens(), contextLimit());
+    }
+    
+    // Sends one user turn, with the files staged by /file in front of it,
+    // after the reduction pass, and prints the reply as it streams in
+    void sendChat(std::string input) {
+        PromptReducer::Stats reduction;
+        reduceText(input, reduction);
+        std::string message = takeAttachments(reduction) + input;
+        reportReduction(reduction);
+        bool reply_started = false;
+        std::string label = draft_model.empty() ? "Ollama: " : "Draft (" + draft_model + "): ";
+        auto print_token = [this, &reply_started, &label](std::string_view delta) {
+            MemoryScope scope(MemoryAccounting::RENDERER);
+            auto output_lock = status_line.lockOutput();
+            status_line.onToken();
+            if (!reply_started) {
+                clearThinking();
+                std::cout << ColorUtils::colorize(label, ColorUtils::BOLD + ColorUtils::GREEN);
+                reply_started = true;
+            }
+            ColorUtils::write(std::cout, delta, ColorUtils::WHITE);
+            std::cout << std::flush;
+            return true;
+        };
+        
+        showThinking();
+        status_line.beginRequest(assistant->estimateHistoryTokens(), contextLimit());
+        uint64_t stopped = assistant->getStopStats().stopped;
+        uint64_t cut = assistant->getDeadlineStats().cut;
+        TokenCallback on_token = assistant->isStreamingEnabled() ? TokenCallback(print_token) : TokenCallback();
+        std::string response;
+        std::string verdict;
+        BestOf::Outcome best;
+        DraftReview::Outcome review;
+        if (!draft_model.empty()) {
+            review = assistant->sendDraftReview(message, draft_model, on_token, [&] {
+                if (!reply_started) {
+                    clearThinking();
+                    std::cout << ColorUtils::colorize(label, ColorUtils::BOLD + ColorUtils::GREEN);
+                    reply_started = true;
+                }
+                std::cout << ColorUtils::colorize("\n\n Reviewing with " + assistant->getCurrentModel() + "...",
+                                                 ColorUtils::YELLOW) << std::flush;
+            });
+            response = review.draft;
+        } else if (best_of > 1) {
+            best = assistant->sendBestOf(message, best_of, bestPicker(message, verdict), on_token);
+            response = best.replies[0];
+        } else {
+            response = assistant->sendMessage(message, on_token);
+        }
+        status_line.endRequest(assistant->getLastPromptEvalCount(), assistant->getLastEvalCount(),
+                               contextLimit());
+        syncHistoryLayout();
+        
+        if (!reply_started) {
+            // Display instantly
+            clearThinking();
+            std::cout << ColorUtils::colorize(label, ColorUtils::BOLD + ColorUtils::GREEN) << response;
+        }
+        if (!draft_model.empty()) {
+            showReview(review);
+        } else if (assistant->getStopStats().stopped > stopped) {
+            std::cout << ColorUtils::colorize(" [stopped early]", ColorUtils::GRAY);
+        } else if (assistant->getDeadlineStats().cut > cut) {
+            std::cout << ColorUtils::colorize(" [cut at the deadline]", ColorUtils::YELLOW);
+        } else if (assistant->wasTruncated() && assistant->getDeadline() > 0) {
+            std::cout << ColorUtils::colorize(" [shortened to fit the deadline]", ColorUtils::GRAY);
+        } else if (assistant->wasTruncated()) {
+            std::cout << ColorUtils::colorize(" [cut off at the length limit; /continue N resumes such replies]", ColorUtils::YELLOW);
+        }
+        if (draft_model.empty() && best_of > 1) {
+            showBestOf(best, verdict);
+        }
+        
+        std::cout << "\n" << std::endl;
+    }
+    
+    // The revision of a /draft reply as a diff against the draft
+    void showReview(const DraftReview::Outcome& review) {
+        std::cout << "\r" << std::string(40, ' ') << "\r";
+        std::string reviewer = assistant->getCurrentModel();
+        std::ostringstream timing;
+        timing.precision(1);
+        timing << std::fixed << "draft: first text " << review.first_token_ms / 1000 << " s, done "
+               << review.draft_ms / 1000 << " s; review " << review.review_ms / 1000 << " s more";
+        if (review.revision.empty()) {
+            std::cout << ColorUtils::colorize(" [review failed, the draft is kept: " + review.error + "]", ColorUtils::YELLOW);
+        } else if (review.revision == review.draft) {
+            std::cout << ColorUtils::colorize(" [" + reviewer + " made no changes]", ColorUtils::GRAY);
+        } else {
+            std::string diff;
+            std::cout << ColorUtils::colorize("Revised by " + reviewer + ":", ColorUtils::BOLD + ColorUtils::GREEN) << "\n";
+            if (!LineDiff::unified(review.draft, review.revision, "reply", diff, 1)) {
+                ColorUtils::write(std::cout, review.revision, ColorUtils::WHITE);
+            } else {
+                std::istringstream lines(diff);
+                std::string line;
+                while (std::getline(lines, line)) {
+                    if (line.rfind("---", 0) == 0 || line.rfind("+++", 0) == 0) continue;
+                    const std::string& color = line.rfind("@@", 0) == 0 ? ColorUtils::CYAN
+                                             : line[0] == '+' ? ColorUtils::GREEN
+                                             : line[0] == '-' ? ColorUtils::RED : ColorUtils::GRAY;
+                    std::cout << ColorUtils::colorize(line, color) << "\n";
+                }
+            }
+        }
+        std::cout << ColorUtils::colorize(" [" + timing.str() + "]", ColorUtils::DIM);
+    }
+    
+    void configureDraft(const std::string& setting) {
+        if (setting == "off") {
+            draft_model.clear();
+        } else if (!setting.empty()) {
+            draft_model = setting;
+        }
+        std::cout << ColorUtils::colorize("Draft-then-review: ", ColorUtils::BOLD + ColorUtils::CYAN)
+                 << (draft_model.empty() ? ColorUtils::colorize("off", ColorUtils::GRAY)
+                                         : draft_model + " drafts, " + assistant->getCurrentModel() + " revises")
+                 << std::endl;
+        const DraftReview::Stats& stats = assistant->getDraftReviewStats();
+        if (stats.turns > 0) {
+            std::ostringstream line;
+            line.precision(1);
+            line << std::fixed << stats.turns << " replies, " << stats.revised << " revised, " << stats.failed
+                 << " reviews failed; first text after " << stats.first_token_ms / stats.turns / 1000
+                 << " s, draft done after " << stats.draft_ms / stats.turns / 1000 << " s, revision "
+                 << (stats.draft_ms + stats.review_ms) / stats.turns / 1000 << " s; the reviewing model alone "
+                 << "takes about " << stats.review_ms / stats.turns / 1000 << " s per answer";
+            std::cout << ColorUtils::colorize("  So far: ", ColorUtils::CYAN) << line.str() << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    // Chooses among /best samples with the configured scorer, describing
+    // the choice in `verdict`
+    BestOf::Picker bestPicker(const std::string& question, std::string& verdict) {
+        return [this, question, &verdict](const std::vector<std::string>& replies) {
+            size_t votes = 0;
+            if (best_scorer == "compile") {
+                for (size_t i = 0; i < replies.size(); ++i) {
+                    if (compiles(BestOf::lastCodeBlock(replies[i]))) {
+                        verdict = "its code compiles";
+                        return i;
+                    }
+                }
+                size_t winner = BestOf::majority(replies, &votes);
+                verdict = "no code compiled; vote " + std::to_string(votes) + "/" + std::to_string(replies.size());
+                return winner;
+            }
+            if (best_scorer == "judge") {
+                size_t winner = assistant->judgeReplies(question, replies, judge_model);
+                verdict = "picked by " + judge_model;
+                return winner;
+            }
+            size_t winner = BestOf::majority(replies, &votes);
+            verdict = "vote " + std::to_string(votes) + "/" + std::to_string(replies.size());
+            return winner;
+        };
+    }
+    
+    // Runs the compile command on `code`; false for no code or a failure
+    bool compiles(const std::string& code) {
+        if (code.empty()) return false;
+        static std::atomic<unsigned> counter{0};
+        std::filesystem::path path = std::filesystem::temp_directory_path() /
+            ("ollama_best_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "_" +
+             std::to_string(counter++));
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << code;
+            if (!file) return false;
+        }
+#ifdef _WIN32
+        std::string command = compile_command + " \"" + path.string() + "\" >NUL 2>&1";
+#else
+        std::string command = compile_command + " '" + path.string() + "' >/dev/null 2>&1";
+#endif
+        int status = std::system(command.c_str());
+        std::error_code ignored;
+        std::filesystem::remove(path, ignored);
+        return status == 0;
+    }
+    
+    // Which /best sample won and, if not the one shown, the winner
+    void showBestOf(const BestOf::Outcome& best, const std::string& verdict) {
+        std::ostringstream line;
+        line.precision(1);
+        line << std::fixed << " [best of " << best.replies.size() << ": sample " << best.winner + 1;
+        if (!verdict.empty()) line << ", " << verdict;
+        if (best.failed > 0) line << "; " << best.failed << " failed";
+        line << "; " << best.wall_ms / 1000 << " s for all, " << best.leader_ms / 1000 << " s for one]";
+        std::cout << ColorUtils::colorize(line.str(), ColorUtils::GRAY);
+        if (best.winner == 0) return;
+        std::cout << "\n\n" << ColorUtils::colorize("Sample " + std::to_string(best.winner + 1) + " (kept): ",
+                                                   ColorUtils::BOLD + ColorUtils::GREEN);
+        ColorUtils::write(std::cout, best.replies[best.winner], ColorUtils::WHITE);
+    }
+    
+    void configureBestOf(const std::string& setting) {
+        std::istringstream words(setting);
+        std::string word;
+        words >> word;
+        std::string rest;
+        std::getline(words >> std::ws, rest);
+        if (word == "off") {
+            best_of = 0;
+        } else if (word == "vote") {
+            best_scorer = word;
+        } else if (word == "compile") {
+            best_scorer = word;
+            if (!rest.empty()) compile_command = rest;
+        } else if (word == "judge") {
+            if (rest.empty()) {
+                std::cout << ColorUtils::colorize(" Usage: /best judge <model>", ColorUtils::RED) << "\n" << std::endl;
+                return;
+            }
+            best_scorer = word;
+            judge_model = rest;
+        } else if (!word.empty()) {
+            try {
+                size_t count = std::stoul(word);
+                if (count < 1 || count > BestOf::MAX_SAMPLES) throw std::out_of_range(word);
+                best_of = count;
+            } catch (const std::exception&) {
+                std::cout << ColorUtils::colorize(" Invalid count (1-" + std::to_string(BestOf::MAX_SAMPLES) + "): ",
+                                                 ColorUtils::RED) << word << "\n" << std::endl;
+                return;
+            }
+        }
+        
+        std::string scorer = best_scorer == "compile" ? "compile check (" + compile_command + ")"
+                           : best_scorer == "judge" ? "judge model " + judge_model : "majority vote on final answers";
+        std::cout << ColorUtils::colorize("Best-of-N: ", ColorUtils::BOLD + ColorUtils::CYAN)
+                 << (best_of > 1 ? std::to_string(best_of) + " samples per message, " + scorer
+                                 : ColorUtils::colorize("off", ColorUtils::GRAY)) << std::endl;
+        const BestOf::Stats& stats = assistant->getBestOfStats();
+        if (stats.runs > 0) {
+            std::ostringstream line;
+            line.precision(1);
+            line << std::fixed << stats.runs << " messages, " << stats.samples << " samples (" << stats.failed
+                 << " failed), streamed sample kept " << stats.leader_won << " times; "
+                 << stats.wall_ms / stats.runs / 1000 << " s per message vs " << stats.leader_ms / stats.runs / 1000
+                 << " s for the streamed sample alone";
+            std::cout << ColorUtils::colorize("  So far:   ", ColorUtils::CYAN) << line.str() << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    static bool readFile(const std::string& path, std::string& content) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        std::ostringstream buffer;
+        buffer << file.rdbuf();
+        content = buffer.str();
+        return true;
+    }
+    
+    void describeAttachment(const std::string& path, const FileAttachments::Attachment& attachment) {
+        std::string detail;
+        if (attachment.unchanged) {
+            detail = "unchanged since version " + std::to_string(attachment.version);
+        } else if (attachment.base_version > 0) {
+            detail = "version " + std::to_string(attachment.version) + " as a diff against version " +
+                     std::to_string(attachment.base_version);
+        } else {
+            detail = "version " + std::to_string(attachment.version) + ", " + formatBytes(attachment.text.size());
+        }
+        std::cout << ColorUtils::colorize(" " + path + ": ", ColorUtils::CYAN) << detail;
+        if (attachment.text.size() < attachment.full_bytes) {
+            const ContextSizer& sizer = assistant->getContextSizer();
+            std::cout << ColorUtils::colorize("  (" + formatBytes(attachment.text.size()) + " instead of " +
+                                             formatBytes(attachment.full_bytes) + ", ~" +
+                                             std::to_string(sizer.estimateTokens(attachment.full_bytes) -
+                                                            sizer.estimateTokens(attachment.text.size())) +
+                                             " tokens saved)", ColorUtils::DIM);
+        }
+        std::cout << std::endl;
+    }
+    
+    // Runs `text` through the reduction pipeline, adding to `stats`
+    void reduceText(std::string& text, PromptReducer::Stats& stats) {
+        if (!reducer.isEnabled()) return;
+        std::string reduced;
+        stats.add(reducer.reduce(text, reduced));
+        text.swap(reduced);
+    }
+    
+    // Reports what the reduction pass saved on one outgoing message
+    void reportReduction(const PromptReducer::Stats& stats) {
+        reduced_total.add(stats);
+        if (stats.savedBytes() == 0) return;
+        const ContextSizer& sizer = assistant->getContextSizer();
+        uint64_t tokens = sizer.estimateTokens(stats.input_bytes) - sizer.estimateTokens(stats.output_bytes);
+        if (tokens == 0) return;
+        ++reduced_messages;
+        std::string detail;
+        auto part = [&](size_t count, const char* what) {
+            if (count == 0) return;
+            detail += (detail.empty() ? ": " : ", ") + std::to_string(count) + " " + what;
+        };
+        part(stats.escape_sequences, "escape sequences");
+        part(stats.collapsed_lines, "repeated lines");
+        part(stats.comment_lines, "comment lines");
+        std::cout << ColorUtils::colorize(" Reduced by " + formatBytes(stats.savedBytes()) + " (~" +
+                                         std::to_string(tokens) + " tokens)" + detail, ColorUtils::DIM) << std::endl;
+    }
+    
+    // Blocks for the files staged with /file, read now so the message
+    // carries their current content
+    std::string takeAttachments(PromptReducer::Stats& stats) {
+        std::string blocks;
+        for (const auto& path : pending_files) {
+            std::string content;
+            if (!readFile(path, content)) {
+                std::cout << ColorUtils::colorize(" Cannot read " + path + ", not attached", ColorUtils::RED) << std::endl;
+                continue;
+            }
+            reduceText(content, stats);
+            FileAttachments::Attachment attachment = assistant->attachFile(path, std::move(content));
+            describeAttachment(path, attachment);
+            blocks += attachment.text;
+        }
+        pending_files.clear();
+        return blocks;
+    }
+    
+    void attachFile(const std::string& path, const std::string& message) {
+        if (!std::filesystem::is_regular_file(path)) {
+            std::cout << ColorUtils::colorize(" No such file: ", ColorUtils::RED) << path << "\n" << std::endl;
+            return;
+        }
+        if (std::find(pending_files.begin(), pending_files.end(), path) == pending_files.end()) {
+            pending_files.push_back(path);
+        }
+        if (!message.empty()) {
+            sendChat(message);
+        } else {
+            std::cout << ColorUtils::colorize(" " + path + " will be attached to your next message", ColorUtils::GREEN)
+                     << "\n" << std::endl;
+        }
+    }
+    
+    void configureReducer(const std::string& setting) {
+        PromptReducer::Options options = reducer.getOptions();
+        if (setting == "on") {
+            options = PromptReducer::Options();
+        } else if (setting == "off") {
+            options = PromptReducer::Options::none();
+        } else if (setting == "ansi") {
+            options.strip_ansi = !options.strip_ansi;
+        } else if (setting == "whitespace") {
+            options.normalize_whitespace = !options.normalize_whitespace;
+        } else if (setting == "repeats") {
+            options.collapse_repeats = !options.collapse_repeats;
+        } else if (setting == "comments") {
+            options.drop_comments = !options.drop_comments;
+        } else if (!setting.empty()) {
+            std::cout << ColorUtils::colorize(" Unknown setting: ", ColorUtils::RED) << setting << "\n" << std::endl;
+            return;
+        }
+        reducer.setOptions(options);
+        
+        auto stage = [](const char* name, bool enabled) {
+            std::cout << ColorUtils::colorize(name, ColorUtils::CYAN)
+                     << ColorUtils::colorize(enabled ? "on" : "off", enabled ? ColorUtils::GREEN : ColorUtils::GRAY) << std::endl;
+        };
+        std::cout << ColorUtils::colorize("Input Reduction:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        stage("  Escape sequences:   ", options.strip_ansi);
+        stage("  Whitespace:         ", options.normalize_whitespace);
+        stage("  Repeated lines:     ", options.collapse_repeats);
+        stage("  Comments:           ", options.drop_comments);
+        const ContextSizer& sizer = assistant->getContextSizer();
+        std::cout << ColorUtils::colorize("  Saved so far:       ", ColorUtils::CYAN) << formatBytes(reduced_total.savedBytes())
+                 << " of " << formatBytes(reduced_total.input_bytes) << " (~"
+                 << sizer.estimateTokens(reduced_total.input_bytes) - sizer.estimateTokens(reduced_total.output_bytes)
+                 << " tokens) over " << reduced_messages << " messages" << "\n" << std::endl;
+    }
+    
+    // /stop text takes \n and \t escapes so multi-line markers can be typed
+    static std::string unescape(const std::string& text) {
+        std::string out;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '\\' && i + 1 < text.size() && (text[i + 1] == 'n' || text[i + 1] == 't')) {
+                out += text[++i] == 'n' ? '\n' : '\t';
+            } else {
+                out += text[i];
+            }
+        }
+        return out;
+    }
+    
+    void configureStopRules(const std::string& setting) {
+        StopRules& rules = assistant->getStopRules();
+        if (setting == "off") {
+            rules.clear();
+        } else if (setting == "block") {
+            rules.setFirstBlock(!rules.isFirstBlock());
+        } else if (setting.rfind("lines ", 0) == 0) {
+            try {
+                rules.setMaxLines(std::stoul(setting.substr(6)));
+            } catch (const std::exception&) {
+                std::cout << ColorUtils::colorize(" Invalid line count: ", ColorUtils::RED) << setting.substr(6) << "\n" << std::endl;
+                return;
+            }
+        } else if (setting.rfind("text ", 0) == 0) {
+            rules.addString(unescape(setting.substr(5)));
+        } else if (!setting.empty()) {
+            std::cout << ColorUtils::colorize(" Unknown setting: ", ColorUtils::RED) << setting << "\n" << std::endl;
+            return;
+        }
+        
+        std::cout << ColorUtils::colorize("Stop Rules:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        std::cout << ColorUtils::colorize("  First code block:   ", ColorUtils::CYAN)
+                 << ColorUtils::colorize(rules.isFirstBlock() ? "on" : "off", rules.isFirstBlock() ? ColorUtils::GREEN : ColorUtils::GRAY)
+                 << std::endl;
+        std::cout << ColorUtils::colorize("  Line limit:         ", ColorUtils::CYAN)
+                 << (rules.getMaxLines() > 0 ? std::to_string(rules.getMaxLines()) : ColorUtils::colorize("off", ColorUtils::GRAY))
+                 << std::endl;
+        std::cout << ColorUtils::colorize("  Stop strings:       ", ColorUtils::CYAN);
+        if (rules.getStrings().empty()) {
+            std::cout << ColorUtils::colorize("none", ColorUtils::GRAY);
+        }
+        for (const auto& text : rules.getStrings()) {
+            std::cout << json(text).dump() << " ";
+        }
+        std::cout << std::endl;
+        printStopSavings();
+        std::cout << std::endl;
+    }
+    
+    void printStopSavings() {
+        const StopRules::Stats& stats = assistant->getStopStats();
+        std::ostringstream seconds;
+        seconds.precision(1);
+        seconds << std::fixed << stats.seconds_saved;
+        std::cout << ColorUtils::colorize("  Stopped early:      ", ColorUtils::CYAN) << stats.stopped << " replies after "
+                 << stats.tokens_generated << " tokens, ~" << stats.tokens_saved << " tokens / " << seconds.str()
+                 << " s not generated" << std::endl;
+    }
+    
+    // /timeout <connect|ttft|load|token|idle|total> <seconds>; 0 turns a limit off
+    void configureTimeouts(const std::string& setting) {
+        OllamaHttpBackend* http = assistant->getHttpBackend();
+        if (!http) {
+            std::cout << ColorUtils::colorize(" Timeouts apply to the Ollama HTTP backend only", ColorUtils::YELLOW) << "\n" << std::endl;
+            return;
+        }
+        TimeoutPolicy policy = http->getTimeoutPolicy();
+        if (!setting.empty()) {
+            std::istringstream args(setting);
+            std::string name;
+            double value = -1;
+            args >> name >> value;
+            uint64_t* field = name == "connect" ? &policy.connect_ms : name == "ttft" ? &policy.first_token_ms :
+                              name == "load" ? &policy.load_ms : name == "token" ? &policy.buffered_token_ms :
+                              name == "idle" ? &policy.idle_ms :
+                              name == "total" ? &policy.total_ms : nullptr;
+            if (!field || value < 0) {
+                std::cout << ColorUtils::colorize(" Usage: ", ColorUtils::RED)
+                         << "/timeout connect|ttft|load|token|idle|total <seconds>" << "\n" << std::endl;
+                return;
+            }
+            *field = static_cast<uint64_t>(value * 1000);
+            http->setTimeoutPolicy(policy);
+        }
+        
+        auto limit = [](const char* label, uint64_t ms) {
+            std::ostringstream value;
+            value << ms / 1000.0 << " s";
+            std::cout << ColorUtils::colorize(label, ColorUtils::CYAN)
+                     << (ms > 0 ? value.str() : ColorUtils::colorize("off", ColorUtils::GRAY)) << std::endl;
+        };
+        std::cout << ColorUtils::colorize("Request Timeouts:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        limit("  Connect:            ", policy.connect_ms);
+        limit("  First token:        ", policy.first_token_ms);
+        limit("  Model load extra:   ", policy.load_ms);
+        limit("  Unstreamed, per tok:", policy.buffered_token_ms);
+        limit("  Idle between chunks:", policy.idle_ms);
+        limit("  Total budget:       ", policy.total_ms);
+        printTimeouts(*http);
+        std::cout << std::endl;
+    }
+    
+    void printTimeouts(OllamaHttpBackend& http) {
+        json counts = http.timeoutStatsJson();
+        std::cout << ColorUtils::colorize("  Timed out:          ", ColorUtils::CYAN) << counts["connect"].get<uint64_t>()
+                 << " connect, " << counts["first_token"].get<uint64_t>() << " first token, "
+                 << counts["idle"].get<uint64_t>() << " idle, " << counts["total"].get<uint64_t>() << " total; "
+                 << counts["load_extensions"].get<uint64_t>() << " waits extended for a model load" << std::endl;
+    }
+    
+    void configureDeadline(const std::string& setting) {
+        if (setting == "off") {
+            assistant->setDeadline(0);
+        } else if (!setting.empty()) {
+            try {
+                double seconds = std::stod(setting);
+                if (seconds <= 0) throw std::invalid_argument(setting);
+                assistant->setDeadline(static_cast<uint64_t>(seconds * 1000));
+            } catch (const std::exception&) {
+                std::cout << ColorUtils::colorize(" Invalid deadline: ", ColorUtils::RED) << setting << "\n" << std::endl;
+                return;
+            }
+        }
+        
+        std::ostringstream line;
+        line.precision(1);
+        line << std::fixed;
+        uint64_t deadline = assistant->getDeadline();
+        std::cout << ColorUtils::colorize("Deadline: ", ColorUtils::BOLD + ColorUtils::CYAN)
+                 << (deadline > 0 ? std::to_string(deadline) + " ms per reply" : ColorUtils::colorize("off", ColorUtils::GRAY))
+                 << std::endl;
+        ThroughputTracker::Estimate rates = assistant->getThroughput();
+        line << rates.eval_rate << " tok/s decode, " << rates.prefill_rate << " tok/s prefill, "
+             << rates.overhead_s * 1000 << " ms overhead (" << rates.samples << " samples)";
+        std::cout << ColorUtils::colorize("  Measured:  ", ColorUtils::CYAN) << line.str() << std::endl;
+        const DeadlineStats& stats = assistant->getDeadlineStats();
+        std::cout << ColorUtils::colorize("  Replies:   ", ColorUtils::CYAN) << stats.requests << " with a deadline: "
+                 << stats.met << " in time, " << stats.cut << " cut at the deadline, " << stats.missed << " late" << std::endl;
+        if (stats.requests > 0) {
+            std::cout << ColorUtils::colorize("  Last:      ", ColorUtils::CYAN) << static_cast<uint64_t>(stats.last_ms) << " ms, num_predict "
+                     << (stats.last_planned > 0 ? std::to_string(stats.last_planned) : "not set (model not measured yet)") << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    void configureContinuation(const std::string& setting) {
+        if (setting == "off") {
+            assistant->setMaxContinuations(0);
+        } else if (!setting.empty()) {
+            try {
+                assistant->setMaxContinuations(static_cast<unsigned>(std::stoul(setting)));
+            } catch (const std::exception&) {
+                std::cout << ColorUtils::colorize(" Invalid count: ", ColorUtils::RED) << setting << "\n" << std::endl;
+                return;
+            }
+        }
+        unsigned count = assistant->getMaxContinuations();
+        std::cout << ColorUtils::colorize("Auto-continue: ", ColorUtils::BOLD + ColorUtils::CYAN)
+                 << (count > 0 ? "up to " + std::to_string(count) + " follow-up requests per cut-off reply"
+                               : ColorUtils::colorize("off", ColorUtils::GRAY)) << std::endl;
+        printContinuations();
+        std::cout << std::endl;
+    }
+    
+    void printContinuations() {
+        const ContinuationStats& stats = assistant->getContinuationStats();
+        std::cout << ColorUtils::colorize("  Continuations: ", ColorUtils::CYAN) << stats.requests << " requests for "
+                 << stats.replies << " replies added " << formatBytes(stats.bytes) << ", re-reading "
+                 << stats.prompt_tokens << " prompt tokens in " << stats.overhead_ns / 1000000 << " ms; "
+                 << stats.truncated << " replies left cut off";
+        if (stats.failed > 0) {
+            std::cout << ", " << stats.failed << " failed";
+        }
+        std::cout << std::endl;
+    }
+    
+    bool isCommand(const std::string& input) {
+        return !input.empty() && input[0] == '/';
+    }
+    
+    bool handleCommand(const std::string& command) {
+        if (command == "/help") {
+            printHelp();
+            return true;
+        } else if (command == "/clear") {
+            assistant->clearConversation();
+            std::cout << ColorUtils::colorize("Conversation history cleared.", ColorUtils::GREEN) << "\n" << std::endl;
+            return true;
+        } else if (command == "/history" || command.rfind("/history ", 0) == 0) {
+            size_t turn = 0;
+            try {
+                if (command.size() > 9) turn = std::stoul(command.substr(9));
+            } catch (const std::exception&) {
+                // Open at the end
+            }
+            showConversationHistory(turn);
+            return true;
+        } else if (command == "/models") {
+            showAvailableModels();
+            return true;
+        } else if (command == "/model") {
+            changeModel();
+            return true;
+        } else if (command == "/info" || command.rfind("/info ", 0) == 0) {
+            std::string name = command.size() > 6 ? command.substr(6) : assistant->getCurrentModel();
+            showModelInfo(name);
+            return true;
+        } else if (command == "/local") {
+            showLocalModels();
+            return true;
+        } else if (command == "/context" || command == "/context auto" || command == "/context off") {
+            if (command != "/context") {
+                assistant->setAutoContext(command == "/context auto");
+            }
+            showContextInfo();
+            return true;
+        } else if (command == "/raw") {
+            toggleGenerateMode();
+            return true;
+        } else if (command == "/stats") {
+            showRequestStats();
+            return true;
+        } else if (command == "/bench" || command.rfind("/bench ", 0) == 0) {
+            int runs = 3;
+            try {
+                if (command.size() > 7) runs = std::max(1, std::stoi(command.substr(7)));
+            } catch (const std::exception&) {
+                // Keep the default
+            }
+            runBenchmark(runs);
+            return true;
+        } else if (command.rfind("/bg ", 0) == 0 && command.size() > 4) {
+            startBackgroundJob(command.substr(4));
+            return true;
+        } else if (command == "/jobs") {
+            showJobs();
+            return true;
+        } else if (command == "/fg" || command.rfind("/fg ", 0) == 0) {
+            size_t id = 0;
+            try {
+                if (command.size() > 4) id = std::stoul(command.substr(4));
+            } catch (const std::exception&) {
+                // Use the oldest job
+            }
+            foregroundJob(id);
+            return true;
+        } else if (command.rfind("/file ", 0) == 0 && command.size() > 6) {
+            std::string args = command.substr(6);
+            size_t space = args.find(' ');
+            attachFile(args.substr(0, space), space == std::string::npos ? "" : args.substr(space + 1));
+            return true;
+        } else if (command == "/reduce" || command.rfind("/reduce ", 0) == 0) {
+            configureReducer(command.size() > 8 ? command.substr(8) : "");
+            return true;
+        } else if (command == "/timeout" || command.rfind("/timeout ", 0) == 0) {
+            configureTimeouts(command.size() > 9 ? command.substr(9) : "");
+            return true;
+        } else if (command == "/draft" || command.rfind("/draft ", 0) == 0) {
+            configureDraft(command.size() > 7 ? command.substr(7) : "");
+            return true;
+        } else if (command == "/best" || command.rfind("/best ", 0) == 0) {
+            configureBestOf(command.size() > 6 ? command.substr(6) : "");
+            return true;
+        } else if (command == "/deadline" || command.rfind("/deadline ", 0) == 0) {
+            configureDeadline(command.size() > 10 ? command.substr(10) : "");
+            return true;
+        } else if (command == "/continue" || command.rfind("/continue ", 0) == 0) {
+            configureContinuation(command.size() > 10 ? command.substr(10) : "");
+            return true;
+        } else if (command == "/stop" || command.rfind("/stop ", 0) == 0) {
+            configureStopRules(command.size() > 6 ? command.substr(6) : "");
+            return true;
+        } else if (command.rfind("/watch ", 0) == 0 && command.size() > 7) {
+            std::string args = command.substr(7);
+            size_t space = args.find(' ');
+            std::string prompt = space == std::string::npos ? "" : args.substr(space + 1);
+            if (prompt.empty()) prompt = "Review this code and point out bugs or problems.";
+#ifndef _WIN32
+            watchFiles(args.substr(0, space), prompt);
+#else
+            std::cout << ColorUtils::colorize(" /watch is not available on this platform.", ColorUtils::RED) << "\n" << std::endl;
+#endif
+            return true;
+        } else if (command == "/mem") {
+            showMemoryAccounting();
+            return true;
+        } else if (command == "/status") {
+            checkStatus();
+            return true;
+        } else if (command == "/stream") {
+            toggleStreaming();
+            return true;
+        } else if (command == "/quit" || command == "/exit") {
+            StreamingOutput::typeText(ColorUtils::colorize(" Goodbye! Thanks for using Ollama Terminal Assistant!", ColorUtils::GREEN) + "\n", "", 25);
+            return false;
+        } else {
+            std::cout << ColorUtils::colorize(" Unknown command: ", ColorUtils::RED) << command << std::endl;
+            std::cout << ColorUtils::colorize(" Type '/help' for available commands.", ColorUtils::YELLOW) << "\n" << std::endl;
+            return true;
+        }
+    }
+    
+    void toggleStreaming() {
+        assistant->setStreamingEnabled(!assistant->isStreamingEnabled());
+        std::string status = assistant->isStreamingEnabled() ? "ENABLED" : "DISABLED";
+        std::string color = assistant->isStreamingEnabled() ? ColorUtils::GREEN : ColorUtils::RED;
+        std::string icon = assistant->isStreamingEnabled() ? " " : " ";
+        
+        std::cout << ColorUtils::colorize(icon + " Streaming output " + status, color) << std::endl;
+        if (assistant->isStreamingEnabled()) {
+            std::cout << ColorUtils::colorize(" Responses will now appear token by token as they are generated!", ColorUtils::CYAN) << std::endl;
+        } else {
+            std::cout << ColorUtils::colorize(" Responses will now appear instantly.", ColorUtils::CYAN) << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    static std::string jobSummary(const BackgroundJobs::Job& job) {
+        std::string text = job.prompt.substr(0, 48);
+        std::replace(text.begin(), text.end(), '\n', ' ');
+        return "\"" + text + (job.prompt.size() > 48 ? "...\"" : "\"");
+    }
+    
+    void startBackgroundJob(const std::string& prompt) {
+        try {
+            size_t id = jobs.start(assistant->exportState(), prompt, assistant->shareBackend(), assistant->getResources());
+            std::cout << ColorUtils::colorize(" [" + std::to_string(id) + "] started in the background", ColorUtils::GREEN)
+                     << ColorUtils::colorize("  (/jobs to list, /fg " + std::to_string(id) + " to view)", ColorUtils::DIM)
+                     << "\n" << std::endl;
+        } catch (const std::exception& e) {
+            std::cout << ColorUtils::colorize(" Could not start job: ", ColorUtils::RED) << e.what() << "\n" << std::endl;
+        }
+    }
+    
+    void announceFinishedJobs() {
+        for (const auto& job : jobs.takeFinished()) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            bool ok = job->state == BackgroundJobs::DONE;
+            std::cout << ColorUtils::colorize(" [" + std::to_string(job->id) + "] " + (ok ? "done: " : "failed: "),
+                                             ok ? ColorUtils::GREEN : ColorUtils::RED)
+                     << jobSummary(*job)
+                     << ColorUtils::colorize(ok ? "  (/fg " + std::to_string(job->id) + " to view)" : "  " + job->error,
+                                            ColorUtils::DIM) << std::endl;
+        }
+    }
+    
+    void showJobs() {
+        auto all = jobs.list();
+        if (all.empty()) {
+            std::cout << ColorUtils::colorize("No background jobs.", ColorUtils::GRAY) << "\n" << std::endl;
+            return;
+        }
+        static const char* const states[] = {"running", "done", "failed", "cancelled"};
+        auto now = std::chrono::steady_clock::now();
+        std::cout << ColorUtils::colorize("Background jobs:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        for (const auto& job : all) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            auto end = job->state == BackgroundJobs::RUNNING ? now : job->finished;
+            std::ostringstream line;
+            line.precision(1);
+            line << std::fixed << "  [" << job->id << "] " << std::left << std::setw(10) << states[job->state]
+                 << std::right << std::setw(7) << std::chrono::duration<double>(end - job->started).count() << " s "
+                 << std::setw(6) << job->pieces << " chunks  " << jobSummary(*job);
+            std::cout << line.str() << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    // Replays a job's reply, streams the rest until it finishes, then adds
+    // the exchange to the foreground conversation
+    void foregroundJob(size_t id) {
+        if (id == 0) {
+            auto all = jobs.list();
+            if (!all.empty()) id = all.front()->id;
+        }
+        auto job = jobs.take(id);
+        if (!job) {
+            std::cout << ColorUtils::colorize(" No such job: ", ColorUtils::RED) << id << "\n" << std::endl;
+            return;
+        }
+        
+        std::cout << ColorUtils::colorize("You: ", ColorUtils::BOLD + ColorUtils::BLUE) << job->prompt << "\n" << std::endl;
+        std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN);
+        size_t shown = 0;
+        std::unique_lock<std::mutex> lock(job->mutex);
+        while (true) {
+            job->changed.wait(lock, [&] { return job->output.size() > shown || job->state != BackgroundJobs::RUNNING; });
+            std::string fresh = job->output.substr(shown);
+            shown = job->output.size();
+            bool finished = job->state != BackgroundJobs::RUNNING;
+            lock.unlock();
+            ColorUtils::write(std::cout, fresh, ColorUtils::WHITE);
+            std::cout << std::flush;
+            if (finished) break;
+            lock.lock();
+        }
+        job->thread.join();
+        std::cout << "\n" << std::endl;
+        
+        if (job->state == BackgroundJobs::FAILED) {
+            std::cout << ColorUtils::colorize(" Error: ", ColorUtils::BOLD + ColorUtils::RED) << job->error << "\n" << std::endl;
+            return;
+        }
+        assistant->appendExchange(job->prompt, job->output);
+        std::cout << ColorUtils::colorize(" [" + std::to_string(job->id) + "] added to the conversation", ColorUtils::DIM)
+                 << "\n" << std::endl;
+    }
+    
+#ifndef _WIN32
+    static constexpr std::chrono::milliseconds WATCH_DEBOUNCE{300};
+    
+    // One generation started by /watch. It runs on its own thread so the
+    // watcher keeps reading file events, and cancels it, while it streams.
+    struct WatchRun {
+        std::map<std::string, std::string> versions;  // File contents this run sent, by path
+        std::thread thread;
+        std::atomic<bool> cancel{false};
+        std::atomic<bool> done{false};
+        std::string error;
+    };
+    
+    // The prompt with each file attached, as a diff when the conversation
+    // already holds an earlier version
+    std::string watchMessage(const std::map<std::string, std::string>& versions, const std::string& prompt,
+                             std::string& summary, uint64_t& bytes_saved) {
+        std::string message;
+        PromptReducer::Stats reduction;
+        for (const auto& version : versions) {
+            std::string content = version.second;
+            reduceText(content, reduction);
+            FileAttachments::Attachment attachment = assistant->attachFile(version.first, std::move(content));
+            message += attachment.text;
+            bytes_saved += attachment.full_bytes - attachment.text.size();
+            if (!summary.empty()) summary += ", ";
+            summary += version.first + (attachment.base_version > 0 ? " (diff)" : "");
+        }
+        reduced_total.add(reduction);
+        return message + prompt;
+    }
+    
+    std::unique_ptr<WatchRun> startWatchRun(std::map<std::string, std::string> versions, const std::string& message) {
+        auto run = std::make_unique<WatchRun>();
+        run->versions = std::move(versions);
+        WatchRun* raw = run.get();
+        status_line.beginRequest(assistant->estimateHistoryTokens(), contextLimit());
+        run->thread = std::thread([this, raw, message] {
+            // Also stops the request while the server is still in prefill
+            CancelScope cancel_scope(raw->cancel);
+            bool reply_started = false;
+            auto print_token = [this, raw, &reply_started](std::string_view delta) {
+                MemoryScope scope(MemoryAccounting::RENDERER);
+                auto output_lock = status_line.lockOutput();
+                if (raw->cancel) return false;
+                status_line.onToken();
+                if (!reply_started) {
+                    std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN);
+                    reply_started = true;
+                }
+                ColorUtils::write(std::cout, delta, ColorUtils::WHITE);
+                std::cout << std::flush;
+                return true;
+            };
+            try {
+                std::string reply = assistant->sendMessage(message, assistant->isStreamingEnabled() ?
+                                                           TokenCallback(print_token) : TokenCallback());
+                if (raw->cancel) {
+                    assistant->discardLastExchange();
+                } else if (!reply_started) {
+                    auto output_lock = status_line.lockOutput();
+                    std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN) << reply;
+                }
+            } catch (const std::exception& e) {
+                raw->error = e.what();
+            }
+            status_line.endRequest(assistant->getLastPromptEvalCount(), assistant->getLastEvalCount(), contextLimit());
+            raw->done = true;
+        });
+        return run;
+    }
+    
+    // Whether `path` now differs from what the run sent, or from what the
+    // conversation holds if the run did not include it
+    static bool isStale(const WatchRun& run, const std::map<std::string, std::string>& seen, const std::string& path) {
+        std::string content;
+        if (!readFile(path, content)) return false;
+        auto sent = run.versions.find(path);
+        if (sent != run.versions.end()) return sent->second != content;
+        auto held = seen.find(path);
+        return held == seen.end() || held->second != content;
+    }
+    
+    // Re-runs `prompt` whenever files matching `glob` change, until Enter.
+    // Changes are debounced; a run whose files change again is cancelled at
+    // once and its exchange dropped, and files the conversation already
+    // holds are sent as diffs.
+    void watchFiles(const std::string& glob, const std::string& prompt) {
+        std::unique_ptr<FileWatcher> watcher;
+        try {
+            watcher = std::make_unique<FileWatcher>(glob);
+        } catch (const std::exception& e) {
+            std::cout << ColorUtils::colorize(" Cannot watch: ", ColorUtils::RED) << e.what() << "\n" << std::endl;
+            return;
+        }
+        std::vector<std::string> files = watcher->files();
+        std::cout << ColorUtils::colorize(" Watching " + glob + " (" + std::to_string(files.size()) + " files)",
+                                         ColorUtils::GREEN)
+                 << ColorUtils::colorize("  Press Enter to stop.", ColorUtils::DIM) << "\n" << std::endl;
+        
+        std::map<std::string, std::string> seen;  // Latest version in the conversation, by path
+        std::set<std::string> pending(files.begin(), files.end());
+        auto deadline = std::chrono::steady_clock::now();  // Review the current files right away
+        std::unique_ptr<WatchRun> run;
+        size_t runs = 0;
+        size_t stale_runs = 0;
+        uint64_t bytes_saved = 0;
+        
+        auto finishRun = [&] {
+            run->thread.join();
+            auto output_lock = status_line.lockOutput();
+            if (run->cancel) {
+                // Nothing it sent stays in the conversation
+                for (const auto& version : run->versions) {
+                    pending.insert(version.first);
+                }
+                std::cout << "\n" << std::endl;
+            } else if (!run->error.empty()) {
+                std::cout << "\n" << ColorUtils::colorize(" Error: ", ColorUtils::BOLD + ColorUtils::RED)
+                         << run->error << "\n" << std::endl;
+            } else {
+                for (auto& version : run->versions) {
+                    seen[version.first] = std::move(version.second);
+                }
+                std::cout << "\n" << std::endl;
+            }
+            run.reset();
+            syncHistoryLayout();
+        };
+        
+        while (true) {
+            auto now = std::chrono::steady_clock::now();
+            if (run && run->done) {
+                finishRun();
+            }
+            if (!run && !pending.empty() && now >= deadline) {
+                std::map<std::string, std::string> versions;
+                for (const auto& path : pending) {
+                    std::string content;
+                    auto held = seen.find(path);
+                    if (readFile(path, content) && (held == seen.end() || held->second != content)) {
+                        versions[path] = std::move(content);
+                    }
+                }
+                pending.clear();
+                if (!versions.empty()) {
+                    std::string summary;
+                    std::string message = watchMessage(versions, prompt, summary, bytes_saved);
+                    std::cout << ColorUtils::colorize(" [watch " + std::to_string(++runs) + "] " + summary,
+                                                     ColorUtils::CYAN) << std::endl;
+                    run = startWatchRun(std::move(versions), message);
+                }
+            }
+            
+            int timeout_ms = 1000;
+            if (run) {
+                timeout_ms = 50;  // Notice the end of the run promptly
+            } else if (!pending.empty()) {
+                timeout_ms = static_cast<int>(std::max<int64_t>(0,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()));
+            }
+            bool input = false;
+            for (const auto& path : watcher->wait(timeout_ms, input)) {
+                pending.insert(path);
+                deadline = std::chrono::steady_clock::now() + WATCH_DEBOUNCE;
+                if (run && !run->cancel && !run->done && isStale(*run, seen, path)) {
+                    auto output_lock = status_line.lockOutput();
+                    run->cancel = true;
+                    ++stale_runs;
+                    std::cout << ColorUtils::colorize(" [" + path + " changed, cancelled]", ColorUtils::YELLOW)
+                             << std::flush;
+                }
+            }
+            if (input) {
+                std::string line;
+                std::getline(std::cin, line);
+                break;
+            }
+        }
+        if (run) {
+            run->cancel = true;
+            ++stale_runs;
+            finishRun();
+        }
+        
+        std::cout << ColorUtils::colorize(" Stopped watching " + glob + ": ", ColorUtils::GREEN) << runs << " runs, "
+                 << stale_runs << " cancelled";
+        if (bytes_saved > 0) {
+            std::cout << ", " << formatBytes(bytes_saved) << " of file content sent as diffs";
+        }
+        std::cout << "\n" << std::endl;
+    }
+#endif
+    
+    void showAvailableModels() {
+        std::cout << ColorUtils::colorize(" Fetching available models...", ColorUtils::YELLOW) << std::endl;
+        
+        try {
+            auto models = assistant->getAvailableModels();
+            if (models.empty()) {
+                std::cout << ColorUtils::colorize(" No models found. Install a model first:", ColorUtils::RED) << std::endl;
+                std::cout << ColorUtils::colorize("   ollama pull llama3.2", ColorUtils::CYAN) << std::endl;
+                std::cout << ColorUtils::colorize("   ollama pull codellama", ColorUtils::CYAN) << std::endl;
+            } else {
+                std::cout << ColorUtils::colorize("Available Models:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+                for (size_t i = 0; i < models.size(); ++i) {
+                    std::string marker = (models[i] == assistant->getCurrentModel()) ? "➤ " : "  ";
+                    std::string color = (models[i] == assistant->getCurrentModel()) ? 
+                                      ColorUtils::BOLD + ColorUtils::GREEN : ColorUtils::WHITE;
+                    std::cout << ColorUtils::colorize(marker + std::to_string(i + 1) + ". " + models[i], color) << std::endl;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cout << ColorUtils::colorize(" Error fetching models: ", ColorUtils::RED) << e.what() << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    static std::string formatBytes(uint64_t bytes) {
+        const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+        double value = static_cast<double>(bytes);
+        int unit = 0;
+        while (value >= 1024.0 && unit < 4) {
+            value /= 1024.0;
+            ++unit;
+        }
+        std::ostringstream out;
+        out.precision(unit == 0 ? 0 : 1);
+        out << std::fixed << value << " " << units[unit];
+        return out.str();
+    }
+    
+    static std::string formatCount(uint64_t count) {
+        std::ostringstream out;
+        out.precision(1);
+        if (count >= 1000000000ULL) {
+            out << std::fixed << count / 1e9 << "B";
+        } else if (count >= 1000000ULL) {
+            out << std::fixed << count / 1e6 << "M";
+        } else {
+            out << count;
+        }
+        return out.str();
+    }
+    
+    void showModelInfo(const std::string& name) {
+        const ModelInfo* info = assistant->getModelRegistry().lookup(name);
+        if (!info) {
+            std::cout << ColorUtils::colorize(" No local model data for: ", ColorUtils::RED) << name << std::endl;
+            std::cout << ColorUtils::colorize(" Models directory: ", ColorUtils::YELLOW) 
+                     << assistant->getModelRegistry().getStore().getModelsDir().string() << "\n" << std::endl;
+            return;
+        }
+        
+        uint64_t available = ModelRegistry::availableMemoryBytes();
+        uint64_t num_ctx = ModelRegistry::suggestedNumCtx(*info, available);
+        uint64_t needed = info->estimateMemoryBytes(num_ctx);
+        
+        std::cout << ColorUtils::colorize("Model: ", ColorUtils::BOLD + ColorUtils::CYAN) << info->name << std::endl;
+        std::cout << ColorUtils::colorize("  Architecture:   ", ColorUtils::CYAN) << info->architecture << std::endl;
+        std::cout << ColorUtils::colorize("  Parameters:     ", ColorUtils::CYAN) << formatCount(info->parameter_count)
+                 << " (" << info->tensor_count << " tensors)" << std::endl;
+        std::cout << ColorUtils::colorize("  Quantization:   ", ColorUtils::CYAN) << info->quantization << std::endl;
+        std::cout << ColorUtils::colorize("  Context length: ", ColorUtils::CYAN) << info->context_length << std::endl;
+        std::cout << ColorUtils::colorize("  Tokenizer:      ", ColorUtils::CYAN) << info->tokenizer_model
+                 << " (" << info->vocab_size << " tokens)" << std::endl;
+        std::cout << ColorUtils::colorize("  Chat template:  ", ColorUtils::CYAN)
+                 << (info->chat_template.empty() ? "none" : "embedded") << std::endl;
+        std::cout << ColorUtils::colorize("  Weights:        ", ColorUtils::CYAN) << formatBytes(info->weights_bytes) << std::endl;
+        std::cout << ColorUtils::colorize("  Suggested ctx:  ", ColorUtils::CYAN) << num_ctx
+                 << " (~" << formatBytes(needed) << " resident)" << std::endl;
+        if (available > 0) {
+            bool fits = needed <= available;
+            std::cout << ColorUtils::colorize("  Memory fit:     ", ColorUtils::CYAN)
+                     << ColorUtils::colorize(fits ? "OK" : "TOO LARGE", fits ? ColorUtils::GREEN : ColorUtils::RED)
+                     << " (" << formatBytes(available) << " available)" << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    void showContextInfo() {
+        const ModelCapabilities& caps = assistant->getCapabilities();
+        const ContextSizer& sizer = assistant->getContextSizer();
+        
+        std::cout << ColorUtils::colorize("Context Sizing:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        std::cout << ColorUtils::colorize("  Auto num_ctx:    ", ColorUtils::CYAN)
+                 << ColorUtils::colorize(assistant->isAutoContext() ? "ON" : "OFF",
+                                        assistant->isAutoContext() ? ColorUtils::GREEN : ColorUtils::RED) << std::endl;
+        std::cout << ColorUtils::colorize("  Model limit:     ", ColorUtils::CYAN)
+                 << (caps.context_length ? std::to_string(caps.context_length) : "unknown") << std::endl;
+        std::cout << ColorUtils::colorize("  Current num_ctx: ", ColorUtils::CYAN)
+                 << (sizer.getCurrentCtx() ? std::to_string(sizer.getCurrentCtx()) : "server default") << std::endl;
+        std::cout << ColorUtils::colorize("  History tokens:  ", ColorUtils::CYAN)
+                 << "~" << assistant->estimateHistoryTokens();
+        if (assistant->getLastPromptEvalCount() > 0) {
+            std::cout << " (last prompt eval: " << assistant->getLastPromptEvalCount() << ")";
+        }
+        std::cout << std::endl;
+        std::cout << ColorUtils::colorize("  Resizes:         ", ColorUtils::CYAN) << sizer.getResizeCount() << std::endl;
+        ModelProfiles::Profile profile;
+        if (assistant->getModelProfiles().find(assistant->getCurrentModel(), profile)) {
+            std::cout << ColorUtils::colorize("  Tuned options:   ", ColorUtils::CYAN) << profile.options.dump()
+                     << " (autotune, " << profile.tuned_at << ")" << std::endl;
+        }
+        if (!caps.quantization_level.empty()) {
+            std::cout << ColorUtils::colorize("  Model details:   ", ColorUtils::CYAN)
+                     << caps.family << " " << caps.parameter_size << " " << caps.quantization_level << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    void toggleGenerateMode() {
+        if (!assistant->setGenerateMode(!assistant->isGenerateMode())) {
+            std::cout << ColorUtils::colorize(" Raw generate mode needs the Ollama backend (current: ", ColorUtils::RED)
+                     << assistant->getBackend().name() << ")\n" << std::endl;
+            return;
+        }
+        if (assistant->isGenerateMode()) {
+            PromptTemplate prompt_template = PromptTemplate::detect(assistant->getCapabilities().template_text);
+            std::cout << ColorUtils::colorize(" Raw generate mode ENABLED", ColorUtils::GREEN) << std::endl;
+            std::cout << ColorUtils::colorize(" Prompts are rendered client-side (" + std::string(prompt_template.familyName()) +
+                                             " template) and context tokens are reused between turns.", ColorUtils::CYAN) << std::endl;
+        } else {
+            std::cout << ColorUtils::colorize(" Raw generate mode DISABLED, using /api/chat", ColorUtils::RED) << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    void showRequestStats() {
+        auto printRow = [](const std::string& label, const RequestStats& stats) {
+            std::ostringstream row;
+            row.precision(1);
+            row << std::fixed << stats.requests << " requests, avg body " << stats.avgBodyBytes() << " B, avg prefill "
+                << stats.avgPrefillTokens() << " tokens / " << stats.avgPrefillMs() << " ms, per-token overhead "
+                << stats.perTokenOverheadUs() << " us";
+            if (stats.malformed_chunks > 0) {
+                row << ", " << stats.malformed_chunks << " malformed stream lines skipped";
+            }
+            std::cout << ColorUtils::colorize(label, ColorUtils::CYAN) << row.str() << std::endl;
+        };
+        
+        std::cout << ColorUtils::colorize("Request Statistics:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        if (OllamaHttpBackend* http = assistant->getHttpBackend()) {
+            printRow("  /api/chat:     ", http->getChatStats());
+            printRow("  /api/generate: ", http->getGenerateStats());
+            if (SingleFlight* single_flight = http->getSingleFlight()) {
+                json coalescing = single_flight->statsJson();
+                std::cout << ColorUtils::colorize("  Coalescing:    ", ColorUtils::CYAN) << coalescing["coalesced"].get<uint64_t>()
+                         << " requests joined an identical one in flight, " << coalescing["tokens_saved"].get<uint64_t>()
+                         << " tokens / " << formatBytes(coalescing["bytes_saved"].get<uint64_t>()) << " not regenerated" << std::endl;
+            }
+            if (ConcurrencyLimiter* limiter = http->getLimiter()) {
+                json limits = limiter->statsJson();
+                for (const auto& [key, limit] : limits.items()) {
+                    std::ostringstream row;
+                    row.precision(0);
+                    row << std::fixed << "limit " << limit["limit"].get<uint32_t>() << " (peak " << limit["peak"].get<uint32_t>()
+                        << ") for " << key.substr(key.rfind(' ') + 1) << ", " << limit["queued"].get<uint64_t>()
+                        << " queued at the server (" << limit["latency_ms"].get<double>() << " ms vs "
+                        << limit["baseline_ms"].get<double>() << " ms baseline), " << limit["waits"].get<uint64_t>()
+                        << " waited here " << limit["wait_ms"].get<uint64_t>() << " ms, " << limit["drops"].get<uint64_t>()
+                        << " overloads";
+                    std::cout << ColorUtils::colorize("  Concurrency:   ", ColorUtils::CYAN) << row.str() << std::endl;
+                }
+            }
+            printTimeouts(*http);
+        } else {
+            printRow("  " + std::string(assistant->getBackend().name()) + ": ", assistant->getBackend().getChatStats());
+        }
+        
+        const CompactTokens& context = assistant->getGenerateContext();
+        std::cout << ColorUtils::colorize("  Context reuse: ", ColorUtils::CYAN) << assistant->getContextReuses()
+                 << " turns, " << assistant->getContextFallbacks() << " full re-sends on mismatch" << std::endl;
+        std::cout << ColorUtils::colorize("  Held context:  ", ColorUtils::CYAN) << context.size() << " tokens in "
+                 << formatBytes(context.byteSize()) << std::endl;
+        const FileAttachments& files = assistant->getAttachments();
+        const ContextSizer& sizer = assistant->getContextSizer();
+        std::cout << ColorUtils::colorize("  Attachments:   ", ColorUtils::CYAN) << files.getAttached() << " files, "
+                 << formatBytes(files.getSentBytes()) << " sent instead of " << formatBytes(files.getFullBytes())
+                 << " (~" << sizer.estimateTokens(files.getFullBytes()) - sizer.estimateTokens(files.getSentBytes())
+                 << " tokens saved by diffs)" << std::endl;
+        printStopSavings();
+        printContinuations();
+        std::cout << std::endl;
+    }
+    
+    // Runs a fixed short prompt outside the conversation to measure decode
+    // rate and per-token client overhead of the current backend
+    void runBenchmark(int runs) {
+        std::vector<json> messages = {
+            {{"role", "user"}, {"content", "Count from 1 to 20, separated by spaces."}}
+        };
+        json options = {{"num_predict", 64}, {"temperature", 0.0}, {"seed", 42}};
+        InferenceBackend& backend = assistant->getBackend();
+        
+        std::cout << ColorUtils::colorize("Benchmarking " + std::string(backend.name()) + " with " + 
+                                         assistant->getCurrentModel() + "...", ColorUtils::YELLOW) << std::endl;
+        RequestStats totals;
+        uint64_t steady_chunks = 0;
+        uint64_t steady_allocations = 0;
+        for (int i = 0; i < runs; ++i) {
+            uint64_t chunks = 0;
+            auto start = std::chrono::steady_clock::now();
+            std::chrono::steady_clock::time_point first;
+            std::chrono::steady_clock::time_point last;
+            // Allocations on this thread between the first and last token are
+            // the streaming path's steady-state cost
+            uint64_t first_allocations = 0;
+            uint64_t last_allocations = 0;
+            try {
+                GenerationResult result = backend.chat(assistant->getCurrentModel(), messages, options, true,
+                    [&](std::string_view) {
+                        last_allocations = MemoryAccounting::threadAllocations();
+                        last = std::chrono::steady_clock::now();
+                        if (chunks++ == 0) {
+                            first = last;
+                            first_allocations = last_allocations;
+                        }
+                        return true;
+                    });
+                totals.record(0, result.final_chunk);
+                if (chunks > 1) {
+                    totals.recordStream(chunks, static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(last - first).count()));
+                    steady_chunks += chunks - 1;
+                    steady_allocations += last_allocations - first_allocations;
+                }
+                double ttft_ms = chunks ? std::chrono::duration<double, std::milli>(first - start).count() : 0.0;
+                uint64_t eval_count = result.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+                double eval_s = result.final_chunk.value("eval_duration", static_cast<uint64_t>(0)) / 1e9;
+                
+                std::ostringstream line;
+                line.precision(1);
+                line << std::fixed << "  run " << (i + 1) << ": TTFT " << ttft_ms << " ms, " << eval_count << " tokens, "
+                     << (eval_s > 0 ? eval_count / eval_s : 0.0) << " tokens/s";
+                std::cout << line.str() << std::endl;
+            } catch (const std::exception& e) {
+                std::cout << ColorUtils::colorize(" Error: ", ColorUtils::RED) << e.what() << std::endl;
+                break;
+            }
+        }
+        
+        std::ostringstream summary;
+        summary.precision(1);
+        summary << std::fixed << "Per-token overhead: " << totals.perTokenOverheadUs() << " us, avg prefill "
+                << totals.avgPrefillMs() << " ms";
+        std::cout << ColorUtils::colorize(summary.str(), ColorUtils::CYAN) << std::endl;
+        if (MemoryAccounting::isTracking() && steady_chunks > 0) {
+            // Amortized growth of the reply text is all that should be left
+            double per_token = static_cast<double>(steady_allocations) / steady_chunks;
+            std::ostringstream allocs;
+            allocs.precision(2);
+            allocs << std::fixed << "Allocations per token: " << per_token;
+            bool ok = per_token < 0.5;
+            std::cout << ColorUtils::colorize(allocs.str(), ColorUtils::CYAN)
+                     << ColorUtils::colorize(ok ? "  (ok)" : "  (streaming path allocates per token)",
+                                            ok ? ColorUtils::GREEN : ColorUtils::RED) << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    
+    void showLocalModels() {
+        ModelRegistry& registry = assistant->getModelRegistry();
+        auto models = registry.scanInstalled();
+        if (models.empty()) {
+            std::cout << ColorUtils::colorize(" No local models found in ", ColorUtils::RED) 
+                     << registry.getStore().getModelsDir().string() << "\n" << std::endl;
+            return;
+        }
+        
+        std::cout << ColorUtils::colorize("Local Models:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        for (const ModelInfo* info : models) {
+            std::string color = (info->name == assistant->getCurrentModel()) ? 
+                              ColorUtils::BOLD + ColorUtils::GREEN : ColorUtils::WHITE;
+            std::cout << ColorUtils::colorize("  " + info->name, color)
+                     << ColorUtils::colorize("  " + formatCount(info->parameter_count) + " params, " +
+                                            info->quantization + ", ctx " + std::to_string(info->context_length) +
+                                            ", " + formatBytes(info->weights_bytes), ColorUtils::GRAY) << std::endl;
+        }
+        std::ostringstream elapsed;
+        elapsed.precision(2);
+        elapsed << std::fixed << registry.getLastScanMs();
+        std::cout << ColorUtils::colorize("Read " + std::to_string(models.size()) + " model headers in " + 
+                                         elapsed.str() + " ms", ColorUtils::DIM) << "\n" << std::endl;
+    }
+    
+    void changeModel() {
+        try {
+            auto models = assistant->getAvailableModels();
+            if (models.empty()) {
+                std::cout << ColorUtils::colorize(" No models available. Install one first:", ColorUtils::RED) << std::endl;
+                std::cout << ColorUtils::colorize("   ollama pull llama3.2", ColorUtils::CYAN) << std::endl;
                 return;
             }
             
@@ -558,6 +2904,13 @@ private:
                 int choice = std::stoi(input);
                 if (choice >= 1 && choice <= static_cast<int>(models.size())) {
                     assistant->setModel(models[choice - 1]);
+                    std::cout << ColorUtils::colorize("Model changed to: ", ColorUtils::GREEN) 
+                             << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+                    uint64_t context_length = assistant->getCapabilities().context_length;
+                    if (context_length > 0) {
+                        std::cout << ColorUtils::colorize("Context window: ", ColorUtils::GREEN) 
+                                 << context_length << " tokens" << std::endl;
+                    }
                 } else {
                     std::cout << ColorUtils::colorize(" Invalid choice!", ColorUtils::RED) << std::endl;
                 }
@@ -570,7 +2923,107 @@ private:
         std::cout << std::endl;
     }
     
+    // Terminal columns when the pager can run: both ends of the REPL are a TTY
+    int pagerColumns(int& rows) const {
+        int columns = 0;
+#ifdef _WIN32
+        bool tty = _isatty(_fileno(stdin)) != 0;
+#else
+        bool tty = isatty(STDIN_FILENO) != 0;
+#endif
+        return tty && terminalSize(rows, columns) ? columns : 0;
+    }
+    
+    void syncHistoryLayout() {
+        int rows = 0;
+        if (int columns = pagerColumns(rows)) {
+            history_layout.sync(assistant->getConversation(), static_cast<size_t>(columns));
+        }
+    }
+    
+    // Pager in a terminal; otherwise the whole history is printed
+    void showConversationHistory(size_t turn = 0) {
+        MemoryScope scope(MemoryAccounting::RENDERER);
+        const ConversationStore& store = assistant->getConversation();
+        int rows = 0;
+        int columns = pagerColumns(rows);
+        if (columns > 0 && store.size() > 1) {
+            history_layout.sync(store, static_cast<size_t>(columns));
+            HistoryPager(store, history_layout, rows, columns).run(turn);
+            status_line.invalidate();
+            return;
+        }
+        
+        std::cout << "\n" << ColorUtils::colorize("=== Conversation History ===", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        
+        if (store.size() <= 1) {
+            std::cout << ColorUtils::colorize("No conversation history yet.", ColorUtils::GRAY) << std::endl;
+        } else {
+            for (size_t i = 1; i < store.size(); ++i) { 
+                json msg = store.at(i);
+                const std::string& role = msg["role"].get_ref<const std::string&>();
+                const std::string& content = msg["content"].get_ref<const std::string&>();
+                
+                if (role == "user") {
+                    std::cout << ColorUtils::colorize("You: ", ColorUtils::BOLD + ColorUtils::BLUE) 
+                             << content << std::endl;
+                } else if (role == "assistant") {
+                    std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN) 
+                             << content << std::endl;
+                }
+                std::cout << std::endl;
+            }
+        }
+        std::cout << ColorUtils::colorize("========================", ColorUtils::CYAN) << "\n" << std::endl;
+    }
+    
+    // Latest health monitor state; never waits on the server
+    void showHealth(HealthMonitor& health) {
+        HealthMonitor::Snapshot snapshot = health.snapshot();
+        auto ago = [](std::chrono::steady_clock::time_point when) {
+            return std::to_string(std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now() - when).count()) + " s ago";
+        };
+        if (!snapshot.probed) {
+            std::cout << ColorUtils::colorize(" Health: first probe still running", ColorUtils::YELLOW) << std::endl;
+            return;
+        }
+        std::ostringstream line;
+        line.precision(1);
+        line << std::fixed;
+        if (snapshot.up) {
+            line << "up since " << ago(snapshot.since) << ", version " << snapshot.version << ", probe latency "
+                 << snapshot.latency_ms << " ms average / " << snapshot.last_ms << " ms last";
+        } else {
+            line << "DOWN since " << ago(snapshot.since) << ", " << snapshot.failing << " probes failed in a row";
+        }
+        line << " (" << snapshot.failures << " of " << snapshot.probes << " probes failed, last " << ago(snapshot.checked) << ")";
+        std::cout << ColorUtils::colorize(" Health: ", ColorUtils::CYAN)
+                 << ColorUtils::colorize(line.str(), snapshot.up ? ColorUtils::WHITE : ColorUtils::RED) << std::endl;
+        for (const auto& model : snapshot.loaded) {
+            std::ostringstream loaded;
+            loaded.precision(1);
+            loaded << std::fixed << model.name << ": " << model.size / 1073741824.0 << " GB, "
+                   << (model.size > 0 ? 100 * model.size_vram / model.size : 0) << "% GPU";
+            if (!model.expires_at.empty()) loaded << ", unloads at " << model.expires_at;
+            std::cout << ColorUtils::colorize(" Loaded: ", ColorUtils::CYAN) << loaded.str() << std::endl;
+        }
+    }
+    
     void checkStatus() {
+        OllamaHttpBackend* http = assistant->getHttpBackend();
+        if (HealthMonitor* health = http ? http->getHealth() : nullptr) {
+            std::cout << ColorUtils::colorize(" Server: " + http->getBaseUrl(), ColorUtils::CYAN) << std::endl;
+            showHealth(*health);
+            std::cout << ColorUtils::colorize(" Current model: ", ColorUtils::CYAN) 
+                     << ColorUtils::colorize(assistant->getCurrentModel(), ColorUtils::BOLD + ColorUtils::GREEN) << std::endl;
+            std::cout << ColorUtils::colorize(" Streaming: ", ColorUtils::CYAN) 
+                     << ColorUtils::colorize(assistant->isStreamingEnabled() ? "ENABLED" : "DISABLED", 
+                                            assistant->isStreamingEnabled() ? ColorUtils::GREEN : ColorUtils::RED) << std::endl;
+            showMemoryTiers();
+            std::cout << std::endl;
+            return;
+        }
         std::cout << ColorUtils::colorize("Checking Ollama connection...", ColorUtils::YELLOW) << std::endl;
         
         if (assistant->checkOllamaConnection()) {
@@ -586,22 +3039,110 @@ private:
             std::cout << ColorUtils::colorize(" Make sure Ollama is running:", ColorUtils::YELLOW) << std::endl;
             std::cout << ColorUtils::colorize("   ollama serve", ColorUtils::CYAN) << std::endl;
         }
+        showMemoryTiers();
         std::cout << std::endl;
     }
     
+    // Live heap per subsystem, plus allocation rates since the previous /mem
+    void showMemoryAccounting() {
+        if (!MemoryAccounting::isTracking()) {
+            std::cout << ColorUtils::colorize(" Allocation tracking is not compiled in (OLLAMA_NO_ALLOCATION_TRACKING).", ColorUtils::YELLOW)
+                     << "\n" << std::endl;
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - last_mem_time).count();
+        last_mem_time = now;
+        
+        std::cout << ColorUtils::colorize("Memory by subsystem:", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+        std::ostringstream table;
+        table << std::left << "  " << std::setw(17) << "subsystem" << std::right << std::setw(11) << "live"
+              << std::setw(13) << "allocations" << std::setw(12) << "allocated" << std::setw(11) << "allocs/s"
+              << std::setw(12) << "bytes/s" << "\n";
+        uint64_t live_total = 0;
+        for (int i = 0; i < MemoryAccounting::SUBSYSTEM_COUNT; ++i) {
+            auto subsystem = static_cast<MemoryAccounting::Subsystem>(i);
+            MemoryAccounting::Snapshot s = MemoryAccounting::snapshot(subsystem);
+            MemoryAccounting::Snapshot& prev = last_mem[i];
+            double alloc_rate = seconds > 0 ? (s.allocations - prev.allocations) / seconds : 0.0;
+            double byte_rate = seconds > 0 ? (s.allocated_bytes - prev.allocated_bytes) / seconds : 0.0;
+            table << std::left << "  " << std::setw(17) << MemoryAccounting::name(subsystem) << std::right
+                  << std::setw(11) << formatBytes(s.live_bytes) << std::setw(13) << s.allocations
+                  << std::setw(12) << formatBytes(s.allocated_bytes) << std::setw(11) << std::fixed
+                  << std::setprecision(0) << alloc_rate << std::setw(12) << formatBytes(static_cast<uint64_t>(byte_rate))
+                  << "\n";
+            live_total += s.live_bytes;
+            prev = s;
+        }
+        std::cout << table.str();
+        
+        std::ostringstream footer;
+        footer.precision(1);
+        footer << std::fixed << "Tracked live: " << formatBytes(live_total);
+        if (uint64_t rss = processResidentBytes()) {
+            footer << ", process RSS: " << formatBytes(rss);
+        }
+        footer << " (rates over " << seconds << " s)";
+        std::cout << ColorUtils::colorize(footer.str(), ColorUtils::DIM) << "\n" << std::endl;
+    }
+    
+    void showMemoryTiers() {
+        ConversationMemory usage = assistant->getMemoryUsage();
+        json codec = assistant->getResources().cold_codec->statsJson();
+        std::cout << ColorUtils::colorize(" Memory (hot):  ", ColorUtils::CYAN) << usage.hot_messages << " messages, "
+                 << formatBytes(usage.hot_bytes) << std::endl;
+        std::cout << ColorUtils::colorize(" Memory (cold): ", ColorUtils::CYAN) << usage.cold_messages << " messages, "
+                 << formatBytes(usage.cold_bytes) << " from " << formatBytes(usage.cold_raw_bytes) << " ("
+                 << codec["codec"].get<std::string>() << (codec["dictionary"].get<bool>() ? " + dictionary" : "") << ")" << std::endl;
+        if (uint64_t rss = processResidentBytes()) {
+            std::cout << ColorUtils::colorize(" Process RSS:   ", ColorUtils::CYAN) << formatBytes(rss) << std::endl;
+        }
+    }
+    
+    static std::shared_ptr<InferenceBackend> createBackend(const std::string& backend_name, const ClientResources& resources) {
+        if (backend_name == "ollama") {
+            return std::make_shared<OllamaHttpBackend>("http://localhost:11434", resources.pool, resources.single_flight,
+                                                       resources.limiter);
+        }
+#ifdef OLLAMA_WITH_LLAMA_CPP
+        if (backend_name == "llama") {
+            return std::make_shared<LlamaCppBackend>();
+        }
+#endif
+        throw std::runtime_error("Unknown or unavailable backend: " + backend_name);
+    }
+    
 public:
-    TerminalInterface(const std::string& model_name = "llama3.2") {
+    TerminalInterface(const std::string& model_name = "llama3.2", const std::string& backend_name = "ollama") {
         try {
-            assistant = std::make_unique<OllamaAssistant>(model_name);
+            ClientResources resources = ClientResources::createDefault();
+            assistant = std::make_unique<OllamaAssistant>(model_name, createBackend(backend_name, resources), resources);
         } catch (const std::exception& e) {
             throw std::runtime_error("Failed to initialize Ollama assistant: " + std::string(e.what()));
         }
     }
     
+    // Latency budget per reply, from --deadline
+    void setDeadline(uint64_t milliseconds) {
+        assistant->setDeadline(milliseconds);
+    }
+    
     bool initializeConnection() {
+        if (!assistant->getHttpBackend()) {
+            std::cout << ColorUtils::colorize(" Using in-process backend: ", ColorUtils::GREEN)
+                     << assistant->getBackend().name() << std::endl;
+            return true;
+        }
+        
         std::cout << ColorUtils::colorize(" Checking Ollama connection...", ColorUtils::YELLOW) << std::endl;
         
         if (!assistant->checkOllamaConnection()) {
+#ifdef OLLAMA_WITH_LLAMA_CPP
+            std::cout << ColorUtils::colorize(" Ollama is not running, switching to in-process llama.cpp backend", 
+                                             ColorUtils::YELLOW) << std::endl;
+            assistant->setBackend(std::make_shared<LlamaCppBackend>());
+            return true;
+#endif
             std::cout << ColorUtils::colorize(" Cannot connect to Ollama!", ColorUtils::RED) << std::endl;
             std::cout << ColorUtils::colorize(" Please make sure Ollama is running:", ColorUtils::YELLOW) << std::endl;
             std::cout << ColorUtils::colorize("   ollama serve", ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
@@ -610,6 +3151,7 @@ public:
         }
         
         std::cout << ColorUtils::colorize(" Connected to Ollama successfully!", ColorUtils::GREEN) << std::endl;
+        assistant->getHttpBackend()->startHealthMonitor();
         return true;
     }
     
@@ -619,10 +3161,19 @@ public:
         }
         
         printWelcome();
+        status_line.start(assistant->getBackend(), assistant->getHttpBackend());
+        jobs.setChangeCallback([this](size_t running, size_t finished) {
+            status_line.setJobs(running, finished);
+        });
+        refreshStatusLine();
         
         while (true) {
             try {
-                std::string input = getInput();
+                std::string input;
+                if (!getInput(input)) {
+                    std::cout << std::endl;
+                    break;
+                }
                 
                 // Handle empty input
                 if (input.empty()) {
@@ -634,36 +3185,168 @@ public:
                     if (!handleCommand(input)) {
                         break; // Exit command was executed
                     }
+                    refreshStatusLine();
                     continue;
                 }
                 
-                // Send message to Ollama
-                showThinking();
-                std::string response = assistant->sendMessage(input);
-                clearThinking();
-                
-                // Display response with streaming effect if enabled
-                std::cout << ColorUtils::colorize("Ollama: ", ColorUtils::BOLD + ColorUtils::GREEN);
-                
-                if (assistant->isStreamingEnabled()) {
-                    // Stream the response like ChatGPT
-                    StreamingOutput::typeText(response, ColorUtils::WHITE, 15);
-                } else {
-                    // Display instantly
-                    std::cout << response;
-                }
-                
-                std::cout << "\n" << std::endl;
-                
+                sendChat(input);
             } catch (const std::exception& e) {
+                status_line.endRequest(0, 0, contextLimit());
                 clearThinking();
                 std::cout << ColorUtils::colorize(" Error: ", ColorUtils::BOLD + ColorUtils::RED) 
                          << e.what() << "\n" << std::endl;
             }
         }
+        jobs.cancelAll();
+        status_line.stop();
     }
 };
 
+// Server URL from --host or OLLAMA_HOST, which may omit the scheme and
+// port as Ollama's own OLLAMA_HOST does ("127.0.0.1", "box:8080")
+std::string ollamaBaseUrl(std::string host) {
+    if (host.empty()) {
+        const char* env = std::getenv("OLLAMA_HOST");
+        host = env ? env : "";
+    }
+    if (host.empty()) return "http://localhost:11434";
+    while (!host.empty() && host.back() == '/') host.pop_back();
+    size_t scheme = host.find("://");
+    if (scheme == std::string::npos) {
+        host = "http://" + host;
+        scheme = 4;
+    }
+    if (host.find(':', scheme + 3) == std::string::npos) {
+        host += ":11434";
+    }
+    return host;
+}
+
+// `autotune [model] [--host=URL] [--repeats=N] [--passes=N]`: searches
+// runtime options for the model's fastest profile on this host and stores
+// it in the per-model config that later sessions read. Returns the process
+// exit code.
+int runAutotune(const std::string& model, const std::string& base_url, unsigned repeats, unsigned passes) {
+    ClientResources resources = ClientResources::createDefault();
+    OllamaHttpBackend http(base_url, resources.pool, resources.single_flight, resources.limiter);
+    
+    std::cout << ColorUtils::colorize(" Checking Ollama connection...", ColorUtils::YELLOW) << std::endl;
+    if (!http.isAvailable()) {
+        std::cout << ColorUtils::colorize(" Cannot connect to Ollama at ", ColorUtils::RED) << http.getBaseUrl() << std::endl;
+        return 1;
+    }
+    std::string digest = http.getDigest(model);
+    if (digest.empty()) {
+        std::cout << ColorUtils::colorize(" Model not installed: ", ColorUtils::RED) << model << std::endl;
+        return 1;
+    }
+    
+    // Layer count for num_gpu candidates and context limit for num_ctx ones
+    uint64_t block_count = 0;
+    uint64_t context_length = 0;
+    if (const ModelInfo* info = resources.registry->lookup(model)) {
+        block_count = info->block_count;
+        context_length = info->context_length;
+    }
+    ModelCapabilities caps;
+    if (context_length == 0 && resources.capability_cache->find(digest, caps)) {
+        context_length = caps.context_length;
+    }
+    
+    AutoTuner::Settings settings;
+    settings.space = AutoTuner::defaultSpace(std::thread::hardware_concurrency(), block_count, context_length);
+    settings.repeats = std::max(1u, repeats);
+    settings.max_passes = std::max(1u, passes);
+    
+    auto describe = [&](const json& options) {
+        std::string text;
+        for (const auto& dimension : settings.space) {
+            if (!text.empty()) text += " ";
+            text += dimension.option + "=" +
+                    (options.contains(dimension.option) ? options[dimension.option].dump() : std::string("auto"));
+        }
+        return text;
+    };
+    
+    std::cout << ColorUtils::colorize(" Tuning ", ColorUtils::BOLD + ColorUtils::CYAN)
+             << ColorUtils::colorize(model, ColorUtils::BOLD + ColorUtils::GREEN)
+             << ColorUtils::colorize(" on " + http.getBaseUrl(), ColorUtils::BOLD + ColorUtils::CYAN) << std::endl;
+    std::cout << ColorUtils::colorize(" ~" + std::to_string(settings.prompt_tokens) + "-token prompts, " +
+                                      std::to_string(settings.predict_tokens) + "-token replies, " +
+                                      std::to_string(settings.repeats) + " measured runs per option set after a warm-up",
+                                      ColorUtils::CYAN) << std::endl;
+    
+    std::ostringstream rate;
+    rate.precision(1);
+    rate << std::fixed;
+    AutoTuner::Trial baseline;
+    bool first = true;
+    AutoTuner tuner(http, model, settings);
+    AutoTuner::Trial best;
+    try {
+        best = tuner.run([&](const AutoTuner::Trial& trial) {
+            if (first) {
+                baseline = trial;
+                first = false;
+            }
+            std::ostringstream line;
+            line.precision(1);
+            line << std::fixed;
+            if (trial.ok) {
+                line << trial.score << " tok/s per turn (prefill " << trial.prefill_rate << ", decode "
+                     << trial.decode_rate << " tok/s, load " << trial.load_s << " s";
+                if (trial.dropped > 0) line << ", " << trial.dropped << " runs dropped for reloads";
+                line << ")";
+            }
+            std::cout << "  " << describe(trial.options) << ": "
+                     << (trial.ok ? line.str() : ColorUtils::colorize("failed: " + trial.error, ColorUtils::RED))
+                     << std::endl;
+        });
+    } catch (const std::exception& e) {
+        std::cout << ColorUtils::colorize(" Tuning stopped: ", ColorUtils::RED) << e.what() << std::endl;
+        return 1;
+    }
+    
+    if (!best.ok) {
+        std::cout << ColorUtils::colorize(" No option set worked; nothing was saved", ColorUtils::RED) << std::endl;
+        return 1;
+    }
+    
+    rate << best.score << " tok/s per turn";
+    if (baseline.ok && baseline.score > 0) {
+        rate << ", " << std::showpos << 100 * (best.score / baseline.score - 1) << std::noshowpos
+             << "% against the starting point";
+    }
+    std::cout << ColorUtils::colorize(" Best after " + std::to_string(tuner.trialCount()) + " option sets: ",
+                                      ColorUtils::BOLD + ColorUtils::GREEN)
+             << describe(best.options) << " (" << rate.str() << ")" << std::endl;
+    AutoTuner::Trial fastest = tuner.fastest();
+    if (fastest.score > best.score) {
+        std::ostringstream note;
+        note.precision(1);
+        note << std::fixed << " Fastest measured: " << describe(fastest.options) << ", "
+             << 100 * (fastest.score / best.score - 1) << "% faster; within the noise margin or kept for a larger num_ctx";
+        std::cout << ColorUtils::colorize(note.str(), ColorUtils::CYAN) << std::endl;
+    }
+    
+    ModelProfiles::Profile profile;
+    profile.options = best.options;
+    profile.prefill_rate = best.prefill_rate;
+    profile.decode_rate = best.decode_rate;
+    profile.server = http.getBaseUrl();
+    std::time_t now = std::time(nullptr);
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    profile.tuned_at = stamp;
+    if (!resources.profiles->store(model, profile)) {
+        std::cout << ColorUtils::colorize(" Could not write ", ColorUtils::RED)
+                 << resources.profiles->getFile().string() << std::endl;
+        return 1;
+    }
+    std::cout << ColorUtils::colorize(" Saved to ", ColorUtils::CYAN) << resources.profiles->getFile().string() << std::endl;
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     // Initialize colors
     ColorUtils::initColors();
@@ -672,14 +3355,47 @@ int main(int argc, char* argv[]) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
     
     std::string model_name = "llama3.2"; // Default model
+    std::string backend_name = "ollama";
+    
+    uint64_t deadline_ms = 0;
     
-    // Get model name from command line argument
-    if (argc > 1) {
-        model_name = argv[1];
+    // `autotune [model] [--host=URL] [--repeats=N] [--passes=N]` runs the tuner instead of the REPL
+    if (argc > 1 && std::string(argv[1]) == "autotune") {
+        std::string host;
+        unsigned repeats = 2;
+        unsigned passes = 3;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--host=", 0) == 0) {
+                host = arg.substr(7);
+            } else if (arg.rfind("--repeats=", 0) == 0) {
+                repeats = static_cast<unsigned>(std::atoi(arg.c_str() + 10));
+            } else if (arg.rfind("--passes=", 0) == 0) {
+                passes = static_cast<unsigned>(std::atoi(arg.c_str() + 9));
+            } else {
+                model_name = arg;
+            }
+        }
+        int code = runAutotune(model_name, ollamaBaseUrl(host), repeats, passes);
+        curl_global_cleanup();
+        return code;
+    }
+    
+    // Get model name, --backend=<ollama|llama> and --deadline=<seconds> from command line arguments
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--backend=", 0) == 0) {
+            backend_name = arg.substr(10);
+        } else if (arg.rfind("--deadline=", 0) == 0) {
+            deadline_ms = static_cast<uint64_t>(std::atof(arg.c_str() + 11) * 1000);
+        } else {
+            model_name = arg;
+        }
     }
     
     try {
-        TerminalInterface terminal(model_name);
+        TerminalInterface terminal(model_name, backend_name);
+        terminal.setDeadline(deadline_ms);
         terminal.run();
     } catch (const std::exception& e) {
         std::cerr << ColorUtils::colorize(" Fatal error: ", ColorUtils::BOLD + ColorUtils::RED) 
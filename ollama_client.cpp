@@ -0,0 +1,260 @@
+// C interface over the engine in ollama_engine.hpp. See ollama_client.h for
+// the ownership and threading contract.
+
+#define OLLAMA_CLIENT_BUILD
+#include "ollama_client.h"
+#include "ollama_engine.hpp"
+
+struct ollama_client {
+    ClientResources resources;
+    std::shared_ptr<OllamaHttpBackend> backend;
+    std::unique_ptr<SessionManager> sessions;
+};
+
+struct ollama_session {
+    OllamaAssistant assistant;
+    std::string last_error;
+
+    ollama_session(const std::string& model, std::shared_ptr<InferenceBackend> backend, const ClientResources& resources)
+        : assistant(model, std::move(backend), resources) {}
+};
+
+namespace {
+
+char* copyString(const std::string& text) {
+    char* copy = static_cast<char*>(std::malloc(text.size() + 1));
+    if (copy) {
+        std::memcpy(copy, text.c_str(), text.size() + 1);
+    }
+    return copy;
+}
+
+ollama_status_t returnString(const std::string& text, char** out) {
+    *out = copyString(text);
+    return *out ? OLLAMA_OK : OLLAMA_INTERNAL;
+}
+
+// Error of the last failed ollama_client_* session call on this thread
+thread_local std::string thread_error;
+
+// Runs one turn through `send`, mapping engine exceptions to status codes
+template <typename Send>
+ollama_status_t runTurn(std::string& last_error, ollama_token_cb on_token, void* user_data, char** reply, Send&& send) {
+    last_error.clear();
+
+    bool cancelled = false;
+    TokenCallback callback;
+    if (on_token) {
+        callback = [&](std::string_view delta) {
+            cancelled = on_token(delta.data(), delta.size(), user_data) != 0;
+            return !cancelled;
+        };
+    }
+
+    try {
+        std::string text = send(callback);
+        if (reply && returnString(text, reply) != OLLAMA_OK) return OLLAMA_INTERNAL;
+        return cancelled ? OLLAMA_CANCELLED : OLLAMA_OK;
+    } catch (const ConnectionError& e) {
+        last_error = e.what();
+        return OLLAMA_CONNECTION;
+    } catch (const std::runtime_error& e) {
+        last_error = e.what();
+        return OLLAMA_REQUEST;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+        return OLLAMA_INTERNAL;
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+int ollama_abi_version(void) {
+    return OLLAMA_CLIENT_ABI_VERSION;
+}
+
+ollama_status_t ollama_global_init(void) {
+    return curl_global_init(CURL_GLOBAL_DEFAULT) == CURLE_OK ? OLLAMA_OK : OLLAMA_INTERNAL;
+}
+
+void ollama_global_cleanup(void) {
+    curl_global_cleanup();
+}
+
+ollama_client_t* ollama_client_create(const char* base_url) {
+    try {
+        auto client = std::make_unique<ollama_client>();
+        client->resources = ClientResources::createDefault();
+        client->backend = std::make_shared<OllamaHttpBackend>(base_url ? base_url : "http://localhost:11434",
+                                                              client->resources.pool,
+                                                              client->resources.single_flight,
+                                                              client->resources.limiter);
+        client->sessions = std::make_unique<SessionManager>(client->backend, client->resources);
+        client->backend->startHealthMonitor();
+        return client.release();
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+void ollama_client_destroy(ollama_client_t* client) {
+    delete client;
+}
+
+int ollama_client_is_available(ollama_client_t* client) {
+    if (!client) return 0;
+    HealthMonitor::Snapshot health = client->backend->getHealth()->snapshot();
+    return (health.probed ? health.up : client->backend->isAvailable()) ? 1 : 0;
+}
+
+ollama_status_t ollama_client_list_models(ollama_client_t* client, char** models_json) {
+    if (!client || !models_json) return OLLAMA_INVALID_ARGUMENT;
+    try {
+        return returnString(json(client->backend->listModels()).dump(), models_json);
+    } catch (const std::exception&) {
+        return OLLAMA_INTERNAL;
+    }
+}
+
+ollama_status_t ollama_client_stats_json(ollama_client_t* client, char** stats_json) {
+    if (!client || !stats_json) return OLLAMA_INVALID_ARGUMENT;
+    try {
+        json stats = {
+            {"connections", client->resources.pool->statsJson()},
+            {"coalescing", client->resources.single_flight->statsJson()},
+            {"timeouts", client->backend->timeoutStatsJson()},
+            {"concurrency", client->resources.limiter->statsJson()},
+            {"health", client->backend->getHealth()->toJson()},
+            {"sessions", client->sessions->statsJson()},
+            {"chat", client->backend->getChatStats().toJson()},
+            {"generate", client->backend->getGenerateStats().toJson()},
+            {"memory", MemoryAccounting::statsJson()}
+        };
+        return returnString(stats.dump(), stats_json);
+    } catch (const std::exception&) {
+        return OLLAMA_INTERNAL;
+    }
+}
+
+void ollama_free(void* ptr) {
+    std::free(ptr);
+}
+
+ollama_status_t ollama_client_open_session(ollama_client_t* client, const char* session_id, const char* model,
+                                           const char* system_prompt) {
+    if (!client || !session_id || !model) return OLLAMA_INVALID_ARGUMENT;
+    thread_error.clear();
+    try {
+        if (!client->sessions->create(session_id, model, system_prompt ? system_prompt : "")) {
+            thread_error = std::string("Session already exists: ") + session_id;
+            return OLLAMA_INVALID_ARGUMENT;
+        }
+        return OLLAMA_OK;
+    } catch (const std::exception& e) {
+        thread_error = e.what();
+        return OLLAMA_INTERNAL;
+    }
+}
+
+ollama_status_t ollama_client_send(ollama_client_t* client, const char* session_id, const char* message,
+                                   ollama_token_cb on_token, void* user_data, char** reply) {
+    if (!client || !session_id || !message) return OLLAMA_INVALID_ARGUMENT;
+    if (!client->sessions->contains(session_id)) {
+        thread_error = std::string("No such session: ") + session_id;
+        return OLLAMA_INVALID_ARGUMENT;
+    }
+    return runTurn(thread_error, on_token, user_data, reply, [&](const TokenCallback& callback) {
+        return client->sessions->send(session_id, message, callback);
+    });
+}
+
+ollama_status_t ollama_client_close_session(ollama_client_t* client, const char* session_id) {
+    if (!client || !session_id) return OLLAMA_INVALID_ARGUMENT;
+    return client->sessions->remove(session_id) ? OLLAMA_OK : OLLAMA_INVALID_ARGUMENT;
+}
+
+void ollama_client_set_memory_ceiling(ollama_client_t* client, size_t bytes) {
+    if (client) {
+        client->sessions->setMemoryCeiling(bytes);
+    }
+}
+
+size_t ollama_client_hibernate_idle(ollama_client_t* client, unsigned int idle_ms) {
+    return client ? client->sessions->hibernateIdle(std::chrono::milliseconds(idle_ms)) : 0;
+}
+
+const char* ollama_last_error(void) {
+    return thread_error.c_str();
+}
+
+ollama_session_t* ollama_session_create(ollama_client_t* client, const char* model, const char* system_prompt) {
+    if (!client || !model) return nullptr;
+    try {
+        auto session = std::make_unique<ollama_session>(model, client->backend, client->resources);
+        if (system_prompt) {
+            session->assistant.setSystemPrompt(system_prompt);
+        }
+        return session.release();
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+void ollama_session_destroy(ollama_session_t* session) {
+    delete session;
+}
+
+ollama_status_t ollama_session_send(ollama_session_t* session, const char* message,
+                                    ollama_token_cb on_token, void* user_data, char** reply) {
+    if (!session || !message) return OLLAMA_INVALID_ARGUMENT;
+    return runTurn(session->last_error, on_token, user_data, reply, [&](const TokenCallback& callback) {
+        return session->assistant.sendMessage(message, callback);
+    });
+}
+
+ollama_status_t ollama_session_send_within(ollama_session_t* session, const char* message, unsigned int deadline_ms,
+                                          ollama_token_cb on_token, void* user_data, char** reply) {
+    if (!session || !message) return OLLAMA_INVALID_ARGUMENT;
+    return runTurn(session->last_error, on_token, user_data, reply, [&](const TokenCallback& callback) {
+        return session->assistant.sendMessage(message, callback, deadline_ms);
+    });
+}
+
+ollama_status_t ollama_session_set_model(ollama_session_t* session, const char* model) {
+    if (!session || !model) return OLLAMA_INVALID_ARGUMENT;
+    session->last_error.clear();
+    try {
+        session->assistant.setModel(model);
+        return OLLAMA_OK;
+    } catch (const std::exception& e) {
+        session->last_error = e.what();
+        return OLLAMA_INTERNAL;
+    }
+}
+
+void ollama_session_clear(ollama_session_t* session) {
+    if (session) {
+        session->assistant.clearConversation();
+    }
+}
+
+size_t ollama_session_length(const ollama_session_t* session) {
+    return session ? session->assistant.getConversationLength() : 0;
+}
+
+ollama_status_t ollama_session_history_json(const ollama_session_t* session, char** history_json) {
+    if (!session || !history_json) return OLLAMA_INVALID_ARGUMENT;
+    try {
+        return returnString(json(session->assistant.getConversation().materialize()).dump(), history_json);
+    } catch (const std::exception&) {
+        return OLLAMA_INTERNAL;
+    }
+}
+
+const char* ollama_session_last_error(const ollama_session_t* session) {
+    return session ? session->last_error.c_str() : "";
+}
+
+} // extern "C"
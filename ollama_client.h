@@ -0,0 +1,148 @@
+/*
+ * ollama_client.h - C interface to the Ollama terminal assistant engine
+ *
+ * Lets other programs (C, C++, or anything with a C FFI) embed the same
+ * conversation engine the terminal client uses, in-process.
+ *
+ * Threading contract:
+ *   - Call ollama_global_init() once before creating any client, and
+ *     ollama_global_cleanup() once after the last one is destroyed.
+ *   - An ollama_client_t is thread-safe and meant to be shared: it owns the
+ *     connection pool and model metadata caches used by all its sessions.
+ *   - An ollama_session_t is one conversation. A session must only be used
+ *     by one thread at a time; different sessions may run concurrently.
+ *   - Token callbacks run synchronously on the thread that called
+ *     ollama_session_send(). Returning nonzero cancels the request.
+ *   - Destroy every session before the client that created it.
+ *
+ * Sessions can also be kept by the client under string ids
+ * (ollama_client_open_session / ollama_client_send). These calls are
+ * thread-safe: turns on one id run one at a time, different ids run in
+ * parallel, and idle sessions are moved to a spill file on disk until their
+ * next turn.
+ *
+ * Strings returned through char** are heap-allocated and must be released
+ * with ollama_free(). Strings returned as const char* are owned by the
+ * library and stay valid until the next call on the same object.
+ */
+
+#ifndef OLLAMA_CLIENT_H
+#define OLLAMA_CLIENT_H
+
+#include <stddef.h>
+
+#define OLLAMA_CLIENT_ABI_VERSION 1
+
+#if defined(_WIN32)
+#  ifdef OLLAMA_CLIENT_BUILD
+#    define OLLAMA_API __declspec(dllexport)
+#  else
+#    define OLLAMA_API __declspec(dllimport)
+#  endif
+#else
+#  define OLLAMA_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ollama_client ollama_client_t;
+typedef struct ollama_session ollama_session_t;
+
+typedef enum {
+    OLLAMA_OK = 0,
+    OLLAMA_INVALID_ARGUMENT = 1,
+    OLLAMA_CONNECTION = 2,   /* Server unreachable */
+    OLLAMA_REQUEST = 3,      /* Server answered with an error */
+    OLLAMA_CANCELLED = 4,    /* Token callback asked to stop */
+    OLLAMA_INTERNAL = 5
+} ollama_status_t;
+
+/* Receives each piece of the reply as it streams in. Return 0 to continue,
+ * nonzero to cancel. */
+typedef int (*ollama_token_cb)(const char* delta, size_t length, void* user_data);
+
+/* ABI version the library was built with; compare to OLLAMA_CLIENT_ABI_VERSION */
+OLLAMA_API int ollama_abi_version(void);
+
+OLLAMA_API ollama_status_t ollama_global_init(void);
+OLLAMA_API void ollama_global_cleanup(void);
+
+/* base_url may be NULL for http://localhost:11434 */
+OLLAMA_API ollama_client_t* ollama_client_create(const char* base_url);
+OLLAMA_API void ollama_client_destroy(ollama_client_t* client);
+
+/* Nonzero if the server answers. Clients probe their server in the
+ * background (GET /api/version every 5 s, every second while it is down), so
+ * this normally returns the last probe's result without waiting; requests
+ * fail at once while the server is known to be down. */
+OLLAMA_API int ollama_client_is_available(ollama_client_t* client);
+
+/* JSON array of installed model names */
+OLLAMA_API ollama_status_t ollama_client_list_models(ollama_client_t* client, char** models_json);
+
+/* JSON object with connection pool, coalescing, timeout, concurrency limit,
+ * server health, session, request and memory statistics. Per-subsystem memory
+ * counts stay zero unless the host program installs allocation hooks (see
+ * allocation_tracking.hpp). */
+OLLAMA_API ollama_status_t ollama_client_stats_json(ollama_client_t* client, char** stats_json);
+
+OLLAMA_API void ollama_free(void* ptr);
+
+/* Client-managed sessions, addressed by id. system_prompt may be NULL.
+ * Failures set ollama_last_error() for the calling thread. */
+OLLAMA_API ollama_status_t ollama_client_open_session(ollama_client_t* client, const char* session_id,
+                                                      const char* model, const char* system_prompt);
+OLLAMA_API ollama_status_t ollama_client_send(ollama_client_t* client, const char* session_id, const char* message,
+                                              ollama_token_cb on_token, void* user_data, char** reply);
+OLLAMA_API ollama_status_t ollama_client_close_session(ollama_client_t* client, const char* session_id);
+
+/* Moves sessions idle for at least idle_ms to disk now (this also happens
+ * on its own after five minutes). Returns how many were moved. */
+OLLAMA_API size_t ollama_client_hibernate_idle(ollama_client_t* client, unsigned int idle_ms);
+
+/* Past this process RSS, least recently used client sessions are moved to
+ * disk after each turn, and within a second while no turns run. 0 (the
+ * default) means no ceiling. */
+OLLAMA_API void ollama_client_set_memory_ceiling(ollama_client_t* client, size_t bytes);
+
+/* Message for the last failed ollama_client_* session call on this thread, or "" */
+OLLAMA_API const char* ollama_last_error(void);
+
+/* system_prompt may be NULL for the default one */
+OLLAMA_API ollama_session_t* ollama_session_create(ollama_client_t* client, const char* model,
+                                                   const char* system_prompt);
+OLLAMA_API void ollama_session_destroy(ollama_session_t* session);
+
+/* Sends a user message. on_token may be NULL; reply may be NULL if the
+ * caller only wants the streamed pieces. A cancelled reply is kept in the
+ * history as far as it got. */
+OLLAMA_API ollama_status_t ollama_session_send(ollama_session_t* session, const char* message,
+                                               ollama_token_cb on_token, void* user_data, char** reply);
+
+/* Like ollama_session_send, with a latency budget: num_predict is sized from
+ * the measured throughput of the model so the reply finishes within
+ * deadline_ms, and a reply still running then is cut there. 0 means no
+ * deadline. */
+OLLAMA_API ollama_status_t ollama_session_send_within(ollama_session_t* session, const char* message,
+                                                      unsigned int deadline_ms, ollama_token_cb on_token,
+                                                      void* user_data, char** reply);
+
+OLLAMA_API ollama_status_t ollama_session_set_model(ollama_session_t* session, const char* model);
+OLLAMA_API void ollama_session_clear(ollama_session_t* session);
+
+/* Number of user and assistant messages, excluding the system prompt */
+OLLAMA_API size_t ollama_session_length(const ollama_session_t* session);
+
+/* JSON array of {role, content} messages, including the system prompt */
+OLLAMA_API ollama_status_t ollama_session_history_json(const ollama_session_t* session, char** history_json);
+
+/* Message for the last failed call on this session, or "" */
+OLLAMA_API const char* ollama_session_last_error(const ollama_session_t* session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OLLAMA_CLIENT_H */
@@ -0,0 +1,6529 @@
+// Engine side of the Ollama terminal assistant: model metadata, capability
+// caches, connection pooling, inference backends and conversation state.
+// Everything here is header-only and UI-free; the REPL in main.cpp and the
+// C ABI in ollama_client.cpp are both consumers.
+#ifndef OLLAMA_ENGINE_HPP
+#define OLLAMA_ENGINE_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <curl/curl.h>
+#include <nlohmann/json.hpp>
+#ifdef OLLAMA_WITH_LLAMA_CPP
+#include <llama.h>
+#endif
+#ifdef OLLAMA_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <exception>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <cctype>
+#include <filesystem>
+#include <string_view>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using json = nlohmann::json;
+
+// Live bytes and allocation counts per subsystem. Counting needs global
+// operator new/delete hooks that call recordAllocation/recordFree (main.cpp
+// installs them); without hooks everything stays zero and isTracking() is
+// false. An allocation is charged to the innermost MemoryScope on the
+// allocating thread, and its free to the same subsystem. Only C++ heap
+// allocations are seen; libcurl's own malloc use is not.
+class MemoryAccounting {
+public:
+    enum Subsystem : uint8_t { OTHER, CONVERSATION, REQUEST, CACHES, INDICES, RENDERER, SUBSYSTEM_COUNT };
+    
+    struct Snapshot {
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        uint64_t allocated_bytes = 0;
+        uint64_t live_bytes = 0;
+    };
+    
+private:
+    // Threads are spread over stripes so the hooks rarely share a cache
+    // line; totals are summed on read. A stripe's live_bytes may wrap when
+    // a block is freed on another thread, but the sum stays exact.
+    static constexpr size_t STRIPES = 16;
+    
+    // Only ever has static storage, so zero-initialized
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> frees;
+        std::atomic<uint64_t> allocated_bytes;
+        std::atomic<uint64_t> live_bytes;
+    };
+    
+    static inline Counters counters[STRIPES][SUBSYSTEM_COUNT];
+    static inline std::atomic<size_t> next_stripe{0};
+    static inline std::atomic<bool> tracking{false};
+    static inline thread_local Subsystem current_subsystem = OTHER;
+    static inline thread_local uint64_t thread_allocations = 0;
+    static inline thread_local size_t thread_stripe = STRIPES;  // Assigned on first use
+    
+    static Counters& countersFor(Subsystem subsystem) {
+        if (thread_stripe == STRIPES) {
+            thread_stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+        }
+        return counters[thread_stripe][subsystem];
+    }
+    
+public:
+    static const char* name(Subsystem subsystem) {
+        static const char* const names[SUBSYSTEM_COUNT] = {
+            "other", "conversation", "request_buffers", "caches", "indices", "renderer"
+        };
+        return subsystem < SUBSYSTEM_COUNT ? names[subsystem] : "other";
+    }
+    
+    static Subsystem current() {
+        return current_subsystem;
+    }
+    
+    static void setCurrent(Subsystem subsystem) {
+        current_subsystem = subsystem;
+    }
+    
+    // Called from the allocation hooks; must not allocate
+    static void recordAllocation(Subsystem subsystem, size_t bytes) {
+        Counters& c = countersFor(subsystem);
+        c.allocations.fetch_add(1, std::memory_order_relaxed);
+        c.allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        c.live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        ++thread_allocations;
+    }
+    
+    static void recordFree(Subsystem subsystem, size_t bytes) {
+        Counters& c = countersFor(subsystem);
+        c.frees.fetch_add(1, std::memory_order_relaxed);
+        c.live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    
+    static void setTracking(bool enabled) {
+        tracking = enabled;
+    }
+    
+    static bool isTracking() {
+        return tracking.load();
+    }
+    
+    // Allocations made so far by the calling thread, in any subsystem
+    static uint64_t threadAllocations() {
+        return thread_allocations;
+    }
+    
+    static Snapshot snapshot(Subsystem subsystem) {
+        Snapshot s;
+        for (const auto& stripe : counters) {
+            const Counters& c = stripe[subsystem];
+            s.allocations += c.allocations.load(std::memory_order_relaxed);
+            s.frees += c.frees.load(std::memory_order_relaxed);
+            s.allocated_bytes += c.allocated_bytes.load(std::memory_order_relaxed);
+            s.live_bytes += c.live_bytes.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+    
+    static json statsJson() {
+        json subsystems = json::object();
+        for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+            Snapshot s = snapshot(static_cast<Subsystem>(i));
+            subsystems[name(static_cast<Subsystem>(i))] = {
+                {"live_bytes", s.live_bytes},
+                {"allocations", s.allocations},
+                {"frees", s.frees},
+                {"allocated_bytes", s.allocated_bytes}
+            };
+        }
+        return {{"tracking", isTracking()}, {"subsystems", subsystems}};
+    }
+};
+
+// Charges this thread's allocations to `subsystem` until destroyed
+class MemoryScope {
+private:
+    MemoryAccounting::Subsystem previous;
+    
+public:
+    explicit MemoryScope(MemoryAccounting::Subsystem subsystem) : previous(MemoryAccounting::current()) {
+        MemoryAccounting::setCurrent(subsystem);
+    }
+    
+    ~MemoryScope() {
+        MemoryAccounting::setCurrent(previous);
+    }
+    
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+};
+
+// Read-only memory-mapped view of a GGUF model file. Only the header, the
+// key/value metadata and the tensor inventory are touched; the weights that
+// follow them are never paged in.
+class GGUFFile {
+public:
+    enum class ValueType : uint32_t {
+        UINT8 = 0, INT8 = 1, UINT16 = 2, INT16 = 3, UINT32 = 4, INT32 = 5,
+        FLOAT32 = 6, BOOL = 7, STRING = 8, ARRAY = 9, UINT64 = 10, INT64 = 11, FLOAT64 = 12
+    };
+    
+    // A metadata value as it sits in the mapping. Nothing is decoded until
+    // one of the accessors is called.
+    struct Value {
+        ValueType type = ValueType::UINT8;
+        ValueType array_type = ValueType::UINT8;
+        uint64_t array_count = 0;
+        const uint8_t* data = nullptr;  // Payload (array items start here)
+    };
+    
+    struct TensorInfo {
+        std::string_view name;
+        uint32_t n_dims = 0;
+        uint64_t dims[4] = {1, 1, 1, 1};
+        uint32_t type = 0;
+        uint64_t offset = 0;
+        
+        uint64_t elements() const {
+            return dims[0] * dims[1] * dims[2] * dims[3];
+        }
+    };
+    
+private:
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = nullptr;
+#endif
+    uint32_t version = 0;
+    uint64_t data_offset = 0;
+    std::map<std::string_view, Value> metadata;
+    std::vector<TensorInfo> tensors;
+    
+    // Bounds-checked cursor over the mapping
+    struct Cursor {
+        const uint8_t* pos;
+        const uint8_t* end;
+        
+        void need(uint64_t n) const {
+            if (n > static_cast<uint64_t>(end - pos)) {
+                throw std::runtime_error("GGUF file is truncated or corrupt");
+            }
+        }
+        
+        template <typename T>
+        T read() {
+            need(sizeof(T));
+            T value;
+            std::memcpy(&value, pos, sizeof(T));
+            pos += sizeof(T);
+            return value;
+        }
+        
+        std::string_view readString() {
+            uint64_t length = read<uint64_t>();
+            need(length);
+            std::string_view s(reinterpret_cast<const char*>(pos), static_cast<size_t>(length));
+            pos += length;
+            return s;
+        }
+    };
+    
+    static size_t scalarSize(ValueType type) {
+        switch (type) {
+            case ValueType::UINT8: case ValueType::INT8: case ValueType::BOOL: return 1;
+            case ValueType::UINT16: case ValueType::INT16: return 2;
+            case ValueType::UINT32: case ValueType::INT32: case ValueType::FLOAT32: return 4;
+            case ValueType::UINT64: case ValueType::INT64: case ValueType::FLOAT64: return 8;
+            default: return 0;
+        }
+    }
+    
+    static void skipValue(Cursor& cursor, ValueType type) {
+        if (type == ValueType::STRING) {
+            cursor.readString();
+            return;
+        }
+        if (type == ValueType::ARRAY) {
+            ValueType item_type = static_cast<ValueType>(cursor.read<uint32_t>());
+            uint64_t count = cursor.read<uint64_t>();
+            skipArrayItems(cursor, item_type, count);
+            return;
+        }
+        size_t n = scalarSize(type);
+        if (n == 0) {
+            throw std::runtime_error("GGUF metadata has unknown value type " + std::to_string(static_cast<uint32_t>(type)));
+        }
+        cursor.need(n);
+        cursor.pos += n;
+    }
+    
+    static void skipArrayItems(Cursor& cursor, ValueType item_type, uint64_t count) {
+        size_t n = scalarSize(item_type);
+        if (n != 0) {
+            // Fixed-size items are skipped in one step
+            if (count > static_cast<uint64_t>(cursor.end - cursor.pos) / n) {
+                throw std::runtime_error("GGUF file is truncated or corrupt");
+            }
+            cursor.pos += count * n;
+            return;
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            skipValue(cursor, item_type);
+        }
+    }
+    
+    void mapFile(const std::string& path) {
+#ifdef _WIN32
+        file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Cannot open model file: " + path);
+        }
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_handle, &file_size);
+        size = static_cast<size_t>(file_size.QuadPart);
+        mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_handle) {
+            throw std::runtime_error("Cannot map model file: " + path);
+        }
+        base = static_cast<const uint8_t*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+        if (!base) {
+            throw std::runtime_error("Cannot map model file: " + path);
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open model file: " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat model file: " + path);
+        }
+        size = static_cast<size_t>(st.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Cannot map model file: " + path);
+        }
+        base = static_cast<const uint8_t*>(mapped);
+#endif
+    }
+    
+    void unmapFile() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping_handle) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+#else
+        if (base) munmap(const_cast<uint8_t*>(base), size);
+#endif
+        base = nullptr;
+    }
+    
+    void parseHeader() {
+        Cursor cursor{base, base + size};
+        cursor.need(4);
+        if (std::memcmp(cursor.pos, "GGUF", 4) != 0) {
+            throw std::runtime_error("Not a GGUF file");
+        }
+        cursor.pos += 4;
+        
+        version = cursor.read<uint32_t>();
+        if (version < 2 || version > 3) {
+            throw std::runtime_error("Unsupported GGUF version " + std::to_string(version));
+        }
+        
+        uint64_t tensor_count = cursor.read<uint64_t>();
+        uint64_t kv_count = cursor.read<uint64_t>();
+        
+        for (uint64_t i = 0; i < kv_count; ++i) {
+            std::string_view key = cursor.readString();
+            Value value;
+            value.type = static_cast<ValueType>(cursor.read<uint32_t>());
+            if (value.type == ValueType::ARRAY) {
+                value.array_type = static_cast<ValueType>(cursor.read<uint32_t>());
+                value.array_count = cursor.read<uint64_t>();
+                value.data = cursor.pos;
+                skipArrayItems(cursor, value.array_type, value.array_count);
+            } else {
+                value.data = cursor.pos;
+                skipValue(cursor, value.type);
+            }
+            metadata[key] = value;
+        }
+        
+        // Every tensor needs at least a name length, n_dims, type and offset
+        if (tensor_count > static_cast<uint64_t>(cursor.end - cursor.pos) / 24) {
+            throw std::runtime_error("GGUF file is truncated or corrupt");
+        }
+        tensors.reserve(static_cast<size_t>(tensor_count));
+        for (uint64_t i = 0; i < tensor_count; ++i) {
+            TensorInfo info;
+            info.name = cursor.readString();
+            info.n_dims = cursor.read<uint32_t>();
+            if (info.n_dims > 4) {
+                throw std::runtime_error("GGUF tensor has too many dimensions");
+            }
+            for (uint32_t d = 0; d < info.n_dims; ++d) {
+                info.dims[d] = cursor.read<uint64_t>();
+            }
+            info.type = cursor.read<uint32_t>();
+            info.offset = cursor.read<uint64_t>();
+            tensors.push_back(info);
+        }
+        
+        uint64_t alignment = getUInt("general.alignment", 32);
+        if (alignment == 0) alignment = 32;
+        uint64_t header_end = static_cast<uint64_t>(cursor.pos - base);
+        data_offset = (header_end + alignment - 1) / alignment * alignment;
+    }
+    
+public:
+    explicit GGUFFile(const std::string& path) {
+        mapFile(path);
+        try {
+            parseHeader();
+        } catch (...) {
+            unmapFile();
+            throw;
+        }
+    }
+    
+    ~GGUFFile() {
+        unmapFile();
+    }
+    
+    GGUFFile(const GGUFFile&) = delete;
+    GGUFFile& operator=(const GGUFFile&) = delete;
+    
+    uint32_t getVersion() const { return version; }
+    size_t fileSize() const { return size; }
+    uint64_t dataOffset() const { return data_offset; }
+    const std::vector<TensorInfo>& getTensors() const { return tensors; }
+    const std::map<std::string_view, Value>& getMetadata() const { return metadata; }
+    
+    bool has(std::string_view key) const {
+        return metadata.find(key) != metadata.end();
+    }
+    
+    uint64_t getUInt(std::string_view key, uint64_t fallback = 0) const {
+        auto it = metadata.find(key);
+        if (it == metadata.end()) return fallback;
+        const Value& v = it->second;
+        switch (v.type) {
+            case ValueType::UINT8: case ValueType::BOOL: return *v.data;
+            case ValueType::INT8: { int8_t x; std::memcpy(&x, v.data, 1); return x < 0 ? fallback : x; }
+            case ValueType::UINT16: { uint16_t x; std::memcpy(&x, v.data, 2); return x; }
+            case ValueType::INT16: { int16_t x; std::memcpy(&x, v.data, 2); return x < 0 ? fallback : x; }
+            case ValueType::UINT32: { uint32_t x; std::memcpy(&x, v.data, 4); return x; }
+            case ValueType::INT32: { int32_t x; std::memcpy(&x, v.data, 4); return x < 0 ? fallback : x; }
+            case ValueType::UINT64: { uint64_t x; std::memcpy(&x, v.data, 8); return x; }
+            case ValueType::INT64: { int64_t x; std::memcpy(&x, v.data, 8); return x < 0 ? fallback : x; }
+            default: return fallback;
+        }
+    }
+    
+    std::string_view getString(std::string_view key, std::string_view fallback = {}) const {
+        auto it = metadata.find(key);
+        if (it == metadata.end() || it->second.type != ValueType::STRING) return fallback;
+        Cursor cursor{it->second.data, base + size};
+        return cursor.readString();
+    }
+    
+    // Views into a string array (e.g. tokenizer.ggml.tokens). The views stay
+    // valid for the lifetime of this object.
+    std::vector<std::string_view> getStringArray(std::string_view key) const {
+        std::vector<std::string_view> items;
+        auto it = metadata.find(key);
+        if (it == metadata.end() || it->second.type != ValueType::ARRAY ||
+            it->second.array_type != ValueType::STRING) {
+            return items;
+        }
+        items.reserve(static_cast<size_t>(it->second.array_count));
+        Cursor cursor{it->second.data, base + size};
+        for (uint64_t i = 0; i < it->second.array_count; ++i) {
+            items.push_back(cursor.readString());
+        }
+        return items;
+    }
+    
+    uint64_t getArrayLength(std::string_view key) const {
+        auto it = metadata.find(key);
+        if (it == metadata.end() || it->second.type != ValueType::ARRAY) return 0;
+        return it->second.array_count;
+    }
+};
+
+// Locates model blobs through Ollama's on-disk manifests, so GGUF headers can
+// be read without asking the server.
+class OllamaModelStore {
+private:
+    std::filesystem::path models_dir;
+    
+    static constexpr const char* DEFAULT_REGISTRY = "registry.ollama.ai";
+    static constexpr const char* DEFAULT_NAMESPACE = "library";
+    static constexpr const char* MODEL_MEDIA_TYPE = "application/vnd.ollama.image.model";
+    
+    static std::filesystem::path findModelsDir() {
+        if (const char* env = std::getenv("OLLAMA_MODELS")) {
+            if (*env) return std::filesystem::path(env);
+        }
+#ifdef _WIN32
+        const char* home = std::getenv("USERPROFILE");
+#else
+        const char* home = std::getenv("HOME");
+#endif
+        std::filesystem::path user_dir = home ? std::filesystem::path(home) / ".ollama" / "models" : std::filesystem::path();
+        std::error_code ec;
+        if (!user_dir.empty() && std::filesystem::exists(user_dir / "manifests", ec)) {
+            return user_dir;
+        }
+#ifndef _WIN32
+        // Default location of the Linux systemd service
+        std::filesystem::path service_dir("/usr/share/ollama/.ollama/models");
+        if (std::filesystem::exists(service_dir / "manifests", ec)) {
+            return service_dir;
+        }
+#endif
+        return user_dir;
+    }
+    
+public:
+    OllamaModelStore() : models_dir(findModelsDir()) {}
+    explicit OllamaModelStore(const std::filesystem::path& dir) : models_dir(dir) {}
+    
+    const std::filesystem::path& getModelsDir() const {
+        return models_dir;
+    }
+    
+    // "llama3.2" -> manifests/registry.ollama.ai/library/llama3.2/latest
+    std::filesystem::path manifestPath(const std::string& model) const {
+        std::string name = model;
+        std::string tag = "latest";
+        size_t slash = name.rfind('/');
+        size_t colon = name.rfind(':');
+        if (colon != std::string::npos && (slash == std::string::npos || colon > slash)) {
+            tag = name.substr(colon + 1);
+            name = name.substr(0, colon);
+        }
+        
+        std::vector<std::string> parts;
+        std::stringstream ss(name);
+        std::string part;
+        while (std::getline(ss, part, '/')) {
+            parts.push_back(part);
+        }
+        if (parts.size() == 1) {
+            parts.insert(parts.begin(), {DEFAULT_REGISTRY, DEFAULT_NAMESPACE});
+        } else if (parts.size() == 2) {
+            parts.insert(parts.begin(), DEFAULT_REGISTRY);
+        }
+        
+        std::filesystem::path path = models_dir / "manifests";
+        for (const auto& p : parts) {
+            path /= p;
+        }
+        return path / tag;
+    }
+    
+    // Path of the GGUF weights blob for a model, or an empty path if the
+    // model is not installed locally.
+    std::filesystem::path findModelBlob(const std::string& model) const {
+        std::ifstream manifest_file(manifestPath(model));
+        if (!manifest_file) return {};
+        
+        try {
+            json manifest = json::parse(manifest_file);
+            for (const auto& layer : manifest.value("layers", json::array())) {
+                if (layer.value("mediaType", "") != MODEL_MEDIA_TYPE) continue;
+                std::string digest = layer.value("digest", "");
+                size_t sep = digest.find(':');
+                if (sep != std::string::npos) {
+                    digest[sep] = '-';
+                }
+                return models_dir / "blobs" / digest;
+            }
+        } catch (const json::exception&) {
+            // Unreadable manifest: treat the model as not installed
+        }
+        return {};
+    }
+    
+    // Names of all locally installed models, spelled the way `ollama list` does
+    std::vector<std::string> listInstalled() const {
+        std::vector<std::string> names;
+        std::filesystem::path root = models_dir / "manifests";
+        std::error_code ec;
+        if (!std::filesystem::is_directory(root, ec)) return names;
+        
+        for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
+             it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (ec) break;
+            if (!it->is_regular_file(ec) || it.depth() != 3) continue;
+            
+            std::filesystem::path rel = std::filesystem::relative(it->path(), root, ec);
+            std::vector<std::string> parts;
+            for (const auto& p : rel) {
+                parts.push_back(p.string());
+            }
+            if (parts.size() != 4) continue;
+            
+            std::string name;
+            if (parts[0] != DEFAULT_REGISTRY) {
+                name = parts[0] + "/" + parts[1] + "/";
+            } else if (parts[1] != DEFAULT_NAMESPACE) {
+                name = parts[1] + "/";
+            }
+            names.push_back(name + parts[2] + ":" + parts[3]);
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+};
+
+// Capabilities of an installed model, read from its GGUF header
+struct ModelInfo {
+    std::string name;
+    std::string blob_path;
+    std::string architecture;
+    std::string quantization;
+    std::string chat_template;
+    std::string tokenizer_model;
+    uint64_t context_length = 0;
+    uint64_t parameter_count = 0;
+    uint64_t weights_bytes = 0;
+    uint64_t block_count = 0;
+    uint64_t embedding_length = 0;
+    uint64_t head_count = 0;
+    uint64_t head_count_kv = 0;
+    uint64_t kv_bytes_per_token = 0;  // f16 K+V cache across all layers
+    uint64_t vocab_size = 0;
+    size_t tensor_count = 0;
+    
+    // Resident memory needed to run the model with a given context size
+    uint64_t estimateMemoryBytes(uint64_t num_ctx) const {
+        uint64_t kv = kv_bytes_per_token * num_ctx;
+        // Compute buffers and runtime overhead, roughly 10% of the weights
+        return weights_bytes + kv + weights_bytes / 10;
+    }
+};
+
+// Tokenizer vocabulary backed by the mapped model file
+struct ModelVocabulary {
+    std::shared_ptr<GGUFFile> file;
+    std::vector<std::string_view> tokens;
+};
+
+// Thread-safe. Entries are never evicted, so returned pointers stay valid for
+// the registry's lifetime.
+class ModelRegistry {
+private:
+    OllamaModelStore store;
+    std::map<std::string, ModelInfo> models;
+    double last_scan_ms = 0.0;
+    std::recursive_mutex mutex;
+    
+    static std::string fileTypeName(uint64_t file_type) {
+        static const std::map<uint64_t, const char*> names = {
+            {0, "F32"}, {1, "F16"}, {2, "Q4_0"}, {3, "Q4_1"}, {7, "Q8_0"}, {8, "Q5_0"},
+            {9, "Q5_1"}, {10, "Q2_K"}, {11, "Q3_K_S"}, {12, "Q3_K_M"}, {13, "Q3_K_L"},
+            {14, "Q4_K_S"}, {15, "Q4_K_M"}, {16, "Q5_K_S"}, {17, "Q5_K_M"}, {18, "Q6_K"},
+            {19, "IQ2_XXS"}, {20, "IQ2_XS"}, {21, "Q2_K_S"}, {22, "IQ3_XS"}, {23, "IQ3_XXS"},
+            {24, "IQ1_S"}, {25, "IQ4_NL"}, {26, "IQ3_S"}, {27, "IQ3_M"}, {28, "IQ2_S"},
+            {29, "IQ2_M"}, {30, "IQ4_XS"}, {31, "IQ1_M"}, {32, "BF16"}, {36, "TQ1_0"}, {37, "TQ2_0"}
+        };
+        auto it = names.find(file_type);
+        return it != names.end() ? it->second : "unknown";
+    }
+    
+    static ModelInfo readInfo(const std::string& name, const std::filesystem::path& blob) {
+        GGUFFile gguf(blob.string());
+        ModelInfo info;
+        info.name = name;
+        info.blob_path = blob.string();
+        info.architecture = std::string(gguf.getString("general.architecture", "unknown"));
+        
+        const std::string& arch = info.architecture;
+        info.context_length = gguf.getUInt(arch + ".context_length");
+        info.block_count = gguf.getUInt(arch + ".block_count");
+        info.embedding_length = gguf.getUInt(arch + ".embedding_length");
+        info.head_count = gguf.getUInt(arch + ".attention.head_count");
+        info.head_count_kv = gguf.getUInt(arch + ".attention.head_count_kv", info.head_count);
+        
+        uint64_t head_dim = info.head_count ? info.embedding_length / info.head_count : 0;
+        uint64_t key_length = gguf.getUInt(arch + ".attention.key_length", head_dim);
+        uint64_t value_length = gguf.getUInt(arch + ".attention.value_length", head_dim);
+        info.kv_bytes_per_token = info.block_count * info.head_count_kv * (key_length + value_length) * 2;
+        
+        info.quantization = gguf.has("general.file_type")
+            ? fileTypeName(gguf.getUInt("general.file_type")) : "unknown";
+        info.chat_template = std::string(gguf.getString("tokenizer.chat_template"));
+        info.tokenizer_model = std::string(gguf.getString("tokenizer.ggml.model"));
+        info.vocab_size = gguf.getArrayLength("tokenizer.ggml.tokens");
+        
+        for (const auto& tensor : gguf.getTensors()) {
+            info.parameter_count += tensor.elements();
+        }
+        info.tensor_count = gguf.getTensors().size();
+        info.weights_bytes = gguf.fileSize() > gguf.dataOffset() ? gguf.fileSize() - gguf.dataOffset() : 0;
+        return info;
+    }
+    
+public:
+    ModelRegistry() = default;
+    explicit ModelRegistry(const OllamaModelStore& model_store) : store(model_store) {}
+    
+    const OllamaModelStore& getStore() const {
+        return store;
+    }
+    
+    // Cached capability lookup; returns nullptr when the model is not
+    // installed locally or its blob cannot be read.
+    const ModelInfo* lookup(const std::string& name) {
+        MemoryScope scope(MemoryAccounting::INDICES);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto it = models.find(name);
+        if (it != models.end()) return &it->second;
+        
+        std::filesystem::path blob = store.findModelBlob(name);
+        if (blob.empty()) return nullptr;
+        try {
+            auto inserted = models.emplace(name, readInfo(name, blob));
+            return &inserted.first->second;
+        } catch (const std::exception&) {
+            return nullptr;
+        }
+    }
+    
+    // Reads the headers of every installed model
+    std::vector<const ModelInfo*> scanInstalled() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<const ModelInfo*> found;
+        for (const auto& name : store.listInstalled()) {
+            if (const ModelInfo* info = lookup(name)) {
+                found.push_back(info);
+            }
+        }
+        last_scan_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return found;
+    }
+    
+    double getLastScanMs() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return last_scan_ms;
+    }
+    
+    // Largest power-of-two context (at least 2048) that the model supports
+    // and that fits in the given memory budget
+    static uint64_t suggestedNumCtx(const ModelInfo& info, uint64_t available_bytes) {
+        uint64_t limit = info.context_length ? info.context_length : 2048;
+        uint64_t num_ctx = 2048;
+        while (num_ctx * 2 <= limit &&
+               (available_bytes == 0 || info.estimateMemoryBytes(num_ctx * 2) <= available_bytes)) {
+            num_ctx *= 2;
+        }
+        return std::min(num_ctx, limit);
+    }
+    
+    std::shared_ptr<ModelVocabulary> loadVocabulary(const std::string& name) {
+        const ModelInfo* info = lookup(name);
+        if (!info) return nullptr;
+        auto vocab = std::make_shared<ModelVocabulary>();
+        vocab->file = std::make_shared<GGUFFile>(info->blob_path);
+        vocab->tokens = vocab->file->getStringArray("tokenizer.ggml.tokens");
+        return vocab;
+    }
+    
+    // Physical memory currently available to load a model, 0 if unknown
+    static uint64_t availableMemoryBytes() {
+#ifdef _WIN32
+        MEMORYSTATUSEX status;
+        status.dwLength = sizeof(status);
+        if (GlobalMemoryStatusEx(&status)) {
+            return status.ullAvailPhys;
+        }
+        return 0;
+#else
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        uint64_t value;
+        std::string unit;
+        while (meminfo >> key >> value >> unit) {
+            if (key == "MemAvailable:") {
+                return value * 1024;
+            }
+        }
+        long pages = sysconf(_SC_AVPHYS_PAGES);
+        long page_size = sysconf(_SC_PAGESIZE);
+        return (pages > 0 && page_size > 0) ? static_cast<uint64_t>(pages) * page_size : 0;
+#endif
+    }
+};
+
+// What the server reports about a model through /api/show
+struct ModelCapabilities {
+    std::string digest;
+    std::string family;
+    std::string parameter_size;
+    std::string quantization_level;
+    std::string template_text;
+    uint64_t context_length = 0;
+    std::vector<std::string> capabilities;
+    
+    json toJson() const {
+        return {
+            {"digest", digest},
+            {"family", family},
+            {"parameter_size", parameter_size},
+            {"quantization_level", quantization_level},
+            {"template", template_text},
+            {"context_length", context_length},
+            {"capabilities", capabilities}
+        };
+    }
+    
+    static ModelCapabilities fromJson(const json& j) {
+        ModelCapabilities caps;
+        caps.digest = j.value("digest", "");
+        caps.family = j.value("family", "");
+        caps.parameter_size = j.value("parameter_size", "");
+        caps.quantization_level = j.value("quantization_level", "");
+        caps.template_text = j.value("template", "");
+        caps.context_length = j.value("context_length", static_cast<uint64_t>(0));
+        caps.capabilities = j.value("capabilities", std::vector<std::string>());
+        return caps;
+    }
+    
+    // Parses an /api/show response body
+    static ModelCapabilities fromShowResponse(const json& show, const std::string& digest) {
+        ModelCapabilities caps;
+        caps.digest = digest;
+        caps.template_text = show.value("template", "");
+        if (show.contains("details")) {
+            const json& details = show["details"];
+            caps.family = details.value("family", "");
+            caps.parameter_size = details.value("parameter_size", "");
+            caps.quantization_level = details.value("quantization_level", "");
+        }
+        if (show.contains("model_info")) {
+            const json& info = show["model_info"];
+            std::string arch = info.value("general.architecture", "");
+            std::string key = arch + ".context_length";
+            if (!arch.empty() && info.contains(key) && info[key].is_number_unsigned()) {
+                caps.context_length = info[key].get<uint64_t>();
+            }
+        }
+        if (show.contains("capabilities") && show["capabilities"].is_array()) {
+            for (const auto& c : show["capabilities"]) {
+                if (c.is_string()) caps.capabilities.push_back(c);
+            }
+        }
+        return caps;
+    }
+};
+
+// Per-user directory for the assistant's caches and spill files
+inline std::filesystem::path assistantCacheDir() {
+#ifdef _WIN32
+    const char* base = std::getenv("LOCALAPPDATA");
+    std::filesystem::path dir = base ? std::filesystem::path(base) : std::filesystem::path(".");
+#else
+    std::filesystem::path dir;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        dir = xdg;
+    } else if (const char* home = std::getenv("HOME")) {
+        dir = std::filesystem::path(home) / ".cache";
+    } else {
+        dir = ".";
+    }
+#endif
+    return dir / "ollama_assistant";
+}
+
+// Per-user directory for settings the assistant writes, such as tuned
+// model profiles
+inline std::filesystem::path assistantConfigDir() {
+#ifdef _WIN32
+    const char* base = std::getenv("APPDATA");
+    std::filesystem::path dir = base ? std::filesystem::path(base) : std::filesystem::path(".");
+#else
+    std::filesystem::path dir;
+    if (const char* xdg = std::getenv("XDG_CONFIG_HOME"); xdg && *xdg) {
+        dir = xdg;
+    } else if (const char* home = std::getenv("HOME")) {
+        dir = std::filesystem::path(home) / ".config";
+    } else {
+        dir = ".";
+    }
+#endif
+    return dir / "ollama_assistant";
+}
+
+// /api/show results persisted across runs, keyed by model digest so a
+// re-pulled model is fetched again while renames and restarts are free.
+// Thread-safe.
+class ModelCapabilityCache {
+private:
+    std::filesystem::path cache_file;
+    std::map<std::string, ModelCapabilities> entries;
+    mutable std::mutex mutex;
+    
+    static std::filesystem::path defaultCacheFile() {
+        return assistantCacheDir() / "model_capabilities.json";
+    }
+    
+    void load() {
+        MemoryScope scope(MemoryAccounting::CACHES);
+        std::ifstream in(cache_file);
+        if (!in) return;
+        try {
+            json data = json::parse(in);
+            for (const auto& entry : data.value("models", json::array())) {
+                ModelCapabilities caps = ModelCapabilities::fromJson(entry);
+                if (!caps.digest.empty()) {
+                    entries[caps.digest] = caps;
+                }
+            }
+        } catch (const json::exception&) {
+            // A corrupt cache is rebuilt from the server
+            entries.clear();
+        }
+    }
+    
+    void save() const {
+        std::error_code ec;
+        std::filesystem::create_directories(cache_file.parent_path(), ec);
+        
+        json data = {{"models", json::array()}};
+        for (const auto& entry : entries) {
+            data["models"].push_back(entry.second.toJson());
+        }
+        
+        // Write-then-rename so a crash never leaves a half-written cache
+        std::filesystem::path tmp = cache_file;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) return;
+            out << data.dump();
+        }
+        std::filesystem::rename(tmp, cache_file, ec);
+    }
+    
+public:
+    ModelCapabilityCache() : cache_file(defaultCacheFile()) {
+        load();
+    }
+    
+    explicit ModelCapabilityCache(const std::filesystem::path& file) : cache_file(file) {
+        load();
+    }
+    
+    bool find(const std::string& digest, ModelCapabilities& result) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(digest);
+        if (it == entries.end()) return false;
+        result = it->second;
+        return true;
+    }
+    
+    void store(const ModelCapabilities& caps) {
+        MemoryScope scope(MemoryAccounting::CACHES);
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[caps.digest] = caps;
+        save();
+    }
+    
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+};
+
+// Picks num_ctx/num_predict for each request from the history size. The
+// context only ever grows within a conversation, and in power-of-two steps,
+// because every num_ctx change makes Ollama reload the model.
+class ContextSizer {
+private:
+    uint64_t model_limit = 0;     // 0 = unknown
+    uint64_t current_ctx = 0;     // 0 = nothing sent yet
+    uint64_t resize_count = 0;
+    uint64_t start_ctx = 0;       // First size sent; 0 = MIN_CTX
+    double chars_per_token = 4.0;  // Calibrated from eval_count
+    
+public:
+    static constexpr uint64_t MIN_CTX = 2048;
+    static constexpr uint64_t REPLY_HEADROOM = 1024;
+    
+    void setModelLimit(uint64_t limit) {
+        model_limit = limit;
+    }
+    
+    uint64_t getModelLimit() const {
+        return model_limit;
+    }
+    
+    // Smallest context to send, e.g. a tuned num_ctx that costs no speed, so
+    // conversations up to that size never trigger a reload
+    void setStartCtx(uint64_t ctx) {
+        start_ctx = ctx;
+    }
+    
+    uint64_t getCurrentCtx() const {
+        return current_ctx;
+    }
+    
+    uint64_t getResizeCount() const {
+        return resize_count;
+    }
+    
+    // Starts over at the smallest context, e.g. after /clear or a model
+    // switch (both of which reload or reset the KV cache anyway)
+    void reset() {
+        current_ctx = 0;
+    }
+    
+    uint64_t estimateTokens(size_t chars) const {
+        return static_cast<uint64_t>(static_cast<double>(chars) / chars_per_token) + 1;
+    }
+    
+    // Feeds back the size of a finished reply to refine the token estimate
+    void observeReply(size_t reply_chars, uint64_t eval_count) {
+        if (eval_count < 16 || reply_chars == 0) return;
+        double ratio = static_cast<double>(reply_chars) / static_cast<double>(eval_count);
+        ratio = std::min(8.0, std::max(1.5, ratio));
+        chars_per_token = 0.8 * chars_per_token + 0.2 * ratio;
+    }
+    
+    // Returns the Ollama options for a prompt of the given size
+    json optionsFor(size_t prompt_chars) {
+        uint64_t prompt_tokens = estimateTokens(prompt_chars);
+        uint64_t needed = prompt_tokens + REPLY_HEADROOM;
+        
+        if (needed > current_ctx) {
+            uint64_t ctx = std::max({current_ctx, MIN_CTX, start_ctx});
+            while (ctx < needed) {
+                ctx *= 2;
+            }
+            if (model_limit > 0) {
+                ctx = std::min(ctx, model_limit);
+            }
+            if (ctx != current_ctx) {
+                if (current_ctx != 0) ++resize_count;
+                current_ctx = ctx;
+            }
+        }
+        
+        // Leave the rest of the window for the reply so generation never
+        // forces a context shift
+        uint64_t num_predict = current_ctx > prompt_tokens ? current_ctx - prompt_tokens : 0;
+        num_predict = std::max<uint64_t>(num_predict, 256);
+        
+        return {
+            {"num_ctx", current_ctx},
+            {"num_predict", num_predict}
+        };
+    }
+};
+
+// Client-side rendering of the common chat template families, so prompts
+// can be sent to /api/generate without server-side templating. The family is
+// detected from the special tokens in the model's Go or Jinja template.
+class PromptTemplate {
+public:
+    enum class Family { LLAMA3, CHATML, GEMMA, PHI3, MISTRAL, GENERIC };
+    
+private:
+    Family family;
+    
+    std::string renderTurn(const std::string& role, const std::string& content) const {
+        switch (family) {
+            case Family::LLAMA3:
+                return "<|start_header_id|>" + role + "<|end_header_id|>\n\n" + content + "<|eot_id|>";
+            case Family::CHATML:
+                return "<|im_start|>" + role + "\n" + content + "<|im_end|>\n";
+            case Family::GEMMA:
+                return "<start_of_turn>" + std::string(role == "assistant" ? "model" : "user") + "\n" +
+                       content + "<end_of_turn>\n";
+            case Family::PHI3:
+                return "<|" + role + "|>\n" + content + "<|end|>\n";
+            case Family::MISTRAL:
+                if (role == "assistant") return content + "</s>";
+                return "[INST] " + content + " [/INST]";
+            case Family::GENERIC:
+            default: {
+                std::string label = role == "system" ? "System" : role == "user" ? "User" : "Assistant";
+                return "### " + label + ":\n" + content + "\n\n";
+            }
+        }
+    }
+    
+public:
+    explicit PromptTemplate(Family f = Family::GENERIC) : family(f) {}
+    
+    static PromptTemplate detect(const std::string& template_text) {
+        if (template_text.find("<|start_header_id|>") != std::string::npos) return PromptTemplate(Family::LLAMA3);
+        if (template_text.find("<|im_start|>") != std::string::npos) return PromptTemplate(Family::CHATML);
+        if (template_text.find("<start_of_turn>") != std::string::npos) return PromptTemplate(Family::GEMMA);
+        if (template_text.find("<|assistant|>") != std::string::npos) return PromptTemplate(Family::PHI3);
+        if (template_text.find("[INST]") != std::string::npos) return PromptTemplate(Family::MISTRAL);
+        return PromptTemplate(Family::GENERIC);
+    }
+    
+    Family getFamily() const {
+        return family;
+    }
+    
+    const char* familyName() const {
+        switch (family) {
+            case Family::LLAMA3: return "llama3";
+            case Family::CHATML: return "chatml";
+            case Family::GEMMA: return "gemma";
+            case Family::PHI3: return "phi3";
+            case Family::MISTRAL: return "mistral";
+            default: return "generic";
+        }
+    }
+    
+    // Text that opens the assistant's turn; generation continues from here
+    std::string assistantPrefix() const {
+        switch (family) {
+            case Family::LLAMA3: return "<|start_header_id|>assistant<|end_header_id|>\n\n";
+            case Family::CHATML: return "<|im_start|>assistant\n";
+            case Family::GEMMA: return "<start_of_turn>model\n";
+            case Family::PHI3: return "<|assistant|>\n";
+            case Family::MISTRAL: return "";
+            default: return "### Assistant:\n";
+        }
+    }
+    
+    // Closes an assistant reply that was generated after assistantPrefix().
+    // The stop token itself is not part of the returned text or context.
+    std::string assistantSuffix() const {
+        switch (family) {
+            case Family::LLAMA3: return "<|eot_id|>";
+            case Family::CHATML: return "<|im_end|>\n";
+            case Family::GEMMA: return "<end_of_turn>\n";
+            case Family::PHI3: return "<|end|>\n";
+            case Family::MISTRAL: return "</s>";
+            default: return "\n\n";
+        }
+    }
+    
+    // Renders messages[from..] followed by the assistant prefix. With
+    // from > 0 the previous assistant reply is assumed to be in the context
+    // already and only needs closing.
+    std::string render(const std::vector<json>& messages, size_t from) const {
+        std::string prompt;
+        if (from > 0 && messages[from - 1]["role"] == "assistant") {
+            prompt += assistantSuffix();
+        }
+        
+        std::string pending_system;
+        for (size_t i = from; i < messages.size(); ++i) {
+            const std::string& role = messages[i]["role"].get_ref<const std::string&>();
+            const std::string& content = messages[i]["content"].get_ref<const std::string&>();
+            
+            // Gemma and Mistral have no system role: fold it into the next user turn
+            if (role == "system" && (family == Family::GEMMA || family == Family::MISTRAL)) {
+                pending_system = content + "\n\n";
+                continue;
+            }
+            if (role == "user" && !pending_system.empty()) {
+                prompt += renderTurn(role, pending_system + content);
+                pending_system.clear();
+                continue;
+            }
+            prompt += renderTurn(role, content);
+        }
+        return prompt + assistantPrefix();
+    }
+};
+
+// Token ids from /api/generate's `context`, LEB128-encoded: 2-3 bytes per
+// token instead of 4 (uint32) or ~7 (JSON text).
+class CompactTokens {
+private:
+    std::vector<uint8_t> bytes;
+    size_t count = 0;
+    
+public:
+    void clear() {
+        bytes.clear();
+        count = 0;
+    }
+    
+    bool empty() const {
+        return count == 0;
+    }
+    
+    size_t size() const {
+        return count;
+    }
+    
+    size_t byteSize() const {
+        return bytes.size();
+    }
+    
+    void push_back(uint32_t token) {
+        while (token >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(token | 0x80));
+            token >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(token));
+        ++count;
+    }
+    
+    // Replaces the contents with a JSON array of token ids; returns false
+    // (and leaves the object empty) if the array is malformed.
+    bool assign(const json& tokens) {
+        clear();
+        if (!tokens.is_array()) return false;
+        bytes.reserve(tokens.size() * 3);
+        for (const auto& t : tokens) {
+            if (!t.is_number_unsigned() || t.get<uint64_t>() > UINT32_MAX) {
+                clear();
+                return false;
+            }
+            push_back(static_cast<uint32_t>(t.get<uint64_t>()));
+        }
+        return true;
+    }
+    
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        uint32_t value = 0;
+        int shift = 0;
+        for (uint8_t b : bytes) {
+            value |= static_cast<uint32_t>(b & 0x7F) << shift;
+            if (b & 0x80) {
+                shift += 7;
+            } else {
+                fn(value);
+                value = 0;
+                shift = 0;
+            }
+        }
+    }
+    
+    json toJson() const {
+        json tokens = json::array();
+        forEach([&tokens](uint32_t t) { tokens.push_back(t); });
+        return tokens;
+    }
+    
+    // True if `tokens` starts with exactly the ids held here
+    bool isPrefixOf(const json& tokens) const {
+        if (!tokens.is_array() || tokens.size() < count) return false;
+        size_t i = 0;
+        bool match = true;
+        forEach([&](uint32_t t) {
+            if (match && (!tokens[i].is_number_unsigned() || tokens[i].get<uint64_t>() != t)) {
+                match = false;
+            }
+            ++i;
+        });
+        return match;
+    }
+};
+
+// Per-endpoint request costs, used to compare /api/chat against /api/generate
+// and the HTTP backend against in-process inference
+struct RequestStats {
+    uint64_t requests = 0;
+    uint64_t body_bytes = 0;
+    uint64_t prompt_eval_tokens = 0;
+    uint64_t prompt_eval_ns = 0;
+    uint64_t eval_tokens = 0;
+    uint64_t eval_ns = 0;
+    uint64_t stream_requests = 0;
+    uint64_t stream_chunks = 0;
+    uint64_t stream_span_ns = 0;  // Client-side time from first to last chunk
+    uint64_t malformed_chunks = 0;  // Stream lines that were not valid JSON, skipped
+    
+    void record(size_t body_size, const json& final_chunk) {
+        ++requests;
+        body_bytes += body_size;
+        prompt_eval_tokens += final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+        prompt_eval_ns += final_chunk.value("prompt_eval_duration", static_cast<uint64_t>(0));
+        eval_tokens += final_chunk.value("eval_count", static_cast<uint64_t>(0));
+        eval_ns += final_chunk.value("eval_duration", static_cast<uint64_t>(0));
+    }
+    
+    double avgBodyBytes() const {
+        return requests ? static_cast<double>(body_bytes) / requests : 0.0;
+    }
+    
+    double avgPrefillMs() const {
+        return requests ? static_cast<double>(prompt_eval_ns) / requests / 1e6 : 0.0;
+    }
+    
+    double avgPrefillTokens() const {
+        return requests ? static_cast<double>(prompt_eval_tokens) / requests : 0.0;
+    }
+    
+    void recordStream(uint64_t chunks, uint64_t span_ns) {
+        ++stream_requests;
+        stream_chunks += chunks;
+        stream_span_ns += span_ns;
+    }
+    
+    // Client-observed time per streamed token beyond the model's own
+    // decode time: transport, parsing and callback cost
+    double perTokenOverheadUs() const {
+        if (stream_chunks <= stream_requests || eval_tokens == 0) return 0.0;
+        double client_ns = static_cast<double>(stream_span_ns) / static_cast<double>(stream_chunks - stream_requests);
+        double server_ns = static_cast<double>(eval_ns) / static_cast<double>(eval_tokens);
+        return std::max(0.0, client_ns - server_ns) / 1000.0;
+    }
+    
+    json toJson() const {
+        return {
+            {"requests", requests},
+            {"body_bytes", body_bytes},
+            {"prompt_eval_tokens", prompt_eval_tokens},
+            {"prompt_eval_ns", prompt_eval_ns},
+            {"eval_tokens", eval_tokens},
+            {"eval_ns", eval_ns},
+            {"per_token_overhead_us", perTokenOverheadUs()},
+            {"malformed_chunks", malformed_chunks}
+        };
+    }
+};
+
+// Reusable curl easy handles. A returned handle keeps its live connection to
+// the server, and the shared DNS/connection cache lets any handle pick up a
+// connection another one opened, so steady-state requests skip TCP setup.
+// Thread-safe; each acquired handle belongs to one thread until released.
+class ConnectionPool {
+private:
+    std::mutex mutex;
+    std::vector<CURL*> idle;
+    CURLSH* share;
+    std::mutex share_locks[CURL_LOCK_DATA_LAST];
+    uint64_t created = 0;
+    uint64_t reused = 0;
+    
+    static void lockShare(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<ConnectionPool*>(userptr)->share_locks[data].lock();
+    }
+    
+    static void unlockShare(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<ConnectionPool*>(userptr)->share_locks[data].unlock();
+    }
+    
+    void release(CURL* curl) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.push_back(curl);
+    }
+    
+public:
+    // Move-only lease on a pooled handle; returned to the pool on destruction
+    class Handle {
+    private:
+        ConnectionPool* pool;
+        CURL* curl;
+        
+    public:
+        Handle(ConnectionPool* owner, CURL* handle) : pool(owner), curl(handle) {}
+        Handle(Handle&& other) noexcept : pool(other.pool), curl(other.curl) {
+            other.curl = nullptr;
+        }
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+        Handle& operator=(Handle&&) = delete;
+        
+        ~Handle() {
+            if (curl) pool->release(curl);
+        }
+        
+        CURL* get() const {
+            return curl;
+        }
+    };
+    
+    ConnectionPool() {
+        share = curl_share_init();
+        if (!share) {
+            throw std::runtime_error("Failed to initialize libcurl share");
+        }
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    
+    ~ConnectionPool() {
+        for (CURL* curl : idle) {
+            curl_easy_cleanup(curl);
+        }
+        curl_share_cleanup(share);
+    }
+    
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+    
+    // Returns a handle with default options; live connections survive the reset
+    Handle acquire() {
+        MemoryScope scope(MemoryAccounting::REQUEST);
+        CURL* curl = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty()) {
+                curl = idle.back();
+                idle.pop_back();
+                ++reused;
+            } else {
+                ++created;
+            }
+        }
+        if (curl) {
+            curl_easy_reset(curl);
+        } else {
+            curl = curl_easy_init();
+            if (!curl) {
+                throw std::runtime_error("Failed to initialize libcurl");
+            }
+        }
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        return Handle(this, curl);
+    }
+    
+    json statsJson() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {{"created", created}, {"reused", reused}, {"idle", idle.size()}};
+    }
+};
+
+// Current resident set size of this process, or 0 where it cannot be read
+inline uint64_t processResidentBytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    if (statm >> size >> resident) {
+        return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+// Hands freed heap pages back to the OS so evictions show up in RSS
+inline void releaseFreeMemory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Compression for cold conversation turns and hibernated sessions. Built
+// with OLLAMA_WITH_ZSTD it uses zstd plus a dictionary trained on the first
+// blocks the process compresses, shared by every conversation so even short
+// blocks compress well; otherwise blocks are stored as is. Every block
+// starts with a format byte, so blocks written before the dictionary
+// existed stay readable. Thread-safe.
+class ColdCodec {
+private:
+    enum Format : char { STORED = 0, ZSTD = 1, ZSTD_DICT = 2 };
+    
+    mutable std::mutex mutex;
+    uint64_t blocks = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t compressed_bytes = 0;
+#ifdef OLLAMA_WITH_ZSTD
+    static constexpr int LEVEL = 3;
+    static constexpr size_t DICTIONARY_BYTES = 16 * 1024;
+    static constexpr size_t TRAINING_SAMPLES = 64;         // Blocks seen before training
+    static constexpr size_t SAMPLE_BYTES = 4096;           // Prefix of each block used as a sample
+    
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+    bool training_done = false;
+    std::string samples;
+    std::vector<size_t> sample_sizes;
+    
+    struct ContextDeleter {
+        void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+        void operator()(ZSTD_DCtx* ctx) const { ZSTD_freeDCtx(ctx); }
+    };
+    
+    static ZSTD_CCtx* compressionContext() {
+        thread_local std::unique_ptr<ZSTD_CCtx, ContextDeleter> ctx(ZSTD_createCCtx());
+        return ctx.get();
+    }
+    
+    static ZSTD_DCtx* decompressionContext() {
+        thread_local std::unique_ptr<ZSTD_DCtx, ContextDeleter> ctx(ZSTD_createDCtx());
+        return ctx.get();
+    }
+    
+    // Caller holds the mutex
+    void collectSample(const std::string& raw) {
+        MemoryScope scope(MemoryAccounting::CACHES);
+        if (training_done) return;
+        size_t sample = std::min(raw.size(), SAMPLE_BYTES);
+        samples.append(raw, 0, sample);
+        sample_sizes.push_back(sample);
+        if (sample_sizes.size() < TRAINING_SAMPLES) return;
+        
+        training_done = true;  // One attempt; a failed training keeps plain zstd
+        std::string dictionary(DICTIONARY_BYTES, '\0');
+        size_t size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), samples.data(),
+                                            sample_sizes.data(), static_cast<unsigned>(sample_sizes.size()));
+        if (!ZDICT_isError(size)) {
+            cdict = ZSTD_createCDict(dictionary.data(), size, LEVEL);
+            ddict = ZSTD_createDDict(dictionary.data(), size);
+        }
+        std::string().swap(samples);
+        std::vector<size_t>().swap(sample_sizes);
+    }
+#endif
+    
+public:
+    ColdCodec() = default;
+    ColdCodec(const ColdCodec&) = delete;
+    ColdCodec& operator=(const ColdCodec&) = delete;
+    
+    ~ColdCodec() {
+#ifdef OLLAMA_WITH_ZSTD
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+#endif
+    }
+    
+    std::string compress(const std::string& raw) {
+        std::string block;
+#ifdef OLLAMA_WITH_ZSTD
+        ZSTD_CDict* dictionary;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            collectSample(raw);
+            dictionary = cdict;
+        }
+        block.resize(1 + ZSTD_compressBound(raw.size()));
+        size_t size = dictionary
+            ? ZSTD_compress_usingCDict(compressionContext(), &block[1], block.size() - 1, raw.data(), raw.size(), dictionary)
+            : ZSTD_compressCCtx(compressionContext(), &block[1], block.size() - 1, raw.data(), raw.size(), LEVEL);
+        if (!ZSTD_isError(size) && size < raw.size()) {
+            block[0] = dictionary ? ZSTD_DICT : ZSTD;
+            block.resize(1 + size);
+            block.shrink_to_fit();
+        } else {
+            block.clear();
+        }
+#endif
+        if (block.empty()) {
+            block.reserve(1 + raw.size());
+            block.push_back(STORED);
+            block += raw;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        ++blocks;
+        raw_bytes += raw.size();
+        compressed_bytes += block.size();
+        return block;
+    }
+    
+    std::string decompress(const char* data, size_t size) const {
+        if (size == 0) {
+            throw std::runtime_error("Empty cold block");
+        }
+        if (data[0] == STORED) {
+            return std::string(data + 1, size - 1);
+        }
+#ifdef OLLAMA_WITH_ZSTD
+        unsigned long long raw_size = ZSTD_getFrameContentSize(data + 1, size - 1);
+        if (raw_size != ZSTD_CONTENTSIZE_ERROR && raw_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+            ZSTD_DDict* dictionary;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                dictionary = ddict;
+            }
+            std::string raw(static_cast<size_t>(raw_size), '\0');
+            size_t result = 0;
+            if (data[0] == ZSTD) {
+                result = ZSTD_decompressDCtx(decompressionContext(), &raw[0], raw.size(), data + 1, size - 1);
+            } else if (data[0] == ZSTD_DICT && dictionary) {
+                result = ZSTD_decompress_usingDDict(decompressionContext(), &raw[0], raw.size(), data + 1, size - 1, dictionary);
+            }
+            if (result == raw.size() && !ZSTD_isError(result)) return raw;
+        }
+#endif
+        throw std::runtime_error("Cannot decode cold block");
+    }
+    
+    std::string decompress(const std::string& block) const {
+        return decompress(block.data(), block.size());
+    }
+    
+    json statsJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {
+#ifdef OLLAMA_WITH_ZSTD
+            {"codec", "zstd"},
+            {"dictionary", cdict != nullptr},
+#else
+            {"codec", "none"},
+            {"dictionary", false},
+#endif
+            {"blocks", blocks},
+            {"raw_bytes", raw_bytes},
+            {"compressed_bytes", compressed_bytes}
+        };
+    }
+};
+
+// Resident bytes of one conversation by tier
+struct ConversationMemory {
+    size_t hot_messages = 0;
+    uint64_t hot_bytes = 0;        // Estimate including json node overhead
+    size_t cold_messages = 0;
+    uint64_t cold_bytes = 0;       // Compressed
+    uint64_t cold_raw_bytes = 0;   // What the cold tier would take uncompressed
+    
+    uint64_t total() const {
+        return hot_bytes + cold_bytes;
+    }
+};
+
+// Message history of one conversation. Keeps a running character count so
+// context sizing never has to walk the history. With a codec, only the
+// system prompt and the most recent messages stay as json; older ones are
+// frozen into compressed blocks of COLD_BLOCK_MESSAGES and decoded only when
+// the whole history is needed.
+class ConversationStore {
+private:
+    struct ColdBlock {
+        std::string data;
+        uint32_t messages;
+        uint32_t raw_bytes;
+    };
+    
+    std::shared_ptr<ColdCodec> codec;  // Null keeps everything hot
+    std::vector<json> hot;             // System prompt, then the messages after the cold ones
+    std::vector<ColdBlock> cold;       // Oldest first; logically between hot[0] and hot[1]
+    size_t cold_messages = 0;
+    uint64_t cold_bytes = 0;
+    uint64_t cold_raw_bytes = 0;
+    uint64_t hot_chars = 0;
+    size_t total_chars = 0;
+    
+    // Rough heap cost of one {"role", "content"} json object beyond its text
+    static constexpr uint64_t MESSAGE_OVERHEAD = 192;
+    
+    static size_t contentSize(const json& message) {
+        return message["content"].get_ref<const std::string&>().size();
+    }
+    
+    void freezeOldest() {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        json block = json::array();
+        for (size_t i = 1; i <= COLD_BLOCK_MESSAGES; ++i) {
+            hot_chars -= contentSize(hot[i]);
+            block.push_back(std::move(hot[i]));
+        }
+        hot.erase(hot.begin() + 1, hot.begin() + 1 + COLD_BLOCK_MESSAGES);
+        
+        std::string raw = block.dump();
+        ColdBlock frozen = {codec->compress(raw), static_cast<uint32_t>(COLD_BLOCK_MESSAGES),
+                            static_cast<uint32_t>(raw.size())};
+        cold_messages += frozen.messages;
+        cold_bytes += frozen.data.size();
+        cold_raw_bytes += frozen.raw_bytes;
+        cold.push_back(std::move(frozen));
+    }
+    
+public:
+    static constexpr const char* DEFAULT_SYSTEM_PROMPT =
+        "You are a helpful terminal assistant. Provide clear, concise responses focused on programming and technical help.";
+    static constexpr size_t HOT_MESSAGES = 16;         // Recent messages always kept as json
+    static constexpr size_t COLD_BLOCK_MESSAGES = 8;
+    
+    explicit ConversationStore(const std::string& system_prompt = DEFAULT_SYSTEM_PROMPT,
+                               std::shared_ptr<ColdCodec> cold_codec = nullptr)
+        : codec(std::move(cold_codec)) {
+        reset(system_prompt);
+    }
+    
+    // Drops every message and starts over with the given system prompt
+    void reset(const std::string& system_prompt) {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        std::vector<json>().swap(hot);
+        std::vector<ColdBlock>().swap(cold);
+        cold_messages = 0;
+        cold_bytes = 0;
+        cold_raw_bytes = 0;
+        hot_chars = 0;
+        total_chars = 0;
+        append("system", system_prompt);
+    }
+    
+    // Drops every message but keeps the system prompt
+    void reset() {
+        std::string system_prompt = getSystemPrompt();
+        reset(system_prompt);
+    }
+    
+    void append(const std::string& role, const std::string& content) {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        hot.push_back({
+            {"role", role},
+            {"content", content}
+        });
+        hot_chars += content.size();
+        total_chars += content.size();
+        if (codec && hot.size() > 1 + HOT_MESSAGES + COLD_BLOCK_MESSAGES) {
+            freezeOldest();
+        }
+    }
+    
+    void popBack() {
+        if (hot.size() <= 1) return;
+        hot_chars -= contentSize(hot.back());
+        total_chars -= contentSize(hot.back());
+        hot.pop_back();
+    }
+    
+    std::string getSystemPrompt() const {
+        return hot.front()["content"];
+    }
+    
+    // Messages [from, size()), decoding only the cold blocks that overlap
+    std::vector<json> materialize(size_t from = 0) const {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        std::vector<json> out;
+        out.reserve(size() - std::min(from, size()));
+        if (from == 0) {
+            out.push_back(hot.front());
+        }
+        size_t index = 1;
+        for (const auto& block : cold) {
+            if (from < index + block.messages) {
+                json messages = json::parse(codec->decompress(block.data));
+                for (size_t i = from > index ? from - index : 0; i < messages.size(); ++i) {
+                    out.push_back(std::move(messages[i]));
+                }
+            }
+            index += block.messages;
+        }
+        for (size_t i = std::max<size_t>(1, from > cold_messages ? from - cold_messages : 1); i < hot.size(); ++i) {
+            out.push_back(hot[i]);
+        }
+        return out;
+    }
+    
+    // The full history: the stored messages themselves when nothing is
+    // cold, otherwise decoded into `scratch`
+    const std::vector<json>& view(std::vector<json>& scratch) const {
+        if (cold.empty()) return hot;
+        scratch = materialize();
+        return scratch;
+    }
+    
+    // The most recent message (the system prompt when there are none)
+    const json& back() const {
+        return hot.back();
+    }
+    
+    // One message; a cold one costs decoding only its own block
+    json at(size_t index) const {
+        if (index == 0) return hot.front();
+        if (index > cold_messages) return hot.at(index - cold_messages);
+        size_t first = 1;
+        for (const auto& block : cold) {
+            if (index < first + block.messages) {
+                MemoryScope scope(MemoryAccounting::CONVERSATION);
+                return json::parse(codec->decompress(block.data)).at(index - first);
+            }
+            first += block.messages;
+        }
+        throw std::out_of_range("Message index out of range");
+    }
+    
+    size_t size() const {
+        return cold_messages + hot.size();
+    }
+    
+    size_t totalChars() const {
+        return total_chars;
+    }
+    
+    ConversationMemory memory() const {
+        ConversationMemory usage;
+        usage.hot_messages = hot.size();
+        usage.hot_bytes = hot_chars + hot.size() * MESSAGE_OVERHEAD;
+        usage.cold_messages = cold_messages;
+        usage.cold_bytes = cold_bytes;
+        usage.cold_raw_bytes = cold_raw_bytes;
+        return usage;
+    }
+};
+
+// Receives reply text as it streams in; returning false cancels the request.
+// `delta` is only valid during the call.
+using TokenCallback = std::function<bool(std::string_view delta)>;
+
+// Outcome of one generation. `final_chunk` carries the timing fields under
+// Ollama's names (prompt_eval_count, eval_duration, ...) for every backend.
+struct GenerationResult {
+    std::string text;
+    json final_chunk = json::object();
+    bool cancelled = false;
+};
+
+// Lets another thread stop the requests made on this thread while the scope
+// is alive, including before the first token when no TokenCallback runs yet.
+// HTTP transfers poll it from curl's progress callback, which drops an
+// abandoned request within about a second even during prefill. Scopes nest;
+// only the innermost one is consulted.
+class CancelScope {
+private:
+    static inline thread_local const CancelScope* current_scope = nullptr;
+    std::function<bool()> check;
+    const CancelScope* previous;
+    
+public:
+    explicit CancelScope(std::function<bool()> should_cancel)
+        : check(std::move(should_cancel)), previous(current_scope) {
+        current_scope = this;
+    }
+    
+    explicit CancelScope(const std::atomic<bool>& flag) : CancelScope([&flag] { return flag.load(); }) {}
+    
+    ~CancelScope() {
+        current_scope = previous;
+    }
+    
+    CancelScope(const CancelScope&) = delete;
+    CancelScope& operator=(const CancelScope&) = delete;
+    
+    // Innermost scope on this thread, or null
+    static const CancelScope* current() {
+        return current_scope;
+    }
+    
+    static bool cancelled() {
+        return current_scope && current_scope->requested();
+    }
+    
+    bool requested() const {
+        return check();
+    }
+};
+
+// The server could not be reached at all, as opposed to answering with an error
+struct ConnectionError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// A request gave up under its TimeoutPolicy
+struct TimeoutError : ConnectionError {
+    using ConnectionError::ConnectionError;
+};
+
+// Coalesces identical concurrent generations. The first caller for a key runs
+// the upstream request; callers arriving while it is in flight subscribe to
+// it instead of starting their own. Streamed pieces are stored once in the
+// flight's append-only pages that every subscriber reads, and a late joiner
+// replays them from the start. Nothing is cached once the flight lands. Thread-safe.
+class SingleFlight {
+public:
+    using Upstream = std::function<GenerationResult(const TokenCallback& on_token)>;
+    
+private:
+    static constexpr size_t PAGE_SIZE = 64 * 1024;
+    
+    struct Flight {
+        std::string key;
+        std::mutex mutex;
+        std::condition_variable changed;
+        // Pieces point into pages, which never move or shrink while the
+        // flight is alive, so readers use them without holding the lock
+        std::vector<std::unique_ptr<char[]>> pages;
+        size_t page_used = PAGE_SIZE;
+        std::vector<std::string_view> chunks;
+        size_t subscribers = 0;  // Attached callers besides the leader
+        bool done = false;
+        GenerationResult result;
+        std::exception_ptr error;
+    };
+    
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<Flight>> in_flight;
+    uint64_t upstream_requests = 0;
+    uint64_t coalesced_requests = 0;
+    uint64_t shared_chunks = 0;   // Chunk deliveries served from another caller's stream
+    uint64_t bytes_saved = 0;     // Reply bytes subscribers did not have to generate
+    uint64_t tokens_saved = 0;    // Prompt and reply tokens the server did not evaluate again
+    
+    // FNV-1a; the full key is compared as well, so a collision only costs a
+    // missed coalescing
+    static uint64_t hashKey(const std::string& key) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+    
+    // Copies a piece into the flight's pages; call with flight->mutex held
+    static void storeChunk(Flight& flight, std::string_view delta) {
+        if (delta.size() > PAGE_SIZE - flight.page_used) {
+            flight.pages.emplace_back(new char[std::max(PAGE_SIZE, delta.size())]);
+            flight.page_used = 0;
+        }
+        char* at = flight.pages.back().get() + flight.page_used;
+        std::memcpy(at, delta.data(), delta.size());
+        flight.page_used += delta.size();
+        flight.chunks.emplace_back(at, delta.size());
+    }
+    
+    GenerationResult lead(const std::shared_ptr<Flight>& flight, uint64_t hash, const TokenCallback& on_token,
+                          const Upstream& upstream) {
+        bool leader_attached = true;
+        TokenCallback publish = [&](std::string_view delta) {
+            std::unique_lock<std::mutex> lock(flight->mutex);
+            storeChunk(*flight, delta);
+            flight->changed.notify_all();
+            bool has_subscribers = flight->subscribers > 0;
+            lock.unlock();
+            
+            if (leader_attached && on_token) {
+                leader_attached = on_token(delta);
+            }
+            // Someone else still wants the reply even if the leader does not
+            return leader_attached || has_subscribers;
+        };
+        
+        // A caller giving up before the first token only stops the upstream
+        // request if nobody else has subscribed to it
+        const CancelScope* caller = CancelScope::current();
+        CancelScope cancel_scope([&] {
+            if (!caller || !caller->requested()) return false;
+            std::lock_guard<std::mutex> lock(flight->mutex);
+            return flight->subscribers == 0;
+        });
+        
+        GenerationResult result;
+        std::exception_ptr error;
+        try {
+            result = upstream(publish);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = in_flight.find(hash);
+            if (it != in_flight.end() && it->second == flight) {
+                in_flight.erase(it);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(flight->mutex);
+            // Non-streamed replies reach subscribers as a single piece
+            if (!error && flight->chunks.empty() && !result.text.empty()) {
+                storeChunk(*flight, result.text);
+            }
+            flight->result = result;
+            flight->error = error;
+            flight->done = true;
+        }
+        flight->changed.notify_all();
+        
+        if (error) std::rethrow_exception(error);
+        result.cancelled = result.cancelled || !leader_attached;
+        return result;
+    }
+    
+    // Runs the request again for a follower that was already given `shown`:
+    // that many bytes of the new stream are not delivered a second time, and
+    // the returned text starts with what the caller saw
+    static GenerationResult rerunAfter(const std::string& shown, const TokenCallback& on_token,
+                                       const Upstream& upstream) {
+        size_t skip = shown.size();
+        GenerationResult result = upstream([&](std::string_view delta) {
+            if (skip >= delta.size()) {
+                skip -= delta.size();
+                return true;
+            }
+            delta.remove_prefix(skip);
+            skip = 0;
+            return on_token(delta);
+        });
+        result.text = shown + (result.text.size() > shown.size() ? result.text.substr(shown.size()) : "");
+        return result;
+    }
+    
+    GenerationResult follow(const std::shared_ptr<Flight>& flight, const TokenCallback& on_token,
+                            const Upstream& upstream) {
+        std::vector<std::string_view> pending;
+        size_t next = 0;
+        const CancelScope* caller = CancelScope::current();
+        std::unique_lock<std::mutex> lock(flight->mutex);
+        while (true) {
+            auto ready = [&] { return flight->done || flight->chunks.size() > next; };
+            if (!caller) {
+                flight->changed.wait(lock, ready);
+            } else {
+                // Nothing arrives to cancel from while the leader is in prefill
+                while (!flight->changed.wait_for(lock, std::chrono::milliseconds(100), ready)) {
+                    lock.unlock();
+                    bool cancelled = caller->requested();
+                    lock.lock();
+                    if (cancelled) {
+                        --flight->subscribers;
+                        GenerationResult partial;
+                        partial.cancelled = true;
+                        for (size_t j = 0; j < next; ++j) {
+                            partial.text += flight->chunks[j];
+                        }
+                        return partial;
+                    }
+                }
+            }
+            // Copies views, not text
+            pending.assign(flight->chunks.begin() + static_cast<std::ptrdiff_t>(next), flight->chunks.end());
+            size_t first = next;
+            next = flight->chunks.size();
+            bool done = flight->done;
+            lock.unlock();
+            
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (on_token && !on_token(pending[i])) {
+                    GenerationResult partial;
+                    partial.cancelled = true;
+                    lock.lock();
+                    --flight->subscribers;
+                    for (size_t j = 0; j <= first + i; ++j) {
+                        partial.text += flight->chunks[j];
+                    }
+                    return partial;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> stats_lock(mutex);
+                shared_chunks += pending.size();
+            }
+            
+            lock.lock();
+            if (done) break;
+        }
+        --flight->subscribers;
+        if (flight->error) std::rethrow_exception(flight->error);
+        GenerationResult result = flight->result;
+        std::string shown;
+        if (result.cancelled && on_token) {
+            for (std::string_view chunk : flight->chunks) shown += chunk;
+        }
+        lock.unlock();
+        
+        // The leader's request was cut short; run our own, without passing on
+        // again what this caller has already been given
+        if (result.cancelled) {
+            return shown.empty() ? upstream(on_token) : rerunAfter(shown, on_token, upstream);
+        }
+        
+        std::lock_guard<std::mutex> stats_lock(mutex);
+        ++coalesced_requests;
+        bytes_saved += result.text.size();
+        tokens_saved += result.final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0)) +
+                        result.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+        return result;
+    }
+    
+public:
+    // `key` must describe the request completely; identical keys share one
+    // upstream call
+    GenerationResult run(const std::string& key, const TokenCallback& on_token, const Upstream& upstream) {
+        MemoryScope scope(MemoryAccounting::REQUEST);
+        uint64_t hash = hashKey(key);
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = in_flight.find(hash);
+            if (it == in_flight.end()) {
+                flight = std::make_shared<Flight>();
+                flight->key = key;
+                in_flight.emplace(hash, flight);
+                leader = true;
+                ++upstream_requests;
+            } else if (it->second->key == key) {
+                flight = it->second;
+                std::lock_guard<std::mutex> flight_lock(flight->mutex);
+                ++flight->subscribers;
+            } else {
+                ++upstream_requests;  // Hash collision: just run it alone
+            }
+        }
+        
+        if (!flight) return upstream(on_token);
+        return leader ? lead(flight, hash, on_token, upstream) : follow(flight, on_token, upstream);
+    }
+    
+    json statsJson() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {
+            {"upstream", upstream_requests},
+            {"coalesced", coalesced_requests},
+            {"in_flight", in_flight.size()},
+            {"shared_chunks", shared_chunks},
+            {"bytes_saved", bytes_saved},
+            {"tokens_saved", tokens_saved}
+        };
+    }
+};
+
+// Adaptive cap on concurrent generations per server and model. Ollama runs
+// OLLAMA_NUM_PARALLEL requests at once and queues the rest, so sending more
+// only moves the wait to the server, where it cannot be cancelled or seen.
+// Like TCP Vegas, the cap is steered by latency: each finished request gives
+// a sample of its time to first token minus the load and prefill time the
+// server reports, i.e. network time plus any wait for a slot. The baseline
+// is the lowest sample, pulled up only by requests that ran alone. A sample
+// well above it means the request queued at the server and lowers the cap by
+// one, at most once per window of requests admitted under the old cap;
+// otherwise, while the cap is in use, it grows by one per sample until the
+// first queueing is seen (which halves it) and by 1/cap per sample after
+// that. It settles at the server's slot count or one above, so a request is
+// ready whenever a slot frees up. Overload answers (timeouts, HTTP 429/503)
+// halve it. Callers past the cap wait here. Thread-safe.
+class ConcurrencyLimiter {
+public:
+    static constexpr double INITIAL_LIMIT = 4.0;
+    static constexpr double MAX_LIMIT = 64.0;
+    
+private:
+    static constexpr double WEIGHT = 0.3;       // Of the newest sample in the latency average
+    static constexpr double DRIFT = 0.1;        // Pull of a lone request on the baseline
+    static constexpr double TOLERANCE = 2.0;    // Latency growth taken as noise ...
+    static constexpr double SLACK_MS = 25.0;    // ... plus this much
+    
+    struct Limit {
+        double limit = INITIAL_LIMIT;
+        bool probing = true;     // No queueing seen yet
+        uint64_t admitted = 0;
+        uint64_t lowered_at = 0; // `admitted` when the cap last went down
+        uint32_t in_flight = 0;
+        uint32_t waiting = 0;
+        double latency_ms = 0.0;
+        double baseline_ms = 0.0;
+        uint64_t samples = 0;
+        uint64_t queued = 0;     // Samples that waited at the server
+        uint64_t drops = 0;
+        uint64_t waits = 0;      // Requests that had to wait for a slot here
+        uint64_t wait_ns = 0;
+        double peak = INITIAL_LIMIT;
+        
+        json toJson() const {
+            return {{"limit", static_cast<uint32_t>(limit)}, {"in_flight", in_flight}, {"waiting", waiting},
+                    {"latency_ms", latency_ms}, {"baseline_ms", baseline_ms}, {"samples", samples},
+                    {"queued", queued}, {"drops", drops}, {"waits", waits}, {"wait_ms", wait_ns / 1000000},
+                    {"peak", static_cast<uint32_t>(peak)}};
+        }
+    };
+    
+    mutable std::mutex mutex;
+    std::condition_variable released;
+    std::map<std::string, Limit> limits;
+    
+    static void update(Limit& state, double latency_ms, uint32_t in_flight, uint64_t sequence) {
+        if (state.samples++ == 0) {
+            state.latency_ms = state.baseline_ms = latency_ms;
+            return;
+        }
+        state.latency_ms += WEIGHT * (latency_ms - state.latency_ms);
+        if (latency_ms < state.baseline_ms) {
+            state.baseline_ms = latency_ms;
+        } else if (in_flight == 1) {
+            state.baseline_ms += DRIFT * (latency_ms - state.baseline_ms);  // Nothing to queue behind
+        }
+        
+        if (latency_ms > state.baseline_ms * TOLERANCE + SLACK_MS) {
+            ++state.queued;
+            if (sequence > state.lowered_at) {
+                // Growing by one per sample overshoots by up to half
+                state.limit = std::max(1.0, state.probing ? state.limit / 2 : state.limit - 1);
+                state.lowered_at = state.admitted;
+            }
+            state.probing = false;
+        } else if (in_flight >= state.limit / 2) {  // Below that there is no evidence either way
+            state.limit = std::min(MAX_LIMIT, state.limit + (state.probing ? 1.0 : 1.0 / state.limit));
+            state.peak = std::max(state.peak, state.limit);
+        }
+    }
+    
+public:
+    // One admitted request. Report how it went before it goes out of scope;
+    // an unreported permit frees its slot without teaching the limiter.
+    class Permit {
+    private:
+        friend class ConcurrencyLimiter;
+        ConcurrencyLimiter* owner = nullptr;
+        std::string key;
+        uint32_t in_flight = 0;  // Including this one, when admitted
+        uint64_t sequence = 0;
+        
+    public:
+        Permit() = default;
+        Permit(Permit&& other) noexcept
+            : owner(std::exchange(other.owner, nullptr)), key(std::move(other.key)), in_flight(other.in_flight),
+              sequence(other.sequence) {}
+        Permit(const Permit&) = delete;
+        Permit& operator=(const Permit&) = delete;
+        Permit& operator=(Permit&&) = delete;
+        
+        ~Permit() {
+            release();
+        }
+        
+        explicit operator bool() const {
+            return owner != nullptr;
+        }
+        
+        // Queueing latency of a finished request
+        void succeeded(double latency_ms) {
+            if (owner) owner->finish(*this, latency_ms, false);
+        }
+        
+        // The server was overloaded
+        void dropped() {
+            if (owner) owner->finish(*this, 0.0, true);
+        }
+        
+        void release() {
+            if (owner) owner->finish(*this, -1.0, false);
+        }
+    };
+    
+    // Waits for a slot under `key`. Returns an empty permit if `cancel` fires
+    // while waiting.
+    Permit acquire(const std::string& key, const CancelScope* cancel) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Limit& state = limits[key];
+        if (state.in_flight >= static_cast<uint32_t>(state.limit)) {
+            auto started = std::chrono::steady_clock::now();
+            ++state.waiting;
+            ++state.waits;
+            bool admitted = true;
+            while (state.in_flight >= static_cast<uint32_t>(state.limit)) {
+                released.wait_for(lock, std::chrono::milliseconds(100));
+                if (cancel && cancel->requested()) {
+                    admitted = false;
+                    break;
+                }
+            }
+            --state.waiting;
+            state.wait_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started).count());
+            if (!admitted) return Permit();
+        }
+        
+        Permit permit;
+        permit.owner = this;
+        permit.key = key;
+        permit.in_flight = ++state.in_flight;
+        permit.sequence = ++state.admitted;
+        return permit;
+    }
+    
+    // Negative latency: no sample
+    void finish(Permit& permit, double latency_ms, bool overloaded) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Limit& state = limits[permit.key];
+            --state.in_flight;
+            if (overloaded) {
+                ++state.drops;
+                state.probing = false;
+                state.limit = std::max(1.0, state.limit / 2);
+            } else if (latency_ms >= 0) {
+                update(state, latency_ms, permit.in_flight, permit.sequence);
+            }
+        }
+        permit.owner = nullptr;
+        released.notify_all();
+    }
+    
+    uint32_t limitFor(const std::string& key) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = limits.find(key);
+        return static_cast<uint32_t>(it != limits.end() ? it->second.limit : INITIAL_LIMIT);
+    }
+    
+    json statsJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        json stats = json::object();
+        for (const auto& [key, state] : limits) {
+            stats[key] = state.toJson();
+        }
+        return stats;
+    }
+};
+
+// Where inference runs. OllamaAssistant owns the conversation; a backend only
+// turns a message list into streamed text. Backends are thread-safe and may
+// be shared by many conversations.
+class InferenceBackend {
+protected:
+    mutable std::mutex stats_mutex;
+    RequestStats chat_stats;
+    std::atomic<uint32_t> queued_requests{0};
+    
+    // Counts a request as queued until it produces its first token or ends
+    class QueueSlot {
+    private:
+        std::atomic<uint32_t>* counter;
+        
+    public:
+        explicit QueueSlot(std::atomic<uint32_t>& queue) : counter(&queue) {
+            ++queue;
+        }
+        
+        ~QueueSlot() {
+            release();
+        }
+        
+        QueueSlot(const QueueSlot&) = delete;
+        QueueSlot& operator=(const QueueSlot&) = delete;
+        
+        void release() {
+            if (counter) {
+                --*counter;
+                counter = nullptr;
+            }
+        }
+    };
+    
+    void recordStats(RequestStats& stats, size_t body_size, const json& final_chunk,
+                     uint64_t stream_chunks, uint64_t stream_span_ns, uint64_t malformed_chunks = 0) {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats.record(body_size, final_chunk);
+        stats.malformed_chunks += malformed_chunks;
+        if (stream_chunks > 1) {
+            stats.recordStream(stream_chunks, stream_span_ns);
+        }
+    }
+    
+public:
+    virtual ~InferenceBackend() = default;
+    
+    virtual const char* name() const = 0;
+    virtual bool isAvailable() = 0;
+    virtual std::vector<std::string> listModels() = 0;
+    virtual GenerationResult chat(const std::string& model, const std::vector<json>& messages,
+                                  const json& options, bool stream, const TokenCallback& on_token) = 0;
+    virtual std::vector<float> embed(const std::string& model, const std::string& input) = 0;
+    
+    RequestStats getChatStats() const {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        return chat_stats;
+    }
+    
+    // Requests from this process still waiting for their first token
+    uint32_t queuedRequests() const {
+        return queued_requests.load();
+    }
+};
+
+// When a generation request gives up, checked from curl's progress callback
+// (about once a second) rather than as one fixed limit, so a reply that is
+// still streaming is never cut off and a dead server is noticed quickly.
+// Zero disables a limit.
+//   - connect_ms: establishing the TCP connection
+//   - first_token_ms: from sending to the first byte of the reply; when it runs
+//     out while the model is not resident yet (still loading), it is extended
+//     once by load_ms or twice the longest load_duration seen for the model
+//   - buffered_token_ms: a reply that is not streamed sends its first byte
+//     only once it is complete, so first_token_ms is extended by this much
+//     per token of num_predict (BUFFERED_TOKENS when it is unset)
+//   - idle_ms: between chunks once data is arriving
+//   - total_ms: the whole request, however it is progressing
+struct TimeoutPolicy {
+    static constexpr uint64_t BUFFERED_TOKENS = 2048;
+    
+    uint64_t connect_ms = 5000;
+    uint64_t first_token_ms = 120000;
+    uint64_t load_ms = 300000;
+    uint64_t buffered_token_ms = 100;
+    uint64_t idle_ms = 30000;
+    uint64_t total_ms = 0;
+    
+    // Wait for the first byte of a request with these options
+    uint64_t firstByteMs(bool streaming, const json& options) const {
+        if (streaming || first_token_ms == 0) return first_token_ms;
+        int64_t tokens = options.is_object() ? options.value("num_predict", static_cast<int64_t>(-1)) : -1;
+        return first_token_ms + (tokens < 0 ? BUFFERED_TOKENS : static_cast<uint64_t>(tokens)) * buffered_token_ms;
+    }
+    
+    json toJson() const {
+        return {{"connect_ms", connect_ms}, {"first_token_ms", first_token_ms}, {"load_ms", load_ms},
+                {"buffered_token_ms", buffered_token_ms}, {"idle_ms", idle_ms}, {"total_ms", total_ms}};
+    }
+};
+
+// Liveness and load of a server, probed in the background so nobody waits
+// on it: a cheap version request every few seconds (every second while the
+// server is down) over the pooled connections, plus the loaded-model list.
+// Keeps the up/down state and a moving average of probe latency. Readers get
+// a copy of the latest state. Thread-safe.
+class HealthMonitor {
+public:
+    using VersionProbe = std::function<bool(std::string& version)>;
+    using LoadQuery = std::function<bool(json& running)>;
+    
+    struct LoadedModel {
+        std::string name;
+        uint64_t size = 0;
+        uint64_t size_vram = 0;
+        std::string expires_at;
+    };
+    
+    struct Snapshot {
+        bool probed = false;  // A probe has finished
+        bool up = false;
+        double latency_ms = 0.0;  // Moving average over answered probes
+        double last_ms = 0.0;
+        std::string version;
+        uint64_t probes = 0;
+        uint64_t failures = 0;
+        uint32_t failing = 0;     // Failed probes in a row
+        std::chrono::steady_clock::time_point checked;
+        std::chrono::steady_clock::time_point since;  // Last change between up and down
+        std::vector<LoadedModel> loaded;
+        
+        // `name` with its tag, e.g. "llama3.2:latest"
+        const LoadedModel* find(const std::string& name) const {
+            for (const auto& model : loaded) {
+                if (model.name == name) return &model;
+            }
+            return nullptr;
+        }
+    };
+    
+    static constexpr std::chrono::milliseconds UP_INTERVAL{5000};
+    static constexpr std::chrono::milliseconds DOWN_INTERVAL{1000};
+    
+private:
+    static constexpr double WEIGHT = 0.2;  // Of the newest probe
+    
+    VersionProbe probe_version;
+    LoadQuery query_loaded;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    Snapshot state;
+    bool stopping = false;
+    bool requested = false;
+    std::thread thread;
+    
+    void probe() {
+        auto started = std::chrono::steady_clock::now();
+        std::string version;
+        bool up = probe_version(version);
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        json running;
+        bool have_loaded = up && query_loaded(running);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (!state.probed || state.up != up) state.since = now;
+        state.probed = true;
+        state.up = up;
+        state.checked = now;
+        ++state.probes;
+        if (!up) {
+            ++state.failures;
+            ++state.failing;
+            state.loaded.clear();
+            return;
+        }
+        state.failing = 0;
+        state.version = version;
+        state.last_ms = elapsed;
+        state.latency_ms = state.latency_ms > 0 ? (1 - WEIGHT) * state.latency_ms + WEIGHT * elapsed : elapsed;
+        if (have_loaded) {
+            state.loaded.clear();
+            for (const auto& entry : running.value("models", json::array())) {
+                state.loaded.push_back({entry.value("name", ""), entry.value("size", static_cast<uint64_t>(0)),
+                                        entry.value("size_vram", static_cast<uint64_t>(0)),
+                                        entry.value("expires_at", "")});
+            }
+        }
+    }
+    
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            probe();
+            lock.lock();
+            auto interval = state.up ? UP_INTERVAL : DOWN_INTERVAL;
+            wake.wait_for(lock, interval, [this] { return stopping || requested; });
+            requested = false;
+        }
+    }
+    
+public:
+    HealthMonitor(VersionProbe version, LoadQuery loaded)
+        : probe_version(std::move(version)), query_loaded(std::move(loaded)) {
+        thread = std::thread([this] { loop(); });
+    }
+    
+    ~HealthMonitor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+    
+    HealthMonitor(const HealthMonitor&) = delete;
+    HealthMonitor& operator=(const HealthMonitor&) = delete;
+    
+    Snapshot snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return state;
+    }
+    
+    // Probes again without waiting for the interval
+    void probeSoon() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requested = true;
+        }
+        wake.notify_all();
+    }
+    
+    // Waits up to `timeout` for the first probe; false if none finished
+    bool waitForFirst(std::chrono::milliseconds timeout) const {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (snapshot().probed) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return snapshot().probed;
+    }
+    
+    json toJson() const {
+        Snapshot current = snapshot();
+        json loaded = json::array();
+        for (const auto& model : current.loaded) {
+            loaded.push_back({{"name", model.name}, {"size", model.size}, {"size_vram", model.size_vram},
+                              {"expires_at", model.expires_at}});
+        }
+        return {{"probed", current.probed}, {"up", current.up}, {"latency_ms", current.latency_ms},
+                {"version", current.version}, {"probes", current.probes}, {"failures", current.failures},
+                {"failing", current.failing}, {"loaded", loaded}};
+    }
+};
+
+// The default backend: a separately running `ollama serve` over HTTP
+class OllamaHttpBackend : public InferenceBackend {
+private:
+    std::string base_url;
+    std::shared_ptr<ConnectionPool> pool;
+    std::shared_ptr<SingleFlight> single_flight;  // Null disables coalescing
+    std::shared_ptr<ConcurrencyLimiter> limiter;  // Null sends everything at once
+    std::mutex digests_mutex;
+    std::map<std::string, std::string> model_digests;  // "name:tag" -> digest from /api/tags
+    RequestStats generate_stats;
+    mutable std::mutex timeouts_mutex;
+    TimeoutPolicy timeouts;
+    std::map<std::string, uint64_t> load_ns;  // Longest load_duration seen per model
+    uint64_t timeouts_connect = 0;
+    uint64_t timeouts_first_token = 0;
+    uint64_t timeouts_idle = 0;
+    uint64_t timeouts_total = 0;
+    uint64_t load_extensions = 0;
+    std::mutex health_mutex;
+    std::unique_ptr<HealthMonitor> health;  // Last, so its thread stops first
+    
+    struct WriteCallback {
+        std::string data;
+    };
+    
+    static size_t WriteCallbackFunc(void* contents, size_t size, size_t nmemb, void* userp) {
+        size_t totalSize = size * nmemb;
+        std::string* response = static_cast<std::string*>(userp);
+        response->append((char*)contents, totalSize);
+        return totalSize;
+    }
+    
+    // Incremental NDJSON parser state for one streaming request
+    struct StreamState {
+        CURL* handle;
+        bool streaming;
+        const TokenCallback* on_token;
+        const CancelScope* cancel_scope = nullptr;
+        QueueSlot* queue_slot = nullptr;
+        long response_code = 0;
+        std::string pending;   // Incomplete trailing line
+        std::string raw;       // Whole body (non-streaming or error responses)
+        std::string delta;     // Current chunk's text, reused across chunks
+        GenerationResult result;
+        uint64_t content_chunks = 0;
+        uint64_t malformed_chunks = 0;
+        std::chrono::steady_clock::time_point first_chunk;
+        std::chrono::steady_clock::time_point last_chunk;
+        
+        // Timeout tracking
+        OllamaHttpBackend* backend = nullptr;
+        const std::string* model = nullptr;
+        TimeoutPolicy timeouts;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last_data;
+        std::chrono::steady_clock::time_point first_token_deadline;
+        uint64_t first_byte_ms = 0;   // first_token_ms, plus the buffered reply allowance
+        uint64_t received = 0;        // Body bytes so far
+        bool load_checked = false;
+        uint64_t* timeout_counter = nullptr;
+        std::string timeout_reason;   // Set when a limit ended the request
+    };
+    
+    // Decodes the JSON string starting after its opening quote into `out`.
+    // Returns false on anything unexpected so the caller can fall back to a
+    // full parse.
+    static bool unescapeJsonString(std::string_view text, std::string& out) {
+        out.clear();
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (++i >= text.size()) return false;
+            switch (text[i]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    auto hex = [&](size_t at, uint32_t& value) {
+                        if (at + 4 > text.size()) return false;
+                        value = 0;
+                        for (size_t k = at; k < at + 4; ++k) {
+                            char h = text[k];
+                            value <<= 4;
+                            if (h >= '0' && h <= '9') value |= h - '0';
+                            else if (h >= 'a' && h <= 'f') value |= h - 'a' + 10;
+                            else if (h >= 'A' && h <= 'F') value |= h - 'A' + 10;
+                            else return false;
+                        }
+                        return true;
+                    };
+                    uint32_t code;
+                    if (!hex(i + 1, code)) return false;
+                    i += 4;
+                    if (code >= 0xD800 && code <= 0xDBFF) {
+                        uint32_t low;
+                        if (i + 2 >= text.size() || text[i + 1] != '\\' || text[i + 2] != 'u' ||
+                            !hex(i + 3, low) || low < 0xDC00 || low > 0xDFFF) return false;
+                        i += 6;
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    if (code < 0x80) {
+                        out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        out += static_cast<char>(0xC0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else if (code < 0x10000) {
+                        out += static_cast<char>(0xE0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        out += static_cast<char>(0xF0 | (code >> 18));
+                        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        out += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;  // Unterminated
+    }
+    
+    // Position just past `"key":` (whitespace allowed around the colon and
+    // after it), or npos. A quote inside a JSON string is always escaped, so
+    // the pattern can only match a real key.
+    static size_t findValue(std::string_view line, std::string_view quoted_key) {
+        size_t at = line.find(quoted_key);
+        if (at == std::string_view::npos) return at;
+        at += quoted_key.size();
+        auto skipSpace = [&] {
+            while (at < line.size() && (line[at] == ' ' || line[at] == '\t')) ++at;
+        };
+        skipSpace();
+        if (at >= line.size() || line[at] != ':') return std::string_view::npos;
+        ++at;
+        skipSpace();
+        return at;
+    }
+    
+    // Fast path for the intermediate chunks, which only carry a text delta:
+    // finds message.content (chat) or response (generate) without building a
+    // json tree, decoding into the reused state.delta buffer. Returns false
+    // when the line needs a full parse.
+    static bool scanDelta(StreamState& state, std::string_view line) {
+        size_t done = findValue(line, "\"done\"");
+        if (done == std::string_view::npos || line.compare(done, 5, "false") != 0) return false;
+        size_t value = findValue(line, "\"content\"");
+        if (value == std::string_view::npos) {
+            value = findValue(line, "\"response\"");
+        }
+        if (value >= line.size() || line[value] != '"') return false;
+        return unescapeJsonString(line.substr(value + 1), state.delta);
+    }
+    
+    // Returns false if the token callback asked to stop
+    static bool handleLine(StreamState& state, std::string_view line) {
+        if (line.size() >= 6 && line.substr(0, 6) == "data: ") {
+            line.remove_prefix(6); // Remove "data: "
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line == "[DONE]") return true;
+        
+        json chunk;
+        bool scanned = scanDelta(state, line);
+        if (!scanned) {
+            try {
+                chunk = json::parse(line);
+            } catch (const json::exception&) {
+                ++state.malformed_chunks;  // Skipped; counted in the request stats
+                return true;
+            }
+            
+            // /api/chat streams message.content, /api/generate streams response
+            state.delta.clear();
+            if (chunk.contains("message") && chunk["message"].contains("content")) {
+                state.delta = chunk["message"]["content"].get_ref<const std::string&>();
+            } else if (chunk.contains("response") && chunk["response"].is_string()) {
+                state.delta = chunk["response"].get_ref<const std::string&>();
+            }
+        }
+        
+        bool keep_going = true;
+        if (!state.delta.empty()) {
+            auto now = std::chrono::steady_clock::now();
+            if (state.content_chunks++ == 0) {
+                state.first_chunk = now;
+                if (state.queue_slot) state.queue_slot->release();
+            }
+            state.last_chunk = now;
+            state.result.text += state.delta;
+            if (state.on_token && *state.on_token) {
+                keep_going = (*state.on_token)(state.delta);
+            }
+        }
+        if (!scanned && chunk.value("done", false)) {
+            state.result.final_chunk = std::move(chunk);
+        }
+        return keep_going;
+    }
+    
+    static size_t StreamCallbackFunc(void* contents, size_t size, size_t nmemb, void* userp) {
+        size_t totalSize = size * nmemb;
+        StreamState& state = *static_cast<StreamState*>(userp);
+        const char* data = static_cast<const char*>(contents);
+        state.received += totalSize;
+        state.last_data = std::chrono::steady_clock::now();
+        
+        if (state.response_code == 0) {
+            curl_easy_getinfo(state.handle, CURLINFO_RESPONSE_CODE, &state.response_code);
+        }
+        if (!state.streaming || state.response_code != 200) {
+            state.raw.append(data, totalSize);
+            return totalSize;
+        }
+        
+        state.pending.append(data, totalSize);
+        size_t start = 0;
+        size_t newline;
+        while ((newline = state.pending.find('\n', start)) != std::string::npos) {
+            std::string_view line(state.pending.data() + start, newline - start);
+            start = newline + 1;
+            if (!handleLine(state, line)) {
+                state.result.cancelled = true;
+                return 0;  // Aborts the transfer
+            }
+        }
+        state.pending.erase(0, start);
+        return totalSize;
+    }
+    
+    static std::string seconds(uint64_t ms) {
+        std::ostringstream text;
+        text << ms / 1000.0 << " s";
+        return text.str();
+    }
+    
+    static int timeOut(StreamState& state, uint64_t& counter, const std::string& reason) {
+        state.timeout_counter = &counter;
+        state.timeout_reason = reason;
+        return 1;  // Aborts the transfer
+    }
+    
+    static int ProgressCallbackFunc(void* userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+        StreamState& state = *static_cast<StreamState*>(userp);
+        if (state.cancel_scope && state.cancel_scope->requested()) {
+            state.result.cancelled = true;
+            return 1;  // Aborts the transfer
+        }
+        
+        const TimeoutPolicy& policy = state.timeouts;
+        OllamaHttpBackend& backend = *state.backend;
+        auto now = std::chrono::steady_clock::now();
+        if (policy.total_ms > 0 && now - state.start > std::chrono::milliseconds(policy.total_ms)) {
+            return timeOut(state, backend.timeouts_total, "exceeded the total budget of " + seconds(policy.total_ms));
+        }
+        if (state.received == 0) {
+            if (policy.first_token_ms == 0 || now < state.first_token_deadline) return 0;
+            if (!state.load_checked) {
+                state.load_checked = true;
+                uint64_t size = 0;
+                uint64_t size_vram = 0;
+                if (backend.modelResidency(*state.model, size, size_vram) && size == 0) {
+                    uint64_t allowance = policy.load_ms;
+                    {
+                        std::lock_guard<std::mutex> lock(backend.timeouts_mutex);
+                        auto it = backend.load_ns.find(*state.model);
+                        if (it != backend.load_ns.end()) allowance = std::max(allowance, 2 * it->second / 1000000);
+                        ++backend.load_extensions;
+                    }
+                    state.first_token_deadline += std::chrono::milliseconds(allowance);
+                    return 0;
+                }
+            }
+            return timeOut(state, backend.timeouts_first_token, "no reply within " + seconds(state.first_byte_ms) +
+                           (state.load_checked ? " (plus the model load allowance)" : ""));
+        }
+        if (policy.idle_ms > 0 && now - state.last_data > std::chrono::milliseconds(policy.idle_ms)) {
+            return timeOut(state, backend.timeouts_idle, "no data for " + seconds(policy.idle_ms) +
+                           (state.streaming ? " while streaming" : " while receiving the reply"));
+        }
+        return 0;
+    }
+    
+    // With the health monitor running, a server that failed its last probes
+    // fails requests at once instead of after the connect timeout
+    void failIfDown() {
+        HealthMonitor* monitor = getHealth();
+        if (!monitor) return;
+        HealthMonitor::Snapshot health = monitor->snapshot();
+        if (!health.probed || health.up || health.failing < 2) return;
+        monitor->probeSoon();
+        throw ConnectionError("Ollama at " + base_url + " is not answering (" + std::to_string(health.failing) +
+                              " health probes failed in a row)\nMake sure Ollama is running: ollama serve");
+    }
+    
+    std::string limiterKey(const std::string& model) const {
+        return base_url + " " + withDefaultTag(model);
+    }
+    
+    // Time to first token (or to the whole body) minus the work the server
+    // reports: what was spent waiting for a slot and on the network
+    static double queueingMs(const StreamState& state) {
+        const json& chunk = state.result.final_chunk;
+        auto until = state.content_chunks > 0 ? state.first_chunk : state.last_data;
+        double elapsed = std::chrono::duration<double, std::milli>(until - state.start).count();
+        uint64_t busy_ns = chunk.value("load_duration", static_cast<uint64_t>(0)) +
+                           chunk.value("prompt_eval_duration", static_cast<uint64_t>(0));
+        if (state.content_chunks == 0) {
+            busy_ns += chunk.value("eval_duration", static_cast<uint64_t>(0));
+        }
+        return std::max(0.0, elapsed - busy_ns / 1e6);
+    }
+    
+    // Small JSON request helper for the metadata endpoints; returns false on
+    // transport, HTTP or parse errors.
+    bool requestJson(const std::string& path, const json* body, json& result, long timeout) {
+        MemoryScope scope(MemoryAccounting::REQUEST);
+        ConnectionPool::Handle handle = pool->acquire();
+        CURL* curl = handle.get();
+        WriteCallback response;
+        std::string url = base_url + path;
+        std::string body_string = body ? body->dump() : std::string();
+        struct curl_slist* headers = nullptr;
+        
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallbackFunc);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.data);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+        if (body) {
+            headers = curl_slist_append(headers, "Content-Type: application/json");
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body_string.c_str());
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        } else {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        }
+        
+        CURLcode res = curl_easy_perform(curl);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+        curl_slist_free_all(headers);
+        
+        long response_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (res != CURLE_OK || response_code != 200) return false;
+        
+        try {
+            result = json::parse(response.data);
+        } catch (const json::exception&) {
+            return false;
+        }
+        return true;
+    }
+    
+    void rememberDigests(const json& tags) {
+        std::lock_guard<std::mutex> lock(digests_mutex);
+        for (const auto& model : tags.value("models", json::array())) {
+            if (model.contains("name") && model.contains("digest")) {
+                model_digests[withDefaultTag(model["name"])] = model["digest"];
+            }
+        }
+    }
+    
+    // Posts a chat or generate payload, streaming the reply through on_token.
+    // Identical payloads already in flight are joined rather than re-sent;
+    // json objects keep their keys sorted, so dump() is a canonical form.
+    GenerationResult performGeneration(const std::string& path, const json& payload, const std::string& model,
+                                       RequestStats& stats, const TokenCallback& on_token) {
+        if (!single_flight) {
+            return performUpstream(path, payload, model, stats, on_token);
+        }
+        json key_payload = payload;
+        key_payload.erase("stream");  // Streamed and buffered callers can share a flight
+        return single_flight->run(path + " " + key_payload.dump(), on_token, [&](const TokenCallback& publish) {
+            return performUpstream(path, payload, model, stats, publish);
+        });
+    }
+    
+    GenerationResult performUpstream(const std::string& path, const json& payload, const std::string& model,
+                                     RequestStats& stats, const TokenCallback& on_token) {
+        MemoryScope scope(MemoryAccounting::REQUEST);
+        failIfDown();
+        QueueSlot queue_slot(queued_requests);
+        ConcurrencyLimiter::Permit permit = limiter ? limiter->acquire(limiterKey(model), CancelScope::current())
+                                                    : ConcurrencyLimiter::Permit();
+        if (limiter && !permit) {
+            GenerationResult cancelled;
+            cancelled.cancelled = true;
+            return cancelled;
+        }
+        ConnectionPool::Handle handle = pool->acquire();
+        CURL* curl = handle.get();
+        std::string url = base_url + path;
+        std::string json_string = payload.dump();
+
+        // Set up HTTP headers
+        struct curl_slist* headers = nullptr;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+
+        StreamState state;
+        state.handle = curl;
+        state.streaming = payload.value("stream", true);
+        state.on_token = &on_token;
+        state.queue_slot = &queue_slot;
+        state.cancel_scope = CancelScope::current();
+        state.backend = this;
+        state.model = &model;
+        state.timeouts = getTimeoutPolicy();
+        state.start = std::chrono::steady_clock::now();
+        state.first_byte_ms = state.timeouts.firstByteMs(state.streaming, payload.value("options", json()));
+        state.first_token_deadline = state.start + std::chrono::milliseconds(state.first_byte_ms);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallbackFunc);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &state);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(state.timeouts.connect_ms));
+
+        // Configure curl options
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_string.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamCallbackFunc);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);  // Enforced by ProgressCallbackFunc
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+
+        // Perform the request
+        CURLcode res = curl_easy_perform(curl);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);  // The handle goes back to the pool
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 0L);
+        curl_slist_free_all(headers);
+
+        if ((res == CURLE_WRITE_ERROR || res == CURLE_ABORTED_BY_CALLBACK) && state.result.cancelled) {
+            return std::move(state.result);
+        }
+        if (res == CURLE_OPERATION_TIMEDOUT && state.received == 0) {
+            state.timeout_counter = &timeouts_connect;
+            state.timeout_reason = "could not connect within " + seconds(state.timeouts.connect_ms);
+        }
+        if (state.timeout_counter) {
+            {
+                std::lock_guard<std::mutex> lock(timeouts_mutex);
+                ++*state.timeout_counter;
+            }
+            if (state.timeout_counter != &timeouts_connect) permit.dropped();
+            throw TimeoutError("Request to " + base_url + path + " timed out: " + state.timeout_reason);
+        }
+        if (res != CURLE_OK) {
+            throw ConnectionError("HTTP request failed: " + std::string(curl_easy_strerror(res)) + 
+                                  "\nMake sure Ollama is running: ollama serve");
+        }
+
+        // Check HTTP response code
+        long response_code;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+        if (response_code != 200) {
+            if (response_code == 429 || response_code == 503) permit.dropped();
+            throw std::runtime_error("Ollama API request failed with HTTP " + std::to_string(response_code) + 
+                                    ": " + state.raw + 
+                                    "\nMake sure the model '" + model + "' is installed: ollama pull " + model);
+        }
+
+        // Parse JSON response
+        if (state.streaming) {
+            if (!state.pending.empty()) {
+                handleLine(state, state.pending);
+            }
+        } else {
+            // Fallback for non-streaming
+            try {
+                state.result.final_chunk = json::parse(state.raw);
+                const json& chunk = state.result.final_chunk;
+                if (chunk.contains("message") && chunk["message"].contains("content")) {
+                    state.result.text = chunk["message"]["content"];
+                } else if (chunk.contains("response") && chunk["response"].is_string()) {
+                    state.result.text = chunk["response"];
+                }
+            } catch (const json::exception& e) {
+                throw std::runtime_error("JSON parsing error: " + std::string(e.what()));
+            }
+        }
+
+        recordStats(stats, json_string.size(), state.result.final_chunk, state.content_chunks, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(state.last_chunk - state.first_chunk).count()),
+            state.malformed_chunks);
+        uint64_t load_duration = state.result.final_chunk.value("load_duration", static_cast<uint64_t>(0));
+        if (load_duration > 0) {
+            std::lock_guard<std::mutex> lock(timeouts_mutex);
+            uint64_t& longest = load_ns[model];
+            longest = std::max(longest, load_duration);
+        }
+        // Only a reply that ran to its done chunk is a latency sample
+        if (state.result.final_chunk.value("done", false) && !state.result.cancelled) {
+            permit.succeeded(queueingMs(state));
+        }
+        return std::move(state.result);
+    }
+    
+public:
+    explicit OllamaHttpBackend(const std::string& url = "http://localhost:11434",
+                               std::shared_ptr<ConnectionPool> connection_pool = nullptr,
+                               std::shared_ptr<SingleFlight> coalescer = nullptr,
+                               std::shared_ptr<ConcurrencyLimiter> concurrency = nullptr)
+        : base_url(url), pool(connection_pool ? std::move(connection_pool) : std::make_shared<ConnectionPool>()),
+          single_flight(std::move(coalescer)), limiter(std::move(concurrency)) {}
+    
+    static std::string withDefaultTag(const std::string& name) {
+        size_t slash = name.rfind('/');
+        size_t colon = name.rfind(':');
+        if (colon != std::string::npos && (slash == std::string::npos || colon > slash)) {
+            return name;
+        }
+        return name + ":latest";
+    }
+    
+    const char* name() const override {
+        return "ollama";
+    }
+    
+    const std::string& getBaseUrl() const {
+        return base_url;
+    }
+    
+    void setTimeoutPolicy(const TimeoutPolicy& policy) {
+        std::lock_guard<std::mutex> lock(timeouts_mutex);
+        timeouts = policy;
+    }
+    
+    TimeoutPolicy getTimeoutPolicy() const {
+        std::lock_guard<std::mutex> lock(timeouts_mutex);
+        return timeouts;
+    }
+    
+    // Requests ended by each limit, and first-token deadlines extended
+    // because the model was still loading
+    json timeoutStatsJson() const {
+        std::lock_guard<std::mutex> lock(timeouts_mutex);
+        return {{"connect", timeouts_connect}, {"first_token", timeouts_first_token}, {"idle", timeouts_idle},
+                {"total", timeouts_total}, {"load_extensions", load_extensions}};
+    }
+    
+    // /api/version rather than /api/tags: the server answers it without
+    // listing every installed model
+    bool isAvailable() override {
+        std::string version;
+        return probeVersion(version, 5L);
+    }
+    
+    bool probeVersion(std::string& version, long timeout = 2L) {
+        json result;
+        if (!requestJson("/api/version", nullptr, result, timeout)) return false;
+        version = result.value("version", "");
+        return true;
+    }
+    
+    // Starts probing the server in the background; see HealthMonitor
+    HealthMonitor& startHealthMonitor() {
+        std::lock_guard<std::mutex> lock(health_mutex);
+        if (!health) {
+            health = std::make_unique<HealthMonitor>(
+                [this](std::string& version) { return probeVersion(version); },
+                [this](json& running) { return requestJson("/api/ps", nullptr, running, 2L); });
+        }
+        return *health;
+    }
+    
+    // Null until startHealthMonitor
+    HealthMonitor* getHealth() {
+        std::lock_guard<std::mutex> lock(health_mutex);
+        return health.get();
+    }
+    
+    std::vector<std::string> listModels() override {
+        std::vector<std::string> models;
+        json tags;
+        if (requestJson("/api/tags", nullptr, tags, 10L)) {
+            rememberDigests(tags);
+            for (const auto& model : tags.value("models", json::array())) {
+                if (model.contains("name")) {
+                    models.push_back(model["name"]);
+                }
+            }
+        }
+        return models;
+    }
+    
+    // Digest of an installed model, refreshing /api/tags once if unknown
+    std::string getDigest(const std::string& model) {
+        std::string key = withDefaultTag(model);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            {
+                std::lock_guard<std::mutex> lock(digests_mutex);
+                auto it = model_digests.find(key);
+                if (it != model_digests.end()) return it->second;
+            }
+            if (attempt == 0) listModels();
+        }
+        return std::string();
+    }
+    
+    bool show(const std::string& model, json& result) {
+        json body = {{"model", model}};
+        return requestJson("/api/show", &body, result, 10L);
+    }
+    
+    // Memory the server holds for a loaded model, from /api/ps. Returns false
+    // when the server cannot be asked; `size` is 0 if the model is not loaded.
+    bool modelResidency(const std::string& model, uint64_t& size, uint64_t& size_vram) {
+        json running;
+        if (!requestJson("/api/ps", nullptr, running, 2L)) return false;
+        size = 0;
+        size_vram = 0;
+        std::string key = withDefaultTag(model);
+        for (const auto& entry : running.value("models", json::array())) {
+            if (withDefaultTag(entry.value("name", "")) == key) {
+                size = entry.value("size", static_cast<uint64_t>(0));
+                size_vram = entry.value("size_vram", static_cast<uint64_t>(0));
+                break;
+            }
+        }
+        return true;
+    }
+    
+    GenerationResult chat(const std::string& model, const std::vector<json>& messages,
+                          const json& options, bool stream, const TokenCallback& on_token) override {
+        // Prepare JSON payload for Ollama chat API
+        json payload = {
+            {"model", model},
+            {"messages", messages},
+            {"stream", stream}
+        };
+        if (!options.empty()) {
+            payload["options"] = options;
+        }
+        return performGeneration("/api/chat", payload, model, chat_stats, on_token);
+    }
+    
+    // /api/generate with an already rendered prompt. A non-null `context`
+    // continues from the token array returned by a previous call.
+    GenerationResult generate(const std::string& model, const std::string& prompt, const json& context,
+                              const json& options, bool stream, const TokenCallback& on_token) {
+        json payload = {
+            {"model", model},
+            {"prompt", prompt},
+            {"template", "{{ .Prompt }}"},
+            {"stream", stream}
+        };
+        if (!context.is_null()) {
+            payload["context"] = context;
+        }
+        if (!options.empty()) {
+            payload["options"] = options;
+        }
+        return performGeneration("/api/generate", payload, model, generate_stats, on_token);
+    }
+    
+    std::vector<float> embed(const std::string& model, const std::string& input) override {
+        json body = {{"model", model}, {"input", input}};
+        json result;
+        if (!requestJson("/api/embed", &body, result, 60L)) {
+            throw std::runtime_error("Embedding request failed for model '" + model + "'");
+        }
+        std::vector<float> embedding;
+        if (result.contains("embeddings") && !result["embeddings"].empty()) {
+            embedding = result["embeddings"][0].get<std::vector<float>>();
+        }
+        return embedding;
+    }
+    
+    RequestStats getGenerateStats() const {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        return generate_stats;
+    }
+    
+    ConnectionPool& getConnectionPool() {
+        return *pool;
+    }
+    
+    // Null when coalescing is off
+    SingleFlight* getSingleFlight() {
+        return single_flight.get();
+    }
+    
+    ConcurrencyLimiter* getLimiter() {
+        return limiter.get();
+    }
+    
+    // Current concurrency cap for `model` on this server
+    uint32_t concurrencyLimit(const std::string& model) const {
+        return limiter ? limiter->limitFor(limiterKey(model)) : 0;
+    }
+};
+
+#ifdef OLLAMA_WITH_LLAMA_CPP
+// Runs GGUF models in-process through llama.cpp on the CPU, so no server,
+// HTTP or JSON sits in the token path. Models are found through the same
+// Ollama manifests as the registry, or given directly as a .gguf path.
+class LlamaCppBackend : public InferenceBackend {
+private:
+    OllamaModelStore store;
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    std::string loaded_model;
+    uint32_t loaded_ctx = 0;
+    std::vector<llama_token> cached_tokens;  // What the KV cache currently holds
+    int n_threads;
+    std::mutex engine_mutex;  // One llama_context: requests run one at a time
+    
+    static constexpr uint32_t DEFAULT_CTX = 4096;
+    static constexpr int32_t BATCH_SIZE = 512;
+    
+    static uint64_t elapsedNs(std::chrono::steady_clock::time_point since) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - since).count());
+    }
+    
+    std::string resolvePath(const std::string& name) const {
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".gguf") == 0) {
+            return name;
+        }
+        std::filesystem::path blob = store.findModelBlob(name);
+        if (blob.empty()) {
+            throw std::runtime_error("Model '" + name + "' is not installed locally: ollama pull " + name);
+        }
+        return blob.string();
+    }
+    
+    void unload() {
+        if (ctx) llama_free(ctx);
+        if (model) llama_model_free(model);
+        ctx = nullptr;
+        model = nullptr;
+        loaded_model.clear();
+        loaded_ctx = 0;
+        cached_tokens.clear();
+    }
+    
+    // Returns the model load time in nanoseconds (0 if already loaded)
+    uint64_t ensureLoaded(const std::string& name, uint32_t n_ctx) {
+        if (model && ctx && loaded_model == name && n_ctx <= loaded_ctx) return 0;
+        
+        auto start = std::chrono::steady_clock::now();
+        if (!model || loaded_model != name) {
+            unload();
+            llama_model_params mparams = llama_model_default_params();
+            mparams.n_gpu_layers = 0;
+            model = llama_model_load_from_file(resolvePath(name).c_str(), mparams);
+            if (!model) {
+                throw std::runtime_error("llama.cpp failed to load model '" + name + "'");
+            }
+            loaded_model = name;
+        }
+        
+        if (ctx) llama_free(ctx);
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = n_ctx;
+        cparams.n_batch = BATCH_SIZE;
+        cparams.n_threads = n_threads;
+        cparams.n_threads_batch = n_threads;
+        ctx = llama_init_from_model(model, cparams);
+        if (!ctx) {
+            throw std::runtime_error("llama.cpp failed to create a context for '" + name + "'");
+        }
+        loaded_ctx = n_ctx;
+        cached_tokens.clear();
+        return elapsedNs(start);
+    }
+    
+    // A trailing assistant message is a reply to continue: it follows the
+    // assistant header open, as Ollama renders it
+    std::string applyTemplate(const std::vector<json>& messages) const {
+        size_t count = messages.size();
+        std::string prefix;
+        if (count > 1 && messages.back()["role"] == "assistant") {
+            prefix = messages.back()["content"].get<std::string>();
+            --count;
+        }
+        std::vector<llama_chat_message> chat;
+        chat.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            chat.push_back({messages[i]["role"].get_ref<const std::string&>().c_str(),
+                            messages[i]["content"].get_ref<const std::string&>().c_str()});
+        }
+        
+        const char* tmpl = llama_model_chat_template(model, nullptr);
+        std::vector<char> buf(4096);
+        int32_t n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), static_cast<int32_t>(buf.size()));
+        if (n > static_cast<int32_t>(buf.size())) {
+            buf.resize(n);
+            n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, buf.data(), static_cast<int32_t>(buf.size()));
+        }
+        if (n < 0) {
+            // Template not supported by llama.cpp: use our own renderer
+            std::vector<json> turns(messages.begin(), messages.begin() + count);
+            return PromptTemplate::detect(tmpl ? tmpl : "").render(turns, 0) + prefix;
+        }
+        return std::string(buf.data(), n) + prefix;
+    }
+    
+    std::vector<llama_token> tokenize(const std::string& text, bool add_special) const {
+        const llama_vocab* vocab = llama_model_get_vocab(model);
+        int32_t n = -llama_tokenize(vocab, text.data(), static_cast<int32_t>(text.size()), nullptr, 0, add_special, true);
+        std::vector<llama_token> tokens(n);
+        if (llama_tokenize(vocab, text.data(), static_cast<int32_t>(text.size()), tokens.data(), n, add_special, true) < 0) {
+            throw std::runtime_error("llama.cpp failed to tokenize the prompt");
+        }
+        return tokens;
+    }
+    
+    void decode(llama_token* tokens, size_t count) {
+        for (size_t i = 0; i < count; i += BATCH_SIZE) {
+            int32_t n = static_cast<int32_t>(std::min<size_t>(BATCH_SIZE, count - i));
+            if (llama_decode(ctx, llama_batch_get_one(tokens + i, n)) != 0) {
+                cached_tokens.clear();
+                throw std::runtime_error("llama.cpp decode failed");
+            }
+        }
+    }
+    
+public:
+    LlamaCppBackend() : n_threads(static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))) {
+        llama_backend_init();
+    }
+    
+    ~LlamaCppBackend() override {
+        unload();
+        llama_backend_free();
+    }
+    
+    const char* name() const override {
+        return "llama.cpp";
+    }
+    
+    bool isAvailable() override {
+        return true;
+    }
+    
+    std::vector<std::string> listModels() override {
+        return store.listInstalled();
+    }
+    
+    GenerationResult chat(const std::string& model_name, const std::vector<json>& messages,
+                          const json& options, bool /*stream*/, const TokenCallback& on_token) override {
+        QueueSlot queue_slot(queued_requests);
+        std::lock_guard<std::mutex> lock(engine_mutex);
+        queue_slot.release();
+        if (CancelScope::cancelled()) {
+            GenerationResult abandoned;
+            abandoned.cancelled = true;
+            return abandoned;
+        }
+        auto request_start = std::chrono::steady_clock::now();
+        uint32_t n_ctx = options.value("num_ctx", DEFAULT_CTX);
+        int64_t n_predict = options.value("num_predict", static_cast<int64_t>(-1));
+        uint64_t load_ns = ensureLoaded(model_name, n_ctx);
+        
+        std::vector<llama_token> tokens = tokenize(applyTemplate(messages), true);
+        if (tokens.size() >= loaded_ctx) {
+            throw std::runtime_error("Prompt of " + std::to_string(tokens.size()) + 
+                                    " tokens does not fit the context of " + std::to_string(loaded_ctx));
+        }
+        
+        // Keep the KV cache for the prefix shared with the previous request;
+        // at least one token must be decoded to get fresh logits
+        size_t keep = 0;
+        while (keep < cached_tokens.size() && keep < tokens.size() && cached_tokens[keep] == tokens[keep]) {
+            ++keep;
+        }
+        if (keep == tokens.size()) --keep;
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, static_cast<llama_pos>(keep), -1);
+        cached_tokens.assign(tokens.begin(), tokens.end());
+        
+        auto prefill_start = std::chrono::steady_clock::now();
+        decode(tokens.data() + keep, tokens.size() - keep);
+        uint64_t prefill_ns = elapsedNs(prefill_start);
+        
+        llama_sampler* sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(sampler, llama_sampler_init_top_k(options.value("top_k", 40)));
+        llama_sampler_chain_add(sampler, llama_sampler_init_top_p(options.value("top_p", 0.9f), 1));
+        llama_sampler_chain_add(sampler, llama_sampler_init_temp(options.value("temperature", 0.8f)));
+        llama_sampler_chain_add(sampler, llama_sampler_init_dist(options.value("seed", LLAMA_DEFAULT_SEED)));
+        
+        const llama_vocab* vocab = llama_model_get_vocab(model);
+        GenerationResult result;
+        std::string done_reason = "stop";
+        uint64_t eval_count = 0;
+        uint64_t eval_ns = 0;
+        char piece[256];
+        
+        try {
+            while (true) {
+                if (n_predict >= 0 && static_cast<int64_t>(eval_count) >= n_predict) {
+                    done_reason = "length";
+                    break;
+                }
+                if (cached_tokens.size() >= loaded_ctx) {
+                    done_reason = "length";
+                    break;
+                }
+                
+                llama_token token = llama_sampler_sample(sampler, ctx, -1);
+                if (llama_vocab_is_eog(vocab, token)) break;
+                
+                int32_t n = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+                std::string_view delta(piece, n > 0 ? n : 0);
+                result.text += delta;
+                ++eval_count;
+                
+                auto eval_start = std::chrono::steady_clock::now();
+                cached_tokens.push_back(token);
+                decode(&token, 1);
+                eval_ns += elapsedNs(eval_start);
+                
+                if ((on_token && !delta.empty() && !on_token(delta)) || CancelScope::cancelled()) {
+                    result.cancelled = true;
+                    break;
+                }
+            }
+        } catch (...) {
+            llama_sampler_free(sampler);
+            throw;
+        }
+        llama_sampler_free(sampler);
+        
+        result.final_chunk = {
+            {"model", model_name},
+            {"done", true},
+            {"done_reason", done_reason},
+            {"load_duration", load_ns},
+            {"prompt_eval_count", tokens.size() - keep},
+            {"prompt_eval_duration", prefill_ns},
+            {"eval_count", eval_count},
+            {"eval_duration", eval_ns},
+            {"total_duration", elapsedNs(request_start)}
+        };
+        recordStats(chat_stats, 0, result.final_chunk, eval_count, elapsedNs(prefill_start) - prefill_ns);
+        return result;
+    }
+    
+    std::vector<float> embed(const std::string& model_name, const std::string& input) override {
+        std::lock_guard<std::mutex> lock(engine_mutex);
+        ensureLoaded(model_name, DEFAULT_CTX);
+        
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = DEFAULT_CTX;
+        cparams.n_batch = DEFAULT_CTX;
+        cparams.n_threads = n_threads;
+        cparams.n_threads_batch = n_threads;
+        cparams.embeddings = true;
+        cparams.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        llama_context* embed_ctx = llama_init_from_model(model, cparams);
+        if (!embed_ctx) {
+            throw std::runtime_error("llama.cpp failed to create an embedding context");
+        }
+        
+        std::vector<llama_token> tokens = tokenize(input, true);
+        if (tokens.size() > DEFAULT_CTX) tokens.resize(DEFAULT_CTX);
+        std::vector<float> embedding;
+        if (llama_decode(embed_ctx, llama_batch_get_one(tokens.data(), static_cast<int32_t>(tokens.size()))) == 0) {
+            if (const float* values = llama_get_embeddings_seq(embed_ctx, 0)) {
+                embedding.assign(values, values + llama_model_n_embd(model));
+            }
+        }
+        llama_free(embed_ctx);
+        return embedding;
+    }
+};
+#endif
+
+// Line-based unified diffs, used to send a file the model has already seen
+// as just its changes. Lines are interned to integers and the common prefix
+// and suffix are skipped. The rest is aligned with patience diff on lines
+// unique to both sides, and the gaps between those with Myers' O(ND)
+// algorithm.
+class LineDiff {
+private:
+    static constexpr int MAX_DEPTH = 32;  // Patience levels before plain Myers
+    
+    static void splitLines(std::string_view text, std::vector<std::string_view>& lines) {
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == std::string_view::npos) end = text.size();
+            lines.push_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    
+    // Appends the shortest edit script between a and b as '=', '-' and '+'
+    // per line, or returns false when it needs more than max_edits
+    // insertions and deletions (Myers)
+    static bool myers(const uint32_t* a, size_t a_size, const uint32_t* b, size_t b_size, size_t max_edits,
+                      std::string& ops) {
+        const int n = static_cast<int>(a_size);
+        const int m = static_cast<int>(b_size);
+        const int limit = static_cast<int>(std::min<size_t>(a_size + b_size, max_edits));
+        const int offset = n + m + 1;
+        std::vector<int> v(2 * offset + 1, 0);
+        // Frontier before each step d, for k in [-d, d]; O(D^2) in total
+        std::vector<std::vector<int>> trace;
+        int found = -1;
+        for (int d = 0; d <= limit && found < 0; ++d) {
+            trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+            for (int k = -d; k <= d; k += 2) {
+                int x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]))
+                    ? v[offset + k + 1] : v[offset + k - 1] + 1;
+                int y = x - k;
+                while (x < n && y < m && a[x] == b[y]) {
+                    ++x;
+                    ++y;
+                }
+                v[offset + k] = x;
+                if (x >= n && y >= m) {
+                    found = d;
+                    break;
+                }
+            }
+        }
+        if (found < 0) return false;
+        
+        size_t first = ops.size();
+        int x = n;
+        int y = m;
+        for (int d = found; d > 0; --d) {
+            const std::vector<int>& frontier = trace[d];
+            auto at = [&](int k) { return frontier[k + d]; };
+            int k = x - y;
+            bool down = k == -d || (k != d && at(k - 1) < at(k + 1));
+            int prev_k = down ? k + 1 : k - 1;
+            int prev_x = at(prev_k);
+            int prev_y = prev_x - prev_k;
+            int snake_x = down ? prev_x : prev_x + 1;
+            while (x > snake_x) {
+                ops += '=';
+                --x;
+                --y;
+            }
+            ops += down ? '+' : '-';
+            x = prev_x;
+            y = prev_y;
+        }
+        ops.append(static_cast<size_t>(x), '=');
+        std::reverse(ops.begin() + static_cast<std::ptrdiff_t>(first), ops.end());
+        return true;
+    }
+    
+    // Appends the edit script between a and b. Lines occurring exactly once
+    // on each side, in the same order on both, are matched first; the gaps
+    // between them are diffed the same way, and with Myers once no such
+    // lines are left. Keeps code diffs aligned on distinctive lines such as
+    // function headers rather than on braces and blank lines.
+    static bool patience(const uint32_t* a, size_t n, const uint32_t* b, size_t m, size_t max_edits, int depth,
+                         std::string& ops) {
+        size_t prefix = 0;
+        while (prefix < n && prefix < m && a[prefix] == b[prefix]) ++prefix;
+        size_t suffix = 0;
+        while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix]) ++suffix;
+        ops.append(prefix, '=');
+        a += prefix;
+        b += prefix;
+        n -= prefix + suffix;
+        m -= prefix + suffix;
+        
+        bool ok = true;
+        std::vector<std::pair<size_t, size_t>> anchors;
+        if (n > 0 && m > 0 && depth > 0) {
+            struct Occurrences {
+                uint32_t in_a = 0;
+                uint32_t in_b = 0;
+                size_t at_b = 0;
+            };
+            std::unordered_map<uint32_t, Occurrences> counts;
+            for (size_t i = 0; i < n; ++i) {
+                ++counts[a[i]].in_a;
+            }
+            for (size_t j = 0; j < m; ++j) {
+                auto it = counts.find(b[j]);
+                if (it != counts.end()) {
+                    ++it->second.in_b;
+                    it->second.at_b = j;
+                }
+            }
+            std::vector<std::pair<size_t, size_t>> unique;  // (line in a, line in b), ordered by a
+            for (size_t i = 0; i < n; ++i) {
+                const Occurrences& found = counts[a[i]];
+                if (found.in_a == 1 && found.in_b == 1) unique.emplace_back(i, found.at_b);
+            }
+            
+            // Longest run increasing in b as well, by patience sorting
+            std::vector<size_t> tails;
+            std::vector<size_t> previous(unique.size(), SIZE_MAX);
+            for (size_t k = 0; k < unique.size(); ++k) {
+                auto pile = std::lower_bound(tails.begin(), tails.end(), unique[k].second,
+                                             [&](size_t tail, size_t line) { return unique[tail].second < line; });
+                if (pile != tails.begin()) previous[k] = *(pile - 1);
+                if (pile == tails.end()) {
+                    tails.push_back(k);
+                } else {
+                    *pile = k;
+                }
+            }
+            for (size_t k = tails.empty() ? SIZE_MAX : tails.back(); k != SIZE_MAX; k = previous[k]) {
+                anchors.push_back(unique[k]);
+            }
+            std::reverse(anchors.begin(), anchors.end());
+        }
+        
+        if (anchors.empty()) {
+            ok = myers(a, n, b, m, max_edits, ops);
+        } else {
+            size_t a_done = 0;
+            size_t b_done = 0;
+            for (const auto& anchor : anchors) {
+                if (!patience(a + a_done, anchor.first - a_done, b + b_done, anchor.second - b_done, max_edits,
+                              depth - 1, ops)) return false;
+                ops += '=';
+                a_done = anchor.first + 1;
+                b_done = anchor.second + 1;
+            }
+            ok = patience(a + a_done, n - a_done, b + b_done, m - b_done, max_edits, depth - 1, ops);
+        }
+        ops.append(suffix, '=');
+        return ok;
+    }
+    
+public:
+    // Unified diff from `before` to `after` with `context` unchanged lines
+    // around each change, labelled with `path`. `out` is empty when the texts
+    // have the same lines. Returns false when a stretch between matched
+    // lines needs more than `max_edits` line edits; such a diff is rarely
+    // smaller than the file itself.
+    static bool unified(std::string_view before, std::string_view after, const std::string& path, std::string& out,
+                        size_t context = 3, size_t max_edits = 2000) {
+        out.clear();
+        std::vector<std::string_view> old_lines;
+        std::vector<std::string_view> new_lines;
+        splitLines(before, old_lines);
+        splitLines(after, new_lines);
+        
+        size_t prefix = 0;
+        while (prefix < old_lines.size() && prefix < new_lines.size() && old_lines[prefix] == new_lines[prefix]) {
+            ++prefix;
+        }
+        size_t suffix = 0;
+        while (suffix < old_lines.size() - prefix && suffix < new_lines.size() - prefix &&
+               old_lines[old_lines.size() - 1 - suffix] == new_lines[new_lines.size() - 1 - suffix]) {
+            ++suffix;
+        }
+        if (prefix == old_lines.size() && prefix == new_lines.size()) return true;
+        
+        std::unordered_map<std::string_view, uint32_t> ids;
+        auto intern = [&](size_t from, size_t to, const std::vector<std::string_view>& lines) {
+            std::vector<uint32_t> result;
+            result.reserve(to - from);
+            for (size_t i = from; i < to; ++i) {
+                result.push_back(ids.emplace(lines[i], static_cast<uint32_t>(ids.size())).first->second);
+            }
+            return result;
+        };
+        std::vector<uint32_t> a = intern(prefix, old_lines.size() - suffix, old_lines);
+        std::vector<uint32_t> b = intern(prefix, new_lines.size() - suffix, new_lines);
+        
+        std::string ops(prefix, '=');
+        if (!patience(a.data(), a.size(), b.data(), b.size(), max_edits, MAX_DEPTH, ops)) return false;
+        ops.append(suffix, '=');
+        
+        // Line numbers in each file before op i
+        std::vector<size_t> old_at(ops.size() + 1, 0);
+        std::vector<size_t> new_at(ops.size() + 1, 0);
+        for (size_t i = 0; i < ops.size(); ++i) {
+            old_at[i + 1] = old_at[i] + (ops[i] != '+');
+            new_at[i + 1] = new_at[i] + (ops[i] != '-');
+        }
+        
+        out = "--- " + path + "\n+++ " + path + "\n";
+        size_t i = 0;
+        while (i < ops.size()) {
+            while (i < ops.size() && ops[i] == '=') ++i;
+            if (i == ops.size()) break;
+            size_t start = i >= context ? i - context : 0;
+            size_t end = i;
+            while (end < ops.size()) {
+                if (ops[end] != '=') {
+                    ++end;
+                    continue;
+                }
+                size_t run_end = end;
+                while (run_end < ops.size() && ops[run_end] == '=') ++run_end;
+                if (run_end == ops.size() || run_end - end > 2 * context) {
+                    end = std::min(end + context, ops.size());
+                    break;
+                }
+                end = run_end;
+            }
+            
+            size_t old_count = old_at[end] - old_at[start];
+            size_t new_count = new_at[end] - new_at[start];
+            out += "@@ -" + std::to_string(old_at[start] + (old_count ? 1 : 0)) + "," + std::to_string(old_count) +
+                   " +" + std::to_string(new_at[start] + (new_count ? 1 : 0)) + "," + std::to_string(new_count) +
+                   " @@\n";
+            for (size_t j = start; j < end; ++j) {
+                std::string_view line = ops[j] == '+' ? new_lines[new_at[j]] : old_lines[old_at[j]];
+                out += ops[j] == '=' ? ' ' : ops[j];
+                out.append(line.data(), line.size());
+                out += '\n';
+            }
+            i = end;
+        }
+        return true;
+    }
+};
+
+// Shrinks pasted text and attachments before they enter the conversation,
+// in one pass over the input. Stages:
+//   - strip_ansi: terminal escape sequences (colors, cursor movement, titles)
+//   - normalize_whitespace: CRLF to LF, trailing blanks, runs of blank lines,
+//     and lines overwritten with a bare CR (progress bars) keep only their
+//     last text
+//   - collapse_repeats: min_repeats or more identical lines become the first
+//     one and a count, when that is shorter
+//   - drop_comments: whole-line // and # comments and /* */ blocks such as
+//     license headers; off by default, as it only makes sense for code
+// Bytes that need no attention are found 16 at a time with SSE2 where
+// available and copied in bulk.
+class PromptReducer {
+public:
+    struct Options {
+        bool strip_ansi = true;
+        bool normalize_whitespace = true;
+        bool collapse_repeats = true;
+        bool drop_comments = false;
+        size_t min_repeats = 3;
+        
+        // Every stage off: text passes through unchanged
+        static Options none() {
+            Options off;
+            off.strip_ansi = off.normalize_whitespace = off.collapse_repeats = off.drop_comments = false;
+            return off;
+        }
+    };
+    
+    struct Stats {
+        size_t input_bytes = 0;
+        size_t output_bytes = 0;
+        size_t escape_sequences = 0;
+        size_t collapsed_lines = 0;
+        size_t comment_lines = 0;
+        
+        size_t savedBytes() const {
+            return input_bytes > output_bytes ? input_bytes - output_bytes : 0;
+        }
+        
+        void add(const Stats& other) {
+            input_bytes += other.input_bytes;
+            output_bytes += other.output_bytes;
+            escape_sequences += other.escape_sequences;
+            collapsed_lines += other.collapsed_lines;
+            comment_lines += other.comment_lines;
+        }
+    };
+    
+private:
+    Options options;
+    
+    // Position of the next '\n', '\r' or ESC at or after `at`, or `size`
+    static size_t findSpecial(const char* data, size_t at, size_t size) {
+#if defined(__SSE2__)
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i carriage = _mm_set1_epi8('\r');
+        const __m128i escape = _mm_set1_epi8('\x1b');
+        for (; at + 16 <= size; at += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + at));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, carriage)),
+                                        _mm_cmpeq_epi8(block, escape));
+            int mask = _mm_movemask_epi8(hits);
+            if (mask != 0) return at + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+#endif
+        for (; at < size; ++at) {
+            char c = data[at];
+            if (c == '\n' || c == '\r' || c == '\x1b') return at;
+        }
+        return size;
+    }
+    
+    // Position just past the escape sequence starting at `at` (an ESC):
+    // CSI (ESC [ ... final byte), OSC (ESC ] ... BEL or ESC \) or a two-byte
+    // escape
+    static size_t skipEscape(const char* data, size_t at, size_t size) {
+        ++at;
+        if (at >= size) return at;
+        char kind = data[at++];
+        if (kind == '[') {
+            while (at < size && static_cast<unsigned char>(data[at]) >= 0x20 && static_cast<unsigned char>(data[at]) <= 0x3F) ++at;
+            return at < size ? at + 1 : at;
+        }
+        if (kind == ']') {
+            while (at < size) {
+                if (data[at] == '\a') return at + 1;
+                if (data[at] == '\x1b' && at + 1 < size && data[at + 1] == '\\') return at + 2;
+                if (data[at] == '\n') return at;  // Unterminated; never swallow lines
+                ++at;
+            }
+        }
+        return at;
+    }
+    
+    static bool isComment(std::string_view line, bool& in_block) {
+        size_t first = line.find_first_not_of(" \t");
+        std::string_view text = first == std::string_view::npos ? std::string_view() : line.substr(first);
+        if (in_block) {
+            size_t end = text.find("*/");
+            if (end == std::string_view::npos) return true;
+            in_block = false;
+            return text.find_first_not_of(" \t", end + 2) == std::string_view::npos;
+        }
+        if (text.compare(0, 2, "//") == 0) return true;
+        if (text.compare(0, 2, "/*") == 0) {
+            size_t end = text.find("*/", 2);
+            if (end == std::string_view::npos) {
+                in_block = true;
+                return true;
+            }
+            return text.find_first_not_of(" \t", end + 2) == std::string_view::npos;
+        }
+        // "# note", not "#include" or "#!/bin/sh"
+        return !text.empty() && text[0] == '#' && (text.size() == 1 || text[1] == ' ' || text[1] == '\t');
+    }
+    
+public:
+    PromptReducer() : PromptReducer(Options()) {}
+    
+    explicit PromptReducer(const Options& reducer_options) : options(reducer_options) {}
+    
+    const Options& getOptions() const {
+        return options;
+    }
+    
+    void setOptions(const Options& reducer_options) {
+        options = reducer_options;
+    }
+    
+    bool isEnabled() const {
+        return options.strip_ansi || options.normalize_whitespace || options.collapse_repeats || options.drop_comments;
+    }
+    
+    Stats reduce(std::string_view input, std::string& out) const {
+        Stats stats;
+        stats.input_bytes = input.size();
+        out.clear();
+        out.reserve(input.size());
+        const char* data = input.data();
+        const size_t size = input.size();
+        
+        size_t line_start = 0;      // Current line in `out`
+        size_t previous_start = 0;  // Last kept non-blank line in `out`
+        size_t previous_size = std::string::npos;
+        size_t repeats = 0;         // Copies of the previous line held back
+        size_t blank_lines = 0;
+        bool in_block_comment = false;
+        
+        // Emits held copies of the previous line, as a count when there are enough
+        auto flushRepeats = [&](size_t at) {
+            if (repeats == 0) return;
+            std::string held = "... (previous line repeated " + std::to_string(repeats) + " more times)\n";
+            if (repeats + 1 >= options.min_repeats && held.size() < repeats * (previous_size + 1)) {
+                stats.collapsed_lines += repeats;
+            } else {
+                held.clear();
+                for (size_t i = 0; i < repeats; ++i) {
+                    held.append(out, previous_start, previous_size);
+                    held += '\n';
+                }
+            }
+            out.insert(at, held);
+            line_start += held.size();
+            repeats = 0;
+        };
+        
+        auto finishLine = [&](bool newline) {
+            if (options.normalize_whitespace) {
+                size_t end = out.size();
+                while (end > line_start && (out[end - 1] == ' ' || out[end - 1] == '\t')) --end;
+                out.resize(end);
+            }
+            std::string_view line(out.data() + line_start, out.size() - line_start);
+            if (options.drop_comments && isComment(line, in_block_comment)) {
+                ++stats.comment_lines;
+                out.resize(line_start);
+                return;
+            }
+            if (line.empty()) {
+                // A blank line ends a run of repeats: held copies go out
+                // before it, and lines after it are not compared across it
+                flushRepeats(line_start);
+                previous_size = std::string::npos;
+                if (options.normalize_whitespace && ++blank_lines > 1) {
+                    out.resize(line_start);
+                    return;
+                }
+            } else {
+                blank_lines = 0;
+                if (options.collapse_repeats && previous_size == line.size() &&
+                    std::string_view(out.data() + previous_start, previous_size) == line) {
+                    ++repeats;
+                    out.resize(line_start);
+                    return;
+                }
+                flushRepeats(line_start);
+                previous_start = line_start;
+                previous_size = out.size() - line_start;
+            }
+            if (newline) out += '\n';
+            line_start = out.size();
+        };
+        
+        size_t at = 0;
+        while (at < size) {
+            size_t next = findSpecial(data, at, size);
+            out.append(data + at, next - at);
+            at = next;
+            if (at == size) break;
+            char c = data[at];
+            if (c == '\n') {
+                finishLine(true);
+                ++at;
+            } else if (c == '\x1b' && options.strip_ansi) {
+                at = skipEscape(data, at, size);
+                ++stats.escape_sequences;
+            } else if (c == '\r' && options.normalize_whitespace) {
+                if (at + 1 < size && data[at + 1] == '\n') {
+                    ++at;  // The newline ends the line
+                } else {
+                    out.resize(line_start);  // Overwritten by what follows
+                    ++at;
+                }
+            } else {
+                out += c;
+                ++at;
+            }
+        }
+        if (out.size() > line_start) {
+            finishLine(false);
+        }
+        flushRepeats(out.size());
+        stats.output_bytes = out.size();
+        return stats;
+    }
+};
+
+// Client-side stop conditions, checked against a reply as it streams in:
+//   - strings: any of a set of strings; the reply ends before it
+//   - first_block: the first fenced code block closes; the reply ends after
+//     its closing ``` (fences count only at the start of a line)
+//   - max_lines: the reply ends before the newline completing that line
+// The strings and the fence are matched with one Aho-Corasick automaton
+// whose state carries over between deltas, so a match split across chunks
+// is still found. A Matcher holds back the bytes that may begin a stop
+// string, so nothing after the cut point is ever shown.
+class StopRules {
+public:
+    struct Stats {
+        uint64_t stopped = 0;            // Replies ended by a rule
+        uint64_t tokens_generated = 0;   // By those replies, up to the cut
+        uint64_t tokens_saved = 0;       // Estimated tokens not generated
+        double seconds_saved = 0.0;      // Estimated time those would have taken
+        
+        json toJson() const {
+            return {{"stopped", stopped}, {"tokens_generated", tokens_generated},
+                    {"tokens_saved", tokens_saved}, {"seconds_saved", seconds_saved}};
+        }
+    };
+    
+private:
+    static constexpr const char* FENCE = "```";
+    
+    std::vector<std::string> strings;
+    bool first_block = false;
+    size_t max_lines = 0;
+    
+    // Automaton as a full transition table, states * 256
+    std::vector<uint32_t> next;
+    std::vector<uint32_t> depth;        // Length of the prefix each state stands for
+    std::vector<uint32_t> match_length; // Longest stop string ending in each state, 0 if none
+    std::vector<bool> fence;            // The fence ends in this state
+    
+    void build() {
+        std::vector<std::string> patterns = strings;
+        if (first_block) patterns.push_back(FENCE);
+        
+        next.assign(256, 0);
+        depth.assign(1, 0);
+        match_length.assign(1, 0);
+        fence.assign(1, false);
+        std::vector<bool> defined(256, false);  // Trie edges, before failure links fill the rest
+        for (size_t p = 0; p < patterns.size(); ++p) {
+            uint32_t state = 0;
+            for (unsigned char c : patterns[p]) {
+                size_t edge = state * 256 + c;
+                if (!defined[edge]) {
+                    uint32_t created = static_cast<uint32_t>(depth.size());
+                    next.resize(next.size() + 256, 0);
+                    defined.resize(defined.size() + 256, false);
+                    depth.push_back(depth[state] + 1);
+                    match_length.push_back(0);
+                    fence.push_back(false);
+                    next[edge] = created;
+                    defined[edge] = true;
+                }
+                state = next[edge];
+            }
+            if (first_block && p + 1 == patterns.size()) {
+                fence[state] = true;
+            } else {
+                match_length[state] = std::max<uint32_t>(match_length[state], static_cast<uint32_t>(patterns[p].size()));
+            }
+        }
+        
+        // Breadth-first: failure links turn missing edges into the
+        // transitions of the longest proper suffix, and outputs are inherited
+        std::vector<uint32_t> failure(depth.size(), 0);
+        std::vector<uint32_t> queue;
+        for (int c = 0; c < 256; ++c) {
+            if (defined[c]) queue.push_back(next[c]);
+        }
+        for (size_t head = 0; head < queue.size(); ++head) {
+            uint32_t state = queue[head];
+            match_length[state] = std::max(match_length[state], match_length[failure[state]]);
+            fence[state] = fence[state] || fence[failure[state]];
+            for (int c = 0; c < 256; ++c) {
+                size_t edge = state * 256 + c;
+                if (defined[edge]) {
+                    failure[next[edge]] = next[failure[state] * 256 + c];
+                    queue.push_back(next[edge]);
+                } else {
+                    next[edge] = next[failure[state] * 256 + c];
+                }
+            }
+        }
+    }
+    
+public:
+    StopRules() {
+        build();
+    }
+    
+    // Tracks one reply. Feed it the deltas in order; it passes on what is
+    // safe to show and reports when a rule fired.
+    class Matcher {
+    private:
+        const StopRules& rules;
+        uint32_t state = 0;
+        size_t seen = 0;        // Bytes fed so far
+        size_t emitted = 0;     // Bytes passed on
+        size_t cut = std::string::npos;
+        size_t lines = 0;
+        size_t fences = 0;
+        bool line_blank = true; // Only blanks since the last newline
+        uint64_t deltas = 0;
+        std::string held;       // Fed but not yet passed on: [emitted, seen)
+        const char* reason = "";
+        bool caller_stopped = false;  // `emit` returned false
+        
+    public:
+        explicit Matcher(const StopRules& stop_rules) : rules(stop_rules) {}
+        
+        // False once a rule has fired or `emit` returned false; the caller
+        // should stop the transfer
+        bool feed(std::string_view delta, const TokenCallback& emit) {
+            if (cut != std::string::npos || caller_stopped) return false;
+            ++deltas;
+            size_t base = seen;
+            for (size_t i = 0; i < delta.size(); ++i) {
+                unsigned char c = static_cast<unsigned char>(delta[i]);
+                size_t position = base + i;
+                bool at_line_start = line_blank;
+                state = rules.next[state * 256 + c];
+                if (c == '\n') {
+                    line_blank = true;
+                } else if (c != ' ' && c != '\t' && c != '`') {
+                    line_blank = false;
+                }
+                if (rules.match_length[state] > 0) {
+                    cut = position + 1 - rules.match_length[state];
+                    reason = "stop string";
+                } else if (rules.fence[state] && at_line_start) {
+                    line_blank = false;  // A fourth backtick is not another fence
+                    if (++fences == 2) {
+                        cut = position + 1;
+                        reason = "code block closed";
+                    }
+                } else if (c == '\n' && rules.max_lines > 0 && ++lines == rules.max_lines) {
+                    cut = position;
+                    reason = "line limit";
+                }
+                if (cut != std::string::npos) {
+                    held.append(delta.data(), i + 1);
+                    seen = position + 1;
+                    break;
+                }
+            }
+            if (cut == std::string::npos) {
+                held.append(delta.data(), delta.size());
+                seen += delta.size();
+            }
+            
+            // Everything before a possible stop string start can be shown
+            size_t safe = cut != std::string::npos ? cut : seen - std::min<size_t>(rules.depth[state], seen - emitted);
+            if (safe > emitted) {
+                caller_stopped = emit && !emit(std::string_view(held.data(), safe - emitted));
+                held.erase(0, safe - emitted);
+                emitted = safe;
+            }
+            return cut == std::string::npos && !caller_stopped;
+        }
+        
+        // Passes on what was held back, once the reply ended on its own.
+        // False if `emit` returned false, now or during feed().
+        bool finish(const TokenCallback& emit) {
+            if (!caller_stopped) {
+                if (cut == std::string::npos && !held.empty() && emit) {
+                    caller_stopped = !emit(held);
+                }
+                emitted = seen;
+            }
+            held.clear();
+            return !caller_stopped;
+        }
+        
+        bool callerStopped() const {
+            return caller_stopped;
+        }
+        
+        // Bytes of the reply passed on so far
+        size_t shown() const {
+            return emitted;
+        }
+        
+        bool fired() const {
+            return cut != std::string::npos;
+        }
+        
+        // Bytes of the reply to keep when a rule fired
+        size_t kept() const {
+            return cut;
+        }
+        
+        uint64_t getDeltas() const {
+            return deltas;
+        }
+        
+        const char* getReason() const {
+            return reason;
+        }
+    };
+    
+    bool empty() const {
+        return strings.empty() && !first_block && max_lines == 0;
+    }
+    
+    void addString(const std::string& text) {
+        if (text.empty() || std::find(strings.begin(), strings.end(), text) != strings.end()) return;
+        strings.push_back(text);
+        build();
+    }
+    
+    void setFirstBlock(bool enabled) {
+        first_block = enabled;
+        build();
+    }
+    
+    void setMaxLines(size_t count) {
+        max_lines = count;
+    }
+    
+    void clear() {
+        strings.clear();
+        first_block = false;
+        max_lines = 0;
+        build();
+    }
+    
+    const std::vector<std::string>& getStrings() const {
+        return strings;
+    }
+    
+    bool isFirstBlock() const {
+        return first_block;
+    }
+    
+    size_t getMaxLines() const {
+        return max_lines;
+    }
+    
+    json toJson() const {
+        return {{"strings", strings}, {"first_block", first_block}, {"max_lines", max_lines}};
+    }
+    
+    void fromJson(const json& rules) {
+        strings = rules.value("strings", std::vector<std::string>());
+        first_block = rules.value("first_block", false);
+        max_lines = rules.value("max_lines", static_cast<size_t>(0));
+        build();
+    }
+};
+
+// Files attached to one conversation, by path. Every version sent is
+// numbered and hashed. Attaching a file again sends only a unified diff
+// against the newest version the conversation still holds, or a one-line
+// note when it is unchanged, so earlier turns stay byte-identical and the
+// server's KV cache keeps covering them. Versions whose message has left the
+// conversation (cleared, failed or discarded turns) are forgotten.
+class FileAttachments {
+public:
+    struct Version {
+        uint32_t number = 0;
+        uint64_t hash = 0;
+        size_t message = 0;  // Index of the user message that carried it
+        std::string content;
+    };
+    
+    // What to put in the next user message for one file
+    struct Attachment {
+        std::string text;
+        uint32_t version = 0;
+        uint32_t base_version = 0;  // Version the diff is against; 0 when sent whole
+        bool unchanged = false;
+        size_t full_bytes = 0;      // Size of the block with the whole file
+    };
+    
+private:
+    static constexpr size_t VERSIONS_KEPT = 4;
+    
+    struct File {
+        uint32_t next_number = 1;
+        std::vector<Version> versions;  // Oldest first
+    };
+    
+    std::map<std::string, File> files;
+    uint64_t attached = 0;
+    uint64_t full_bytes = 0;   // What whole-file blocks would have cost
+    uint64_t sent_bytes = 0;
+    
+    static std::string fullBlock(const std::string& path, const Version& version) {
+        std::string block = marker(path, version) + ":\n```\n" + version.content;
+        if (!version.content.empty() && version.content.back() != '\n') block += '\n';
+        return block + "```\n\n";
+    }
+    
+public:
+    // FNV-1a, as for request keys
+    static uint64_t hash(std::string_view content) {
+        uint64_t value = 14695981039346656037ULL;
+        for (unsigned char c : content) {
+            value = (value ^ c) * 1099511628211ULL;
+        }
+        return value;
+    }
+    
+    // Heading that identifies a version inside its message
+    static std::string marker(const std::string& path, const Version& version) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hash_text(8, '0');
+        uint32_t top = static_cast<uint32_t>(version.hash >> 32);
+        for (int i = 7; i >= 0; --i, top >>= 4) {
+            hash_text[i] = digits[top & 0xF];
+        }
+        return "File " + path + " (version " + std::to_string(version.number) + ", " + hash_text + ")";
+    }
+    
+    // `message` is the index the next user message will have; `holds(path,
+    // version)` tells whether the conversation still contains a version
+    template <typename Holds>
+    Attachment attach(const std::string& path, std::string content, size_t message, Holds&& holds) {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        File& file = files[path];
+        file.versions.erase(std::remove_if(file.versions.begin(), file.versions.end(),
+                                           [&](const Version& version) { return !holds(path, version); }),
+                            file.versions.end());
+        
+        Version version;
+        version.hash = hash(content);
+        version.message = message;
+        version.content = std::move(content);
+        
+        Attachment result;
+        ++attached;
+        if (!file.versions.empty()) {
+            const Version& base = file.versions.back();
+            if (base.hash == version.hash && base.content == version.content) {
+                result.text = "File " + path + " is unchanged since version " + std::to_string(base.number) + " above.\n\n";
+                result.version = base.number;
+                result.unchanged = true;
+                result.full_bytes = fullBlock(path, base).size();
+                full_bytes += result.full_bytes;
+                sent_bytes += result.text.size();
+                return result;
+            }
+        }
+        
+        version.number = file.next_number++;
+        std::string full = fullBlock(path, version);
+        result.version = version.number;
+        result.full_bytes = full.size();
+        std::string diff;
+        if (!file.versions.empty()) {
+            const Version& base = file.versions.back();
+            if (LineDiff::unified(base.content, version.content, path, diff) && diff.size() < full.size()) {
+                result.text = marker(path, version) + ", changes since version " + std::to_string(base.number) +
+                              " above:\n```diff\n" + diff + "```\n\n";
+                result.base_version = base.number;
+            }
+        }
+        if (result.text.empty()) {
+            result.text = std::move(full);
+        }
+        full_bytes += result.full_bytes;
+        sent_bytes += result.text.size();
+        
+        file.versions.push_back(std::move(version));
+        if (file.versions.size() > VERSIONS_KEPT) {
+            file.versions.erase(file.versions.begin());
+        }
+        return result;
+    }
+    
+    void clear() {
+        files.clear();
+    }
+    
+    uint64_t getAttached() const {
+        return attached;
+    }
+    
+    uint64_t getFullBytes() const {
+        return full_bytes;
+    }
+    
+    uint64_t getSentBytes() const {
+        return sent_bytes;
+    }
+    
+    // Bytes of file content held for diffing
+    size_t byteSize() const {
+        size_t bytes = 0;
+        for (const auto& file : files) {
+            for (const auto& version : file.second.versions) {
+                bytes += version.content.size();
+            }
+        }
+        return bytes;
+    }
+    
+    // Newest versions only, for exportState
+    json toJson() const {
+        json all = json::array();
+        for (const auto& file : files) {
+            if (file.second.versions.empty()) continue;
+            const Version& version = file.second.versions.back();
+            all.push_back({
+                {"path", file.first},
+                {"next", file.second.next_number},
+                {"version", version.number},
+                {"hash", version.hash},
+                {"message", version.message},
+                {"content", version.content}
+            });
+        }
+        return all;
+    }
+    
+    void fromJson(const json& all) {
+        files.clear();
+        for (const auto& entry : all) {
+            File& file = files[entry.at("path").get<std::string>()];
+            file.next_number = entry.at("next");
+            Version version;
+            version.number = entry.at("version");
+            version.hash = entry.at("hash");
+            version.message = entry.at("message");
+            version.content = entry.at("content");
+            file.versions.push_back(std::move(version));
+        }
+    }
+};
+
+// Best-of-N sampling: the same message sent N times at once with different
+// seeds and temperatures, one reply picked afterwards. The first sample (the
+// leader) uses the conversation's own options and is the one streamed. The
+// others differ only in sampling options, so their prompts are the same
+// bytes and each server slot reuses its cached prefix. Pickers get every
+// reply, empty where a sample failed, and return the winner's index.
+class BestOf {
+public:
+    using Picker = std::function<size_t(const std::vector<std::string>& replies)>;
+    
+    struct Outcome {
+        std::vector<std::string> replies;  // Index 0 is the leader
+        size_t winner = 0;
+        size_t failed = 0;
+        double leader_ms = 0.0;            // The leader on its own
+        double wall_ms = 0.0;              // Until every sample was in
+    };
+    
+    struct Stats {
+        uint64_t runs = 0;
+        uint64_t samples = 0;
+        uint64_t failed = 0;
+        uint64_t leader_won = 0;
+        double leader_ms = 0.0;
+        double wall_ms = 0.0;
+    };
+    
+    static constexpr size_t MAX_SAMPLES = 8;
+    
+    // Options of sample `index` (> 0): temperatures spread over 0.4-1.0 and a
+    // seed of its own
+    static json sampleOptions(json options, size_t index, size_t count, uint32_t seed) {
+        options["temperature"] = 0.4 + 0.6 * static_cast<double>(index) / static_cast<double>(count);
+        options["seed"] = seed + index;
+        return options;
+    }
+    
+    // Contents of the last fenced code block, or "" without one
+    static std::string lastCodeBlock(const std::string& text) {
+        std::string code;
+        size_t at = 0;
+        while (true) {
+            size_t open = text.find("```", at);
+            if (open == std::string::npos || (open > 0 && text[open - 1] != '\n')) {
+                if (open == std::string::npos) break;
+                at = open + 3;
+                continue;
+            }
+            size_t body = text.find('\n', open);
+            if (body == std::string::npos) break;
+            size_t close = text.find("\n```", body);
+            if (close == std::string::npos) break;
+            code = text.substr(body + 1, close - body);
+            at = close + 4;
+        }
+        return code;
+    }
+    
+    // What a reply concludes, normalized for comparison: the text after the
+    // last "answer:" marker, else the last code block, else the last
+    // non-empty line; lowercased with whitespace collapsed
+    static std::string extractAnswer(const std::string& text) {
+        std::string lower = text;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::string answer;
+        size_t marker = lower.rfind("answer:");
+        if (marker != std::string::npos) {
+            size_t end = lower.find('\n', marker);
+            answer = lower.substr(marker + 7, end == std::string::npos ? std::string::npos : end - marker - 7);
+        } else {
+            answer = lastCodeBlock(lower);
+        }
+        if (answer.find_first_not_of(" \t\r\n") == std::string::npos) {
+            size_t end = lower.find_last_not_of(" \t\r\n");
+            size_t start = end == std::string::npos ? std::string::npos : lower.rfind('\n', end);
+            start = start == std::string::npos ? 0 : start + 1;
+            answer = end == std::string::npos ? std::string() : lower.substr(start, end + 1 - start);
+        }
+        
+        std::string normalized;
+        for (char c : answer) {
+            bool space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+            if (space) {
+                if (!normalized.empty() && normalized.back() != ' ') normalized += ' ';
+            } else if (c != '*' && c != '`') {
+                normalized += c;
+            }
+        }
+        while (!normalized.empty() && (normalized.back() == ' ' || normalized.back() == '.')) normalized.pop_back();
+        return normalized;
+    }
+    
+    // The first reply whose answer most replies agree on; `votes` gets the
+    // count. Ties go to the earlier sample, so the leader wins by default.
+    static size_t majority(const std::vector<std::string>& replies, size_t* votes = nullptr) {
+        std::vector<std::string> answers;
+        for (const auto& reply : replies) {
+            answers.push_back(reply.empty() ? std::string() : extractAnswer(reply));
+        }
+        size_t best = 0;
+        size_t best_count = 0;
+        for (size_t i = 0; i < answers.size(); ++i) {
+            if (replies[i].empty()) continue;
+            size_t count = static_cast<size_t>(std::count(answers.begin(), answers.end(), answers[i]));
+            if (count > best_count) {
+                best = i;
+                best_count = count;
+            }
+        }
+        if (votes) *votes = best_count;
+        return best;
+    }
+};
+
+// Draft-then-review turns: a fast model drafts the reply, shown as it
+// streams, and the conversation's model then revises the draft. The history
+// is prefilled on the reviewing model while the draft streams, so the review
+// itself only has to read the draft.
+struct DraftReview {
+    static constexpr const char* REVIEW_PROMPT =
+        "Review your answer above for mistakes, omissions and unclear parts. Reply with the corrected answer in "
+        "full and nothing else. If it needs no changes, repeat it unchanged.";
+    
+    struct Outcome {
+        std::string draft;
+        std::string revision;         // Empty when the review failed
+        std::string error;            // Why it failed
+        double first_token_ms = 0.0;  // Of the draft
+        double draft_ms = 0.0;
+        double review_ms = 0.0;       // From the end of the draft; a whole answer by the reviewing model
+    };
+    
+    struct Stats {
+        uint64_t turns = 0;
+        uint64_t revised = 0;         // Revision differs from the draft
+        uint64_t failed = 0;
+        double first_token_ms = 0.0;
+        double draft_ms = 0.0;
+        double review_ms = 0.0;
+    };
+};
+
+// Replies sent with a deadline and how they fared
+struct DeadlineStats {
+    uint64_t requests = 0;
+    uint64_t met = 0;           // Finished in time
+    uint64_t cut = 0;           // Still running at the deadline and cancelled there
+    uint64_t missed = 0;        // Finished late, e.g. a slow prefill
+    uint64_t last_planned = 0;  // num_predict chosen for the last one, 0 if unmeasured
+    double last_ms = 0.0;       // How long the last one took
+};
+
+// Follow-up requests made for replies cut off at the length limit
+struct ContinuationStats {
+    uint64_t replies = 0;        // Replies continued at least once
+    uint64_t requests = 0;       // Continuation requests
+    uint64_t truncated = 0;      // Replies still cut off after any continuations
+    uint64_t failed = 0;         // Continuations that failed; the reply so far was kept
+    uint64_t prompt_tokens = 0;  // Re-evaluated by continuations
+    uint64_t overhead_ns = 0;    // Their prompt evaluation and load time
+    uint64_t bytes = 0;          // Reply text they added
+};
+
+// Measured speed per model, shared by the conversations of a process:
+// moving averages of the decode rate (eval_count over eval_duration), the
+// prefill rate and the latency around them (total_duration minus load,
+// prefill and decode). Recent replies weigh most, so estimates follow the
+// drift as load on the machine changes. Used to fit replies to deadlines.
+class ThroughputTracker {
+public:
+    struct Estimate {
+        double eval_rate = 0.0;     // Tokens per second
+        double prefill_rate = 0.0;  // Prompt tokens per second
+        double overhead_s = 0.0;
+        uint64_t samples = 0;
+    };
+    
+private:
+    static constexpr double WEIGHT = 0.3;   // Of the newest sample
+    static constexpr double MARGIN = 0.9;   // Share of the budget planned for
+    
+    mutable std::mutex mutex;
+    std::map<std::string, Estimate> models;
+    
+    static void blend(double& average, double sample) {
+        average = average > 0 ? (1 - WEIGHT) * average + WEIGHT * sample : sample;
+    }
+    
+public:
+    void observe(const std::string& model, const json& final_chunk) {
+        uint64_t eval_count = final_chunk.value("eval_count", static_cast<uint64_t>(0));
+        uint64_t eval_ns = final_chunk.value("eval_duration", static_cast<uint64_t>(0));
+        if (eval_count < 2 || eval_ns == 0) return;
+        uint64_t prompt_count = final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+        uint64_t prompt_ns = final_chunk.value("prompt_eval_duration", static_cast<uint64_t>(0));
+        uint64_t total_ns = final_chunk.value("total_duration", static_cast<uint64_t>(0));
+        uint64_t busy_ns = final_chunk.value("load_duration", static_cast<uint64_t>(0)) + prompt_ns + eval_ns;
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        Estimate& estimate = models[model];
+        blend(estimate.eval_rate, eval_count * 1e9 / eval_ns);
+        if (prompt_count > 0 && prompt_ns > 0) {
+            blend(estimate.prefill_rate, prompt_count * 1e9 / prompt_ns);
+        }
+        if (total_ns > busy_ns) {
+            blend(estimate.overhead_s, (total_ns - busy_ns) / 1e9);
+        }
+        ++estimate.samples;
+    }
+    
+    // Rate seen by the client, for replies that ended without a final chunk
+    void observeStream(const std::string& model, uint64_t tokens, double seconds) {
+        if (tokens < 2 || seconds <= 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        Estimate& estimate = models[model];
+        blend(estimate.eval_rate, (tokens - 1) / seconds);
+        ++estimate.samples;
+    }
+    
+    Estimate estimate(const std::string& model) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = models.find(model);
+        return it != models.end() ? it->second : Estimate();
+    }
+    
+    // Tokens that can be generated within `seconds` after prefilling
+    // `prompt_tokens`, keeping a margin; 0 when the model was never measured
+    uint64_t tokensWithin(const std::string& model, double seconds, uint64_t prompt_tokens) const {
+        Estimate rates = estimate(model);
+        if (rates.eval_rate <= 0) return 0;
+        double prefill = rates.prefill_rate > 0 ? prompt_tokens / rates.prefill_rate : 0.0;
+        double left = seconds * MARGIN - prefill - rates.overhead_s;
+        return std::max<uint64_t>(1, static_cast<uint64_t>(std::max(0.0, left) * rates.eval_rate));
+    }
+};
+
+// Runtime options tuned per model by `autotune` (see AutoTuner), kept in
+// the user's config directory and merged into every request for that model.
+// Keyed by model name with its tag. Thread-safe.
+class ModelProfiles {
+public:
+    struct Profile {
+        json options = json::object();  // num_ctx, num_batch, num_gpu, num_thread
+        double prefill_rate = 0.0;      // Tokens per second when tuned
+        double decode_rate = 0.0;
+        std::string server;
+        std::string tuned_at;           // UTC, ISO 8601
+        
+        json toJson() const {
+            return {
+                {"options", options},
+                {"prefill_rate", prefill_rate},
+                {"decode_rate", decode_rate},
+                {"server", server},
+                {"tuned_at", tuned_at}
+            };
+        }
+        
+        static Profile fromJson(const json& data) {
+            Profile profile;
+            profile.options = data.value("options", json::object());
+            profile.prefill_rate = data.value("prefill_rate", 0.0);
+            profile.decode_rate = data.value("decode_rate", 0.0);
+            profile.server = data.value("server", "");
+            profile.tuned_at = data.value("tuned_at", "");
+            return profile;
+        }
+    };
+    
+private:
+    std::filesystem::path config_file;
+    std::map<std::string, Profile> entries;
+    mutable std::mutex mutex;
+    
+    void load() {
+        std::ifstream in(config_file);
+        if (!in) return;
+        try {
+            json data = json::parse(in);
+            json models = data.value("models", json::object());
+            for (const auto& entry : models.items()) {
+                if (entry.value().is_object()) {
+                    entries[entry.key()] = Profile::fromJson(entry.value());
+                }
+            }
+        } catch (const std::exception&) {
+            entries.clear();  // Hand-edited into invalid JSON; ignore it
+        }
+    }
+    
+    bool save() const {
+        std::error_code ec;
+        std::filesystem::create_directories(config_file.parent_path(), ec);
+        
+        json data = {{"models", json::object()}};
+        for (const auto& entry : entries) {
+            data["models"][entry.first] = entry.second.toJson();
+        }
+        
+        // Indented: this file is meant to be read and edited by hand
+        std::filesystem::path tmp = config_file;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) return false;
+            out << data.dump(2) << "\n";
+        }
+        std::filesystem::rename(tmp, config_file, ec);
+        return !ec;
+    }
+    
+public:
+    ModelProfiles() : config_file(assistantConfigDir() / "model_profiles.json") {
+        load();
+    }
+    
+    explicit ModelProfiles(const std::filesystem::path& file) : config_file(file) {
+        load();
+    }
+    
+    const std::filesystem::path& getFile() const {
+        return config_file;
+    }
+    
+    bool find(const std::string& model, Profile& result) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(OllamaHttpBackend::withDefaultTag(model));
+        if (it == entries.end()) return false;
+        result = it->second;
+        return true;
+    }
+    
+    // Options to send with each request. num_ctx is left out: ContextSizer
+    // starts at it instead (see startCtxFor).
+    json optionsFor(const std::string& model) const {
+        Profile profile;
+        if (!find(model, profile)) return json::object();
+        json options = profile.options;
+        options.erase("num_ctx");
+        return options;
+    }
+    
+    uint64_t startCtxFor(const std::string& model) const {
+        Profile profile;
+        if (!find(model, profile)) return 0;
+        return profile.options.value("num_ctx", static_cast<uint64_t>(0));
+    }
+    
+    // Returns false if the file could not be written
+    bool store(const std::string& model, const Profile& profile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[OllamaHttpBackend::withDefaultTag(model)] = profile;
+        return save();
+    }
+};
+
+// Searches Ollama's load-time options for the fastest profile of one model
+// on this host, by coordinate descent: each option is swept over its
+// candidates with the others held, until a pass changes nothing. Every
+// trial starts with an unscored warm-up request that absorbs the reload a
+// new option set causes. A measured run that reports a load of its own (the
+// model was evicted in between) is dropped and the trial warmed up again.
+// Each run starts with a distinct line so the prompt cache never skips the
+// prefill. Rates come from the durations the server reports.
+class AutoTuner {
+public:
+    static constexpr int64_t SERVER_DEFAULT = -1;  // Option not sent
+    
+    struct Dimension {
+        std::string option;
+        std::vector<int64_t> values;  // The first is the starting point
+    };
+    
+    struct Settings {
+        std::vector<Dimension> space;
+        uint64_t prompt_tokens = 512;  // Approximate size of the standard prompt
+        uint64_t predict_tokens = 128;
+        unsigned repeats = 2;          // Measured runs per trial
+        unsigned max_passes = 3;
+        double min_gain = 0.03;        // Smaller differences count as noise
+        double ctx_tolerance = 0.05;   // Larger num_ctx kept if this close to the best
+    };
+    
+    struct Trial {
+        json options = json::object();  // As sent; server defaults left out
+        bool ok = false;
+        std::string error;
+        double prefill_rate = 0.0;
+        double decode_rate = 0.0;
+        double score = 0.0;     // Generated tokens per second of a standard turn
+        double load_s = 0.0;    // Longest warm-up load
+        unsigned dropped = 0;   // Runs discarded because the model reloaded
+    };
+    
+    using Progress = std::function<void(const Trial&)>;
+    
+private:
+    static constexpr uint64_t RELOAD_NS = 250000000;  // load_duration of a real load
+    static constexpr unsigned MAX_DROPPED = 3;
+    
+    OllamaHttpBackend& backend;
+    std::string model;
+    Settings settings;
+    std::map<std::string, Trial> measured;  // By options.dump()
+    unsigned run_number = 0;
+    
+    std::string standardPrompt() {
+        static const char* const PARAGRAPH =
+            "The committee reviewed the quarterly report on the regional rail network. Ridership rose on the "
+            "coastal line after the timetable change, while the mountain branch lost passengers to the new "
+            "highway. Maintenance costs grew with the age of the rolling stock, and two stations still lack "
+            "step-free access. ";
+        std::string prompt = "Run " + std::to_string(++run_number) + ". Read these notes.\n\n";
+        while (prompt.size() < settings.prompt_tokens * 4) {
+            prompt += PARAGRAPH;
+        }
+        return prompt + "\n\nWrite a detailed summary of the notes above.\n";
+    }
+    
+    static uint64_t field(const json& chunk, const char* name) {
+        return chunk.value(name, static_cast<uint64_t>(0));
+    }
+    
+    Trial measure(const json& options) {
+        std::string key = options.dump();
+        auto cached = measured.find(key);
+        if (cached != measured.end()) return cached->second;
+        
+        Trial trial;
+        trial.options = options;
+        json request = options;
+        request["temperature"] = 0;
+        request["seed"] = 42;
+        try {
+            bool warm = false;
+            uint64_t prompt_count = 0, prompt_ns = 0, eval_count = 0, eval_ns = 0;
+            unsigned runs = 0;
+            while (runs < settings.repeats) {
+                if (!warm) {
+                    request["num_predict"] = 1;
+                    GenerationResult warmup = backend.generate(model, "Hello", json(), request, false, nullptr);
+                    trial.load_s = std::max(trial.load_s, field(warmup.final_chunk, "load_duration") / 1e9);
+                    warm = true;
+                }
+                request["num_predict"] = settings.predict_tokens;
+                GenerationResult run = backend.generate(model, standardPrompt(), json(), request, false, nullptr);
+                if (field(run.final_chunk, "load_duration") > RELOAD_NS) {
+                    if (++trial.dropped > MAX_DROPPED) {
+                        throw std::runtime_error("the model keeps reloading; is another client using it?");
+                    }
+                    warm = false;
+                    continue;
+                }
+                prompt_count += field(run.final_chunk, "prompt_eval_count");
+                prompt_ns += field(run.final_chunk, "prompt_eval_duration");
+                eval_count += field(run.final_chunk, "eval_count");
+                eval_ns += field(run.final_chunk, "eval_duration");
+                ++runs;
+            }
+            if (eval_count == 0 || eval_ns == 0) {
+                throw std::runtime_error("the server reported no eval timings");
+            }
+            trial.decode_rate = eval_count * 1e9 / eval_ns;
+            if (prompt_count > 0 && prompt_ns > 0) {
+                trial.prefill_rate = prompt_count * 1e9 / prompt_ns;
+            }
+            double seconds = settings.predict_tokens / trial.decode_rate;
+            if (trial.prefill_rate > 0) {
+                seconds += settings.prompt_tokens / trial.prefill_rate;
+            }
+            trial.score = settings.predict_tokens / seconds;
+            trial.ok = true;
+        } catch (const ConnectionError&) {
+            throw;  // Not a property of these options
+        } catch (const std::runtime_error& e) {
+            trial.error = e.what();  // E.g. more layers offloaded than fit
+        }
+        measured[key] = trial;
+        return trial;
+    }
+    
+    static json withValue(json options, const std::string& option, int64_t value) {
+        if (value == SERVER_DEFAULT) {
+            options.erase(option);
+        } else {
+            options[option] = value;
+        }
+        return options;
+    }
+    
+public:
+    AutoTuner(OllamaHttpBackend& http, const std::string& model_name, Settings tuning)
+        : backend(http), model(model_name), settings(std::move(tuning)) {}
+    
+    // Candidates for this host. Zero arguments mean unknown.
+    static std::vector<Dimension> defaultSpace(unsigned hardware_threads, uint64_t block_count,
+                                               uint64_t context_length) {
+        std::vector<Dimension> space;
+        
+        Dimension gpu{"num_gpu", {SERVER_DEFAULT, 0}};
+        if (block_count > 0) {
+            gpu.values.push_back(static_cast<int64_t>(block_count / 2));
+            gpu.values.push_back(static_cast<int64_t>(block_count + 1));  // Every layer and the output
+        } else {
+            gpu.values.push_back(999);
+        }
+        space.push_back(gpu);
+        
+        Dimension ctx{"num_ctx", {}};
+        for (int64_t size = static_cast<int64_t>(ContextSizer::MIN_CTX); size <= 32768; size *= 2) {
+            if (context_length == 0 || static_cast<uint64_t>(size) <= context_length) {
+                ctx.values.push_back(size);
+            }
+        }
+        if (!ctx.values.empty()) {
+            space.push_back(ctx);
+        }
+        
+        space.push_back({"num_batch", {SERVER_DEFAULT, 128, 256, 1024}});
+        
+        Dimension threads{"num_thread", {SERVER_DEFAULT}};
+        for (unsigned divisor : {4u, 2u, 1u}) {
+            int64_t count = static_cast<int64_t>(hardware_threads / divisor);
+            if (count > 0 && std::find(threads.values.begin(), threads.values.end(), count) == threads.values.end()) {
+                threads.values.push_back(count);
+            }
+        }
+        space.push_back(threads);
+        return space;
+    }
+    
+    // Runs the search and returns the trial it settled on (ok is false if no
+    // option set worked). `on_trial` sees each measured option set. A move
+    // must beat the fastest trial so far by min_gain. For num_ctx, the
+    // largest size within ctx_tolerance of the fastest is kept as a
+    // tie-break, so the result can trail fastest() by at most that much.
+    Trial run(const Progress& on_trial) {
+        json current = json::object();
+        for (const auto& dimension : settings.space) {
+            if (!dimension.values.empty()) {
+                current = withValue(current, dimension.option, dimension.values.front());
+            }
+        }
+        
+        auto measureAndReport = [&](const json& options) {
+            bool fresh = measured.find(options.dump()) == measured.end();
+            Trial trial = measure(options);
+            if (fresh && on_trial) on_trial(trial);
+            return trial;
+        };
+        
+        Trial point = measureAndReport(current);  // Trial at `current`
+        for (unsigned pass = 0; pass < settings.max_passes; ++pass) {
+            bool changed = false;
+            for (const auto& dimension : settings.space) {
+                double reference = fastest().score;  // Before this sweep; never lowered by a tie-break
+                std::vector<std::pair<int64_t, Trial>> results;
+                for (int64_t value : dimension.values) {
+                    results.emplace_back(value, measureAndReport(withValue(current, dimension.option, value)));
+                }
+                
+                const Trial* chosen = nullptr;
+                for (const auto& result : results) {
+                    if (result.second.ok && result.second.score > reference * (1 + settings.min_gain) &&
+                        (!chosen || result.second.score > chosen->score)) {
+                        chosen = &result.second;
+                    }
+                }
+                if (dimension.option == "num_ctx") {
+                    // Speed rarely depends on num_ctx until the cache spills out
+                    // of VRAM, so among sizes about as fast as the fastest
+                    // trial keep the largest
+                    double top = std::max(reference, chosen ? chosen->score : 0.0);
+                    int64_t largest = -1;
+                    for (const auto& result : results) {
+                        if (result.second.ok && result.second.score >= top * (1 - settings.ctx_tolerance) &&
+                            result.first > largest) {
+                            largest = result.first;
+                            chosen = &result.second;
+                        }
+                    }
+                }
+                
+                if (chosen && chosen->options != current) {
+                    current = chosen->options;
+                    point = *chosen;
+                    changed = true;
+                }
+            }
+            if (!changed) break;
+        }
+        return point;
+    }
+    
+    // Fastest trial measured so far (ok is false if none worked)
+    Trial fastest() const {
+        Trial top;
+        for (const auto& entry : measured) {
+            if (entry.second.ok && (!top.ok || entry.second.score > top.score)) {
+                top = entry.second;
+            }
+        }
+        return top;
+    }
+    
+    size_t trialCount() const {
+        return measured.size();
+    }
+};
+
+// Pieces shared by every conversation in a process: pooled connections, the
+// model metadata caches, measured throughput, the concurrency limits and the
+// tuned model profiles. All of them are thread-safe.
+struct ClientResources {
+    std::shared_ptr<ConnectionPool> pool;
+    std::shared_ptr<ModelRegistry> registry;
+    std::shared_ptr<ModelCapabilityCache> capability_cache;
+    std::shared_ptr<SingleFlight> single_flight;
+    std::shared_ptr<ColdCodec> cold_codec;
+    std::shared_ptr<ThroughputTracker> throughput;
+    std::shared_ptr<ConcurrencyLimiter> limiter;
+    std::shared_ptr<ModelProfiles> profiles;
+    
+    static ClientResources createDefault() {
+        return {
+            std::make_shared<ConnectionPool>(),
+            std::make_shared<ModelRegistry>(),
+            std::make_shared<ModelCapabilityCache>(),
+            std::make_shared<SingleFlight>(),
+            std::make_shared<ColdCodec>(),
+            std::make_shared<ThroughputTracker>(),
+            std::make_shared<ConcurrencyLimiter>(),
+            std::make_shared<ModelProfiles>()
+        };
+    }
+};
+
+// One conversation and its per-conversation tuning state. Not thread-safe:
+// each instance must be used by one thread at a time, while the backend and
+// resources behind it may be shared by many instances.
+class OllamaAssistant {
+private:
+    ClientResources resources;
+    std::shared_ptr<InferenceBackend> backend;
+    OllamaHttpBackend* http;  // Same object as `backend` when it talks to Ollama, else null
+    std::string model_name;
+    ConversationStore conversation;  // Cold turns compressed with resources.cold_codec
+    bool streaming_enabled;
+    ContextSizer context_sizer;
+    ModelCapabilities current_capabilities;
+    bool capabilities_loaded;
+    bool auto_context;
+    uint64_t last_prompt_eval_count;
+    uint64_t last_eval_count;
+    bool generate_mode;
+    CompactTokens generate_context;
+    std::string generate_context_model;
+    size_t generate_context_messages;  // History entries covered by generate_context
+    uint64_t context_reuses;
+    uint64_t context_fallbacks;
+    FileAttachments attachments;
+    StopRules stop_rules;
+    StopRules::Stats stop_stats;
+    double reply_tokens_average;  // Replies that ended on their own, for savings estimates
+    uint64_t default_deadline_ms;
+    DeadlineStats deadline_stats;
+    BestOf::Stats best_of_stats;
+    DraftReview::Stats draft_review_stats;
+    unsigned max_continuations;
+    ContinuationStats continuation_stats;
+    bool last_truncated;
+    
+    // Resolves the current model's capabilities: persistent cache by digest
+    // first, then /api/show, then the local GGUF header.
+    void loadCapabilities() {
+        capabilities_loaded = true;
+        current_capabilities = ModelCapabilities();
+        
+        std::string digest = http ? http->getDigest(model_name) : std::string();
+        if (!digest.empty() && !resources.capability_cache->find(digest, current_capabilities)) {
+            json show;
+            if (http->show(model_name, show)) {
+                current_capabilities = ModelCapabilities::fromShowResponse(show, digest);
+                resources.capability_cache->store(current_capabilities);
+            }
+        }
+        
+        if (const ModelInfo* info = resources.registry->lookup(model_name)) {
+            if (current_capabilities.context_length == 0) {
+                current_capabilities.context_length = info->context_length;
+            }
+            if (current_capabilities.template_text.empty()) {
+                current_capabilities.template_text = info->chat_template;
+            }
+        }
+        context_sizer.setModelLimit(current_capabilities.context_length);
+        context_sizer.setStartCtx(resources.profiles->startCtxFor(model_name));
+    }
+    
+    // /api/generate with a client-rendered prompt. The identity template
+    // keeps the server from templating while still returning `context`
+    // (raw:true responses carry none). When the previous turn's context is
+    // still valid only the new turn is sent; otherwise the whole history is.
+    GenerationResult sendGenerate(const json& options, const TokenCallback& on_token) {
+        PromptTemplate prompt_template = PromptTemplate::detect(getCapabilities().template_text);
+        size_t message_count = conversation.size();
+        
+        // Context covers everything up to the previous reply, so exactly one
+        // new (user) message may follow it
+        bool incremental = !generate_context.empty() && generate_context_model == model_name &&
+                           generate_context_messages + 1 == message_count;
+        if (incremental && context_sizer.getCurrentCtx() > 0 &&
+            generate_context.size() + context_sizer.estimateTokens(conversation.back()["content"].get_ref<const std::string&>().size()) +
+                ContextSizer::REPLY_HEADROOM > context_sizer.getCurrentCtx()) {
+            incremental = false;  // Would be truncated by the server
+        }
+        
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            // Incremental prompts only need the previous reply and the new
+            // turn, which are always in the hot tier
+            std::vector<json> scratch;
+            std::string prompt = incremental
+                ? prompt_template.render(conversation.materialize(generate_context_messages - 1), 1)
+                : prompt_template.render(conversation.view(scratch), 0);
+            GenerationResult result;
+            try {
+                result = http->generate(model_name, prompt, incremental ? generate_context.toJson() : json(),
+                                        options, streaming_enabled, on_token);
+            } catch (const ConnectionError&) {
+                throw;
+            } catch (const std::runtime_error&) {
+                if (!incremental) throw;
+                // The server rejected the context; retry with the full history
+                ++context_fallbacks;
+                generate_context.clear();
+                incremental = false;
+                continue;
+            }
+            
+            if (incremental) {
+                ++context_reuses;
+            }
+            if (result.cancelled) {
+                generate_context.clear();  // No context comes back, and the stored reply may be cut
+                return result;
+            }
+            
+            // The new context must extend the one we sent; anything else means
+            // the server re-tokenized differently and the tokens can't be trusted
+            const json& final_chunk = result.final_chunk;
+            const json& context = final_chunk.contains("context") ? final_chunk["context"] : json();
+            if (incremental && !generate_context.isPrefixOf(context)) {
+                ++context_fallbacks;
+                generate_context.clear();
+            } else if (generate_context.assign(context)) {
+                generate_context_model = model_name;
+                generate_context_messages = message_count + 1;  // + this reply
+            }
+            return result;
+        }
+        throw std::runtime_error("Generate request failed");
+    }
+    
+    // Asks for the rest of a reply the server cut off at num_predict or the
+    // context length, up to max_continuations times, and appends it to
+    // `result`. The partial reply goes last in the history as an assistant
+    // message, which the server extends rather than answers, so the prompt
+    // is the one its KV cache already holds plus the reply so far. Generate
+    // mode does the same with the rendered history: the open assistant turn
+    // plus the reply so far, through the identity template so a context
+    // comes back. (An empty prompt with only `context` would be answered as
+    // a load request, with no text.)
+    void continueTruncated(GenerationResult& result, json options, const TokenCallback& on_token, unsigned limit) {
+        unsigned count = 0;
+        while (!result.cancelled && result.final_chunk.value("done_reason", "") == "length" && count < limit) {
+            if (auto_context) {
+                options.update(context_sizer.optionsFor(conversation.totalChars() + result.text.size()));
+            }
+            GenerationResult part;
+            try {
+                if (generate_mode && http) {
+                    std::vector<json> scratch;
+                    PromptTemplate prompt_template = PromptTemplate::detect(getCapabilities().template_text);
+                    std::string prompt = prompt_template.render(conversation.view(scratch), 0) + result.text;
+                    part = http->generate(model_name, prompt, json(), options, streaming_enabled, on_token);
+                    const json& context = part.final_chunk.contains("context") ? part.final_chunk["context"] : json();
+                    if (!part.cancelled && generate_context.assign(context)) {
+                        generate_context_model = model_name;
+                        generate_context_messages = conversation.size() + 1;  // + this reply
+                    } else {
+                        generate_context.clear();
+                    }
+                } else {
+                    std::vector<json> scratch;
+                    conversation.append("assistant", result.text);
+                    try {
+                        part = backend->chat(model_name, conversation.view(scratch), options, streaming_enabled, on_token);
+                    } catch (...) {
+                        conversation.popBack();
+                        throw;
+                    }
+                    conversation.popBack();
+                }
+            } catch (const std::runtime_error&) {
+                ++continuation_stats.failed;  // Keep what arrived rather than lose the turn
+                break;
+            }
+            if (part.final_chunk.value("done_reason", "") == "load") {
+                break;  // Nothing was generated; not a continuation
+            }
+            
+            if (count++ == 0) ++continuation_stats.replies;
+            ++continuation_stats.requests;
+            continuation_stats.prompt_tokens += part.final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+            continuation_stats.overhead_ns += part.final_chunk.value("prompt_eval_duration", static_cast<uint64_t>(0)) +
+                                              part.final_chunk.value("load_duration", static_cast<uint64_t>(0));
+            continuation_stats.bytes += part.text.size();
+            resources.throughput->observe(model_name, part.final_chunk);
+            last_eval_count += part.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+            result.text += part.text;
+            result.cancelled = part.cancelled;
+            result.final_chunk = std::move(part.final_chunk);
+        }
+        last_truncated = !result.cancelled && result.final_chunk.value("done_reason", "") == "length";
+        if (last_truncated) ++continuation_stats.truncated;
+    }
+    
+    // Options for a request over the current history: the tuned profile's,
+    // plus num_ctx/num_predict when sized here
+    json requestOptions() {
+        json options = resources.profiles->optionsFor(model_name);
+        if (!auto_context) return options;
+        if (!capabilities_loaded) {
+            loadCapabilities();
+        }
+        options.update(context_sizer.optionsFor(conversation.totalChars()));
+        return options;
+    }
+    
+    // Caps num_predict so the reply fits `budget_ms` at the measured rates.
+    // With a warm cache only the new message needs prefilling. Returns the
+    // cap, or 0 while the model has not been measured yet.
+    uint64_t planDeadline(json& options, uint64_t budget_ms, size_t message_chars) {
+        uint64_t prompt_tokens = last_prompt_eval_count > 0 ? context_sizer.estimateTokens(message_chars)
+                                                             : estimateHistoryTokens();
+        uint64_t tokens = resources.throughput->tokensWithin(model_name, budget_ms / 1000.0, prompt_tokens);
+        if (tokens == 0) return 0;
+        int64_t current = options.value("num_predict", static_cast<int64_t>(-1));
+        if (current < 0 || static_cast<uint64_t>(current) > tokens) {
+            options["num_predict"] = tokens;
+        }
+        return tokens;
+    }
+    
+    // Cuts the reply where a stop rule fired and estimates what stopping
+    // early saved: the tokens a reply that ends on its own usually has (at
+    // most num_predict) minus those generated, at the observed eval rate
+    void applyStopRules(StopRules::Matcher& matcher, GenerationResult& result, const json& options,
+                        const TokenCallback& on_token) {
+        if (matcher.getDeltas() == 0 && !result.text.empty()) {
+            matcher.feed(result.text, nullptr);  // Not streamed: cut after the fact
+        }
+        if (!matcher.fired()) {
+            if (!matcher.finish(on_token)) {
+                // The caller stopped the reply; keep what it was shown
+                result.text.resize(std::min(result.text.size(), matcher.shown()));
+                result.cancelled = true;
+            }
+            return;
+        }
+        
+        result.text.resize(std::min(result.text.size(), matcher.kept()));
+        generate_context.clear();  // Covers the reply past the cut
+        uint64_t generated = result.cancelled ? matcher.getDeltas() : last_eval_count;
+        ++stop_stats.stopped;
+        stop_stats.tokens_generated += generated;
+        if (!result.cancelled) return;  // Generated in full anyway
+        
+        double expected = reply_tokens_average;
+        int64_t limit = options.value("num_predict", static_cast<int64_t>(0));
+        if (limit > 0) {
+            expected = expected > 0 ? std::min(expected, static_cast<double>(limit)) : limit;
+        }
+        if (expected > generated) {
+            uint64_t saved = static_cast<uint64_t>(expected) - generated;
+            stop_stats.tokens_saved += saved;
+            double eval_rate = resources.throughput->estimate(model_name).eval_rate;
+            if (eval_rate > 0) {
+                stop_stats.seconds_saved += saved / eval_rate;
+            }
+        }
+    }
+
+    
+public:
+    OllamaAssistant(const std::string& model = "llama3.2", std::shared_ptr<InferenceBackend> inference_backend = nullptr,
+                    ClientResources shared_resources = ClientResources::createDefault()) 
+        : resources(std::move(shared_resources)), http(nullptr), model_name(model),
+          conversation(ConversationStore::DEFAULT_SYSTEM_PROMPT, resources.cold_codec), streaming_enabled(true),
+          capabilities_loaded(false), auto_context(true), last_prompt_eval_count(0), last_eval_count(0),
+          generate_mode(false), generate_context_messages(0), context_reuses(0), context_fallbacks(0),
+          reply_tokens_average(0.0), default_deadline_ms(0), max_continuations(0), last_truncated(false) {
+        if (!resources.throughput) {
+            resources.throughput = std::make_shared<ThroughputTracker>();
+        }
+        setBackend(inference_backend ? std::move(inference_backend)
+                                     : std::make_shared<OllamaHttpBackend>("http://localhost:11434", resources.pool,
+                                                                         resources.single_flight, resources.limiter));
+    }
+    
+    void setBackend(std::shared_ptr<InferenceBackend> inference_backend) {
+        backend = std::move(inference_backend);
+        http = dynamic_cast<OllamaHttpBackend*>(backend.get());
+        capabilities_loaded = false;
+        context_sizer.reset();
+        generate_context.clear();
+        if (!http) generate_mode = false;
+    }
+    
+    InferenceBackend& getBackend() {
+        return *backend;
+    }
+    
+    // For another conversation on the same backend
+    std::shared_ptr<InferenceBackend> shareBackend() const {
+        return backend;
+    }
+    
+    // Null unless the current backend is the Ollama HTTP one
+    OllamaHttpBackend* getHttpBackend() {
+        return http;
+    }
+    
+    const ClientResources& getResources() const {
+        return resources;
+    }
+    
+    void setStreamingEnabled(bool enabled) {
+        streaming_enabled = enabled;
+    }
+    
+    bool isStreamingEnabled() const {
+        return streaming_enabled;
+    }
+    
+    bool checkOllamaConnection() {
+        return backend->isAvailable();
+    }
+    
+    std::vector<std::string> getAvailableModels() {
+        return backend->listModels();
+    }
+    
+    // Switches model and resolves its capabilities (context limit, template)
+    void setModel(const std::string& model) {
+        model_name = model;
+        context_sizer.reset();
+        loadCapabilities();
+    }
+    
+    const ModelCapabilities& getCapabilities() {
+        if (!capabilities_loaded) {
+            loadCapabilities();
+        }
+        return current_capabilities;
+    }
+    
+    const ContextSizer& getContextSizer() const {
+        return context_sizer;
+    }
+    
+    void setAutoContext(bool enabled) {
+        auto_context = enabled;
+    }
+    
+    bool isAutoContext() const {
+        return auto_context;
+    }
+    
+    uint64_t estimateHistoryTokens() const {
+        return context_sizer.estimateTokens(conversation.totalChars());
+    }
+    
+    uint64_t getLastPromptEvalCount() const {
+        return last_prompt_eval_count;
+    }
+    
+    uint64_t getLastEvalCount() const {
+        return last_eval_count;
+    }
+    
+    // Generate mode needs the Ollama HTTP backend
+    bool setGenerateMode(bool enabled) {
+        generate_mode = enabled && http != nullptr;
+        return generate_mode == enabled;
+    }
+    
+    bool isGenerateMode() const {
+        return generate_mode;
+    }
+    
+    const CompactTokens& getGenerateContext() const {
+        return generate_context;
+    }
+    
+    uint64_t getContextReuses() const {
+        return context_reuses;
+    }
+    
+    uint64_t getContextFallbacks() const {
+        return context_fallbacks;
+    }
+    
+    std::string getCurrentModel() const {
+        return model_name;
+    }
+    
+    ModelRegistry& getModelRegistry() {
+        return *resources.registry;
+    }
+    
+    const ModelProfiles& getModelProfiles() const {
+        return *resources.profiles;
+    }
+    
+    const ConversationStore& getConversation() const {
+        return conversation;
+    }
+    
+    // Applied to every reply from now on; see StopRules
+    StopRules& getStopRules() {
+        return stop_rules;
+    }
+    
+    const StopRules::Stats& getStopStats() const {
+        return stop_stats;
+    }
+    
+    // Latency budget for every reply from now on, 0 for none; a deadline
+    // passed to sendMessage takes precedence
+    void setDeadline(uint64_t milliseconds) {
+        default_deadline_ms = milliseconds;
+    }
+    
+    uint64_t getDeadline() const {
+        return default_deadline_ms;
+    }
+    
+    const DeadlineStats& getDeadlineStats() const {
+        return deadline_stats;
+    }
+    
+    ThroughputTracker::Estimate getThroughput() const {
+        return resources.throughput->estimate(model_name);
+    }
+    
+    // Follow-up requests allowed per reply cut off at the length limit; 0 off
+    void setMaxContinuations(unsigned count) {
+        max_continuations = count;
+    }
+    
+    unsigned getMaxContinuations() const {
+        return max_continuations;
+    }
+    
+    const ContinuationStats& getContinuationStats() const {
+        return continuation_stats;
+    }
+    
+    // The last reply still ended at the length limit
+    bool wasTruncated() const {
+        return last_truncated;
+    }
+    
+    // Conversation tiers plus the held generate context
+    ConversationMemory getMemoryUsage() const {
+        ConversationMemory usage = conversation.memory();
+        usage.hot_bytes += generate_context.byteSize() + attachments.byteSize();
+        return usage;
+    }
+
+    // Sends a user message; with streaming enabled, `on_token` receives the
+    // reply as it is generated. A reply cut off by the length limit is
+    // continued when setMaxContinuations allows. When a stop rule fires the
+    // transfer is cancelled there and the reply is stored as cut.
+    // `deadline_ms` (0: the one from setDeadline, if any) sizes num_predict to
+    // finish in time and cancels the transfer if the reply still runs over.
+    std::string sendMessage(const std::string& message, const TokenCallback& on_token = nullptr,
+                            uint64_t deadline_ms = 0) {
+        // Add user message to conversation history
+        conversation.append("user", message);
+
+        json options = requestOptions();
+        
+        std::unique_ptr<StopRules::Matcher> matcher;
+        TokenCallback callback = on_token;
+        if (!stop_rules.empty()) {
+            matcher = std::make_unique<StopRules::Matcher>(stop_rules);
+            callback = [&matcher, &on_token](std::string_view delta) {
+                return matcher->feed(delta, on_token);
+            };
+        }
+        
+        uint64_t budget_ms = deadline_ms > 0 ? deadline_ms : default_deadline_ms;
+        auto started = std::chrono::steady_clock::now();
+        auto expires = started + std::chrono::milliseconds(budget_ms);
+        std::unique_ptr<CancelScope> deadline_scope;
+        uint64_t pieces = 0;
+        std::chrono::steady_clock::time_point first_piece;
+        std::chrono::steady_clock::time_point last_piece;
+        if (budget_ms > 0) {
+            deadline_stats.last_planned = planDeadline(options, budget_ms, message.size());
+            const CancelScope* outer = CancelScope::current();
+            deadline_scope = std::make_unique<CancelScope>([outer, expires] {
+                return std::chrono::steady_clock::now() >= expires || (outer && outer->requested());
+            });
+            callback = [inner = std::move(callback), &pieces, &first_piece, &last_piece](std::string_view delta) {
+                last_piece = std::chrono::steady_clock::now();
+                if (pieces++ == 0) first_piece = last_piece;
+                return !inner || inner(delta);
+            };
+        }
+        
+        GenerationResult result;
+        try {
+            std::vector<json> scratch;
+            result = (generate_mode && http) 
+                ? sendGenerate(options, callback)
+                : backend->chat(model_name, conversation.view(scratch), options, streaming_enabled, callback);
+        } catch (...) {
+            conversation.popBack();  // Keep the history consistent for the next attempt
+            throw;
+        }
+        
+        last_prompt_eval_count = result.final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+        last_eval_count = result.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+        resources.throughput->observe(model_name, result.final_chunk);
+        continueTruncated(result, options, callback, budget_ms > 0 ? 0 : max_continuations);
+        if (budget_ms > 0) {
+            deadline_scope.reset();
+            auto finished = std::chrono::steady_clock::now();
+            if (last_eval_count == 0) {
+                resources.throughput->observeStream(model_name, pieces,
+                                                    std::chrono::duration<double>(last_piece - first_piece).count());
+            }
+            ++deadline_stats.requests;
+            if (finished <= expires) {
+                ++deadline_stats.met;
+            } else if (result.cancelled) {
+                ++deadline_stats.cut;
+            } else {
+                ++deadline_stats.missed;
+            }
+            deadline_stats.last_ms = std::chrono::duration<double, std::milli>(finished - started).count();
+        }
+        context_sizer.observeReply(result.text.size(), last_eval_count);
+        if (matcher) {
+            applyStopRules(*matcher, result, options, on_token);
+        }
+        if (last_eval_count > 0 && !result.cancelled && budget_ms == 0) {
+            reply_tokens_average = reply_tokens_average > 0 ? 0.8 * reply_tokens_average + 0.2 * last_eval_count
+                                                            : static_cast<double>(last_eval_count);
+        }
+
+        // Append assistant reply to history
+        conversation.append("assistant", result.text);
+
+        return result.text;
+    }
+    
+    // Sends a user message as `count` concurrent samples (see BestOf), streams
+    // the leader through `on_token` and keeps the reply `pick` chooses. Stop
+    // rules, deadlines and continuations do not apply. Throws only if the
+    // leader fails; failed samples are left out.
+    BestOf::Outcome sendBestOf(const std::string& message, size_t count, const BestOf::Picker& pick,
+                               const TokenCallback& on_token = nullptr) {
+        count = std::clamp<size_t>(count, 1, BestOf::MAX_SAMPLES);
+        conversation.append("user", message);
+        json options = requestOptions();
+        std::vector<json> scratch;
+        const std::vector<json>& messages = conversation.view(scratch);
+        
+        BestOf::Outcome outcome;
+        outcome.replies.resize(count);
+        std::vector<char> succeeded(count, false);  // Not vector<bool>: written from several threads
+        auto started = std::chrono::steady_clock::now();
+        uint32_t seed = static_cast<uint32_t>(started.time_since_epoch().count());
+        const CancelScope* outer = CancelScope::current();
+        std::atomic<bool> abandon{false};
+        std::vector<std::thread> samplers;
+        for (size_t i = 1; i < count; ++i) {
+            samplers.emplace_back([&, i] {
+                CancelScope scope([&] { return abandon.load() || (outer && outer->requested()); });
+                try {
+                    GenerationResult sample = backend->chat(model_name, messages,
+                                                            BestOf::sampleOptions(options, i, count, seed), true, nullptr);
+                    succeeded[i] = !sample.cancelled;
+                    outcome.replies[i] = std::move(sample.text);
+                } catch (const std::exception&) {
+                }
+            });
+        }
+        auto joinAll = [&] {
+            for (auto& sampler : samplers) sampler.join();
+        };
+        
+        GenerationResult leader;
+        try {
+            leader = backend->chat(model_name, messages, options, streaming_enabled, on_token);
+        } catch (...) {
+            abandon = true;
+            joinAll();
+            conversation.popBack();
+            throw;
+        }
+        outcome.leader_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        if (leader.cancelled) abandon = true;  // Stopped by the user: keep what streamed
+        joinAll();
+        outcome.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        
+        last_prompt_eval_count = leader.final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+        last_eval_count = leader.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+        last_truncated = leader.final_chunk.value("done_reason", "") == "length";
+        resources.throughput->observe(model_name, leader.final_chunk);
+        outcome.replies[0] = std::move(leader.text);
+        succeeded[0] = true;
+        for (size_t i = 1; i < count; ++i) {
+            if (!succeeded[i]) {
+                outcome.replies[i].clear();
+                ++outcome.failed;
+            }
+        }
+        if (!leader.cancelled && pick) {
+            try {
+                outcome.winner = std::min(pick(outcome.replies), count - 1);
+            } catch (const std::exception&) {
+                outcome.winner = 0;
+            }
+            if (outcome.replies[outcome.winner].empty()) outcome.winner = 0;
+        }
+        
+        ++best_of_stats.runs;
+        best_of_stats.samples += count;
+        best_of_stats.failed += outcome.failed;
+        best_of_stats.leader_won += outcome.winner == 0;
+        best_of_stats.leader_ms += outcome.leader_ms;
+        best_of_stats.wall_ms += outcome.wall_ms;
+        conversation.append("assistant", outcome.replies[outcome.winner]);
+        return outcome;
+    }
+    
+    // Asks `judge_model` which of `replies` answers `question` best; returns
+    // its index, or 0 when the verdict names none
+    size_t judgeReplies(const std::string& question, const std::vector<std::string>& replies,
+                        const std::string& judge_model) {
+        std::string prompt = "Question:\n" + question + "\n\n";
+        for (size_t i = 0; i < replies.size(); ++i) {
+            if (replies[i].empty()) continue;
+            prompt += "Answer " + std::to_string(i + 1) + ":\n" + replies[i] + "\n\n";
+        }
+        prompt += "Which answer is the most correct and complete? Reply with its number only.";
+        std::vector<json> messages = {{{"role", "user"}, {"content", prompt}}};
+        GenerationResult verdict = backend->chat(judge_model, messages, {{"temperature", 0}, {"num_predict", 8}},
+                                                 false, nullptr);
+        size_t digit = verdict.text.find_first_of("0123456789");
+        if (digit == std::string::npos) return 0;
+        size_t number = std::strtoul(verdict.text.c_str() + digit, nullptr, 10);
+        return number >= 1 && number <= replies.size() && !replies[number - 1].empty() ? number - 1 : 0;
+    }
+    
+    const BestOf::Stats& getBestOfStats() const {
+        return best_of_stats;
+    }
+    
+    // Streams a draft of the reply from `draft_model` through `on_draft`,
+    // on a copy of this conversation, then has this conversation's model
+    // revise it (see DraftReview); `on_review` runs in between. The revision
+    // is kept, or the draft if the review fails. Throws only if the draft
+    // fails.
+    DraftReview::Outcome sendDraftReview(const std::string& message, const std::string& draft_model,
+                                         const TokenCallback& on_draft = nullptr,
+                                         const std::function<void()>& on_review = nullptr) {
+        OllamaAssistant drafter("", backend, resources);
+        drafter.importState(exportState());
+        drafter.setGenerateMode(false);
+        drafter.setModel(draft_model);
+        
+        conversation.append("user", message);
+        json options = requestOptions();
+        std::vector<json> scratch;
+        const std::vector<json>& messages = conversation.view(scratch);
+        const CancelScope* outer = CancelScope::current();
+        std::atomic<bool> abandon{false};
+        std::thread prefill([&] {
+            CancelScope scope([&] { return abandon.load() || (outer && outer->requested()); });
+            json prefill_options = options;
+            prefill_options["num_predict"] = 1;
+            try {
+                backend->chat(model_name, messages, prefill_options, true, nullptr);
+            } catch (const std::exception&) {
+                // Only a warm-up; the review request stands on its own
+            }
+        });
+        
+        DraftReview::Outcome outcome;
+        auto started = std::chrono::steady_clock::now();
+        auto since = [](std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+        bool streamed = false;
+        TokenCallback draft_callback = [&](std::string_view delta) {
+            if (!streamed) {
+                streamed = true;
+                outcome.first_token_ms = since(started);
+            }
+            return !on_draft || on_draft(delta);
+        };
+        try {
+            outcome.draft = drafter.sendMessage(message, on_draft ? draft_callback : TokenCallback());
+        } catch (...) {
+            abandon = true;
+            prefill.join();
+            conversation.popBack();
+            throw;
+        }
+        outcome.draft_ms = since(started);
+        if (!streamed) outcome.first_token_ms = outcome.draft_ms;
+        prefill.join();
+        if (on_review) on_review();
+        
+        auto review_started = std::chrono::steady_clock::now();
+        conversation.append("assistant", outcome.draft);
+        conversation.append("user", DraftReview::REVIEW_PROMPT);
+        try {
+            GenerationResult review = backend->chat(model_name, conversation.view(scratch), requestOptions(),
+                                                    streaming_enabled, nullptr);
+            last_prompt_eval_count = review.final_chunk.value("prompt_eval_count", static_cast<uint64_t>(0));
+            last_eval_count = review.final_chunk.value("eval_count", static_cast<uint64_t>(0));
+            if (review.cancelled) {
+                outcome.error = "Review cancelled";
+            } else {
+                outcome.revision = std::move(review.text);
+            }
+        } catch (const std::exception& e) {
+            outcome.error = e.what();
+        }
+        outcome.review_ms = since(review_started);
+        conversation.popBack();
+        conversation.popBack();
+        conversation.append("assistant", outcome.revision.empty() ? outcome.draft : outcome.revision);
+        
+        ++draft_review_stats.turns;
+        draft_review_stats.revised += !outcome.revision.empty() && outcome.revision != outcome.draft;
+        draft_review_stats.failed += outcome.revision.empty();
+        draft_review_stats.first_token_ms += outcome.first_token_ms;
+        draft_review_stats.draft_ms += outcome.draft_ms;
+        draft_review_stats.review_ms += outcome.review_ms;
+        return outcome;
+    }
+    
+    const DraftReview::Stats& getDraftReviewStats() const {
+        return draft_review_stats;
+    }
+    
+    // Adds a question and answer produced elsewhere (e.g. a forked copy of
+    // this conversation) as if they had been exchanged here
+    void appendExchange(const std::string& message, const std::string& reply) {
+        conversation.append("user", message);
+        conversation.append("assistant", reply);
+    }
+    
+    // Block carrying `content` of `path` for the next user message: the whole
+    // file the first time, afterwards a diff against the newest version this
+    // conversation still holds. Call right before sendMessage.
+    FileAttachments::Attachment attachFile(const std::string& path, std::string content) {
+        return attachments.attach(path, std::move(content), conversation.size(),
+                                  [this](const std::string& file, const FileAttachments::Version& version) {
+            if (version.message >= conversation.size()) return false;
+            json message = conversation.at(version.message);
+            return message["role"] == "user" &&
+                message["content"].get_ref<const std::string&>().find(FileAttachments::marker(file, version)) !=
+                    std::string::npos;
+        });
+    }
+    
+    const FileAttachments& getAttachments() const {
+        return attachments;
+    }
+    
+    // Drops the last question and answer, e.g. a reply abandoned because the
+    // question went stale, so the history the server has cached stays valid
+    void discardLastExchange() {
+        if (conversation.size() < 3 || conversation.back()["role"] != "assistant") return;
+        conversation.popBack();
+        conversation.popBack();
+        if (generate_context_messages > conversation.size()) {
+            generate_context.clear();
+        }
+    }
+    
+    void clearConversation() {
+        conversation.reset();
+        context_sizer.reset();
+        generate_context.clear();
+        attachments.clear();
+    }
+    
+    void setSystemPrompt(const std::string& system_prompt) {
+        conversation.reset(system_prompt);
+        context_sizer.reset();
+        generate_context.clear();
+        attachments.clear();
+    }
+    
+    size_t getConversationLength() const {
+        return conversation.size() - 1; 
+    }
+    
+    // Everything needed to rebuild this conversation on the same backend.
+    // Context sizing restarts from the history size after a restore.
+    json exportState() const {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        json state = {
+            {"model", model_name},
+            {"messages", conversation.materialize()},
+            {"streaming", streaming_enabled},
+            {"auto_context", auto_context},
+            {"generate_mode", generate_mode}
+        };
+        if (!stop_rules.empty()) {
+            state["stop"] = stop_rules.toJson();
+        }
+        if (max_continuations > 0) {
+            state["max_continuations"] = max_continuations;
+        }
+        if (!generate_context.empty()) {
+            state["generate_context"] = {
+                {"model", generate_context_model},
+                {"messages", generate_context_messages},
+                {"tokens", generate_context.toJson()}
+            };
+        }
+        json attached = attachments.toJson();
+        if (!attached.empty()) {
+            state["attachments"] = std::move(attached);
+        }
+        return state;
+    }
+    
+    void importState(const json& state) {
+        MemoryScope scope(MemoryAccounting::CONVERSATION);
+        const json& messages = state.at("messages");
+        if (!messages.is_array() || messages.empty()) {
+            throw std::runtime_error("Conversation state has no messages");
+        }
+        model_name = state.at("model").get<std::string>();
+        conversation.reset(messages[0].at("content").get<std::string>());
+        for (size_t i = 1; i < messages.size(); ++i) {
+            conversation.append(messages[i].at("role").get<std::string>(), messages[i].at("content").get<std::string>());
+        }
+        streaming_enabled = state.value("streaming", true);
+        auto_context = state.value("auto_context", true);
+        setGenerateMode(state.value("generate_mode", false));
+        stop_rules.fromJson(state.value("stop", json::object()));
+        max_continuations = state.value("max_continuations", 0u);
+        capabilities_loaded = false;
+        context_sizer.reset();
+        generate_context.clear();
+        if (state.contains("generate_context")) {
+            const json& context = state["generate_context"];
+            if (generate_context.assign(context.at("tokens"))) {
+                generate_context_model = context.at("model").get<std::string>();
+                generate_context_messages = context.at("messages").get<size_t>();
+            }
+        }
+        attachments.fromJson(state.value("attachments", json::array()));
+    }
+};
+
+// Append-only spill file for hibernated sessions. Each record is a 4-byte
+// little-endian length followed by the payload; an in-memory index maps
+// session ids to their latest record. Records are read back through a
+// read-only mapping of the file, so a restore faults in only the pages of
+// its own record. The file is private to the process and removed with it.
+// Thread-safe.
+class SessionJournal {
+private:
+    struct Record {
+        uint64_t offset;
+        uint32_t length;
+    };
+    
+    std::filesystem::path path;
+    std::fstream file;
+    std::unordered_map<std::string, Record> index;
+    uint64_t file_bytes = 0;
+    uint64_t live_bytes = 0;
+    mutable std::mutex mutex;
+#ifndef _WIN32
+    void* mapping = nullptr;
+    size_t mapped_bytes = 0;
+#endif
+    
+    static constexpr uint64_t COMPACT_MIN_BYTES = 1 << 20;
+    
+    void unmap() {
+#ifndef _WIN32
+        if (mapping) munmap(mapping, mapped_bytes);
+        mapping = nullptr;
+        mapped_bytes = 0;
+#endif
+    }
+    
+    void open(std::ios::openmode extra) {
+        unmap();
+        file.close();
+        file.clear();
+        file.open(path, std::ios::in | std::ios::out | std::ios::binary | extra);
+        if (!file) {
+            throw std::runtime_error("Cannot open session journal: " + path.string());
+        }
+    }
+    
+    // Points `data` at the record's payload, remapping when the file has
+    // grown past the current mapping
+    bool viewRecord(const Record& record, const char*& data, std::string& buffer) {
+#ifndef _WIN32
+        uint64_t end = record.offset + 4 + record.length;
+        if (end > mapped_bytes) {
+            file.flush();
+            unmap();
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            void* view = mmap(nullptr, static_cast<size_t>(file_bytes), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (view == MAP_FAILED) return false;
+            mapping = view;
+            mapped_bytes = static_cast<size_t>(file_bytes);
+        }
+        data = static_cast<const char*>(mapping) + record.offset + 4;
+        (void)buffer;
+        return true;
+#else
+        buffer.resize(record.length);
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(record.offset + 4));
+        data = buffer.data();
+        return static_cast<bool>(file.read(&buffer[0], record.length));
+#endif
+    }
+    
+    bool readRecord(const Record& record, std::string& payload) {
+        const char* data = nullptr;
+        std::string buffer;
+        if (!viewRecord(record, data, buffer)) return false;
+        payload.assign(data, record.length);
+        return true;
+    }
+    
+    bool appendRecord(const std::string& payload, Record& record) {
+        uint32_t length = static_cast<uint32_t>(payload.size());
+        unsigned char header[4] = {
+            static_cast<unsigned char>(length), static_cast<unsigned char>(length >> 8),
+            static_cast<unsigned char>(length >> 16), static_cast<unsigned char>(length >> 24)
+        };
+        file.clear();
+        file.seekp(static_cast<std::streamoff>(file_bytes));
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        if (!file) return false;
+        record = {file_bytes, length};
+        file_bytes += sizeof(header) + payload.size();
+        return true;
+    }
+    
+    // Rewrites the file with only the live records once most of it is dead
+    void compactIfNeeded() {
+        if (file_bytes < COMPACT_MIN_BYTES || live_bytes * 2 > file_bytes) return;
+        std::vector<std::pair<std::string, std::string>> live;
+        live.reserve(index.size());
+        for (const auto& entry : index) {
+            std::string payload;
+            if (!readRecord(entry.second, payload)) return;  // Keep the old file rather than lose records
+            live.emplace_back(entry.first, std::move(payload));
+        }
+        open(std::ios::trunc);
+        file_bytes = 0;
+        index.clear();
+        for (const auto& entry : live) {
+            Record record;
+            if (appendRecord(entry.second, record)) {
+                index[entry.first] = record;
+            }
+        }
+    }
+    
+public:
+    explicit SessionJournal(std::filesystem::path file_path = {}) : path(std::move(file_path)) {
+        if (path.empty()) {
+            path = assistantCacheDir() / ("sessions-" + std::to_string(
+#ifdef _WIN32
+                GetCurrentProcessId()
+#else
+                getpid()
+#endif
+            ) + ".journal");
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        open(std::ios::trunc);
+    }
+    
+    ~SessionJournal() {
+        unmap();
+        file.close();
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+    
+    SessionJournal(const SessionJournal&) = delete;
+    SessionJournal& operator=(const SessionJournal&) = delete;
+    
+    bool put(const std::string& id, const std::string& payload) {
+        MemoryScope scope(MemoryAccounting::INDICES);
+        std::lock_guard<std::mutex> lock(mutex);
+        Record record;
+        if (!appendRecord(payload, record)) return false;
+        auto it = index.find(id);
+        if (it != index.end()) {
+            live_bytes -= 4 + it->second.length;
+        }
+        index[id] = record;
+        live_bytes += 4 + record.length;
+        return true;
+    }
+    
+    // Hands a session's record to `consume` straight from the mapping. The
+    // record stays until erase(), so a caller that fails to restore it loses
+    // nothing. `consume` runs under the journal lock.
+    template <typename Fn>
+    bool read(const std::string& id, Fn&& consume) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(id);
+        if (it == index.end()) return false;
+        const char* data = nullptr;
+        std::string buffer;
+        if (!viewRecord(it->second, data, buffer)) return false;
+        consume(data, static_cast<size_t>(it->second.length));
+        return true;
+    }
+    
+    void erase(const std::string& id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(id);
+        if (it == index.end()) return;
+        live_bytes -= 4 + it->second.length;
+        index.erase(it);
+        compactIfNeeded();
+    }
+    
+    json statsJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {{"records", index.size()}, {"live_bytes", live_bytes}, {"file_bytes", file_bytes}};
+    }
+};
+
+// Many independent conversations sharing one backend and one set of client
+// resources. Sessions live in a sharded hash map, so lookups only contend
+// within a shard. Turns on one session run one at a time; different
+// sessions run in parallel. Memory is tiered: recent turns are hot, older
+// turns are compressed in memory (ConversationStore), and sessions idle
+// longer than the idle timeout, or least recently used ones while the
+// process is over its memory ceiling, are compressed into the journal and
+// dropped from memory until their next use. Thread-safe.
+class SessionManager {
+public:
+    struct Options {
+        size_t shards = 16;
+        std::chrono::milliseconds idle_timeout = std::chrono::minutes(5);  // 0 disables idle hibernation
+        std::filesystem::path journal_file;                               // Empty for the default
+        uint64_t memory_ceiling = 0;                                      // Process RSS bytes; 0 for none
+    };
+    
+private:
+    struct Session {
+        std::mutex turn_mutex;                       // Held for a whole turn
+        std::unique_ptr<OllamaAssistant> assistant;  // Null while hibernated
+        std::atomic<int64_t> last_used_ms{0};
+        std::atomic<uint64_t> hot_bytes{0};          // Zero while hibernated
+        std::atomic<uint64_t> cold_bytes{0};
+    };
+    
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Session>> sessions;
+    };
+    
+    std::shared_ptr<InferenceBackend> backend;
+    ClientResources resources;
+    std::chrono::milliseconds idle_timeout;
+    std::vector<std::unique_ptr<Shard>> shards;
+    SessionJournal journal;
+    std::atomic<uint64_t> resident{0};
+    std::atomic<uint64_t> hibernations{0};
+    std::atomic<uint64_t> wakes{0};
+    std::atomic<uint64_t> memory_ceiling;
+    std::atomic<int64_t> last_ceiling_check_ms{0};
+    std::atomic<uint64_t> ceiling_evictions{0};
+    
+    static constexpr int64_t CEILING_CHECK_MS = 250;
+    
+    std::thread reaper;
+    std::mutex reaper_mutex;
+    std::condition_variable reaper_wakeup;
+    bool stopping = false;
+    bool settings_changed = false;
+    
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    Shard& shardFor(const std::string& id) {
+        return *shards[std::hash<std::string>()(id) % shards.size()];
+    }
+    
+    std::shared_ptr<Session> find(const std::string& id) {
+        Shard& shard = shardFor(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.sessions.find(id);
+        return it == shard.sessions.end() ? nullptr : it->second;
+    }
+    
+    // Caller holds the session's turn_mutex
+    static void account(Session& session) {
+        ConversationMemory usage = session.assistant->getMemoryUsage();
+        session.hot_bytes = usage.hot_bytes;
+        session.cold_bytes = usage.cold_bytes;
+    }
+    
+    // Caller holds the session's turn_mutex
+    void wake(const std::string& id, Session& session) {
+        std::string payload;
+        if (!journal.read(id, [&](const char* data, size_t size) { payload = resources.cold_codec->decompress(data, size); })) {
+            throw std::runtime_error("Session '" + id + "' was lost from the journal");
+        }
+        // The record is dropped only once it has been restored; if parsing
+        // throws, the next turn tries again
+        auto assistant = std::make_unique<OllamaAssistant>("", backend, resources);
+        assistant->importState(json::parse(payload));
+        journal.erase(id);
+        session.assistant = std::move(assistant);
+        account(session);
+        ++resident;
+        ++wakes;
+    }
+    
+    // Caller holds the session's turn_mutex
+    bool hibernate(const std::string& id, Session& session) {
+        if (!session.assistant ||
+            !journal.put(id, resources.cold_codec->compress(session.assistant->exportState().dump()))) return false;
+        session.assistant.reset();
+        session.hot_bytes = 0;
+        session.cold_bytes = 0;
+        --resident;
+        ++hibernations;
+        return true;
+    }
+    
+    // Resident sessions, least recently used first
+    std::vector<std::pair<std::string, std::shared_ptr<Session>>> residentByAge() {
+        std::vector<std::pair<std::string, std::shared_ptr<Session>>> sessions;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (const auto& entry : shard->sessions) {
+                if (entry.second->hot_bytes.load() > 0) {
+                    sessions.push_back(entry);
+                }
+            }
+        }
+        std::sort(sessions.begin(), sessions.end(), [](const auto& a, const auto& b) {
+            return a.second->last_used_ms.load() < b.second->last_used_ms.load();
+        });
+        return sessions;
+    }
+    
+    // How often the reaper runs for the current settings; zero while it has
+    // nothing to do
+    std::chrono::milliseconds reaperInterval() const {
+        std::chrono::milliseconds interval{0};
+        if (idle_timeout.count() > 0) {
+            interval = std::max(idle_timeout / 4, std::chrono::milliseconds(10));
+        }
+        if (memory_ceiling.load() > 0 && (interval.count() == 0 || interval > std::chrono::seconds(1))) {
+            interval = std::chrono::seconds(1);
+        }
+        return interval;
+    }
+    
+    // Caller holds reaper_mutex
+    void startReaper() {
+        if (!reaper.joinable() && reaperInterval().count() > 0) {
+            reaper = std::thread(&SessionManager::reaperLoop, this);
+        }
+    }
+    
+    void reaperLoop() {
+        std::unique_lock<std::mutex> lock(reaper_mutex);
+        while (!stopping) {
+            auto interval = reaperInterval();
+            if (interval.count() == 0) {
+                reaper_wakeup.wait(lock);
+            } else {
+                reaper_wakeup.wait_for(lock, interval);
+            }
+            if (stopping) break;
+            // A new setting restarts the wait with the interval it implies
+            if (settings_changed) {
+                settings_changed = false;
+                continue;
+            }
+            lock.unlock();
+            if (idle_timeout.count() > 0) {
+                hibernateIdle(idle_timeout);
+            }
+            enforceCeiling();
+            lock.lock();
+        }
+    }
+    
+public:
+    SessionManager(std::shared_ptr<InferenceBackend> inference_backend, ClientResources shared_resources)
+        : SessionManager(std::move(inference_backend), std::move(shared_resources), Options()) {}
+    
+    SessionManager(std::shared_ptr<InferenceBackend> inference_backend, ClientResources shared_resources,
+                   const Options& options)
+        : backend(std::move(inference_backend)), resources(std::move(shared_resources)),
+          idle_timeout(options.idle_timeout), journal(options.journal_file), memory_ceiling(options.memory_ceiling) {
+        if (!resources.cold_codec) {
+            resources.cold_codec = std::make_shared<ColdCodec>();
+        }
+        for (size_t i = 0; i < std::max<size_t>(1, options.shards); ++i) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+        std::lock_guard<std::mutex> lock(reaper_mutex);
+        startReaper();
+    }
+    
+    ~SessionManager() {
+        {
+            std::lock_guard<std::mutex> lock(reaper_mutex);
+            stopping = true;
+        }
+        reaper_wakeup.notify_all();
+        if (reaper.joinable()) reaper.join();
+    }
+    
+    SessionManager(const SessionManager&) = delete;
+    SessionManager& operator=(const SessionManager&) = delete;
+    
+    // Returns false if the id is already taken
+    bool create(const std::string& id, const std::string& model, const std::string& system_prompt = "") {
+        MemoryScope scope(MemoryAccounting::INDICES);
+        auto session = std::make_shared<Session>();
+        session->assistant = std::make_unique<OllamaAssistant>(model, backend, resources);
+        if (!system_prompt.empty()) {
+            session->assistant->setSystemPrompt(system_prompt);
+        }
+        session->last_used_ms = nowMs();
+        account(*session);
+        
+        Shard& shard = shardFor(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (!shard.sessions.emplace(id, std::move(session)).second) return false;
+        ++resident;
+        return true;
+    }
+    
+    bool remove(const std::string& id) {
+        std::shared_ptr<Session> session;
+        {
+            Shard& shard = shardFor(id);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.sessions.find(id);
+            if (it == shard.sessions.end()) return false;
+            session = std::move(it->second);
+            shard.sessions.erase(it);
+        }
+        // Waits for a running turn to finish
+        std::lock_guard<std::mutex> turn(session->turn_mutex);
+        if (session->assistant) {
+            session->assistant.reset();
+            session->hot_bytes = 0;
+            session->cold_bytes = 0;
+            --resident;
+        } else {
+            journal.erase(id);
+        }
+        return true;
+    }
+    
+    bool contains(const std::string& id) {
+        return find(id) != nullptr;
+    }
+    
+    // Runs `fn` with exclusive access to the session, restoring it from the
+    // journal first if needed. Throws if the session does not exist.
+    template <typename Fn>
+    auto withSession(const std::string& id, Fn&& fn) -> decltype(fn(std::declval<OllamaAssistant&>())) {
+        std::shared_ptr<Session> session = find(id);
+        if (!session) {
+            throw std::runtime_error("No such session: " + id);
+        }
+        std::lock_guard<std::mutex> turn(session->turn_mutex);
+        if (!session->assistant) {
+            wake(id, *session);
+        }
+        session->last_used_ms = nowMs();
+        struct Touch {
+            Session& session;
+            ~Touch() {
+                session.last_used_ms = nowMs();
+                if (session.assistant) account(session);
+            }
+        } touch{*session};
+        return fn(*session->assistant);
+    }
+    
+    std::string send(const std::string& id, const std::string& message, const TokenCallback& on_token = nullptr) {
+        std::string reply = withSession(id, [&](OllamaAssistant& assistant) {
+            return assistant.sendMessage(message, on_token);
+        });
+        enforceCeiling();
+        return reply;
+    }
+    
+    void setMemoryCeiling(uint64_t bytes) {
+        memory_ceiling = bytes;
+        {
+            std::lock_guard<std::mutex> lock(reaper_mutex);
+            settings_changed = true;
+            startReaper();
+        }
+        reaper_wakeup.notify_all();
+    }
+    
+    uint64_t getMemoryCeiling() const {
+        return memory_ceiling.load();
+    }
+    
+    // Hibernates least recently used sessions while the process is over the
+    // memory ceiling, judged by RSS where the platform reports it and by the
+    // tier accounting otherwise. Runs at most every CEILING_CHECK_MS; returns
+    // how many sessions were hibernated.
+    size_t enforceCeiling() {
+        uint64_t ceiling = memory_ceiling.load();
+        if (ceiling == 0) return 0;
+        int64_t now = nowMs();
+        int64_t last = last_ceiling_check_ms.load();
+        if (now - last < CEILING_CHECK_MS || !last_ceiling_check_ms.compare_exchange_strong(last, now)) return 0;
+        
+        uint64_t used = processResidentBytes();
+        if (used == 0) used = residentBytes();
+        if (used <= ceiling) return 0;
+        
+        uint64_t excess = used - ceiling;
+        uint64_t freed = 0;
+        size_t count = 0;
+        for (auto& entry : residentByAge()) {
+            if (freed >= excess) break;
+            std::unique_lock<std::mutex> turn(entry.second->turn_mutex, std::try_to_lock);
+            if (!turn.owns_lock()) continue;
+            uint64_t bytes = entry.second->hot_bytes.load() + entry.second->cold_bytes.load();
+            if (hibernate(entry.first, *entry.second)) {
+                freed += bytes;
+                ++count;
+            }
+        }
+        if (count > 0) {
+            ceiling_evictions += count;
+            releaseFreeMemory();
+        }
+        return count;
+    }
+    
+    // Accounted bytes of all resident conversations
+    uint64_t residentBytes() {
+        uint64_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (const auto& entry : shard->sessions) {
+                total += entry.second->hot_bytes.load() + entry.second->cold_bytes.load();
+            }
+        }
+        return total;
+    }
+    
+    // Moves sessions idle for at least `idle` to the journal. Sessions in the
+    // middle of a turn are skipped. Returns how many were hibernated.
+    size_t hibernateIdle(std::chrono::milliseconds idle) {
+        int64_t cutoff = nowMs() - idle.count();
+        size_t count = 0;
+        for (auto& shard : shards) {
+            std::vector<std::pair<std::string, std::shared_ptr<Session>>> candidates;
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                for (const auto& entry : shard->sessions) {
+                    if (entry.second->last_used_ms.load() <= cutoff) {
+                        candidates.push_back(entry);
+                    }
+                }
+            }
+            for (auto& entry : candidates) {
+                std::unique_lock<std::mutex> turn(entry.second->turn_mutex, std::try_to_lock);
+                if (turn.owns_lock() && entry.second->last_used_ms.load() <= cutoff &&
+                    hibernate(entry.first, *entry.second)) {
+                    ++count;
+                }
+            }
+        }
+        if (count > 0) {
+            releaseFreeMemory();
+        }
+        return count;
+    }
+    
+    size_t size() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total += shard->sessions.size();
+        }
+        return total;
+    }
+    
+    json statsJson() {
+        size_t sessions = 0;
+        uint64_t hot = 0;
+        uint64_t cold = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            sessions += shard->sessions.size();
+            for (const auto& entry : shard->sessions) {
+                hot += entry.second->hot_bytes.load();
+                cold += entry.second->cold_bytes.load();
+            }
+        }
+        uint64_t in_memory = resident.load();
+        return {
+            {"sessions", sessions},
+            {"resident", in_memory},
+            {"hibernated", sessions - std::min<uint64_t>(sessions, in_memory)},
+            {"hibernations", hibernations.load()},
+            {"wakes", wakes.load()},
+            {"memory", {
+                {"hot_bytes", hot},
+                {"cold_bytes", cold},
+                {"rss_bytes", processResidentBytes()},
+                {"ceiling_bytes", memory_ceiling.load()},
+                {"ceiling_evictions", ceiling_evictions.load()}
+            }},
+            {"codec", resources.cold_codec->statsJson()},
+            {"journal", journal.statsJson()}
+        };
+    }
+};
+
+#endif // OLLAMA_ENGINE_HPP
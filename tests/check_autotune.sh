@@ -0,0 +1,49 @@
+#!/bin/sh
+# End-to-end check of `ollama_assistant autotune` against mock_ollama.py:
+# builds the assistant, tunes llama3.2 on the mock and compares the saved
+# profile with the best options of the mock's speed model (all layers on
+# the GPU, the largest num_ctx below its 16384 slowdown, no num_batch or
+# num_thread gain above the noise margin). Run by run_checks.sh.
+cd "$(dirname "$0")" || exit 1
+CXX=${CXX:-g++}
+PYTHON=${PYTHON:-python3}
+BUILD_DIR=${BUILD_DIR:-$(mktemp -d)}
+WORK=$(mktemp -d)
+PORT=$((20000 + $$ % 20000))
+
+fail() {
+    echo "check_autotune: FAIL: $1"
+    [ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null
+    rm -rf "$WORK"
+    exit 1
+}
+
+$CXX -std=c++17 -O1 $CXXFLAGS -o "$BUILD_DIR/ollama_assistant" ../main.cpp $LDFLAGS -lcurl -pthread ||
+    fail "build failed"
+
+$PYTHON mock_ollama.py --port "$PORT" --slots 1 --prefill 0.01 --token-delay 0 &
+MOCK_PID=$!
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    $PYTHON -c 'import sys, urllib.request; urllib.request.urlopen(sys.argv[1], timeout=1)' \
+        "http://127.0.0.1:$PORT/api/version" 2>/dev/null && break
+    [ "$attempt" = 10 ] && fail "mock server did not start on port $PORT"
+    sleep 0.5
+done
+
+XDG_CONFIG_HOME="$WORK/config" XDG_CACHE_HOME="$WORK/cache" OLLAMA_MODELS="$WORK/models" \
+    "$BUILD_DIR/ollama_assistant" autotune llama3.2 --host="127.0.0.1:$PORT" > "$WORK/output.txt" 2>&1 ||
+    { cat "$WORK/output.txt"; fail "autotune exited with an error"; }
+kill "$MOCK_PID" 2>/dev/null
+MOCK_PID=
+
+PROFILE="$WORK/config/ollama_assistant/model_profiles.json"
+[ -f "$PROFILE" ] || fail "no profile written to $PROFILE"
+OPTIONS=$($PYTHON -c 'import json, sys; print(json.dumps(json.load(open(sys.argv[1]))["models"]["llama3.2:latest"]["options"], sort_keys=True))' "$PROFILE") ||
+    fail "profile has no llama3.2:latest entry"
+EXPECTED='{"num_ctx": 8192, "num_gpu": 999}'
+if [ "$OPTIONS" != "$EXPECTED" ]; then
+    cat "$WORK/output.txt"
+    fail "saved options $OPTIONS, expected $EXPECTED"
+fi
+rm -rf "$WORK"
+echo "check_autotune: saved $OPTIONS"
@@ -0,0 +1,230 @@
+/* Drives every entry point of ollama_client.h from C, linked against
+ * libollama_client.so, with mock_ollama.py as the server: status codes for
+ * bad arguments, unknown models and an unreachable server, cancellation
+ * through a nonzero callback return, client-managed sessions through
+ * hibernation and the memory ceiling, and the cost of a call that does not
+ * touch the network. The mock is started with $PYTHON (python3) from
+ * $MOCK_OLLAMA (mock_ollama.py in the current directory). */
+
+#define _POSIX_C_SOURCE 200809L
+#include "../ollama_client.h"
+
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+static int failures = 0;
+
+#define EXPECT(condition)                                                         \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            ++failures;                                                           \
+            fprintf(stderr, "FAIL line %d: %s\n", __LINE__, #condition);          \
+        }                                                                         \
+    } while (0)
+
+static double nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static pid_t startMock(int port) {
+    const char* python = getenv("PYTHON") ? getenv("PYTHON") : "python3";
+    const char* script = getenv("MOCK_OLLAMA") ? getenv("MOCK_OLLAMA") : "mock_ollama.py";
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char* argv[] = {(char*)python, (char*)script, "--port", port_arg, "--prefill", "0.01",
+                    "--token-delay", "0.002", "--tokens", "12", NULL};
+    pid_t pid = -1;
+    if (posix_spawnp(&pid, python, NULL, NULL, argv, environ) != 0) {
+        fprintf(stderr, "cannot start %s %s\n", python, script);
+        return -1;
+    }
+    return pid;
+}
+
+struct Tokens {
+    int count;
+    int stop_after;  /* Cancel on this token; 0 for never */
+};
+
+static int onToken(const char* delta, size_t length, void* user_data) {
+    struct Tokens* tokens = user_data;
+    (void)delta;
+    if (length > 0) ++tokens->count;
+    return tokens->stop_after > 0 && tokens->count >= tokens->stop_after;
+}
+
+static int contains(const char* text, const char* part) {
+    return text && strstr(text, part) != NULL;
+}
+
+static void checkSessions(ollama_client_t* client) {
+    char* reply = NULL;
+    ollama_session_t* session = ollama_session_create(client, "llama3.2", "Answer briefly.");
+    EXPECT(session != NULL);
+    if (!session) return;
+    
+    struct Tokens tokens = {0, 0};
+    EXPECT(ollama_session_send(session, "Hello", onToken, &tokens, &reply) == OLLAMA_OK);
+    EXPECT(tokens.count == 12);
+    EXPECT(contains(reply, "quick brown fox"));
+    ollama_free(reply);
+    reply = NULL;
+    EXPECT(ollama_session_length(session) == 2);
+    
+    /* A nonzero return cancels; the partial reply stays in the history */
+    tokens.count = 0;
+    tokens.stop_after = 3;
+    EXPECT(ollama_session_send(session, "Again", onToken, &tokens, &reply) == OLLAMA_CANCELLED);
+    EXPECT(tokens.count == 3);
+    EXPECT(reply && strcmp(reply, "The quick brown ") == 0);
+    ollama_free(reply);
+    reply = NULL;
+    EXPECT(ollama_session_length(session) == 4);
+    
+    EXPECT(ollama_session_send_within(session, "Quickly", 5000, NULL, NULL, &reply) == OLLAMA_OK);
+    EXPECT(reply && *reply);
+    ollama_free(reply);
+    reply = NULL;
+    
+    char* history = NULL;
+    EXPECT(ollama_session_history_json(session, &history) == OLLAMA_OK);
+    EXPECT(contains(history, "Answer briefly.") && contains(history, "\"Quickly\""));
+    ollama_free(history);
+    
+    /* Unknown model: the server answers with an error, the message is dropped */
+    EXPECT(ollama_session_set_model(session, "missing-model") == OLLAMA_OK);
+    EXPECT(ollama_session_send(session, "Hello?", NULL, NULL, NULL) == OLLAMA_REQUEST);
+    EXPECT(contains(ollama_session_last_error(session), "missing-model"));
+    EXPECT(ollama_session_length(session) == 6);
+    
+    ollama_session_clear(session);
+    EXPECT(ollama_session_length(session) == 0);
+    EXPECT(ollama_session_send(NULL, "x", NULL, NULL, NULL) == OLLAMA_INVALID_ARGUMENT);
+    EXPECT(ollama_session_send(session, NULL, NULL, NULL, NULL) == OLLAMA_INVALID_ARGUMENT);
+    ollama_session_destroy(session);
+}
+
+static void checkClientSessions(ollama_client_t* client) {
+    char* reply = NULL;
+    EXPECT(ollama_client_open_session(client, "a", "llama3.2", NULL) == OLLAMA_OK);
+    EXPECT(ollama_client_open_session(client, "b", "llama3.2", "Be terse.") == OLLAMA_OK);
+    EXPECT(ollama_client_open_session(client, "a", "llama3.2", NULL) == OLLAMA_INVALID_ARGUMENT);
+    EXPECT(contains(ollama_last_error(), "already exists"));
+    
+    EXPECT(ollama_client_send(client, "a", "Hello", NULL, NULL, &reply) == OLLAMA_OK);
+    EXPECT(contains(reply, "quick brown fox"));
+    ollama_free(reply);
+    reply = NULL;
+    EXPECT(*ollama_last_error() == '\0');
+    EXPECT(ollama_client_send(client, "nobody", "Hello", NULL, NULL, NULL) == OLLAMA_INVALID_ARGUMENT);
+    EXPECT(contains(ollama_last_error(), "No such session"));
+    
+    struct Tokens tokens = {0, 2};
+    EXPECT(ollama_client_send(client, "b", "Hello", onToken, &tokens, &reply) == OLLAMA_CANCELLED);
+    EXPECT(tokens.count == 2);
+    ollama_free(reply);
+    reply = NULL;
+    
+    /* Both sessions go to disk and come back on their next turn */
+    EXPECT(ollama_client_hibernate_idle(client, 0) == 2);
+    EXPECT(ollama_client_hibernate_idle(client, 0) == 0);
+    EXPECT(ollama_client_send(client, "a", "Still there?", NULL, NULL, &reply) == OLLAMA_OK);
+    ollama_free(reply);
+    reply = NULL;
+    
+    /* Any RSS is over a one-byte ceiling: the turn's session is moved out after it */
+    ollama_client_set_memory_ceiling(client, 1);
+    EXPECT(ollama_client_send(client, "a", "And now?", NULL, NULL, NULL) == OLLAMA_OK);
+    ollama_client_set_memory_ceiling(client, 0);
+    char* stats = NULL;
+    EXPECT(ollama_client_stats_json(client, &stats) == OLLAMA_OK);
+    EXPECT(contains(stats, "\"ceiling_evictions\":1"));
+    EXPECT(contains(stats, "\"resident\":0"));
+    ollama_free(stats);
+    
+    EXPECT(ollama_client_close_session(client, "a") == OLLAMA_OK);
+    EXPECT(ollama_client_close_session(client, "b") == OLLAMA_OK);
+    EXPECT(ollama_client_close_session(client, "a") == OLLAMA_INVALID_ARGUMENT);
+}
+
+/* Average cost of a call that stays in process, in microseconds */
+static double callOverheadUs(ollama_client_t* client) {
+    ollama_session_t* session = ollama_session_create(client, "llama3.2", NULL);
+    if (!session) return 1e9;
+    const int calls = 200000;
+    size_t sink = 0;
+    double start = nowUs();
+    for (int i = 0; i < calls; ++i) {
+        sink += ollama_session_length(session);
+        sink += (size_t)ollama_client_is_available(client);
+    }
+    double elapsed = nowUs() - start;
+    ollama_session_destroy(session);
+    return sink == (size_t)calls ? elapsed / (2.0 * calls) : 1e9;
+}
+
+int main(void) {
+    int port = 20000 + (int)(getpid() % 20000);
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d", port);
+    pid_t mock = startMock(port);
+    if (mock < 0) return 1;
+    
+    EXPECT(ollama_abi_version() == OLLAMA_CLIENT_ABI_VERSION);
+    EXPECT(ollama_global_init() == OLLAMA_OK);
+    ollama_client_t* client = ollama_client_create(url);
+    EXPECT(client != NULL);
+    if (!client) return 1;
+    for (int attempt = 0; !ollama_client_is_available(client); ++attempt) {
+        if (attempt == 50) {
+            fprintf(stderr, "mock server did not start on port %d\n", port);
+            return 1;
+        }
+        struct timespec pause = {0, 100000000};
+        nanosleep(&pause, NULL);
+    }
+    
+    char* models = NULL;
+    EXPECT(ollama_client_list_models(client, &models) == OLLAMA_OK);
+    EXPECT(contains(models, "llama3.2:latest"));
+    ollama_free(models);
+    EXPECT(ollama_client_list_models(client, NULL) == OLLAMA_INVALID_ARGUMENT);
+    
+    checkSessions(client);
+    checkClientSessions(client);
+    
+    double overhead_us = callOverheadUs(client);
+    EXPECT(overhead_us < 5.0);
+    
+    char* stats = NULL;
+    EXPECT(ollama_client_stats_json(client, &stats) == OLLAMA_OK);
+    EXPECT(contains(stats, "\"connections\"") && contains(stats, "\"sessions\""));
+    ollama_free(stats);
+    
+    /* Once the server is gone, sends fail as connection errors */
+    kill(mock, SIGTERM);
+    waitpid(mock, NULL, 0);
+    ollama_session_t* session = ollama_session_create(client, "llama3.2", NULL);
+    EXPECT(ollama_session_send(session, "Anyone?", NULL, NULL, NULL) == OLLAMA_CONNECTION);
+    EXPECT(*ollama_session_last_error(session) != '\0');
+    EXPECT(ollama_session_length(session) == 0);
+    ollama_session_destroy(session);
+    
+    ollama_client_destroy(client);
+    ollama_global_cleanup();
+    
+    if (failures == 0) {
+        printf("check_c_api: all passed, %.3f us per in-process call\n", overhead_us);
+    }
+    return failures == 0 ? 0 : 1;
+}
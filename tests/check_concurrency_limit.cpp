@@ -0,0 +1,106 @@
+// Convergence check for ConcurrencyLimiter: 16 callers share one backend
+// against mock_ollama.py with a given number of slots, and the limit must
+// settle near the slot count (neither wasting slots nor queueing at the
+// server). Usage: check_concurrency_limit [slots...], default 1 2 6.
+// Also checks that replies cut off before their done chunk are not taken
+// as latency samples.
+
+#include "../ollama_engine.hpp"
+#include "mock_server.hpp"
+
+namespace {
+
+constexpr int CALLERS = 16;
+
+// Median limit over the second half of the run, or 0 on failure
+uint32_t settledLimit(int slots, int port) {
+    MockServer mock(port, {"--slots", std::to_string(slots), "--prefill", "0.03", "--token-delay", "0.005",
+                            "--tokens", "10"});
+    ClientResources resources = ClientResources::createDefault();
+    OllamaHttpBackend backend(mock.url(), resources.pool, nullptr, resources.limiter);
+    if (!mock.waitUntilUp(backend)) return 0;
+    
+    // Enough requests per caller for the limit to find the slot count and hold it
+    const int rounds = 6 + 3 * slots;
+    std::atomic<int> remaining{CALLERS};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < CALLERS; ++i) {
+        callers.emplace_back([&, i] {
+            for (int round = 0; round < rounds; ++round) {
+                std::vector<json> messages{{{"role", "user"}, {"content", "question " + std::to_string(i * 1000 + round)}}};
+                try {
+                    backend.chat("llama3.2", messages, json::object(), true, nullptr);
+                } catch (const std::exception&) {
+                    ++failures;
+                }
+            }
+            --remaining;
+        });
+    }
+    
+    std::vector<uint32_t> samples;
+    while (remaining > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        json stats = resources.limiter->statsJson();
+        if (!stats.empty()) {
+            samples.push_back(stats.begin().value().value("limit", 0u));
+        }
+    }
+    for (auto& caller : callers) caller.join();
+    
+    if (failures > 0 || samples.size() < 4) {
+        std::cerr << "slots=" << slots << ": " << failures << " failed requests, " << samples.size() << " samples"
+                  << std::endl;
+        return 0;
+    }
+    std::vector<uint32_t> tail(samples.begin() + samples.size() / 2, samples.end());
+    std::sort(tail.begin(), tail.end());
+    return tail[tail.size() / 2];
+}
+
+// Latency samples taken from replies that all end before their done chunk
+uint64_t samplesFromCutReplies(int port) {
+    MockServer mock(port, {"--prefill", "0", "--token-delay", "0.001", "--cut-after", "3"});
+    ClientResources resources = ClientResources::createDefault();
+    OllamaHttpBackend backend(mock.url(), resources.pool, nullptr, resources.limiter);
+    if (!mock.waitUntilUp(backend)) return 1;
+    
+    std::vector<json> messages{{{"role", "user"}, {"content", "question"}}};
+    for (int i = 0; i < 5; ++i) {
+        try {
+            backend.chat("llama3.2", messages, json::object(), true, nullptr);
+        } catch (const std::exception&) {
+            // Failing the cut-off reply is fine; only the samples count here
+        }
+    }
+    json stats = resources.limiter->statsJson();
+    return stats.empty() ? 0 : stats.begin().value().value("samples", static_cast<uint64_t>(0));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    std::vector<int> slot_counts;
+    for (int i = 1; i < argc; ++i) slot_counts.push_back(std::atoi(argv[i]));
+    if (slot_counts.empty()) slot_counts = {1, 2, 6};
+    
+    int failed = 0;
+    int port = checkPort();
+    for (int slots : slot_counts) {
+        uint32_t limit = settledLimit(slots, port++);
+        // At least every slot in use, and at most a little queueing
+        uint32_t highest = static_cast<uint32_t>(slots + std::max(2, slots / 2));
+        bool ok = limit >= static_cast<uint32_t>(slots) && limit <= highest;
+        std::cout << "check_concurrency_limit: " << slots << " slots, limit settled at " << limit << " (expected "
+                  << slots << "-" << highest << ") " << (ok ? "ok" : "FAIL") << std::endl;
+        if (!ok) ++failed;
+    }
+    uint64_t samples = samplesFromCutReplies(port);
+    std::cout << "check_concurrency_limit: " << samples << " latency samples from 5 cut-off replies "
+              << (samples == 0 ? "ok" : "FAIL") << std::endl;
+    if (samples != 0) ++failed;
+    curl_global_cleanup();
+    return failed == 0 ? 0 : 1;
+}
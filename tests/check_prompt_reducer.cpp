@@ -0,0 +1,48 @@
+// Checks for PromptReducer: repeats collapse only within a run of
+// identical lines, and the text is never reordered.
+
+#include "../ollama_engine.hpp"
+
+namespace {
+
+int failures = 0;
+
+void expect(const std::string& name, const std::string& input, const std::string& expected,
+            const PromptReducer::Options& options = PromptReducer::Options()) {
+    PromptReducer reducer(options);
+    std::string out;
+    reducer.reduce(input, out);
+    if (out != expected) {
+        ++failures;
+        std::cerr << "FAIL " << name << "\n  input:    " << json(input).dump() << "\n  expected: "
+                  << json(expected).dump() << "\n  got:      " << json(out).dump() << std::endl;
+    }
+}
+
+} // namespace
+
+int main() {
+    // Copies separated by blank lines stay where they are
+    expect("blank lines end a run", "x = 1\n\nx = 1\n\nx = 1\nend\n", "x = 1\n\nx = 1\n\nx = 1\nend\n");
+    expect("held copies go out before a blank line", "a\na\n\nb\n", "a\na\n\nb\n");
+    expect("blank runs squeezed between copies", "x\n\n\n\nx\n", "x\n\nx\n");
+    std::string retry = "retrying connection to 10.0.0.7:5432\n";
+    expect("run collapsed", retry + retry + retry + retry + "done\n",
+           retry + "... (previous line repeated 3 more times)\ndone\n");
+    expect("run collapsed before a blank line", retry + retry + retry + "\n" + retry + "done\n",
+           retry + "... (previous line repeated 2 more times)\n\n" + retry + "done\n");
+    expect("short run kept", "ab\nab\ncd\n", "ab\nab\ncd\n");
+    expect("ansi and trailing blanks", "\x1b[31mred\x1b[0m  \r\nplain\n", "red\nplain\n");
+    expect("progress bar keeps its final text", "10%\r50%\r100%\n", "100%\n");
+    expect("comments dropped", "/* license\n   text */\nint x;  // kept\n# note\n#include <a>\n",
+           "int x;  // kept\n#include <a>\n",
+           [] { PromptReducer::Options options; options.drop_comments = true; return options; }());
+    
+    std::string text = "x\n\nx\n\x1b[1mbold\x1b[0m\n";
+    expect("off leaves text unchanged", text, text, PromptReducer::Options::none());
+    
+    if (failures == 0) {
+        std::cout << "check_prompt_reducer: all passed" << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
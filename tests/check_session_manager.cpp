@@ -0,0 +1,231 @@
+// Concurrency check and benchmark for SessionManager: one thread per core
+// takes turns on 1000 sessions (or argv[1]) through an instant echo backend,
+// then again after every session has been hibernated, so each session's
+// first turn in the second pass includes a restore. Fails on any failed or
+// crossed turn, a lost turn, or a session that did not wake; prints turns/s
+// and p50/p99 turn latency for each pass. Also checks that a memory ceiling
+// set later is enforced by the reaper and that an unreadable journal record
+// survives a failed wake.
+
+#include "../ollama_engine.hpp"
+#include <random>
+
+namespace {
+
+constexpr size_t TURNS_PER_SESSION = 4;
+
+// Answers instantly by echoing the last message back in a few pieces, so the
+// timings are the session manager's rather than a model's
+class EchoBackend : public InferenceBackend {
+public:
+    const char* name() const override {
+        return "echo";
+    }
+    
+    bool isAvailable() override {
+        return true;
+    }
+    
+    std::vector<std::string> listModels() override {
+        return {};
+    }
+    
+    GenerationResult chat(const std::string&, const std::vector<json>& messages, const json&, bool stream,
+                          const TokenCallback& on_token) override {
+        GenerationResult result;
+        const std::string& text = messages.back()["content"].get_ref<const std::string&>();
+        for (size_t pos = 0; pos < text.size(); pos += 8) {
+            std::string_view piece = std::string_view(text).substr(pos, 8);
+            result.text += piece;
+            if (stream && on_token && !on_token(piece)) {
+                result.cancelled = true;
+                break;
+            }
+        }
+        result.final_chunk = {{"done", true}, {"eval_count", (text.size() + 7) / 8}};
+        return result;
+    }
+    
+    std::vector<float> embed(const std::string&, const std::string&) override {
+        return {};
+    }
+};
+
+std::string sessionId(size_t index) {
+    return "session-" + std::to_string(index);
+}
+
+// Every session TURNS_PER_SESSION times, in a shuffled order shared by all
+// threads; returns the number of failed or wrong turns
+size_t runPass(SessionManager& manager, size_t session_count, size_t threads, const std::string& label,
+               unsigned seed) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < session_count * TURNS_PER_SESSION; ++i) order.push_back(i % session_count);
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+    
+    std::vector<std::vector<double>> latencies(threads);
+    std::atomic<size_t> failures{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (size_t i = t; i < order.size(); i += threads) {
+                std::string message = label + " turn " + std::to_string(i) + " for " + sessionId(order[i]);
+                auto turn_start = std::chrono::steady_clock::now();
+                try {
+                    if (manager.send(sessionId(order[i]), message) != message) ++failures;
+                } catch (const std::exception& e) {
+                    if (failures++ == 0) std::cerr << label << ": " << e.what() << std::endl;
+                }
+                latencies[t].push_back(std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - turn_start).count());
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    std::vector<double> all;
+    for (const auto& per_thread : latencies) all.insert(all.end(), per_thread.begin(), per_thread.end());
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all.empty() ? 0.0 : all[static_cast<size_t>(p * (all.size() - 1))]; };
+    std::printf("check_session_manager: %-10s %.0f turns/s, p50 %.1f us, p99 %.1f us, %zu failures\n",
+                (label + ":").c_str(), seconds > 0 ? order.size() / seconds : 0.0, percentile(0.50),
+                percentile(0.99), failures.load());
+    return failures.load();
+}
+
+// Waits up to `limit` for the reaper to hibernate sessions over a one-byte
+// memory ceiling set after construction
+bool ceilingReaped(std::chrono::milliseconds idle_timeout, std::chrono::milliseconds limit) {
+    SessionManager::Options options;
+    options.idle_timeout = idle_timeout;
+    SessionManager manager(std::make_shared<EchoBackend>(), ClientResources::createDefault(), options);
+    manager.create("a", "echo");
+    manager.create("b", "echo");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));  // Reaper running with the old settings
+    manager.setMemoryCeiling(1);
+    auto deadline = std::chrono::steady_clock::now() + limit;
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (manager.statsJson()["resident"].get<uint64_t>() == 0) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+}
+
+// A wake that cannot parse the record fails the turn but keeps the record,
+// so the session comes back once the record is readable again
+bool survivesBadRecord() {
+    std::filesystem::path journal_file = std::filesystem::temp_directory_path() /
+                                         ("check_session_manager-" + std::to_string(getpid()) + ".journal");
+    SessionManager::Options options;
+    options.idle_timeout = std::chrono::milliseconds(0);
+    options.journal_file = journal_file;
+    SessionManager manager(std::make_shared<EchoBackend>(), ClientResources::createDefault(), options);
+    manager.create("a", "echo");
+    manager.create("b", "echo");
+    manager.send("a", "remember this");
+    if (manager.hibernateIdle(std::chrono::milliseconds(0)) != 2) return false;
+    manager.send("b", "wake up");  // Maps the journal, so both records are on disk
+    
+    // Records are a 4-byte little-endian length and the payload
+    std::string saved;
+    {
+        std::ifstream in(journal_file, std::ios::binary);
+        saved.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::string garbled = saved;
+    bool found = false;
+    for (size_t pos = 0; pos + 4 <= saved.size();) {
+        size_t length = 0;
+        for (int i = 3; i >= 0; --i) length = (length << 8) | static_cast<unsigned char>(saved[pos + i]);
+        if (pos + 4 + length > saved.size()) break;
+        if (saved.substr(pos + 4, length).find("remember this") != std::string::npos) {
+            // Keeps the codec's format byte, so the block decodes and fails to parse
+            std::fill(garbled.begin() + static_cast<std::ptrdiff_t>(pos + 5),
+                      garbled.begin() + static_cast<std::ptrdiff_t>(pos + 4 + length), '#');
+            found = true;
+        }
+        pos += 4 + length;
+    }
+    if (!found) {
+        std::cerr << "record of session a not found in " << journal_file << std::endl;
+        return false;
+    }
+    auto overwrite = [&](const std::string& bytes) {
+        std::fstream out(journal_file, std::ios::in | std::ios::out | std::ios::binary);
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    };
+    
+    overwrite(garbled);
+    bool failed = false;
+    try {
+        manager.send("a", "hello");
+    } catch (const std::exception&) {
+        failed = true;
+    }
+    overwrite(saved);
+    if (!failed) return false;
+    try {
+        manager.send("a", "hello again");
+    } catch (const std::exception& e) {
+        std::cerr << "wake after restoring the record: " << e.what() << std::endl;
+        return false;
+    }
+    return manager.withSession("a", [](OllamaAssistant& assistant) { return assistant.getConversationLength(); }) == 4;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const size_t session_count = argc > 1 ? std::max(1, std::atoi(argv[1])) : 1000;
+    const size_t threads = std::max(4u, std::thread::hardware_concurrency());
+    int failed = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        if (!ok) {
+            ++failed;
+            std::cerr << "FAIL " << what << std::endl;
+        }
+    };
+    
+    SessionManager::Options options;
+    options.idle_timeout = std::chrono::milliseconds(0);  // Hibernate explicitly below
+    SessionManager manager(std::make_shared<EchoBackend>(), ClientResources::createDefault(), options);
+    for (size_t i = 0; i < session_count; ++i) {
+        check(manager.create(sessionId(i), "echo"), "create " + sessionId(i));
+    }
+    
+    check(runPass(manager, session_count, threads, "resident", 1) == 0, "failed turns with every session resident");
+    size_t hibernated = manager.hibernateIdle(std::chrono::milliseconds(0));
+    check(hibernated == session_count, std::to_string(hibernated) + " of " + std::to_string(session_count) +
+                                       " sessions hibernated");
+    check(runPass(manager, session_count, threads, "woken", 2) == 0, "failed turns after hibernation");
+    
+    json stats = manager.statsJson();
+    check(stats["wakes"].get<uint64_t>() == session_count,
+          std::to_string(stats["wakes"].get<uint64_t>()) + " wakes for " + std::to_string(session_count) + " sessions");
+    check(stats["resident"].get<uint64_t>() == session_count, "not every session is resident at the end");
+    check(stats["journal"]["records"].get<uint64_t>() == 0, "journal still holds records after every wake");
+    
+    // Each session kept both passes' turns: a user message and a reply per turn
+    size_t short_histories = 0;
+    for (size_t i = 0; i < session_count; ++i) {
+        size_t length = manager.withSession(sessionId(i), [](OllamaAssistant& assistant) {
+            return assistant.getConversationLength();
+        });
+        if (length != 4 * TURNS_PER_SESSION) ++short_histories;
+    }
+    check(short_histories == 0, std::to_string(short_histories) + " sessions lost turns");
+    
+    check(ceilingReaped(std::chrono::milliseconds(0), std::chrono::seconds(3)),
+          "ceiling set later not enforced without an idle timeout");
+    check(ceilingReaped(std::chrono::minutes(5), std::chrono::seconds(3)),
+          "ceiling set later not enforced within 3 s with a 5 minute idle timeout");
+    check(survivesBadRecord(), "session lost after a failed wake");
+    
+    if (failed == 0) {
+        std::cout << "check_session_manager: " << session_count << " sessions, " << threads
+                  << " threads, all passed" << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
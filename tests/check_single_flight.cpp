@@ -0,0 +1,75 @@
+// Checks for SingleFlight: a follower of a leader whose request is cut short
+// runs its own request and is not given the text it already has again.
+
+#include "../ollama_engine.hpp"
+#include <future>
+
+namespace {
+
+int failures = 0;
+
+void expect(const std::string& name, const std::string& got, const std::string& expected) {
+    if (got != expected) {
+        ++failures;
+        std::cerr << "FAIL " << name << "\n  expected: " << json(expected).dump() << "\n  got:      "
+                  << json(got).dump() << std::endl;
+    }
+}
+
+// Streams `pieces` and returns them as one result
+GenerationResult streamed(const std::vector<std::string>& pieces, const TokenCallback& on_token) {
+    GenerationResult result;
+    for (const auto& piece : pieces) {
+        result.text += piece;
+        if (on_token && !on_token(piece)) {
+            result.cancelled = true;
+            break;
+        }
+    }
+    return result;
+}
+
+// The leader gives two pieces, waits for a follower to take them, then stops
+// short; `follower_pieces` is what the follower's own request streams
+void checkFollowerAfterCutoff(const std::string& name, const std::vector<std::string>& follower_pieces,
+                              const std::string& expected_seen) {
+    SingleFlight flight;
+    std::promise<void> started;
+    std::promise<void> subscribed;
+    std::thread leader([&] {
+        flight.run("key", nullptr, [&](const TokenCallback& on_token) {
+            GenerationResult result = streamed({"Hello, ", "wor"}, on_token);
+            started.set_value();
+            subscribed.get_future().wait_for(std::chrono::seconds(5));
+            result.cancelled = true;
+            return result;
+        });
+    });
+    started.get_future().wait();
+    
+    std::string seen;
+    std::thread follower([&] {
+        GenerationResult result = flight.run("key", [&](std::string_view delta) {
+            if (seen.empty()) subscribed.set_value();
+            seen += delta;
+            return true;
+        }, [&](const TokenCallback& on_token) { return streamed(follower_pieces, on_token); });
+        expect(name + ": returned text", result.text, seen);
+    });
+    follower.join();
+    leader.join();
+    expect(name + ": delivered text", seen, expected_seen);
+}
+
+} // namespace
+
+int main() {
+    checkFollowerAfterCutoff("same prefix", {"Hello, w", "orld", "!"}, "Hello, world!");
+    checkFollowerAfterCutoff("prefix inside one piece", {"Hello, world!"}, "Hello, world!");
+    checkFollowerAfterCutoff("shorter rerun", {"Hi"}, "Hello, wor");
+    
+    if (failures == 0) {
+        std::cout << "check_single_flight: all passed" << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
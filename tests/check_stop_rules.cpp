@@ -0,0 +1,117 @@
+// Checks for stop rules in OllamaAssistant::sendMessage: with a rule set,
+// a token callback returning false still stops the transfer, a rule that
+// fires stops it at the match, and a reply that ends on its own reaches the
+// callback in full.
+
+#include "../ollama_engine.hpp"
+
+namespace {
+
+int failures = 0;
+
+void expect(const std::string& name, bool ok, const std::string& detail = "") {
+    if (!ok) {
+        ++failures;
+        std::cerr << "FAIL " << name << (detail.empty() ? "" : ": " + detail) << std::endl;
+    }
+}
+
+// Streams a fixed list of pieces and counts how many it handed out before
+// the callback asked it to stop
+class ScriptedBackend : public InferenceBackend {
+public:
+    std::vector<std::string> pieces;
+    size_t sent = 0;
+    
+    const char* name() const override {
+        return "scripted";
+    }
+    
+    bool isAvailable() override {
+        return true;
+    }
+    
+    std::vector<std::string> listModels() override {
+        return {};
+    }
+    
+    GenerationResult chat(const std::string&, const std::vector<json>&, const json&, bool,
+                          const TokenCallback& on_token) override {
+        GenerationResult result;
+        sent = 0;
+        for (const auto& piece : pieces) {
+            ++sent;
+            result.text += piece;
+            if (on_token && !on_token(piece)) {
+                result.cancelled = true;
+                return result;
+            }
+        }
+        result.final_chunk = {{"done", true}, {"done_reason", "stop"}, {"eval_count", pieces.size()}};
+        return result;
+    }
+    
+    std::vector<float> embed(const std::string&, const std::string&) override {
+        return {};
+    }
+};
+
+struct Turn {
+    std::string reply;
+    std::string shown;
+    size_t sent = 0;
+};
+
+// One turn with stop string "NEVER" (and `stop` if given); the callback
+// refuses the piece that takes it to `accept` pieces (0: accepts everything)
+Turn run(const std::vector<std::string>& pieces, size_t accept, const std::string& stop = "") {
+    auto backend = std::make_shared<ScriptedBackend>();
+    backend->pieces = pieces;
+    OllamaAssistant assistant("scripted", backend);
+    assistant.getStopRules().addString("NEVER");
+    if (!stop.empty()) assistant.getStopRules().addString(stop);
+    
+    Turn turn;
+    size_t calls = 0;
+    turn.reply = assistant.sendMessage("go", [&](std::string_view delta) {
+        turn.shown += delta;
+        return accept == 0 || ++calls < accept;
+    });
+    turn.sent = backend->sent;
+    return turn;
+}
+
+} // namespace
+
+int main() {
+    std::vector<std::string> words;
+    std::string all;
+    for (int i = 0; i < 100; ++i) {
+        words.push_back("word" + std::to_string(i) + " ");
+        all += words.back();
+    }
+    
+    Turn stopped = run(words, 5);
+    expect("callback false stops the transfer", stopped.sent == 5, std::to_string(stopped.sent) + " of 100 pieces sent");
+    expect("cancelled reply is what was shown", stopped.reply == stopped.shown, stopped.reply + " vs " + stopped.shown);
+    
+    std::vector<std::string> with_stop = words;
+    with_stop[10] = "STOP here ";
+    Turn fired = run(with_stop, 0, "STOP");
+    expect("stop string stops the transfer", fired.sent == 11, std::to_string(fired.sent) + " of 100 pieces sent");
+    expect("reply cut before the stop string", fired.reply == all.substr(0, all.find("word10 ")), fired.reply);
+    
+    Turn full = run(words, 0);
+    expect("full reply", full.sent == 100 && full.reply == all && full.shown == all, full.shown);
+    
+    // "NEV" is held back until the reply ends; refusing it then still counts
+    std::vector<std::string> held = {"one ", "two ", "NEV"};
+    Turn late = run(held, 3);
+    expect("held text reaches the callback at the end", late.shown == "one two NEV", late.shown);
+    expect("refused held text is the last of the reply", late.reply == "one two NEV", late.reply);
+    
+    if (failures == 0) {
+        std::cout << "check_stop_rules: all passed" << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+// Checks that the streaming path does not allocate per token: streams long
+// replies from mock_ollama.py over /api/chat and /api/generate with the
+// allocation hooks installed, and fails when the calling thread makes 0.5 or
+// more heap allocations per token between the first and the last token (the
+// figure /bench prints). Amortized growth of the reply text is all that
+// should be left.
+
+#include "../ollama_engine.hpp"
+#include "../allocation_tracking.hpp"
+#include "mock_server.hpp"
+
+namespace {
+
+constexpr int RUNS = 3;
+constexpr double LIMIT = 0.5;
+
+struct Steady {
+    uint64_t chunks = 0;
+    uint64_t allocations = 0;
+};
+
+// Counts this thread's allocations from the first to the last token of one reply
+template <typename Send>
+void measure(Steady& steady, Send&& send) {
+    uint64_t chunks = 0;
+    uint64_t first_allocations = 0;
+    uint64_t last_allocations = 0;
+    GenerationResult result = send([&](std::string_view) {
+        last_allocations = MemoryAccounting::threadAllocations();
+        if (chunks++ == 0) first_allocations = last_allocations;
+        return true;
+    });
+    if (result.final_chunk.empty() || chunks < 2) {
+        throw std::runtime_error("reply was not streamed (" + std::to_string(chunks) + " chunks)");
+    }
+    steady.chunks += chunks - 1;
+    steady.allocations += last_allocations - first_allocations;
+}
+
+bool report(const std::string& endpoint, const Steady& steady) {
+    double per_token = steady.chunks ? static_cast<double>(steady.allocations) / steady.chunks : 0.0;
+    bool ok = steady.chunks > 0 && per_token < LIMIT;
+    std::printf("check_stream_allocations: %-13s %.2f allocations per token over %llu tokens %s\n",
+                endpoint.c_str(), per_token, static_cast<unsigned long long>(steady.chunks), ok ? "ok" : "FAIL");
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    if (!MemoryAccounting::isTracking()) {
+        std::cerr << "check_stream_allocations: allocation hooks are not installed" << std::endl;
+        return 1;
+    }
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    int failed = 0;
+    {
+        MockServer mock(checkPort(), {"--prefill", "0", "--token-delay", "0.0005", "--tokens", "400"});
+        ClientResources resources = ClientResources::createDefault();
+        OllamaHttpBackend backend(mock.url(), resources.pool, nullptr, resources.limiter);
+        if (!mock.waitUntilUp(backend)) return 1;
+        
+        std::vector<json> messages = {{{"role", "user"}, {"content", "Count from 1 to 400."}}};
+        Steady chat;
+        Steady generate;
+        try {
+            for (int run = 0; run < RUNS; ++run) {
+                measure(chat, [&](const TokenCallback& on_token) {
+                    return backend.chat("llama3.2", messages, json::object(), true, on_token);
+                });
+                measure(generate, [&](const TokenCallback& on_token) {
+                    return backend.generate("llama3.2", "Count from 1 to 400.", json(), json::object(), true, on_token);
+                });
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "check_stream_allocations: " << e.what() << std::endl;
+            ++failed;
+        }
+        if (!report("/api/chat", chat)) ++failed;
+        if (!report("/api/generate", generate)) ++failed;
+    }
+    curl_global_cleanup();
+    return failed == 0 ? 0 : 1;
+}
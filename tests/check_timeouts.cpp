@@ -0,0 +1,78 @@
+// Checks that requests whose reply is not streamed are held to the first-byte
+// limit: a server that stalls is given up on once first_token_ms plus the
+// per-token allowance for num_predict has passed, and a reply that takes
+// longer than first_token_ms alone but fits the allowance still arrives.
+
+#include "../ollama_engine.hpp"
+#include "mock_server.hpp"
+
+namespace {
+
+int failures = 0;
+
+void expect(const std::string& name, bool ok, const std::string& detail = "") {
+    if (!ok) {
+        ++failures;
+        std::cerr << "FAIL " << name << (detail.empty() ? "" : ": " + detail) << std::endl;
+    }
+}
+
+struct Outcome {
+    std::string text;
+    std::string error;
+    double seconds = 0.0;
+    uint64_t first_token_timeouts = 0;
+};
+
+// One non-streamed chat turn against a mock started with `options`
+Outcome unstreamed(const std::vector<std::string>& options, const TimeoutPolicy& policy, int num_predict) {
+    MockServer mock(checkPort(), options);
+    ClientResources resources = ClientResources::createDefault();
+    OllamaHttpBackend backend(mock.url(), resources.pool, nullptr, resources.limiter);
+    Outcome outcome;
+    if (!mock.waitUntilUp(backend)) {
+        outcome.error = "mock server did not start";
+        return outcome;
+    }
+    backend.setTimeoutPolicy(policy);
+    
+    std::vector<json> messages = {{{"role", "user"}, {"content", "Say something."}}};
+    auto start = std::chrono::steady_clock::now();
+    try {
+        outcome.text = backend.chat("llama3.2", messages, {{"num_predict", num_predict}}, false, nullptr).text;
+    } catch (const std::exception& e) {
+        outcome.error = e.what();
+    }
+    outcome.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    outcome.first_token_timeouts = backend.timeoutStatsJson()["first_token"].get<uint64_t>();
+    return outcome;
+}
+
+} // namespace
+
+int main() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    TimeoutPolicy policy;
+    policy.first_token_ms = 500;
+    policy.buffered_token_ms = 50;
+    
+    // 0.5 s + 20 x 50 ms = 1.5 s against a server that says nothing for 30 s
+    Outcome stalled = unstreamed({"--prefill", "30"}, policy, 20);
+    expect("stalled reply times out", stalled.error.find("no reply within") != std::string::npos,
+           stalled.error.empty() ? "no error" : stalled.error);
+    expect("stalled reply times out after the allowance", stalled.seconds >= 1.4 && stalled.seconds < 5.0,
+           std::to_string(stalled.seconds) + " s");
+    expect("first token timeout counted", stalled.first_token_timeouts == 1);
+    
+    // 20 tokens at 40 ms: over first_token_ms, within the allowance
+    Outcome slow = unstreamed({"--prefill", "0", "--token-delay", "0.04", "--tokens", "20"}, policy, 20);
+    expect("slow reply within the allowance arrives", slow.error.empty() && !slow.text.empty(), slow.error);
+    expect("slow reply took longer than first_token_ms", slow.seconds > 0.5, std::to_string(slow.seconds) + " s");
+    
+    curl_global_cleanup();
+    if (failures == 0) {
+        std::cout << "check_timeouts: stalled reply ended after " << stalled.seconds << " s, slow reply took "
+                  << slow.seconds << " s, all passed" << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
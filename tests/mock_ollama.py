@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""Minimal stand-in for `ollama serve`, for the checks in this directory.
+
+Serves /api/version, /api/tags, /api/ps, /api/show, /api/chat and
+/api/generate (streamed NDJSON or a single JSON object). Generation requests
+hold one of --slots slots for their whole duration and wait for a free one
+otherwise, like OLLAMA_NUM_PARALLEL.
+
+Replies are --tokens words, or num_predict if that is smaller (then with
+done_reason "length"), each followed by --token-delay seconds; prefill takes
+--prefill seconds. With --cut-after N, streamed replies stop after N words
+without a final chunk, like a server that died mid-reply. An empty
+/api/generate prompt is a load request, as in Ollama. The final chunk reports durations from a fixed speed model of the
+runtime options, so an option search has a known best answer:
+
+  decode  10 ms/token, x3 with num_gpu=0, x0.7 with num_gpu >= 999,
+          x1.3 with num_ctx >= 16384
+  prefill 0.1 ms/token, with the same factors, x0.6 with num_batch=1024
+  load    300 ms when the runtime options differ from the last request's
+          (the model "reloads"), else 1 ms
+
+Usage: mock_ollama.py [--port 11434] [--slots 4] [--prefill 0.05]
+                      [--token-delay 0.005] [--tokens 20] [--cut-after N]
+"""
+
+import argparse
+import json
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+MODELS = [
+    {"name": "llama3.2:latest", "digest": "mock-llama", "size": 2019393189},
+    {"name": "tiny:latest", "digest": "mock-tiny", "size": 91739413},
+]
+RUNTIME_OPTIONS = ("num_gpu", "num_ctx", "num_batch", "num_thread")
+WORDS = "The quick brown fox jumps over the lazy dog while the mock server counts every word".split()
+
+
+def speed_factors(options):
+    """Decode and prefill time multipliers for a set of runtime options."""
+    factor = 1.0
+    num_gpu = options.get("num_gpu")
+    if num_gpu == 0:
+        factor *= 3.0
+    elif num_gpu is not None and num_gpu >= 999:
+        factor *= 0.7
+    if options.get("num_ctx", 2048) >= 16384:
+        factor *= 1.3
+    prefill = factor * (0.6 if options.get("num_batch") == 1024 else 1.0)
+    return factor, prefill
+
+
+class State:
+    def __init__(self, slots):
+        self.slots = threading.Semaphore(slots)
+        self.lock = threading.Lock()
+        self.loaded = {}  # Model -> runtime options of the last request
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    state = None
+    args = None
+
+    def log_message(self, *args):
+        pass
+
+    def send_json(self, payload, code=200):
+        body = json.dumps(payload).encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_chunk(self, payload):
+        body = (json.dumps(payload) + "\n").encode()
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(body), body))
+        self.wfile.flush()
+
+    def do_GET(self):
+        if self.path == "/api/version":
+            self.send_json({"version": "0.5.0"})
+        elif self.path == "/api/tags":
+            self.send_json({"models": MODELS})
+        elif self.path == "/api/ps":
+            with self.state.lock:
+                loaded = list(self.state.loaded)
+            self.send_json({"models": [{"name": name, "size": 2019393189, "size_vram": 2019393189,
+                                        "expires_at": "2030-01-01T00:00:00Z"} for name in loaded]})
+        else:
+            self.send_json({"error": "not found"}, 404)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        try:
+            body = json.loads(self.rfile.read(length) or b"{}")
+        except ValueError:
+            self.send_json({"error": "invalid JSON"}, 400)
+            return
+        if self.path == "/api/show":
+            self.send_json({"template": "{{ .Prompt }}", "capabilities": ["completion"],
+                            "details": {"family": "llama", "parameter_size": "3.2B", "quantization_level": "Q4_K_M"},
+                            "model_info": {"general.architecture": "llama", "llama.context_length": 131072}})
+        elif self.path in ("/api/chat", "/api/generate"):
+            self.generate(body)
+        else:
+            self.send_json({"error": "not found"}, 404)
+
+    def generate(self, body):
+        model = body.get("model", "")
+        if not any(entry["name"] in (model, model + ":latest") for entry in MODELS):
+            self.send_json({"error": "model '%s' not found" % model}, 404)
+            return
+        options = body.get("options") or {}
+        num_predict = options.get("num_predict")
+        limited = num_predict is not None and 0 <= num_predict <= self.args.tokens
+        tokens = num_predict if limited else self.args.tokens
+        if self.path == "/api/generate":
+            prompt = body.get("prompt", "")
+            if not prompt:
+                self.send_json({"model": model, "done": True, "done_reason": "load", "response": ""})
+                return
+            prompt_tokens = max(1, len(prompt) // 4)
+        else:
+            prompt_tokens = max(1, sum(len(m.get("content", "")) for m in body.get("messages", [])) // 4)
+
+        runtime = {key: options[key] for key in RUNTIME_OPTIONS if key in options}
+        decode, prefill = speed_factors(runtime)
+        stream = body.get("stream", True)
+        with self.state.slots:
+            with self.state.lock:
+                reloaded = self.state.loaded.get(model) != runtime
+                self.state.loaded[model] = runtime
+            if stream:
+                self.send_response(200)
+                self.send_header("Content-Type", "application/x-ndjson")
+                self.send_header("Transfer-Encoding", "chunked")
+                self.end_headers()
+            start = time.monotonic()
+            time.sleep(self.args.prefill)
+            prefill_ns = int((time.monotonic() - start) * 1e9)
+            text = ""
+            try:
+                for i in range(tokens):
+                    word = WORDS[i % len(WORDS)] + " "
+                    text += word
+                    if stream:
+                        key = "message" if self.path == "/api/chat" else "response"
+                        value = {"role": "assistant", "content": word} if key == "message" else word
+                        self.send_chunk({"model": model, key: value, "done": False})
+                    time.sleep(self.args.token_delay)
+                    if stream and i + 1 == self.args.cut_after:
+                        self.wfile.write(b"0\r\n\r\n")
+                        self.wfile.flush()
+                        return
+                final = {
+                    "model": model,
+                    "done": True,
+                    "done_reason": "length" if limited else "stop",
+                    "load_duration": 300000000 if reloaded else 1000000,
+                    "prompt_eval_count": prompt_tokens,
+                    "prompt_eval_duration": int(prompt_tokens * 100000 * prefill) + prefill_ns,
+                    "eval_count": tokens,
+                    "eval_duration": int(tokens * 10000000 * decode),
+                }
+                final["total_duration"] = final["load_duration"] + final["prompt_eval_duration"] + final["eval_duration"]
+                if self.path == "/api/generate":
+                    final["context"] = list(range(1, prompt_tokens + tokens + 1))
+                if self.path == "/api/chat":
+                    final["message"] = {"role": "assistant", "content": "" if stream else text}
+                else:
+                    final["response"] = "" if stream else text
+                if stream:
+                    self.send_chunk(final)
+                    self.wfile.write(b"0\r\n\r\n")
+                    self.wfile.flush()
+                else:
+                    self.send_json(final)
+            except (BrokenPipeError, ConnectionResetError):
+                pass  # Client cancelled
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=11434)
+    parser.add_argument("--slots", type=int, default=4)
+    parser.add_argument("--prefill", type=float, default=0.05)
+    parser.add_argument("--token-delay", type=float, default=0.005)
+    parser.add_argument("--tokens", type=int, default=20)
+    parser.add_argument("--cut-after", type=int, default=0)
+    args = parser.parse_args()
+
+    Handler.state = State(args.slots)
+    Handler.args = args
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+    server.daemon_threads = True
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
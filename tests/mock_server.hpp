@@ -0,0 +1,65 @@
+// Starts mock_ollama.py for a check and stops it when the check is done.
+// The mock is run with $PYTHON (python3) from $MOCK_OLLAMA (mock_ollama.py
+// in the current directory).
+
+#ifndef CHECK_MOCK_SERVER_HPP
+#define CHECK_MOCK_SERVER_HPP
+
+#include "../ollama_engine.hpp"
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+struct MockServer {
+    pid_t pid = -1;
+    int port;
+    
+    // `options` are mock_ollama.py flags besides --port
+    MockServer(int server_port, const std::vector<std::string>& options) : port(server_port) {
+        std::string python = std::getenv("PYTHON") ? std::getenv("PYTHON") : "python3";
+        std::string script = std::getenv("MOCK_OLLAMA") ? std::getenv("MOCK_OLLAMA") : "mock_ollama.py";
+        std::vector<std::string> args = {python, script, "--port", std::to_string(port)};
+        args.insert(args.end(), options.begin(), options.end());
+        std::vector<char*> argv;
+        for (auto& arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        if (posix_spawnp(&pid, python.c_str(), nullptr, nullptr, argv.data(), environ) != 0) {
+            throw std::runtime_error("cannot start " + python + " " + script);
+        }
+    }
+    
+    ~MockServer() {
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+    
+    MockServer(const MockServer&) = delete;
+    MockServer& operator=(const MockServer&) = delete;
+    
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(port);
+    }
+    
+    // Polls `backend` for up to five seconds
+    bool waitUntilUp(InferenceBackend& backend) const {
+        for (int attempt = 0; !backend.isAvailable(); ++attempt) {
+            if (attempt == 50) {
+                std::cerr << "mock server did not start on port " << port << std::endl;
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return true;
+    }
+};
+
+// A port per check process, so checks can run side by side
+inline int checkPort() {
+    return 20000 + static_cast<int>(getpid() % 20000);
+}
+
+#endif // CHECK_MOCK_SERVER_HPP
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Builds and runs every check in this directory; exits nonzero if any fails.
+# CXX, CXXFLAGS and LDFLAGS are passed to the compiler (e.g. -I/-L for curl
+# and nlohmann/json); C checks are built with CC and linked against
+# libollama_client.so. Binaries go to BUILD_DIR, a temporary directory by default.
+cd "$(dirname "$0")" || exit 1
+CXX=${CXX:-g++}
+CC=${CC:-cc}
+BUILD_DIR=${BUILD_DIR:-$(mktemp -d)}
+export BUILD_DIR
+mkdir -p "$BUILD_DIR"
+
+status=0
+for source in check_*.cpp; do
+    name=${source%.cpp}
+    if ! $CXX -std=c++17 -O1 -Wall -Wextra $CXXFLAGS -o "$BUILD_DIR/$name" "$source" $LDFLAGS -lcurl -pthread; then
+        echo "$name: build failed"
+        status=1
+        continue
+    fi
+    "$BUILD_DIR/$name" || status=1
+done
+c_sources=check_*.c
+if ! $CXX -std=c++17 -O1 -fPIC -shared -fvisibility=hidden $CXXFLAGS -o "$BUILD_DIR/libollama_client.so" \
+        ../ollama_client.cpp $LDFLAGS -lcurl -pthread; then
+    echo "libollama_client.so: build failed"
+    status=1
+    c_sources=
+fi
+for source in $c_sources; do
+    name=${source%.c}
+    if ! $CC -std=c99 -O1 -Wall -Wextra -o "$BUILD_DIR/$name" "$source" \
+            -L"$BUILD_DIR" -Wl,-rpath,"$BUILD_DIR" -lollama_client; then
+        echo "$name: build failed"
+        status=1
+        continue
+    fi
+    "$BUILD_DIR/$name" || status=1
+done
+export CXX CXXFLAGS LDFLAGS
+for script in check_*.sh; do
+    sh "./$script" || status=1
+done
+exit $status